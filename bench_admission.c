@@ -0,0 +1,209 @@
+/*
+ *  File:        bench_admission.c
+ *  Purpose:     Hit rate of the shared hashtable as a cache, evicting by
+ *               CLOCK alone and with the TinyLFU admission sketch, in
+ *               process.
+ *
+ *               ./bench_admission [-n keys] [-c capacity] [-o ops]
+ *                                 [-z theta] [-s size] [-w percent]
+ *               -n keys:       popular names, default 100000.
+ *               -c capacity:   values the memory limit holds, default 
+ *                              5000.
+ *               -o ops:        GETs, default 500000.
+ *               -z theta:      Zipfian skew of the names, default 0.99.
+ *               -s size:       value size, default 32.
+ *               -w percent:    percent of GETs for one off names, as a
+ *                              scan or batch job makes, default 25.
+ *
+ *  Note:        Cache aside: a GET that misses SETs the value. The hit
+ *               rate counts the GETs of popular names, one off names
+ *               always miss. Every eviction leaves a tombstone, the time
+ *               per GET grows with them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+
+#include "utility_macros.h"
+#include "shared_hashtable.h"
+
+#define NAME_SIZE       32
+#define KEY_BYTES       12          /* Bytes a name takes, about. */
+
+static int n_keys = 100000, capacity = 5000, n_ops = 500000,
+           value_size = 32, wonders = 25;
+static double theta = 0.99, zipf_zetan, zipf_alpha, zipf_eta;
+static unsigned long seed;
+
+
+/*
+* Name:         now_ns
+* Argument:     none
+* Return:       double
+* Purpose:      Monotonic clock in nanoseconds.
+* Note:         none
+*/
+static double now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+/*
+* Name:         next_random
+* Argument:     none
+* Return:       unsigned long
+* Purpose:      xorshift64*.
+* Note:         none
+*/
+static unsigned long next_random(void){
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return seed*0x2545f4914f6cdd1dUL;
+}
+
+/*
+* Name:         zipf_init
+* Argument:     none
+* Return:       none
+* Purpose:      Constants of the Zipfian generator for n_keys and theta.
+* Note:         Gray et al., as loadgen.
+*/
+static void zipf_init(void){
+    double zeta2 = 1.0 + 1.0/pow(2, theta);
+
+    zipf_zetan = 0;
+    FORONE(i, n_keys)
+        zipf_zetan += 1.0/pow(i + 1, theta);
+    zipf_alpha = 1.0/(1.0 - theta);
+    zipf_eta = (1.0 - pow(2.0/n_keys, 1.0 - theta))/(1.0 - zeta2/zipf_zetan);
+}
+
+/*
+* Name:         pick_key
+* Argument:     none
+* Return:       unsigned long
+* Purpose:      Popular name of the next GET, hot ranks scattered.
+* Note:         none
+*/
+static unsigned long pick_key(void){
+    double u = (next_random() >> 11)*(1.0/9007199254740992.0);
+    double uz = u*zipf_zetan;
+    unsigned long rank;
+
+    if (uz < 1.0)
+        rank = 0;
+    else if (uz < 1.0 + pow(0.5, theta))
+        rank = 1;
+    else
+        rank = (unsigned long)(n_keys*pow(zipf_eta*u - zipf_eta + 1,
+                                          zipf_alpha));
+    rank = MIN(rank, (unsigned long)n_keys - 1);
+    return (rank*0x9e3779b97f4a7c15UL >> 17) % n_keys;
+}
+
+/*
+* Name:         run_policy
+* Argument:     int
+* Return:       int
+* Purpose:      Run the workload on a table with admission on or off.
+* Note:         The same seed for both, they see the same GETs. Returns
+*               -1 if the table cannot be made.
+*/
+static int run_policy(int admission){
+    hash_options options;
+    hash_stats st;
+    char name[NAME_SIZE], *value = malloc(value_size);
+    long hits = 0, popular = 0, wonder = 0;
+    void *table, *data;
+    int size;
+
+    /* Twice the slots needed, the memory limit decides what fits. */
+    memset(&options, 0, sizeof(options));
+    options.lock_type = HASH_LOCK_THREAD;
+    options.admission = admission;
+    table = make_hashtable_opt(2*capacity, value_size, &options);
+    if (table == NULL || value == NULL){
+        FREE(value);
+        return -1;
+    }
+    hash_get_stats(table, &st);
+    hash_detach(table);
+    options.memory_limit = st.metadata_bytes +
+                           (size_t)capacity*(KEY_BYTES + value_size);
+    options.evict = 1;
+    table = make_hashtable_opt(2*capacity, value_size, &options);
+    if (table == NULL){
+        FREE(value);
+        return -1;
+    }
+    memset(value, 'v', value_size);
+
+    seed = 0x9e3779b97f4a7c15UL;
+    double start = now_ns();
+    FORONE(i, n_ops){
+        int is_wonder = (int)(next_random() % 100) < wonders;
+
+        if (is_wonder)
+            sprintf(name, "once:%ld", wonder++);
+        else{
+            sprintf(name, "key:%lu", pick_key());
+            popular++;
+        }
+        if (hash_get(table, name, &data, &size) == HASH_OK){
+            hits += !is_wonder;
+            free(data);
+        }
+        else
+            hash_set(table, name, value, value_size);
+    }
+    double elapsed = now_ns() - start;
+
+    hash_get_stats(table, &st);
+    printf("%-8s hit rate %6.2f%%   %8.1f ns/op   %9lu evictions   "
+           "%9lu rejected   %d items\n", admission ? "tinylfu" : "clock",
+           popular ? 100.0*hits/popular : 0.0, elapsed/n_ops, st.evictions,
+           st.rejected, st.n_items);
+    hash_detach(table);
+    FREE(value);
+    return 0;
+}
+
+int main(int argc, char **argv){
+    int option;
+
+    while ((option = getopt(argc, argv, "n:c:o:z:s:w:")) != -1){
+        switch (option){
+            case 'n': n_keys = atoi(optarg); break;
+            case 'c': capacity = atoi(optarg); break;
+            case 'o': n_ops = atoi(optarg); break;
+            case 'z': theta = atof(optarg); break;
+            case 's': value_size = atoi(optarg); break;
+            case 'w': wonders = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-n keys] [-c capacity] [-o ops] "
+                        "[-z theta] [-s size] [-w percent]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    EXIT_NOT_ON_VALUE(argc - optind, 0, "TOO MANY ARGUMENTS, EXIT.\n",
+                      EXIT_FAILURE);
+    EXIT_ON_VALUE(n_keys < 2 || capacity < 1 || n_ops < 1 ||
+                  value_size < 1 || theta <= 0 || theta >= 1 ||
+                  wonders < 0 || wonders > 100, 1,
+                  "BAD COMMANDLINE ARGUMENT, EXIT.\n", EXIT_FAILURE);
+
+    zipf_init();
+    printf("%d names, capacity %d, %d GETs, zipf %.2f, %d%% one off\n",
+           n_keys, capacity, n_ops, theta, wonders);
+    EXIT_ON_VALUE(run_policy(0), -1, "CANNOT MAKE THE TABLE, EXIT.\n",
+                  EXIT_FAILURE);
+    EXIT_ON_VALUE(run_policy(1), -1, "CANNOT MAKE THE TABLE, EXIT.\n",
+                  EXIT_FAILURE);
+    return EXIT_SUCCESS;
+}
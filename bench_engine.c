@@ -0,0 +1,225 @@
+/*
+ *  File:        bench_engine.c
+ *  Purpose:     Compare the HASH_ENGINE_PROBING and HASH_ENGINE_CUCKOO
+ *               engines of the shared hashtable in process: how full a
+ *               table gets before a SET is refused, and the time per GET
+ *               hit, GET miss and DELETE + SET at a range of loads.
+ *
+ *               ./bench_engine [-n slots] [-o ops] [-s size]
+ *               -n slots:      slots of each table, default 262144.
+ *               -o ops:        operations timed per load, default 1000000.
+ *               -s size:       value size, default 32.
+ *
+ *  Note:        Names are picked uniformly. A DELETE + SET replaces a
+ *               stored name by a new one, the load stays the same while
+ *               linear probing gathers tombstones. A phase stops after 2
+ *               seconds, the time is per operation it ran.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "utility_macros.h"
+#include "shared_hashtable.h"
+
+#define NAME_SIZE       24
+#define N_LOADS         5
+#define PHASE_NS        2e9         /* A timed phase stops after this. */
+
+/* Checked every 256 operations, the clock is not free. */
+#define TIMED_OUT(done, start) \
+        ((done) % 256 == 255 && now_ns() - (start) > PHASE_NS)
+
+static const int loads[N_LOADS] = {50, 75, 90, 95, 98};
+static int n_slots = 262144, n_ops = 1000000, value_size = 32;
+static char (*names)[NAME_SIZE], (*absent)[NAME_SIZE];
+
+
+/*
+* Name:         now_ns
+* Argument:     none
+* Return:       double
+* Purpose:      Monotonic clock in nanoseconds.
+* Note:         none
+*/
+static double now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+/*
+* Name:         make_table
+* Argument:     int
+* Return:       void*
+* Purpose:      A table of n_slots slots with the engine.
+* Note:         none
+*/
+static void* make_table(int engine){
+    hash_options options;
+
+    memset(&options, 0, sizeof(options));
+    options.lock_type = HASH_LOCK_THREAD;
+    options.engine = engine;
+    return make_hashtable_opt(n_slots, value_size, &options);
+}
+
+/*
+* Name:         run_fill
+* Argument:     int, char*
+* Return:       int
+* Purpose:      SET new names until one is refused or every slot is used.
+* Note:         Returns -1 if the table cannot be made.
+*/
+static int run_fill(int engine, char *value){
+    void *table = make_table(engine);
+    hash_stats st;
+    int n = 0;
+
+    if (table == NULL)
+        return -1;
+    double start = now_ns();
+    while (n < n_slots && hash_set(table, names[n], value, value_size)
+                          == HASH_OK)
+        n++;
+    double elapsed = now_ns() - start;
+
+    hash_get_stats(table, &st);
+    printf("%-8s fills to %6.2f%%   %8.1f ns/SET   %9lu moved\n",
+           engine == HASH_ENGINE_CUCKOO ? "cuckoo" : "probing",
+           100.0*n/n_slots, elapsed/MAX(n, 1), st.displaced);
+    hash_detach(table);
+    return 0;
+}
+
+/*
+* Name:         run_load
+* Argument:     int, int, char*, int*
+* Return:       int
+* Purpose:      Fill a table to load percent and time GET hits, GET
+*               misses and DELETE + SET.
+* Note:         live is scratch for the names stored. Returns -1 if the
+*               table cannot be made, 1 if it cannot be filled that far.
+*/
+static int run_load(int engine, int load, char *value, int *live){
+    void *table = make_table(engine);
+    int n_live = (int)((long)n_slots*load/100), next, size, handle;
+    unsigned int seed = 1;
+    long checksum = 0;
+    double hit, miss, churn, start;
+    void *data;
+    int done;
+
+    if (table == NULL)
+        return -1;
+    FORONE(i, n_live){
+        if (hash_set(table, names[i], value, value_size) != HASH_OK){
+            hash_detach(table);
+            return 1;
+        }
+        live[i] = i;
+    }
+    next = n_live;
+
+    start = now_ns();
+    for (done = 0; done < n_ops && !TIMED_OUT(done, start); done++){
+        handle = hash_acquire(table, names[live[rand_r(&seed) % n_live]],
+                              &data, &size);
+        if (handle >= 0){
+            checksum += ((char*)data)[0];
+            hash_release(table, handle);
+        }
+    }
+    hit = (now_ns() - start)/done;
+
+    start = now_ns();
+    for (done = 0; done < n_ops && !TIMED_OUT(done, start); done++){
+        handle = hash_acquire(table, absent[rand_r(&seed) % n_slots],
+                              &data, &size);
+        if (handle >= 0){
+            checksum += ((char*)data)[0];
+            hash_release(table, handle);
+        }
+    }
+    miss = (now_ns() - start)/done;
+
+    /* Names come back once the fresh ones run out. */
+    start = now_ns();
+    for (done = 0; done < n_ops && !TIMED_OUT(done, start); done++){
+        int k = rand_r(&seed) % n_live;
+
+        hash_delete(table, names[live[k]]);
+        if (hash_set(table, names[next], value, value_size) == HASH_OK)
+            live[k] = next;
+        next = (next + 1) % (n_slots + n_ops);
+    }
+    churn = (now_ns() - start)/done;
+
+    printf("%-8s %3d%% load   GET hit %7.1f ns   GET miss %7.1f ns   "
+           "DELETE+SET %7.1f ns   (checksum %ld)\n",
+           engine == HASH_ENGINE_CUCKOO ? "cuckoo" : "probing", load, hit,
+           miss, churn, checksum);
+    hash_detach(table);
+    return 0;
+}
+
+int main(int argc, char **argv){
+    int option, engines[2] = {HASH_ENGINE_PROBING, HASH_ENGINE_CUCKOO};
+    char *value;
+    int *live;
+
+    while ((option = getopt(argc, argv, "n:o:s:")) != -1){
+        switch (option){
+            case 'n': n_slots = atoi(optarg); break;
+            case 'o': n_ops = atoi(optarg); break;
+            case 's': value_size = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-n slots] [-o ops] [-s size]\n",
+                        argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    EXIT_NOT_ON_VALUE(argc - optind, 0, "TOO MANY ARGUMENTS, EXIT.\n",
+                      EXIT_FAILURE);
+    /* Whole cuckoo buckets, both engines get the same slots. */
+    EXIT_ON_VALUE(n_slots < 4 || n_slots % 4 != 0 || n_ops < 1 ||
+                  value_size < 1, 1, "BAD COMMANDLINE ARGUMENT, EXIT.\n",
+                  EXIT_FAILURE);
+
+    names = malloc((size_t)(n_slots + n_ops)*NAME_SIZE);
+    absent = malloc((size_t)n_slots*NAME_SIZE);
+    live = malloc((size_t)n_slots*sizeof(int));
+    value = malloc(value_size);
+    EXIT_ON_VALUE(names == NULL || absent == NULL || live == NULL || 
+                  value == NULL, 1, "CANNOT ALLOCATE MEMORY, EXIT.\n", 
+                  EXIT_FAILURE);
+    FORONE(i, n_slots + n_ops)
+        snprintf(names[i], NAME_SIZE, "key:%d", i);
+    FORONE(i, n_slots)
+        snprintf(absent[i], NAME_SIZE, "absent:%d", i);
+    memset(value, 'v', value_size);
+
+    printf("%d slots, %d ops per load, %d byte values\n", n_slots, n_ops,
+           value_size);
+    FORONE(e, 2)
+        EXIT_ON_VALUE(run_fill(engines[e], value), -1,
+                      "CANNOT MAKE THE TABLE, EXIT.\n", EXIT_FAILURE);
+    FORONE(l, N_LOADS){
+        FORONE(e, 2){
+            int status = run_load(engines[e], loads[l], value, live);
+
+            EXIT_ON_VALUE(status, -1, "CANNOT MAKE THE TABLE, EXIT.\n",
+                          EXIT_FAILURE);
+            if (status == 1)
+                printf("%-8s %3d%% load   cannot be filled\n",
+                       engines[e] == HASH_ENGINE_CUCKOO ? "cuckoo"
+                                                        : "probing", loads[l]);
+        }
+    }
+    FREE_ON_VAL(names, absent, live);
+    FREE(value);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,200 @@
+/*
+ *  File:        bench_layout.c
+ *  Purpose:     Compare the HASH_LAYOUT_ARRAYS and HASH_LAYOUT_BUCKETS
+ *               slot layouts of the shared hashtable in process, with
+ *               time and cache misses per operation.
+ *
+ *               ./bench_layout [-n keys] [-o ops] [-s size] [-l load]
+ *                              [-g percent]
+ *               -n keys:       names stored before the run, default 262144.
+ *               -o ops:        operations timed per layout, default 2000000.
+ *               -s size:       value size, default 32.
+ *               -l load:       percent of slots used, default 50.
+ *               -g percent:    percent of GET, the rest SET, default 90.
+ *
+ *  Note:        Names are picked uniformly, a quarter of the GETs miss.
+ *               Cache misses come from perf_event_open(), "n/a" is
+ *               printed where the kernel or its perf_event_paranoid
+ *               setting does not allow counting.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "utility_macros.h"
+#include "shared_hashtable.h"
+
+#define N_COUNTERS      2
+
+static const char *counter_names[N_COUNTERS] = {"cache misses",
+                                                "L1d read misses"};
+static int n_keys = 262144, n_ops = 2000000, value_size = 32, load = 50,
+           get_percent = 90;
+
+
+/*
+* Name:         now_ns
+* Argument:     none
+* Return:       double
+* Purpose:      Monotonic clock in nanoseconds.
+* Note:         none
+*/
+static double now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+/*
+* Name:         counter_open
+* Argument:     unsigned int, unsigned long long
+* Return:       int
+* Purpose:      Open a disabled counter of this process, user space only.
+* Note:         Returns -1 when it cannot be counted.
+*/
+static int counter_open(unsigned int type, unsigned long long config){
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+* Name:         run_layout
+* Argument:     int, int*
+* Return:       int
+* Purpose:      Fill a table of the layout and time the GET/SET mix.
+* Note:         fds are the counters, -1 for the ones not available.
+*               Returns -1 if the table cannot be made or filled.
+*/
+static int run_layout(int layout, int *fds){
+    hash_options options;
+    char name[32], *value = malloc(value_size);
+    unsigned long long counts[N_COUNTERS];
+    unsigned int seed = 1;
+    long checksum = 0;
+    void *table, *data;
+    int size, handle;
+
+    memset(&options, 0, sizeof(options));
+    options.lock_type = HASH_LOCK_THREAD;
+    options.layout = layout;
+    table = make_hashtable_opt((int)((long)n_keys*100/load), value_size,
+                               &options);
+    if (table == NULL || value == NULL){
+        FREE(value);
+        return -1;
+    }
+    memset(value, 'v', value_size);
+    FORONE(i, n_keys){
+        sprintf(name, "key:%d", i);
+        if (hash_set(table, name, value, value_size) != HASH_OK){
+            hash_detach(table);
+            FREE(value);
+            return -1;
+        }
+    }
+
+    FORONE(i, N_COUNTERS)
+        if (fds[i] != -1){
+            ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    double start = now_ns();
+    FORONE(i, n_ops){
+        int key = rand_r(&seed) % n_keys;
+        if ((int)(rand_r(&seed) % 100) < get_percent){
+            /* Names past n_keys are never stored. */
+            sprintf(name, "key:%d", key % 4 == 0 ? key + n_keys : key);
+            handle = hash_acquire(table, name, &data, &size);
+            if (handle >= 0){
+                checksum += ((char*)data)[0];
+                hash_release(table, handle);
+            }
+        }
+        else{
+            sprintf(name, "key:%d", key);
+            value[0] = 'a' + i % 26;
+            hash_set(table, name, value, value_size);
+        }
+    }
+    double elapsed = now_ns() - start;
+    FORONE(i, N_COUNTERS){
+        counts[i] = 0;
+        if (fds[i] != -1){
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fds[i], &counts[i], sizeof(counts[i]))
+                != sizeof(counts[i]))
+                fds[i] = -1;
+        }
+    }
+
+    hash_stats st;
+    hash_get_stats(table, &st);
+    printf("%-8s %8.1f ns/op %10.2f MB metadata",
+           layout == HASH_LAYOUT_BUCKETS ? "buckets" : "arrays",
+           elapsed/n_ops, st.metadata_bytes/1e6);
+    FORONE(i, N_COUNTERS){
+        if (fds[i] == -1)
+            printf("   %s n/a", counter_names[i]);
+        else
+            printf("   %s %.2f/op", counter_names[i], (double)counts[i]/n_ops);
+    }
+    printf("   (checksum %ld)\n", checksum);
+
+    hash_detach(table);
+    FREE(value);
+    return 0;
+}
+
+int main(int argc, char **argv){
+    int option, fds[N_COUNTERS];
+
+    while ((option = getopt(argc, argv, "n:o:s:l:g:")) != -1){
+        switch (option){
+            case 'n': n_keys = atoi(optarg); break;
+            case 'o': n_ops = atoi(optarg); break;
+            case 's': value_size = atoi(optarg); break;
+            case 'l': load = atoi(optarg); break;
+            case 'g': get_percent = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-n keys] [-o ops] [-s size] "
+                        "[-l load] [-g percent]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    EXIT_NOT_ON_VALUE(argc - optind, 0, "TOO MANY ARGUMENTS, EXIT.\n",
+                      EXIT_FAILURE);
+    EXIT_ON_VALUE(n_keys < 1 || n_ops < 1 || value_size < 1 || load < 1 ||
+                  load > 95 || get_percent < 0 || get_percent > 100, 1,
+                  "BAD COMMANDLINE ARGUMENT, EXIT.\n", EXIT_FAILURE);
+
+    fds[0] = counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    fds[1] = counter_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                          (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+    printf("%d names, %d ops, %d byte values, %d%% load, %d%% GET\n",
+           n_keys, n_ops, value_size, load, get_percent);
+    EXIT_ON_VALUE(run_layout(HASH_LAYOUT_ARRAYS, fds), -1,
+                  "CANNOT FILL THE TABLE, EXIT.\n", EXIT_FAILURE);
+    EXIT_ON_VALUE(run_layout(HASH_LAYOUT_BUCKETS, fds), -1,
+                  "CANNOT FILL THE TABLE, EXIT.\n", EXIT_FAILURE);
+
+    FORONE(i, N_COUNTERS)
+        if (fds[i] != -1)
+            close(fds[i]);
+    return EXIT_SUCCESS;
+}
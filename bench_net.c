@@ -0,0 +1,296 @@
+/* 
+ *  File:        bench_net.c
+ *  Purpose:     Throughput benchmark of a running memcache server, used 
+ *               to compare the fork, thread, epoll and io_uring modes.
+ * 
+ *               ./bench_net [-c clients] [-n requests] [-s size] [-k keys]
+ *                           [-p depth] <host> <port>
+ *               -c clients:    concurrent client threads, default 8.
+ *               -n requests:   total requests, default 20000.
+ *               -s size:       SET value size, default 32.
+ *               -k keys:       distinct names, default 1000.
+ *               -p depth:      pipeline depth requests per client on one
+ *                              kept alive connection with mcclient.h, 
+ *                              the server must run with -k.
+ * 
+ *  Note:        Without -p every request is one connection, as the server
+ *               expects without -k. Latency is from submit to response.
+ *               Half of the requests are SET, half GET. Syscalls per 
+ *               request come from the server's own STATS counters, read 
+ *               before and after the run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "utility_macros.h"
+#include "socket_utils.h"
+#include "mcclient.h"
+
+#define RESPONSE_SIZE   65536
+
+/* Arguments and results of a client thread. */
+typedef struct client_struct {
+    pthread_t thread;
+    int id;
+    int n_requests;
+    int errors;
+    double total_us;                /* Sum of request latencies. */
+} client;
+
+/* A pipelined request, the argument of its callback. */
+typedef struct pipelined_struct {
+    client *self;
+    double start;
+} pipelined;
+
+static struct addrinfo *server;
+static int value_size = 32, n_keys = 1000, depth = 0;
+static char *host, *port;
+
+
+/*  
+* Name:         now_us
+* Argument:     none
+* Return:       double
+* Purpose:      Monotonic clock in microseconds.
+* Note:         none
+*/
+static double now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e6 + ts.tv_nsec/1e3;
+}
+
+/*  
+* Name:         request_once
+* Argument:     char*, size_t, char*, size_t
+* Return:       int
+* Purpose:      Connect, send one request and read the response until the
+*               server closes.
+* Note:         Returns bytes of response, -1 on errors.
+*/
+static int request_once(char *msg, size_t length, char *out, size_t out_size){
+    int fd, status, total = 0, one = 1;
+
+    fd = socket(server->ai_family, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, server->ai_addr, server->ai_addrlen) == -1){
+        close(fd);
+        return -1;
+    }
+    if (write_in_full(fd, msg, length) == -1){
+        close(fd);
+        return -1;
+    }
+    shutdown(fd, SHUT_WR);
+    while ((size_t)total < out_size - 1){
+        status = read(fd, out + total, out_size - 1 - total);
+        if (status == -1 && errno == EINTR) continue;
+        if (status <= 0) break;
+        total += status;
+    }
+    out[total] = '\0';
+    close(fd);
+    return total;
+}
+
+/*  
+* Name:         client_main
+* Argument:     void*
+* Return:       void*
+* Purpose:      Thread body, run n_requests alternating SET and GET.
+* Note:         none
+*/
+static void* client_main(void *arg){
+    client *self = (client*)arg;
+    char *msg = malloc(value_size + 256), *out = malloc(RESPONSE_SIZE);
+    unsigned int seed = self->id + 1;
+    int length;
+
+    FORONE(i, self->n_requests){
+        int key = rand_r(&seed) % n_keys;
+        if (i % 2 == 0){
+            length = sprintf(msg, "SET key%d %d\r\n", key, value_size);
+            memset(msg + length, 'a' + key % 26, value_size);
+            length += value_size;
+        }
+        else
+            length = sprintf(msg, "GET key%d\r\n", key);
+
+        double start = now_us();
+        if (request_once(msg, length, out, RESPONSE_SIZE) <= 0 ||
+            (strncmp(out, "OK", 2) != 0 && strncmp(out, "ERR NOT_FOUND", 13) != 0))
+            self->errors++;
+        self->total_us += now_us() - start;
+    }
+    FREE_ON_VAL(msg, out, NULL);
+    return NULL;
+}
+
+/*  
+* Name:         pipelined_done
+* Argument:     mc_result*, void*
+* Return:       none
+* Purpose:      Account for a pipelined request's response.
+* Note:         none
+*/
+static void pipelined_done(mc_result *result, void *arg){
+    pipelined *request = (pipelined*)arg;
+
+    if (result->status != MC_OK && result->status != MC_ERR_NOT_FOUND)
+        request->self->errors++;
+    request->self->total_us += now_us() - request->start;
+}
+
+/*  
+* Name:         pipelined_main
+* Argument:     void*
+* Return:       void*
+* Purpose:      Thread body of -p, the requests of client_main() kept 
+*               depth deep on one connection.
+* Note:         none
+*/
+static void* pipelined_main(void *arg){
+    client *self = (client*)arg;
+    pipelined *requests = malloc(self->n_requests*sizeof(pipelined));
+    char *value = malloc(value_size), name[32];
+    mc_options options = {1, depth, 0};
+    unsigned int seed = self->id + 1;
+    mc_client *mc = mc_connect(host, atoi(port), &options);
+    int status;
+
+    if (requests == NULL || value == NULL || mc == NULL){
+        self->errors = self->n_requests;
+        FREE_ON_VAL(requests, value, NULL);
+        mc_close(mc);
+        return NULL;
+    }
+    FORONE(i, self->n_requests){
+        int key = rand_r(&seed) % n_keys;
+
+        sprintf(name, "key%d", key);
+        requests[i].self = self;
+        requests[i].start = now_us();
+        if (i % 2 == 0){
+            memset(value, 'a' + key % 26, value_size);
+            status = mc_set_async(mc, name, value, value_size, 
+                                  pipelined_done, &requests[i]);
+        }
+        else
+            status = mc_get_async(mc, name, pipelined_done, &requests[i]);
+        if (status != MC_OK)
+            self->errors++;
+    }
+    mc_wait(mc, -1);
+    mc_close(mc);
+    FREE_ON_VAL(requests, value, NULL);
+    return NULL;
+}
+
+/*  
+* Name:         server_stat
+* Argument:     const char*
+* Return:       long
+* Purpose:      Read one counter from the server's STATS response.
+* Note:         Returns -1 if the server does not report it.
+*/
+static long server_stat(const char *name){
+    char *out = malloc(RESPONSE_SIZE), key[64], *found;
+    long value = -1;
+
+    if (request_once("STATS\r\n", 7, out, RESPONSE_SIZE) > 0){
+        snprintf(key, sizeof(key), "STAT %s ", name);
+        found = strstr(out, key);
+        if (found != NULL)
+            value = atol(found + strlen(key));
+    }
+    free(out);
+    return value;
+}
+
+int main(int argc, char **argv){
+    int n_clients = 8, n_requests = 20000, option, errors = 0;
+    struct addrinfo hints;
+    double total_us = 0;
+
+    while ((option = getopt(argc, argv, "c:n:s:k:p:")) != -1){
+        switch (option){
+            case 'c': n_clients = atoi(optarg); break;
+            case 'n': n_requests = atoi(optarg); break;
+            case 's': value_size = atoi(optarg); break;
+            case 'k': n_keys = atoi(optarg); break;
+            case 'p': depth = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-c clients] [-n requests] "
+                        "[-s size] [-k keys] [-p depth] <host> <port>\n", 
+                        argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    EXIT_NOT_ON_VALUE(argc - optind, 2, "TOO MANY OR TO FEW ARGUMENTS, EXIT.\n",
+                      EXIT_FAILURE);
+    EXIT_ON_VALUE(n_clients < 1 || n_requests < 1 || value_size < 1 || 
+                  n_keys < 1 || depth < 0, 1, 
+                  "BAD COMMANDLINE ARGUMENT, EXIT.\n", EXIT_FAILURE);
+    host = argv[optind];
+    port = argv[optind+1];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(argv[optind], argv[optind+1], &hints, &server) != 0){
+        fprintf(stderr, "CANNOT RESOLVE %s, EXIT.\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    client *clients = calloc(n_clients, sizeof(client));
+    EXIT_ON_VALUE(clients, NULL, "CANNOT ALLOCATE MEMORY, EXIT.\n", 
+                  EXIT_FAILURE);
+
+    long syscalls_before = server_stat("syscalls");
+    long requests_before = server_stat("requests");
+    double start = now_us();
+    FORONE(i, n_clients){
+        clients[i].id = i;
+        clients[i].n_requests = n_requests/n_clients + 
+                                (i < n_requests % n_clients);
+        pthread_create(&clients[i].thread, NULL, 
+                       depth > 0 ? pipelined_main : client_main, &clients[i]);
+    }
+    FORONE(i, n_clients){
+        pthread_join(clients[i].thread, NULL);
+        errors += clients[i].errors;
+        total_us += clients[i].total_us;
+    }
+    double elapsed = now_us() - start;
+    long requests_after = server_stat("requests");
+    long syscalls_after = server_stat("syscalls");
+
+    printf("requests:           %d\n", n_requests);
+    printf("errors:             %d\n", errors);
+    printf("elapsed:            %.3f s\n", elapsed/1e6);
+    printf("throughput:         %.0f req/s\n", n_requests/(elapsed/1e6));
+    printf("mean latency:       %.1f us\n", total_us/n_requests);
+    if (syscalls_before >= 0 && syscalls_after >= 0){
+        /* The STATS request between the samples is counted too. */
+        long served = requests_after - requests_before;
+        printf("server syscalls:    %.2f per request\n", 
+               served > 0 ? (double)(syscalls_after - syscalls_before)/served : 0);
+    }
+
+    FREE(clients);
+    freeaddrinfo(server);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
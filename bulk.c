@@ -0,0 +1,337 @@
+/*
+ *  File:        bulk.c
+ *  Purpose:     Parallel load and export of dump files, see bulk.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utility_macros.h"
+#include "shared_hashtable.h"
+#include "bulk.h"
+
+#define BULK_NAME_SIZE      120             /* Key slot, NUL included. */
+#define BULK_MAX_WORKERS    256
+
+/* Work of one thread. */
+typedef struct bulk_worker_struct {
+    pthread_t thread;
+    void *hashtable;
+    const unsigned char *start;     /* Load: first entry of the range. */
+    const unsigned char *end;       /* Load: end of the range. */
+    int first_slot;                 /* Export: slots first_slot to */
+    int last_slot;                  /*         last_slot - 1. */
+    FILE *file;                     /* Export: entries of the range. */
+    long records;
+    long errors;
+    int running;                    /* Thread was created. */
+    int failed;
+} bulk_worker;
+
+
+/*
+* Name:         now_seconds
+* Argument:     none
+* Return:       double
+* Purpose:      Monotonic clock in seconds.
+* Note:         none
+*/
+static double now_seconds(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/*
+* Name:         get_u32
+* Argument:     const unsigned char*
+* Return:       uint32_t
+* Purpose:      Read a little endian 32 bit integer.
+* Note:         none
+*/
+static uint32_t get_u32(const unsigned char *p){
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+* Name:         next_record
+* Argument:     const unsigned char*, const unsigned char*
+* Return:       const unsigned char*
+* Purpose:      Find the entry after the one at p.
+* Note:         Returns NULL if the entry at p is cut short or invalid.
+*/
+static const unsigned char* next_record(const unsigned char *p,
+                                        const unsigned char *end){
+    uint32_t length;
+
+    if (end - p < 4)
+        return NULL;
+    length = get_u32(p);
+    if (length < 1 || length >= BULK_NAME_SIZE || 
+        (size_t)(end - p) < 8 + length)
+        return NULL;
+    p += 4 + length;
+    length = get_u32(p);
+    if (length < 1 || (size_t)(end - p - 4) < length)
+        return NULL;
+    return p + 4 + length;
+}
+
+/*
+* Name:         load_worker
+* Argument:     void*
+* Return:       void*
+* Purpose:      Thread body, hash_set() every entry of its range.
+* Note:         Ranges are already validated by bulk_load().
+*/
+static void* load_worker(void *arg){
+    bulk_worker *self = (bulk_worker*)arg;
+    const unsigned char *p = self->start;
+    char name[BULK_NAME_SIZE];
+
+    while (p < self->end){
+        uint32_t name_len = get_u32(p), value_len;
+
+        memcpy(name, p + 4, name_len);
+        name[name_len] = '\0';
+        p += 4 + name_len;
+        value_len = get_u32(p);
+        if (hash_set(self->hashtable, name, (void*)(p + 4), 
+                     value_len) == HASH_OK)
+            self->records++;
+        else
+            self->errors++;
+        p += 4 + value_len;
+    }
+    return NULL;
+}
+
+/*
+* Name:         bulk_load
+* Argument:     void*, const char*, int, bulk_result*
+* Return:       int
+* Purpose:      Insert every entry of the dump at path into hashtable with
+*               n_workers threads.
+* Note:         One pass over the entry lengths finds the boundaries,
+*               workers then only touch their own part of the file.
+*/
+int bulk_load(void *hashtable, const char *path, int n_workers,
+              bulk_result *result){
+    bulk_worker workers[BULK_MAX_WORKERS];
+    const unsigned char *data, *p, *end;
+    double started = now_seconds();
+    int fd, status = 0;
+    struct stat info;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    RETURN_ON_VALUE(fd, -1, "CANNOT OPEN DUMP FILE.\n", -1);
+    if (fstat(fd, &info) == -1 || info.st_size < BULK_MAGIC_SIZE){
+        fprintf(stderr, "NOT A DUMP FILE.\n");
+        close(fd);
+        return -1;
+    }
+    data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    RETURN_ON_VALUE(data, MAP_FAILED, "CANNOT MAP DUMP FILE.\n", -1);
+    if (memcmp(data, BULK_MAGIC, BULK_MAGIC_SIZE) != 0){
+        fprintf(stderr, "NOT A DUMP FILE.\n");
+        munmap((void*)data, info.st_size);
+        return -1;
+    }
+    madvise((void*)data, info.st_size, MADV_SEQUENTIAL);
+
+    n_workers = MIN(MAX(n_workers, 1), BULK_MAX_WORKERS);
+    p = data + BULK_MAGIC_SIZE;
+    end = data + info.st_size;
+
+    /* Cut the file at the first entry past each 1/n_workers of it. */
+    FORONE(i, n_workers){
+        const unsigned char *target = p + (end - p)/(n_workers - i);
+
+        memset(&workers[i], 0, sizeof(bulk_worker));
+        workers[i].hashtable = hashtable;
+        workers[i].start = p;
+        while (p < target && p < end){
+            const unsigned char *next = next_record(p, end);
+            if (next == NULL){
+                fprintf(stderr, "DUMP FILE CORRUPT AT BYTE %ld.\n",
+                        (long)(p - data));
+                status = -1;
+                end = p;
+                break;
+            }
+            p = next;
+        }
+        workers[i].end = p;
+    }
+
+    FORONE(i, n_workers){
+        workers[i].running = pthread_create(&workers[i].thread, NULL, 
+                                            load_worker, &workers[i]) == 0;
+        /* Run the range here instead. */
+        if (!workers[i].running)
+            load_worker(&workers[i]);
+    }
+    FORONE(i, n_workers)
+        if (workers[i].running)
+            pthread_join(workers[i].thread, NULL);
+
+    if (result != NULL){
+        memset(result, 0, sizeof(bulk_result));
+        FORONE(i, n_workers){
+            result->records += workers[i].records;
+            result->errors += workers[i].errors;
+        }
+        result->bytes = info.st_size;
+        result->seconds = now_seconds() - started;
+    }
+    munmap((void*)data, info.st_size);
+    return status;
+}
+
+/*
+* Name:         bulk_write_record
+* Argument:     FILE*, const char*, const void*, int
+* Return:       int
+* Purpose:      Append one entry to a dump being written.
+* Note:         none
+*/
+int bulk_write_record(FILE *file, const char *name, const void *data,
+                      int size){
+    uint32_t lengths[2] = {strlen(name), size};
+    unsigned char header[4];
+
+    FORONE(i, 2){
+        FORONE(j, 4)
+            header[j] = (lengths[i] >> (8*j)) & 0xff;
+        if (fwrite(header, 4, 1, file) != 1)
+            return -1;
+        if (i == 0 && fwrite(name, lengths[0], 1, file) != 1)
+            return -1;
+    }
+    if (fwrite(data, size, 1, file) != 1)
+        return -1;
+    return 0;
+}
+
+/*
+* Name:         export_record
+* Argument:     char*, void*, int, void*
+* Return:       int
+* Purpose:      hash_scan() callback writing one entry.
+* Note:         none
+*/
+static int export_record(char *name, void *data, int size, void *arg){
+    bulk_worker *self = (bulk_worker*)arg;
+
+    if (bulk_write_record(self->file, name, data, size) == -1)
+        return -1;
+    self->records++;
+    return 0;
+}
+
+/*
+* Name:         export_worker
+* Argument:     void*
+* Return:       void*
+* Purpose:      Thread body, write the entries of its slots to a
+*               temporary file.
+* Note:         none
+*/
+static void* export_worker(void *arg){
+    bulk_worker *self = (bulk_worker*)arg;
+
+    self->file = tmpfile();
+    if (self->file == NULL ||
+        hash_scan(self->hashtable, self->first_slot, self->last_slot,
+                  export_record, self) < 0)
+        self->failed = 1;
+    return NULL;
+}
+
+/*
+* Name:         bulk_export
+* Argument:     void*, const char*, int, bulk_result*
+* Return:       int
+* Purpose:      Write every entry of hashtable to a dump at path, scanning
+*               the table with n_workers threads.
+* Note:         Each worker fills a temporary file, they are concatenated
+*               in slot order once all are done.
+*/
+int bulk_export(void *hashtable, const char *path, int n_workers,
+                bulk_result *result){
+    bulk_worker workers[BULK_MAX_WORKERS];
+    double started = now_seconds();
+    char tmp_path[4096], buffer[65536];
+    int status = 0, n_slots;
+    hash_stats table;
+    FILE *out;
+
+    if (hash_get_stats(hashtable, &table) != HASH_OK)
+        return -1;
+    n_slots = table.num_elements;
+    n_workers = MIN(MAX(n_workers, 1), BULK_MAX_WORKERS);
+
+    FORONE(i, n_workers){
+        memset(&workers[i], 0, sizeof(bulk_worker));
+        workers[i].hashtable = hashtable;
+        workers[i].first_slot = (long)n_slots*i/n_workers;
+        workers[i].last_slot = (long)n_slots*(i + 1)/n_workers;
+        workers[i].running = pthread_create(&workers[i].thread, NULL, 
+                                            export_worker, &workers[i]) == 0;
+        if (!workers[i].running)
+            export_worker(&workers[i]);
+    }
+    FORONE(i, n_workers)
+        if (workers[i].running)
+            pthread_join(workers[i].thread, NULL);
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    out = fopen(tmp_path, "w");
+    if (out == NULL || fwrite(BULK_MAGIC, BULK_MAGIC_SIZE, 1, out) != 1)
+        status = -1;
+
+    FORONE(i, n_workers){
+        size_t n;
+
+        if (workers[i].failed)
+            status = -1;
+        if (workers[i].file == NULL)
+            continue;
+        rewind(workers[i].file);
+        while (status == 0 &&
+               (n = fread(buffer, 1, sizeof(buffer), workers[i].file)) > 0)
+            if (fwrite(buffer, 1, n, out) != n)
+                status = -1;
+        fclose(workers[i].file);
+    }
+
+    if (out != NULL){
+        if (fflush(out) != 0 || fsync(fileno(out)) != 0)
+            status = -1;
+        if (result != NULL){
+            memset(result, 0, sizeof(bulk_result));
+            FORONE(i, n_workers)
+                result->records += workers[i].records;
+            result->bytes = ftell(out);
+        }
+        fclose(out);
+    }
+    if (status == 0 && rename(tmp_path, path) == -1)
+        status = -1;
+    if (status != 0){
+        fprintf(stderr, "CANNOT WRITE DUMP FILE.\n");
+        unlink(tmp_path);
+    }
+    if (result != NULL)
+        result->seconds = now_seconds() - started;
+    return status;
+}
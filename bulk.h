@@ -0,0 +1,73 @@
+/*
+ *  File:        bulk.h
+ *  Purpose:     Load a hashtable from a dump file and dump a live one,
+ *               with several threads and without the socket protocol.
+ *
+ *               Dump file format, integers are 32 bit little endian:
+ *               "MCDUMP1\n"                                header
+ *               <name_len><name><value_len><value>         per entry
+ *               name_len:      1 to 119, name is not NUL terminated.
+ *               value_len:     >= 1, the value before compression.
+ */
+
+#ifndef _BULK_H_
+#define _BULK_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define BULK_MAGIC          "MCDUMP1\n"     /* Header of a dump file. */
+#define BULK_MAGIC_SIZE     8
+
+/* What a bulk_load()/bulk_export() did. */
+typedef struct bulk_result_struct {
+    long records;                   /* Entries read or written. */
+    long errors;                    /* Entries hash_set() refused. */
+    size_t bytes;                   /* Bytes of the dump file. */
+    double seconds;                 /* Wall time. */
+} bulk_result;
+
+
+/*
+* Name:         bulk_load
+* Argument:     void*, const char*, int, bulk_result*
+* Return:       int
+* Purpose:      Insert every entry of the dump at path into hashtable with
+*               n_workers threads.
+* Note:         The file is mapped and cut at entry boundaries into one
+*               range per worker. Entries the table refuses (too large,
+*               no space) are counted in result->errors, not fatal.
+*               Returns 0, or -1 if the file cannot be read or is corrupt
+*               (entries before the corruption are loaded). result may be
+*               NULL.
+*/
+int bulk_load(void *hashtable, const char *path, int n_workers,
+              bulk_result *result);
+
+
+/*
+* Name:         bulk_export
+* Argument:     void*, const char*, int, bulk_result*
+* Return:       int
+* Purpose:      Write every entry of hashtable to a dump at path, scanning
+*               the table with n_workers threads.
+* Note:         Clients may keep using the table, the dump is then a
+*               mix of before and after. The file is written to
+*               path.tmp and renamed, so path is never half written.
+*               Returns 0, or -1 on errors. result may be NULL.
+*/
+int bulk_export(void *hashtable, const char *path, int n_workers,
+                bulk_result *result);
+
+
+/*
+* Name:         bulk_write_record
+* Argument:     FILE*, const char*, const void*, int
+* Return:       int
+* Purpose:      Append one entry to a dump being written.
+* Note:         Returns 0, or -1 on write errors.
+*/
+int bulk_write_record(FILE *file, const char *name, const void *data,
+                      int size);
+
+#endif      /* _BULK_H_ */
@@ -0,0 +1,327 @@
+/*
+ *  File:        capture.c
+ *  Purpose:     Capture of the requests a server runs to a binary trace
+ *               file, and loading it back, see capture.h.
+ *
+ *  Note:        A request costs a clock read and a copy into the calling
+ *               thread's buffer, the file is written a buffer at a time.
+ *               The file is opened with O_APPEND, so the buffers of
+ *               threads and forked children never overwrite each other.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "utility_macros.h"
+#include "capture.h"
+
+/* A record with its position in the file, while sorting. */
+typedef struct capture_entry_struct {
+    capture_record record;
+    char *value;
+    long order;
+} capture_entry;
+
+int capture_fd = -1;
+static int capture_values = 0;
+
+/* The calling thread's records not written yet. */
+static __thread char *buffer = NULL;
+static __thread size_t used = 0;
+static __thread long first_ns = 0;
+
+
+/*
+* Name:         now_ns
+* Argument:     none
+* Return:       long
+* Purpose:      Monotonic clock in nanoseconds.
+* Note:         none
+*/
+static long now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+/*
+* Name:         write_all
+* Argument:     const char*, size_t
+* Return:       none
+* Purpose:      Append length bytes to the trace file.
+* Note:         A failed write loses them, serving goes on.
+*/
+static void write_all(const char *data, size_t length){
+    while (length > 0){
+        ssize_t done = write(capture_fd, data, length);
+        if (done <= 0)
+            return;
+        data += done;
+        length -= done;
+    }
+}
+
+/*
+* Name:         capture_open
+* Argument:     const char*, int
+* Return:       int
+* Purpose:      Start capturing requests to a new trace file at path.
+* Note:         none
+*/
+int capture_open(const char *path, int values){
+    capture_header header = {CAPTURE_MAGIC, CAPTURE_VERSION,
+                             values ? CAPTURE_VALUES : 0};
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+              0644);
+    if (fd == -1)
+        return -1;
+    if (write(fd, &header, sizeof(header)) != sizeof(header)){
+        close(fd);
+        return -1;
+    }
+    capture_values = values;
+    capture_fd = fd;
+    return 0;
+}
+
+/*
+* Name:         capture_write
+* Argument:     int, const char*, int, const void*, size_t
+* Return:       none
+* Purpose:      Record a request in the calling thread's buffer.
+* Note:         A record too large for a buffer is written on its own,
+*               after the buffer.
+*/
+void capture_write(int op, const char *name, int size, const void *data,
+                   size_t data_len){
+    capture_record record;
+    size_t value_size;
+
+    record.time_ns = now_ns();
+    record.key = capture_hash(name);
+    record.size = op == CAPTURE_OP_SET ? size : 0;
+    record.op = op;
+    record.has_value = capture_values && op == CAPTURE_OP_SET &&
+                       data_len == (size_t)size;
+    value_size = record.has_value ? record.size : 0;
+
+    if (buffer == NULL){
+        buffer = malloc(CAPTURE_BUFFER_SIZE);
+        if (buffer == NULL)
+            return;
+    }
+    if (used > 0 && (used + sizeof(record) + value_size > CAPTURE_BUFFER_SIZE
+                     || (long)record.time_ns - first_ns > CAPTURE_FLUSH_NS)){
+        write_all(buffer, used);
+        used = 0;
+    }
+    if (sizeof(record) + value_size > CAPTURE_BUFFER_SIZE){
+        struct iovec parts[2] = {{&record, sizeof(record)},
+                                 {(void*)data, value_size}};
+        writev(capture_fd, parts, 2);
+        return;
+    }
+    if (used == 0)
+        first_ns = record.time_ns;
+    memcpy(buffer + used, &record, sizeof(record));
+    if (value_size > 0)
+        memcpy(buffer + used + sizeof(record), data, value_size);
+    used += sizeof(record) + value_size;
+}
+
+/*
+* Name:         capture_timeout
+* Argument:     none
+* Return:       int
+* Purpose:      Milliseconds until the calling thread's buffer is due to 
+*               be written.
+* Note:         Rounded up, a wait ends once it is due.
+*/
+int capture_timeout(void){
+    long left;
+
+    if (used == 0)
+        return -1;
+    left = first_ns + CAPTURE_FLUSH_NS - now_ns();
+    return left <= 0 ? 0 : (int)((left + 999999) / 1000000);
+}
+
+/*
+* Name:         capture_tick
+* Argument:     none
+* Return:       none
+* Purpose:      Write the calling thread's buffer if it is due.
+* Note:         The buffer is kept for the next records.
+*/
+void capture_tick(void){
+    if (capture_fd != -1 && used > 0 && 
+        now_ns() - first_ns >= CAPTURE_FLUSH_NS){
+        write_all(buffer, used);
+        used = 0;
+    }
+}
+
+/*
+* Name:         capture_flush
+* Argument:     none
+* Return:       none
+* Purpose:      Write the calling thread's buffer out and free it.
+* Note:         none
+*/
+void capture_flush(void){
+    if (capture_fd != -1 && used > 0)
+        write_all(buffer, used);
+    used = 0;
+    FREE(buffer);
+}
+
+/*
+* Name:         capture_close
+* Argument:     none
+* Return:       none
+* Purpose:      Flush the calling thread's buffer and stop capturing.
+* Note:         none
+*/
+void capture_close(void){
+    capture_flush();
+    if (capture_fd != -1)
+        close(capture_fd);
+    capture_fd = -1;
+}
+
+/*
+* Name:         capture_hash
+* Argument:     const char*
+* Return:       uint64_t
+* Purpose:      Key of a name in the trace, FNV-1a.
+* Note:         none
+*/
+uint64_t capture_hash(const char *name){
+    uint64_t hash = 0xcbf29ce484222325UL;
+
+    while (*name != '\0'){
+        hash ^= (unsigned char)*name++;
+        hash *= 0x100000001b3UL;
+    }
+    return hash;
+}
+
+/*
+* Name:         compare_entries
+* Argument:     const void*, const void*
+* Return:       int
+* Purpose:      qsort() order of records: time, then position in the file.
+* Note:         none
+*/
+static int compare_entries(const void *a, const void *b){
+    const capture_entry *x = a, *y = b;
+
+    if (x->record.time_ns != y->record.time_ns)
+        return x->record.time_ns < y->record.time_ns ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/*
+* Name:         capture_load
+* Argument:     const char*
+* Return:       capture_trace*
+* Purpose:      Read a trace file and sort its records by time.
+* Note:         The records are counted first, then copied out of the
+*               file, which stays in memory for the values.
+*/
+capture_trace* capture_load(const char *path){
+    capture_trace *trace;
+    capture_header header;
+    capture_entry *entries;
+    capture_record record;
+    struct stat st;
+    size_t at, size;
+    long n = 0;
+    FILE *file;
+
+    file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+    if (fstat(fileno(file), &st) == -1 ||
+        (size_t)st.st_size < sizeof(header)){
+        fclose(file);
+        return NULL;
+    }
+    size = st.st_size;
+    trace = calloc(1, sizeof(capture_trace));
+    if (trace != NULL)
+        trace->data = malloc(size);
+    if (trace == NULL || trace->data == NULL ||
+        fread(trace->data, 1, size, file) != size){
+        fclose(file);
+        capture_free(trace);
+        return NULL;
+    }
+    fclose(file);
+    memcpy(&header, trace->data, sizeof(header));
+    if (header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION){
+        capture_free(trace);
+        return NULL;
+    }
+    trace->flags = header.flags;
+
+    /* Count the whole records. */
+    at = sizeof(header);
+    while (at + sizeof(record) <= size){
+        memcpy(&record, trace->data + at, sizeof(record));
+        if (record.has_value && at + sizeof(record) + record.size > size)
+            break;
+        at += sizeof(record) + (record.has_value ? record.size : 0);
+        n++;
+    }
+
+    entries = malloc(MAX(n, 1)*sizeof(capture_entry));
+    trace->records = malloc(MAX(n, 1)*sizeof(capture_record));
+    trace->values = malloc(MAX(n, 1)*sizeof(char*));
+    if (entries == NULL || trace->records == NULL || trace->values == NULL){
+        FREE(entries);
+        capture_free(trace);
+        return NULL;
+    }
+    at = sizeof(header);
+    FORONE(i, n){
+        memcpy(&entries[i].record, trace->data + at, sizeof(record));
+        at += sizeof(record);
+        entries[i].value = entries[i].record.has_value ? trace->data + at
+                                                       : NULL;
+        entries[i].order = i;
+        at += entries[i].record.has_value ? entries[i].record.size : 0;
+    }
+    qsort(entries, n, sizeof(capture_entry), compare_entries);
+    FORONE(i, n){
+        trace->records[i] = entries[i].record;
+        trace->values[i] = entries[i].value;
+    }
+    trace->n = n;
+    free(entries);
+    return trace;
+}
+
+/*
+* Name:         capture_free
+* Argument:     capture_trace*
+* Return:       none
+* Purpose:      Free a trace of capture_load().
+* Note:         none
+*/
+void capture_free(capture_trace *trace){
+    if (trace == NULL)
+        return;
+    free(trace->records);
+    free(trace->values);
+    free(trace->data);
+    free(trace);
+}
@@ -0,0 +1,173 @@
+/*
+ *  File:        capture.h
+ *  Purpose:     Capture of the requests a server runs to a binary trace
+ *               file, and loading it back for mcreplay.
+ *
+ *               File:      capture_header, then records in the order
+ *                          their buffers were written.
+ *               Record:    capture_record, followed by size bytes of
+ *                          value when has_value is set.
+ *
+ *  Note:        Names are kept as capture_hash(), 64 bits, a replay names
+ *               them "k<16 hex digits>". Every thread (or forked child)
+ *               fills its own buffer and appends it whole, records of
+ *               different buffers interleave: capture_load() sorts them
+ *               by time. Batches are recorded as one SET or DELETE per
+ *               name. Integers are in the host's byte order.
+ */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC       0x3145434152544d4dUL    /* "MMTRACE1". */
+#define CAPTURE_VERSION     1
+#define CAPTURE_VALUES      1               /* Header flag, SET values are
+                                               recorded when whole. */
+#define CAPTURE_BUFFER_SIZE 65536           /* Bytes a thread buffers. */
+#define CAPTURE_FLUSH_NS    1000000000L     /* Oldest record a buffer keeps
+                                               waiting for more. */
+
+#define CAPTURE_OP_SET      0               /* Same values as MC_OP_*. */
+#define CAPTURE_OP_GET      1
+#define CAPTURE_OP_DELETE   2
+
+/* Start of a trace file. */
+typedef struct capture_header_struct {
+    uint64_t magic;                 /* CAPTURE_MAGIC. */
+    uint32_t version;               /* CAPTURE_VERSION. */
+    uint32_t flags;                 /* CAPTURE_VALUES or 0. */
+} capture_header;
+
+/* One request, 24 bytes. */
+typedef struct capture_record_struct {
+    uint64_t time_ns;               /* CLOCK_MONOTONIC at execution. */
+    uint64_t key;                   /* capture_hash() of the name. */
+    uint32_t size;                  /* Value bytes of a SET, else 0. */
+    uint16_t op;                    /* CAPTURE_OP_*. */
+    uint16_t has_value;             /* size bytes of value follow. */
+} capture_record;
+
+/* A trace loaded in memory, in time order. */
+typedef struct capture_trace_struct {
+    long n;                         /* Records. */
+    uint32_t flags;                 /* Of the header. */
+    capture_record *records;
+    char **values;                  /* Recorded value of each record, or
+                                       NULL. Points into data. */
+    char *data;                     /* The file. */
+} capture_trace;
+
+/* Trace file of this server, -1 while not capturing. */
+extern int capture_fd;
+
+#define CAPTURE(op, name, size, data, data_len) \
+        do { if (capture_fd != -1) \
+            capture_write((op), (name), (size), (data), (data_len)); \
+        } while (0)
+
+
+/*
+* Name:         capture_open
+* Argument:     const char*, int
+* Return:       int
+* Purpose:      Start capturing requests to a new trace file at path, with
+*               the values of SETs if values is set.
+* Note:         Returns 0, or -1 if the file cannot be written. Call
+*               before fork() or creating threads, they share the file.
+*/
+int capture_open(const char *path, int values);
+
+
+/*
+* Name:         capture_write
+* Argument:     int, const char*, int, const void*, size_t
+* Return:       none
+* Purpose:      Record a request in the calling thread's buffer.
+* Note:         Use CAPTURE(). The value is kept only when the trace keeps
+*               values and data_len is its whole size. A buffer is
+*               written when full, or once its oldest record waited 
+*               CAPTURE_FLUSH_NS: on the next record, or by capture_tick()
+*               when the thread waits for work. Records are dropped if
+*               memory runs out.
+*/
+void capture_write(int op, const char *name, int size, const void *data,
+                   size_t data_len);
+
+
+/*
+* Name:         capture_timeout
+* Argument:     none
+* Return:       int
+* Purpose:      Milliseconds until the calling thread's buffer is due to 
+*               be written, a timeout for poll() or epoll_wait().
+* Note:         -1 while the buffer holds no record, the wait needs none.
+*/
+int capture_timeout(void);
+
+
+/*
+* Name:         capture_tick
+* Argument:     none
+* Return:       none
+* Purpose:      Write the calling thread's buffer if its oldest record 
+*               waited CAPTURE_FLUSH_NS.
+* Note:         Call after a wait of capture_timeout() ended.
+*/
+void capture_tick(void);
+
+
+/*
+* Name:         capture_flush
+* Argument:     none
+* Return:       none
+* Purpose:      Write the calling thread's buffer out and free it.
+* Note:         Call before a capturing thread or child ends, records
+*               left in its buffer are lost otherwise.
+*/
+void capture_flush(void);
+
+
+/*
+* Name:         capture_close
+* Argument:     none
+* Return:       none
+* Purpose:      Flush the calling thread's buffer and stop capturing.
+* Note:         Other threads must be done.
+*/
+void capture_close(void);
+
+
+/*
+* Name:         capture_hash
+* Argument:     const char*
+* Return:       uint64_t
+* Purpose:      Key of a name in the trace, FNV-1a.
+* Note:         none
+*/
+uint64_t capture_hash(const char *name);
+
+
+/*
+* Name:         capture_load
+* Argument:     const char*
+* Return:       capture_trace*
+* Purpose:      Read a trace file and sort its records by time.
+* Note:         Returns NULL if it cannot be read or is not a trace of
+*               this version. A record cut off by a crash ends the trace.
+*/
+capture_trace* capture_load(const char *path);
+
+
+/*
+* Name:         capture_free
+* Argument:     capture_trace*
+* Return:       none
+* Purpose:      Free a trace of capture_load().
+* Note:         none
+*/
+void capture_free(capture_trace *trace);
+
+#endif      /* _CAPTURE_H_ */
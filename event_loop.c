@@ -0,0 +1,1711 @@
+/*
+ *  File:        event_loop.c
+ *  Purpose:     epoll and io_uring networking backends for memcache.
+ *
+ *  Note:        io_uring is driven through the raw syscalls, no liburing.
+ *               Multishot accept and recv need Linux 6.0, older kernels
+ *               get the epoll backend. Each connection lives in a conn
+ *               indexed by its fd, io_uring completions carry the fd and
+ *               a generation so late completions for a closed fd are
+ *               dropped instead of reaching the next client on that fd.
+ *               A sharded loop hands a request for another shard's name 
+ *               to that shard's loop with the conn itself, the owner 
+ *               writes the response into the conn and hands it back. The
+ *               client's loop leaves the conn alone in between.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#include "utility_macros.h"
+#include "shared_hashtable.h"
+#include "protocol.h"
+#include "stats.h"
+#include "trace_probes.h"
+#include "capture.h"
+#include "event_loop.h"
+
+#define MAX_EVENTS          256             /* epoll_wait() batch. */
+#define MAX_CONNS           65536           /* Cap on fds tracked. */
+#define URING_ENTRIES       256             /* Submission queue size. */
+#define URING_CQ_ENTRIES    4096            /* Completion queue size. */
+#define BUF_RING_ENTRIES    256             /* Provided recv buffers. */
+#define BUF_RING_SIZE       4096            /* Bytes of a recv buffer. */
+#define BUF_GROUP           0               /* Provided buffer group id. */
+#define PIPELINE_LIMIT      (4 << 20)       /* Bytes a kept alive client may
+                                               send ahead of its responses. */
+#define SHARD_RING_SIZE     256             /* Requests in flight from one 
+                                               shard to another, more wait
+                                               in a backlog. */
+#define CACHE_LINE          64              /* Bytes of a cache line. */
+
+/* Sharded requests, conn->forward. */
+#define FWD_NONE            0               /* Run by the client's loop. */
+#define FWD_REQUEST         1               /* Handed to its owner. */
+#define FWD_REPLY           2               /* Answered, handed back. */
+
+/* epoll_watch() states, conn->want_out. */
+#define WATCH_IN            0
+#define WATCH_OUT           1
+#define WATCH_NONE          2               /* Owner runs the request. */
+
+/* io_uring user_data: generation << 40 | fd << 8 | operation. */
+#define OP_ACCEPT           1
+#define OP_RECV             2
+#define OP_SEND             3
+#define OP_CLOSE            4
+#define OP_CANCEL           5
+#define OP_STOP             6
+#define OP_WAKE             7
+#define UD_MAKE(op, fd, gen) \
+        (((unsigned long long)(gen) << 40) | ((unsigned long long)(fd) << 8) | (op))
+#define UD_OP(ud)           ((int)((ud) & 0xff))
+#define UD_FD(ud)           ((int)(((ud) >> 8) & 0xffffffff))
+#define UD_GEN(ud)          ((unsigned int)((ud) >> 40))
+
+/* Structure of one client connection. */
+typedef struct conn_struct {
+    int fd;                         /* Client socket. */
+    unsigned int gen;               /* Generation, bumped on every reuse. */
+    char *input;                    /* Bytes read from client, not yet 
+                                       parsed. */
+    size_t in_len;                  /* Bytes in input. */
+    size_t in_size;                 /* Bytes allocated for input. */
+    int eof;                        /* Client stopped sending. */
+    int served;                     /* Requests parsed on this client. */
+    int close_after;                /* Close once the response is sent. */
+    int want_out;                   /* epoll: waiting for EPOLLOUT. */
+    int recv_armed;                 /* io_uring: multishot recv queued. */
+    int recv_paused;                /* io_uring: recv held back until the 
+                                       input drains. */
+    char *output;                   /* Response. */
+    size_t out_len;                 /* Bytes in output. */
+    size_t out_sent;                /* Bytes of output already sent. */
+    int replied;                    /* Response is built. */
+    int cmd;                        /* CMD_* of the request. */
+    value_stream stream;            /* Large value being streamed. */
+    void *table;                    /* Table the request ran on. */
+    request *req;                   /* Sharded: request kept while its 
+                                       owner runs it, else NULL. */
+    size_t consumed;                /* Input bytes of the request. */
+    int forward;                    /* FWD_*. */
+    int abandoned;                  /* Closed while its owner runs it. */
+    char *held;                     /* Input the owner may still read, 
+                                       replaced while it grew. */
+    struct conn_struct *next_out;   /* Backlog link to a full ring. */
+    struct conn_struct *next_free;  /* Free list link. */
+} conn;
+
+/* Structure of a ring handing conns from one shard to another, each 
+ * side writes its own cache line. */
+typedef struct shard_ring_struct {
+    unsigned long tail __attribute__((aligned(CACHE_LINE)));
+    unsigned long head_seen;        /* Producer's copy of head. */
+    unsigned long head __attribute__((aligned(CACHE_LINE)));
+    unsigned long tail_seen;        /* Consumer's copy of tail. */
+    int blocked __attribute__((aligned(CACHE_LINE)));  /* Producer waits 
+                                                          for room. */
+    conn *entries[SHARD_RING_SIZE] __attribute__((aligned(CACHE_LINE)));
+} shard_ring;
+
+/* Structure of the loops of a sharded server. */
+struct shard_group_struct {
+    int n_shards;
+    int busy;                       /* Loops still accepting or serving. */
+    int *wake_fds;                  /* eventfd of each loop. */
+    shard_ring *rings;              /* Ring from shard i to j at i*n + j. */
+};
+
+/* Conns for one shard waiting for room in its ring. */
+typedef struct shard_out_struct {
+    conn *first, *last;
+    int notify;                     /* Wake the shard at the next flush. */
+    int dirty;                      /* Listed in loop's dirty. */
+} shard_out;
+
+/* Structure of an io_uring instance and its provided buffer ring. */
+typedef struct uring_struct {
+    int fd;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned int sq_entries;
+    unsigned int to_submit;         /* SQEs queued since last enter. */
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+
+    struct io_uring_buf_ring *br;   /* Provided buffer ring. */
+    char *bufs;                     /* BUF_RING_ENTRIES buffers. */
+    unsigned short br_tail;         /* Local copy of the ring tail. */
+} uring;
+
+/* Structure of one event loop. */
+typedef struct loop_struct {
+    int server_socket;
+    int stop_fd;
+    void *hashtable;
+    int max_size;                   /* Max value size of the table. */
+    size_t out_size;                /* Bytes of a response buffer. */
+    int keep_alive;                 /* Serve requests until clients close. */
+    size_t max_input;               /* Cap on a client's input buffer. */
+    size_t pause_input;             /* Input that pauses an io_uring recv, 
+                                       0 to never pause. */
+    int accepting;                  /* Still accepting clients. */
+    int n_conns;                    /* Open connections. */
+    int max_conns;                  /* Size of conns. */
+    conn **conns;                   /* Connections indexed by fd. */
+    conn *free_list;                /* Closed conns kept for reuse. */
+    unsigned int next_gen;
+    request req;                    /* Scratch request for parsing. */
+
+    shard_group *group;             /* Sharded loops, else NULL. */
+    int shard;                      /* Shard of this loop. */
+    int wake_fd;                    /* Readable once conns were handed in. */
+    shard_out *outs;                /* Backlog to each shard. */
+    int *dirty;                     /* Shards with something to flush. */
+    int n_dirty;
+    int stopped;                    /* Counted off group->busy. */
+    unsigned long long wake_value;  /* io_uring: read of wake_fd. */
+
+    int epoll_fd;                   /* EVLOOP_EPOLL. */
+    uring ring;                     /* EVLOOP_URING. */
+} loop;
+
+
+/*
+* Name:         event_loop_name
+* Argument:     int
+* Return:       const char*
+* Purpose:      Name of a backend for logs.
+* Note:         none
+*/
+const char* event_loop_name(int backend){
+    if (backend == EVLOOP_EPOLL) return "epoll";
+    if (backend == EVLOOP_URING) return "io_uring";
+    return "none";
+}
+
+/*
+* Name:         event_loop_supported
+* Argument:     int
+* Return:       int
+* Purpose:      Check if backend can run on this kernel.
+* Note:         Multishot recv is in Linux 6.0, there is no probe for
+*               opcode flags so the kernel release is checked.
+*/
+int event_loop_supported(int backend){
+    struct utsname name;
+    int major = 0, minor = 0;
+
+    if (backend != EVLOOP_URING)
+        return backend;
+    if (uname(&name) != 0 || sscanf(name.release, "%d.%d", &major, &minor) != 2)
+        return EVLOOP_EPOLL;
+    if (major < 6)
+        return EVLOOP_EPOLL;
+    return EVLOOP_URING;
+}
+
+
+/* ------------------------------------------------------------------ */
+/*  Shards, rings between sharded loops.                              */
+/* ------------------------------------------------------------------ */
+
+/*
+* Name:         ring_push
+* Argument:     shard_ring*, conn*
+* Return:       int
+* Purpose:      Hand c to the consumer of the ring.
+* Note:         Producer side only. Returns 0, or -1 when the ring is full.
+*/
+static int ring_push(shard_ring *ring, conn *c){
+    if (ring->tail - ring->head_seen == SHARD_RING_SIZE){
+        ring->head_seen = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (ring->tail - ring->head_seen == SHARD_RING_SIZE)
+            return -1;
+    }
+    ring->entries[ring->tail & (SHARD_RING_SIZE - 1)] = c;
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+* Name:         ring_pop
+* Argument:     shard_ring*
+* Return:       conn*
+* Purpose:      Take the oldest conn handed over the ring.
+* Note:         Consumer side only. Returns NULL when the ring is empty.
+*/
+static conn* ring_pop(shard_ring *ring){
+    conn *c;
+
+    if (ring->head == ring->tail_seen){
+        ring->tail_seen = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (ring->head == ring->tail_seen)
+            return NULL;
+    }
+    c = ring->entries[ring->head & (SHARD_RING_SIZE - 1)];
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    return c;
+}
+
+/*
+* Name:         shard_group_create
+* Argument:     int
+* Return:       shard_group*
+* Purpose:      Make the rings and wakeups of n_shards sharded loops.
+* Note:         Returns NULL if memory or eventfds run out.
+*/
+shard_group* shard_group_create(int n_shards){
+    shard_group *group = calloc(1, sizeof(shard_group));
+
+    RETURN_ON_VALUE(group, NULL, "Cannot allocate memory, return.\n", NULL);
+    group->n_shards = n_shards;
+    group->busy = n_shards;
+    group->wake_fds = malloc(n_shards*sizeof(int));
+    group->rings = aligned_alloc(CACHE_LINE, 
+                                 (size_t)n_shards*n_shards*sizeof(shard_ring));
+    if (group->wake_fds == NULL || group->rings == NULL){
+        FREE_ON_VAL(group->wake_fds, group->rings, group);
+        return NULL;
+    }
+    memset(group->rings, 0, (size_t)n_shards*n_shards*sizeof(shard_ring));
+    FORONE(i, n_shards)
+        group->wake_fds[i] = -1;
+    FORONE(i, n_shards){
+        group->wake_fds[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (group->wake_fds[i] == -1){
+            shard_group_free(group);
+            return NULL;
+        }
+    }
+    return group;
+}
+
+/*
+* Name:         shard_group_free
+* Argument:     shard_group*
+* Return:       none
+* Purpose:      Free a group once every loop of it returned.
+* Note:         none
+*/
+void shard_group_free(shard_group *group){
+    FORONE(i, group->n_shards)
+        if (group->wake_fds[i] != -1)
+            close(group->wake_fds[i]);
+    FREE_ON_VAL(group->wake_fds, group->rings, group);
+}
+
+/*
+* Name:         shard_of
+* Argument:     shard_group*, const char*
+* Return:       int
+* Purpose:      Shard owning a name.
+* Note:         64 bit FNV-1a finished with the murmur3 mixer, unrelated 
+*               to the djb2 home slots of the tables.
+*/
+int shard_of(shard_group *group, const char *name){
+    unsigned long long h = 0xcbf29ce484222325ULL;
+
+    for (const unsigned char *p = (const unsigned char*)name; *p; p++){
+        h ^= *p;
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (int)(h % group->n_shards);
+}
+
+/*
+* Name:         shard_post
+* Argument:     loop*, int, conn*
+* Return:       none
+* Purpose:      Hand c to the loop of shard to, a request for it to run or
+*               the response to a request it handed over.
+* Note:         The shard is woken by the next shard_flush(). Conns that
+*               find the ring full wait in a backlog, in order.
+*/
+static void shard_post(loop *lp, int to, conn *c){
+    shard_out *out = &lp->outs[to];
+
+    if (out->first == NULL && 
+        ring_push(&lp->group->rings[lp->shard*lp->group->n_shards + to], 
+                  c) == 0)
+        out->notify = 1;
+    else{
+        c->next_out = NULL;
+        if (out->last != NULL)
+            out->last->next_out = c;
+        else
+            out->first = c;
+        out->last = c;
+    }
+    if (!out->dirty){
+        out->dirty = 1;
+        lp->dirty[lp->n_dirty++] = to;
+    }
+}
+
+/*
+* Name:         shard_flush
+* Argument:     loop*
+* Return:       none
+* Purpose:      Move backlogs into their rings and wake the shards handed
+*               something since the last flush, once each.
+* Note:         Called once per batch of events. A ring still full is 
+*               marked blocked, its consumer wakes this loop once it made
+*               room.
+*/
+static void shard_flush(loop *lp){
+    int n_dirty = lp->n_dirty;
+
+    lp->n_dirty = 0;
+    FORONE(i, n_dirty){
+        int to = lp->dirty[i];
+        shard_out *out = &lp->outs[to];
+        shard_ring *ring = &lp->group->rings[lp->shard*lp->group->n_shards 
+                                             + to];
+
+        while (out->first != NULL){
+            if (ring_push(ring, out->first) == -1){
+                /* Look again in case the consumer just made room. */
+                __atomic_store_n(&ring->blocked, 1, __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                if (ring_push(ring, out->first) == -1)
+                    break;
+            }
+            out->notify = 1;
+            out->first = out->first->next_out;
+        }
+        if (out->first == NULL)
+            out->last = NULL;
+        if (out->notify){
+            eventfd_write(lp->group->wake_fds[to], 1);
+            STAT_ADD(syscalls, 1);
+            out->notify = 0;
+        }
+        out->dirty = out->first != NULL;
+        if (out->dirty)
+            lp->dirty[lp->n_dirty++] = to;
+    }
+}
+
+/*
+* Name:         shard_receive
+* Argument:     loop*, void (*)(loop*, conn*)
+* Return:       none
+* Purpose:      Run the requests other shards handed to this loop and 
+*               give the responses back, resume this loop's conns whose
+*               response is back.
+* Note:         resume continues a conn like a request just executed, it
+*               is the backend's.
+*/
+static void shard_receive(loop *lp, void (*resume)(loop*, conn*)){
+    int n = lp->group->n_shards;
+    conn *c;
+
+    FORONE(from, n){
+        shard_ring *ring = &lp->group->rings[from*n + lp->shard];
+
+        if (from == lp->shard)
+            continue;
+        while ((c = ring_pop(ring)) != NULL){
+            if (c->forward == FWD_REQUEST){
+                c->out_len = execute_request(lp->hashtable, c->req, c->output,
+                                             lp->out_size, &c->stream);
+                c->table = lp->hashtable;
+                c->forward = FWD_REPLY;
+                shard_post(lp, from, c);
+                continue;
+            }
+            c->forward = FWD_NONE;
+            if (c->held != NULL){
+                FREE(c->held);
+            }
+            resume(lp, c);
+        }
+
+        /* The producer sets blocked before looking at head again. */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->blocked, __ATOMIC_RELAXED)){
+            __atomic_store_n(&ring->blocked, 0, __ATOMIC_RELAXED);
+            eventfd_write(lp->group->wake_fds[from], 1);
+            STAT_ADD(syscalls, 1);
+        }
+    }
+}
+
+/*
+* Name:         loop_running
+* Argument:     loop*
+* Return:       int
+* Purpose:      Check if the loop has to keep going.
+* Note:         A sharded loop done with its own clients still runs the
+*               requests of the others until every loop is done, the last
+*               one wakes them all.
+*/
+static int loop_running(loop *lp){
+    if (lp->accepting || lp->n_conns > 0)
+        return 1;
+    if (lp->group == NULL)
+        return 0;
+    if (!lp->stopped){
+        lp->stopped = 1;
+        if (__atomic_sub_fetch(&lp->group->busy, 1, __ATOMIC_ACQ_REL) == 0)
+            FORONE(i, lp->group->n_shards)
+                eventfd_write(lp->group->wake_fds[i], 1);
+    }
+    return __atomic_load_n(&lp->group->busy, __ATOMIC_ACQUIRE) > 0;
+}
+
+
+/* ------------------------------------------------------------------ */
+/*  Connections, shared by both backends.                              */
+/* ------------------------------------------------------------------ */
+
+/*
+* Name:         conn_open
+* Argument:     loop*, int
+* Return:       conn*
+* Purpose:      Track a newly accepted client.
+* Note:         Returns NULL if fd is out of range or memory runs out, the
+*               caller closes the fd then.
+*/
+static conn* conn_open(loop *lp, int fd){
+    conn *c;
+
+    if (fd >= lp->max_conns)
+        return NULL;
+
+    if (lp->free_list != NULL){
+        c = lp->free_list;
+        lp->free_list = c->next_free;
+    }
+    else{
+        c = calloc(1, sizeof(conn));
+        if (c == NULL)
+            return NULL;
+        c->in_size = MAX_INPUT_SIZE + 1;
+        c->stream.type = STREAM_NONE;
+        c->input = malloc(c->in_size);
+        c->output = malloc(lp->out_size);
+        if (lp->group != NULL && c->input != NULL && c->output != NULL){
+            c->req = malloc(sizeof(request));
+            if (c->req == NULL){
+                FREE(c->output);
+            }
+        }
+        if (c->input == NULL || c->output == NULL){
+            FREE_ON_VAL(c->input, c->output, c);
+            return NULL;
+        }
+    }
+    c->fd = fd;
+    c->gen = ++lp->next_gen & 0xffffff;
+    c->in_len = 0;
+    c->eof = 0;
+    c->served = 0;
+    c->close_after = 0;
+    c->want_out = 0;
+    c->recv_armed = 0;
+    c->recv_paused = 0;
+    c->out_len = 0;
+    c->out_sent = 0;
+    c->replied = 0;
+    c->cmd = CMD_INVALID;
+    c->table = lp->hashtable;
+    c->forward = FWD_NONE;
+    c->abandoned = 0;
+    lp->conns[fd] = c;
+    lp->n_conns++;
+
+    STAT_ADD(connections, 1);
+    TRACE1(request_start, fd);
+    return c;
+}
+
+/*
+* Name:         conn_release
+* Argument:     loop*, conn*
+* Return:       none
+* Purpose:      Forget a connection whose fd is being closed.
+* Note:         A value still streaming is dropped or unpinned. Buffers 
+*               are kept on the free list for the next client.
+*/
+static void conn_release(loop *lp, conn *c){
+    if (c->stream.type != STREAM_NONE)
+        finish_request(c->table, &c->stream, c->output);
+    lp->conns[c->fd] = NULL;
+    lp->n_conns--;
+    c->next_free = lp->free_list;
+    lp->free_list = c;
+}
+
+/*
+* Name:         conn_received
+* Argument:     loop*, conn*, size_t, int
+* Return:       int
+* Purpose:      Account length bytes of a streamed SET value already 
+*               placed in its slot.
+* Note:         Returns 1 once the response is built, else 0.
+*/
+static int conn_received(loop *lp, conn *c, size_t length, int eof){
+    c->stream.done += length;
+    if (c->stream.done < c->stream.size && !eof)
+        return 0;
+    c->out_len = finish_request(c->table, &c->stream, c->output);
+    c->replied = 1;
+    return 1;
+}
+
+/*
+* Name:         conn_append
+* Argument:     loop*, conn*, const char*, size_t
+* Return:       int
+* Purpose:      Buffer bytes received ahead of parsing.
+* Note:         Returns 0, or -1 once the client sent more than 
+*               lp->max_input without waiting for responses. While an
+*               owner runs the request the input it reads is kept.
+*/
+static int conn_append(loop *lp, conn *c, const char *data, size_t length){
+    if (c->in_len + length + 1 > c->in_size){
+        size_t size = MAX(c->in_size*2, c->in_len + length + 1);
+        char *larger;
+
+        if (c->in_len + length + 1 > lp->max_input)
+            return -1;
+        size = MIN(size, lp->max_input);
+        if (c->forward != FWD_NONE && c->held == NULL){
+            larger = malloc(size);
+            if (larger != NULL){
+                memcpy(larger, c->input, c->in_len);
+                c->held = c->input;
+            }
+        }
+        else
+            larger = realloc(c->input, size);
+        if (larger == NULL)
+            return -1;
+        c->input = larger;
+        c->in_size = size;
+    }
+    memcpy(c->input + c->in_len, data, length);
+    c->in_len += length;
+    return 0;
+}
+
+/*
+* Name:         conn_executed
+* Argument:     loop*, conn*
+* Return:       int
+* Purpose:      Drop the request's bytes from the input, the next 
+*               pipelined one moves to the start.
+* Note:         Returns like conn_process(). Bytes of a streamed SET value
+*               that arrived while an owner ran the request go to its 
+*               slot.
+*/
+static int conn_executed(loop *lp, conn *c){
+    size_t take;
+
+    c->in_len -= c->consumed;
+    memmove(c->input, c->input + c->consumed, c->in_len);
+
+    if (c->stream.type == STREAM_SET){
+        take = MIN(c->in_len, c->stream.size - c->stream.done);
+        if (take > 0){
+            memcpy(c->stream.data + c->stream.done, c->input, take);
+            c->in_len -= take;
+            memmove(c->input, c->input + take, c->in_len);
+        }
+        return conn_received(lp, c, take, c->eof);
+    }
+    c->replied = 1;
+    return 1;
+}
+
+/*
+* Name:         conn_process
+* Argument:     loop*, conn*
+* Return:       int
+* Purpose:      Parse and execute the request at the start of the input.
+* Note:         Returns 1 when c->output holds the response, 0 to wait for
+*               more bytes or the shard owning the name and -1 when a kept
+*               alive client closed between requests.
+*/
+static int conn_process(loop *lp, conn *c){
+    request *req = c->req != NULL ? c->req : &lp->req;
+    int status;
+
+    if (c->served > 0 && c->in_len == 0 && c->eof)
+        return -1;
+    status = parse_request(c->input, c->in_len, c->eof, lp->max_size, req);
+    if (status == PARSE_NEED_MORE)
+        return 0;
+    TRACE3(request_parse, c->fd, c->in_len, req->n_tokens);
+    c->cmd = req->cmd;
+    c->served++;
+
+    if (status == PARSE_ERROR){
+        STAT_ADD(requests, 1);
+        STAT_ADD(bad_requests, 1);
+        c->out_len = strlen(req->error);
+        memcpy(c->output, req->error, c->out_len);
+        c->close_after = 1;
+        c->consumed = c->in_len;
+    }
+    else{
+        TRACE3(command_dispatch, c->fd, req->cmd, req->name);
+        c->consumed = req->header_len + req->data_len;
+        if (lp->group != NULL && 
+            (req->cmd == CMD_MSET || req->cmd == CMD_MDELETE)){
+            /* Its names belong to several shards, none owns the batch. */
+            STAT_ADD(requests, 1);
+            strcpy(c->output, "ERR NOT_SHARDED\r\n");
+            c->out_len = strlen(c->output);
+            c->close_after = 1;
+            c->consumed = c->in_len;
+            return conn_executed(lp, c);
+        }
+        if (lp->group != NULL && req->name != NULL){
+            int owner = shard_of(lp->group, req->name);
+            if (owner != lp->shard){
+                c->forward = FWD_REQUEST;
+                shard_post(lp, owner, c);
+                return 0;
+            }
+        }
+        c->out_len = execute_request(lp->hashtable, req, c->output,
+                                     lp->out_size, &c->stream);
+        c->table = lp->hashtable;
+    }
+    return conn_executed(lp, c);
+}
+
+/*
+* Name:         conn_input
+* Argument:     loop*, conn*, const char*, size_t, int
+* Return:       int
+* Purpose:      Feed bytes received from the client, build the response
+*               once the request is complete.
+* Note:         eof is set when the client stopped sending. Returns 1 when
+*               c->output holds a new response, 0 to wait and -1 to close.
+*               Bytes of a SET value beyond the command line go straight 
+*               to the reserved slot, bytes arriving while a response is
+*               sent wait in the input for the next request.
+*/
+static int conn_input(loop *lp, conn *c, const char *data, size_t length,
+                      int eof){
+    int status = 0;
+    size_t take;
+
+    if (eof)
+        c->eof = 1;
+
+    /* The owner of the request may be reading the conn. */
+    if (c->forward != FWD_NONE)
+        return length > 0 && conn_append(lp, c, data, length) == -1 ? -1 : 0;
+
+    if (c->stream.type == STREAM_SET){
+        take = MIN(length, c->stream.size - c->stream.done);
+        memcpy(c->stream.data + c->stream.done, data, take);
+        data += take;
+        length -= take;
+        status = conn_received(lp, c, take, c->eof);
+    }
+
+    if (length > 0 && conn_append(lp, c, data, length) == -1){
+        /* A response in flight must finish before the close. */
+        if (!c->replied)
+            return -1;
+        c->close_after = 1;
+    }
+    if (!c->replied && c->stream.type != STREAM_SET)
+        status = conn_process(lp, c);
+    return status;
+}
+
+/*
+* Name:         conn_done
+* Argument:     loop*, conn*
+* Return:       int
+* Purpose:      Move a kept alive client to its next request once the
+*               response is sent.
+* Note:         Returns like conn_input(), -1 as well when the client is
+*               not kept alive or the loop is stopping.
+*/
+static int conn_done(loop *lp, conn *c){
+    if (!lp->keep_alive || c->close_after || !lp->accepting)
+        return -1;
+    if (c->stream.type != STREAM_NONE)
+        finish_request(c->table, &c->stream, c->output);
+    c->out_len = 0;
+    c->out_sent = 0;
+    c->replied = 0;
+    c->cmd = CMD_INVALID;
+    TRACE1(request_start, c->fd);
+    return conn_process(lp, c);
+}
+
+/*
+* Name:         conn_idle
+* Argument:     conn*
+* Return:       int
+* Purpose:      Check if a kept alive client is between requests.
+* Note:         Idle clients are closed when the loop stops.
+*/
+static int conn_idle(conn *c){
+    return c->forward == FWD_NONE && c->served > 0 && c->in_len == 0 && !c->replied && 
+           c->stream.type == STREAM_NONE;
+}
+
+/*
+* Name:         conn_next_chunk
+* Argument:     conn*, char**
+* Return:       size_t
+* Purpose:      Find the next bytes of the response to send, the buffered
+*               response first and then a value streamed from its slot.
+* Note:         Returns 0 when everything is sent.
+*/
+static size_t conn_next_chunk(conn *c, char **data){
+    if (c->out_sent < c->out_len){
+        *data = c->output + c->out_sent;
+        return c->out_len - c->out_sent;
+    }
+    if (c->stream.type == STREAM_GET && c->stream.done < c->stream.size){
+        *data = c->stream.data + c->stream.done;
+        return c->stream.size - c->stream.done;
+    }
+    return 0;
+}
+
+/*
+* Name:         conn_sent
+* Argument:     conn*, size_t
+* Return:       none
+* Purpose:      Account length bytes handed to the socket.
+* Note:         none
+*/
+static void conn_sent(conn *c, size_t length){
+    if (c->out_sent < c->out_len)
+        c->out_sent += length;
+    else
+        c->stream.done += length;
+}
+
+/*
+* Name:         loop_init
+* Argument:     loop*, int, void*, shard_group*, int, int, int
+* Return:       int
+* Purpose:      Initialize what both backends need.
+* Note:         group is NULL unless sharded. Returns 0 on success, -1 if 
+*               memory allocation fail.
+*/
+static int loop_init(loop *lp, int server_socket, void *hashtable,
+                     shard_group *group, int shard, int stop_fd, 
+                     int keep_alive){
+    struct rlimit limit;
+
+    memset(lp, 0, sizeof(loop));
+    lp->server_socket = server_socket;
+    lp->stop_fd = stop_fd;
+    lp->hashtable = hashtable;
+    lp->max_size = hash_get_max_value_size(hashtable);
+    lp->out_size = response_buffer_size(hashtable);
+    lp->keep_alive = keep_alive;
+    lp->max_input = MAX_INPUT_SIZE + 1 + BUF_RING_SIZE;
+    if (keep_alive){
+        /* A cancelled multishot recv may still hand over every buffer 
+         * of the ring, the cap leaves room for them past the pause. */
+        lp->pause_input = PIPELINE_LIMIT;
+        lp->max_input += PIPELINE_LIMIT + lp->max_size
+                         + (size_t)BUF_RING_ENTRIES*BUF_RING_SIZE;
+    }
+    lp->accepting = 1;
+    lp->epoll_fd = -1;
+    lp->ring.fd = -1;
+    lp->wake_fd = -1;
+    if (group != NULL){
+        /* io_uring keeps receiving while the owner runs a request, a
+         * whole value may arrive in the input meanwhile. */
+        lp->group = group;
+        lp->shard = shard;
+        lp->wake_fd = group->wake_fds[shard];
+        lp->max_input += lp->max_size + (size_t)BUF_RING_ENTRIES*BUF_RING_SIZE;
+        lp->outs = calloc(group->n_shards, sizeof(shard_out));
+        lp->dirty = malloc(group->n_shards*sizeof(int));
+        if (lp->outs == NULL || lp->dirty == NULL){
+            FREE_ON_VAL(lp->outs, lp->dirty, NULL);
+            return -1;
+        }
+    }
+
+    lp->max_conns = MAX_CONNS;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < MAX_CONNS)
+        lp->max_conns = limit.rlim_cur;
+    lp->conns = calloc(lp->max_conns, sizeof(conn*));
+    RETURN_ON_VALUE(lp->conns, NULL, "Cannot allocate memory, return.\n", -1);
+    return 0;
+}
+
+/*
+* Name:         loop_free
+* Argument:     loop*
+* Return:       none
+* Purpose:      Free connections and buffers of a loop.
+* Note:         Every client should be closed already.
+*/
+static void loop_free(loop *lp){
+    FORONE(i, lp->max_conns){
+        if (lp->conns[i] != NULL){
+            close(i);
+            conn_release(lp, lp->conns[i]);
+        }
+    }
+    while (lp->free_list != NULL){
+        conn *c = lp->free_list;
+        lp->free_list = c->next_free;
+        FREE_ON_VAL(c->input, c->output, c->req);
+        FREE(c);
+    }
+    FREE(lp->conns);
+    FREE_ON_VAL(lp->outs, lp->dirty, NULL);
+}
+
+
+/* ------------------------------------------------------------------ */
+/*  epoll backend.                                                     */
+/* ------------------------------------------------------------------ */
+
+/*
+* Name:         epoll_close
+* Argument:     loop*, conn*
+* Return:       none
+* Purpose:      Close a client, closing the fd also removes it from epoll.
+* Note:         none
+*/
+static void epoll_close(loop *lp, conn *c){
+    if (c->forward != FWD_NONE){
+        c->abandoned = 1;
+        return;
+    }
+    close(c->fd);
+    STAT_ADD(syscalls, 1);
+    conn_release(lp, c);
+}
+
+/*
+* Name:         epoll_watch
+* Argument:     loop*, conn*, int
+* Return:       none
+* Purpose:      Wait for EPOLLOUT (WATCH_OUT), EPOLLIN (WATCH_IN) or 
+*               nothing (WATCH_NONE) on a client.
+* Note:         Only calls epoll_ctl() when it changes. WATCH_NONE still
+*               reports a hang up once.
+*/
+static void epoll_watch(loop *lp, conn *c, int out){
+    struct epoll_event event;
+
+    if (c->want_out == out)
+        return;
+    event.events = out == WATCH_OUT ? EPOLLOUT : 
+                   out == WATCH_IN ? EPOLLIN : EPOLLONESHOT;
+    event.data.fd = c->fd;
+    epoll_ctl(lp->epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+    STAT_ADD(syscalls, 1);
+    c->want_out = out;
+}
+
+/*
+* Name:         epoll_send
+* Argument:     loop*, conn*
+* Return:       none
+* Purpose:      Write as much of the response as the socket takes, then 
+*               close, answer the next pipelined request or wait for 
+*               EPOLLOUT.
+* Note:         none
+*/
+static void epoll_send(loop *lp, conn *c){
+    char *data;
+    size_t length;
+    int status = 1;
+
+    while (status == 1){
+        while ((length = conn_next_chunk(c, &data)) > 0){
+            ssize_t n = write(c->fd, data, length);
+            STAT_ADD(syscalls, 1);
+            if (n == -1){
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN){
+                    epoll_watch(lp, c, WATCH_OUT);
+                    return;
+                }
+                epoll_close(lp, c);
+                return;
+            }
+            conn_sent(c, n);
+        }
+        TRACE3(response_write, c->fd, c->cmd, (int)c->out_sent);
+        status = conn_done(lp, c);
+    }
+    if (status == -1)
+        epoll_close(lp, c);
+    else
+        epoll_watch(lp, c, WATCH_IN);
+}
+
+/*
+* Name:         epoll_read
+* Argument:     loop*, conn*
+* Return:       none
+* Purpose:      Read what the client sent and answer once complete.
+* Note:         The rest of a streamed SET value is read straight into its
+*               slot. Nothing is read while the owner of the request runs
+*               it.
+*/
+static void epoll_read(loop *lp, conn *c){
+    char buffer[BUF_RING_SIZE];
+    int status = 0;
+    ssize_t n;
+
+    if (c->forward != FWD_NONE){
+        epoll_watch(lp, c, WATCH_NONE);
+        return;
+    }
+    while (status == 0 && c->forward == FWD_NONE){
+        if (c->stream.type == STREAM_SET)
+            n = read(c->fd, c->stream.data + c->stream.done, 
+                     c->stream.size - c->stream.done);
+        else
+            n = read(c->fd, buffer, sizeof(buffer));
+        STAT_ADD(syscalls, 1);
+        if (n == -1){
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return;
+            epoll_close(lp, c);
+            return;
+        }
+        if (c->stream.type == STREAM_SET){
+            c->eof = n == 0;
+            status = conn_received(lp, c, n, c->eof);
+        }
+        else
+            status = conn_input(lp, c, buffer, n, n == 0);
+    }
+    if (status == -1)
+        epoll_close(lp, c);
+    else if (status == 1)
+        epoll_send(lp, c);
+}
+
+/*
+* Name:         epoll_resume
+* Argument:     loop*, conn*
+* Return:       none
+* Purpose:      Continue a client once the owner of its request answered.
+* Note:         none
+*/
+static void epoll_resume(loop *lp, conn *c){
+    int status;
+
+    if (c->abandoned){
+        epoll_close(lp, c);
+        return;
+    }
+    status = conn_executed(lp, c);
+    if (status == -1)
+        epoll_close(lp, c);
+    else if (status == 1)
+        epoll_send(lp, c);
+    else
+        epoll_watch(lp, c, WATCH_IN);
+}
+
+/*
+* Name:         epoll_accept
+* Argument:     loop*
+* Return:       none
+* Purpose:      Accept every pending client and register it.
+* Note:         The listening socket is non-blocking.
+*/
+static void epoll_accept(loop *lp){
+    struct epoll_event event;
+
+    while (1){
+        int client = accept4(lp->server_socket, NULL, NULL,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        STAT_ADD(syscalls, 1);
+        if (client == -1){
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;
+        }
+
+        conn *c = conn_open(lp, client);
+        if (c == NULL){
+            close(client);
+            continue;
+        }
+        event.events = EPOLLIN;
+        event.data.fd = client;
+        epoll_ctl(lp->epoll_fd, EPOLL_CTL_ADD, client, &event);
+        STAT_ADD(syscalls, 1);
+    }
+}
+
+/*
+* Name:         epoll_run
+* Argument:     loop*
+* Return:       int
+* Purpose:      Run the epoll backend until stopped and drained.
+* Note:         Returns 0 on a clean stop, -1 on errors.
+*/
+static int epoll_run(loop *lp){
+    struct epoll_event event, events[MAX_EVENTS];
+    int flags;
+
+    lp->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    RETURN_ON_VALUE(lp->epoll_fd, -1, "EPOLL CREATION FAILED.\n", -1);
+
+    /* Several loops may share the listening socket, wake only one. */
+    flags = fcntl(lp->server_socket, F_GETFL);
+    fcntl(lp->server_socket, F_SETFL, flags | O_NONBLOCK);
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.fd = lp->server_socket;
+    epoll_ctl(lp->epoll_fd, EPOLL_CTL_ADD, lp->server_socket, &event);
+    event.events = EPOLLIN;
+    event.data.fd = lp->stop_fd;
+    epoll_ctl(lp->epoll_fd, EPOLL_CTL_ADD, lp->stop_fd, &event);
+    if (lp->group != NULL){
+        event.data.fd = lp->wake_fd;
+        epoll_ctl(lp->epoll_fd, EPOLL_CTL_ADD, lp->wake_fd, &event);
+    }
+
+    while (loop_running(lp)){
+        int n = epoll_wait(lp->epoll_fd, events, MAX_EVENTS, 
+                           capture_timeout());
+        STAT_ADD(syscalls, 1);
+        capture_tick();
+        if (n == -1){
+            if (errno == EINTR) continue;
+            close(lp->epoll_fd);
+            return -1;
+        }
+
+        FORONE(i, n){
+            int fd = events[i].data.fd;
+            if (fd == lp->stop_fd){
+                /* Stop accepting, answer clients already accepted. */
+                epoll_ctl(lp->epoll_fd, EPOLL_CTL_DEL, lp->server_socket, NULL);
+                epoll_ctl(lp->epoll_fd, EPOLL_CTL_DEL, lp->stop_fd, NULL);
+                lp->accepting = 0;
+                FORONE(j, lp->max_conns)
+                    if (lp->conns[j] != NULL && conn_idle(lp->conns[j]))
+                        epoll_close(lp, lp->conns[j]);
+            }
+            else if (fd == lp->server_socket){
+                if (lp->accepting)
+                    epoll_accept(lp);
+            }
+            else if (fd == lp->wake_fd){
+                eventfd_t value;
+                eventfd_read(lp->wake_fd, &value);
+                STAT_ADD(syscalls, 1);
+                shard_receive(lp, epoll_resume);
+            }
+            else if (lp->conns[fd] != NULL){
+                if (events[i].events & EPOLLOUT)
+                    epoll_send(lp, lp->conns[fd]);
+                else
+                    epoll_read(lp, lp->conns[fd]);
+            }
+        }
+        if (lp->n_dirty > 0)
+            shard_flush(lp);
+    }
+
+    close(lp->epoll_fd);
+    return 0;
+}
+
+
+/* ------------------------------------------------------------------ */
+/*  io_uring backend.                                                  */
+/* ------------------------------------------------------------------ */
+
+/*
+* Name:         uring_enter
+* Argument:     uring*, unsigned int, int
+* Return:       int
+* Purpose:      Submit queued SQEs and wait for at least min_complete
+*               completions, in one syscall.
+* Note:         Returns the result of io_uring_enter(), -1 with errno 
+*               ETIME when timeout milliseconds (-1 for none) passed 
+*               first.
+*/
+static int uring_enter(uring *ring, unsigned int min_complete, int timeout){
+    struct __kernel_timespec ts = {timeout / 1000, 
+                                   (timeout % 1000)*1000000L};
+    struct io_uring_getevents_arg arg = {0};
+    unsigned int flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    int status;
+
+    arg.ts = (unsigned long)&ts;
+    if (min_complete && timeout != -1)
+        flags |= IORING_ENTER_EXT_ARG;
+    status = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+                     min_complete, flags, 
+                     flags & IORING_ENTER_EXT_ARG ? &arg : NULL, 
+                     flags & IORING_ENTER_EXT_ARG ? sizeof(arg) : 0);
+    STAT_ADD(syscalls, 1);
+    if (status >= 0)
+        ring->to_submit -= MIN((unsigned int)status, ring->to_submit);
+    return status;
+}
+
+/*
+* Name:         uring_sqe
+* Argument:     uring*
+* Return:       struct io_uring_sqe*
+* Purpose:      Get a zeroed SQE, queued for the next uring_enter().
+* Note:         Submits early when the queue is full.
+*/
+static struct io_uring_sqe* uring_sqe(uring *ring){
+    unsigned int head, tail = *ring->sq_tail;
+    struct io_uring_sqe *sqe;
+
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    while (tail - head >= ring->sq_entries){
+        uring_enter(ring, 0, -1);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    }
+
+    sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+/*
+* Name:         uring_recycle
+* Argument:     uring*, int
+* Return:       none
+* Purpose:      Give provided buffer bid back to the kernel.
+* Note:         none
+*/
+static void uring_recycle(uring *ring, int bid){
+    struct io_uring_buf *buf;
+
+    buf = &ring->br->bufs[ring->br_tail & (BUF_RING_ENTRIES - 1)];
+    buf->addr = (unsigned long)(ring->bufs + (size_t)bid * BUF_RING_SIZE);
+    buf->len = BUF_RING_SIZE;
+    buf->bid = bid;
+    ring->br_tail++;
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+/*
+* Name:         uring_setup
+* Argument:     uring*
+* Return:       int
+* Purpose:      Create the ring, map its queues and register the provided
+*               buffer ring.
+* Note:         Returns 0 on success, -1 if io_uring cannot be used.
+*/
+static int uring_setup(uring *ring){
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+                   IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+    params.cq_entries = URING_CQ_ENTRIES;
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd == -1 && errno == EINVAL){
+        /* Kernels before 6.0 do not know the newer setup flags. */
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_CQ_ENTRIES;
+        ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    }
+    if (ring->fd == -1)
+        return -1;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_NODROP) ||
+        !(params.features & IORING_FEAT_EXT_ARG))
+        return -1;
+
+    /* SQ and CQ rings share one mapping. */
+    ring->sq_len = params.sq_off.array + params.sq_entries*sizeof(unsigned int);
+    ring->cq_len = params.cq_off.cqes +
+                   params.cq_entries*sizeof(struct io_uring_cqe);
+    ring->sq_len = MAX(ring->sq_len, ring->cq_len);
+    ring->cq_len = 0;
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        return -1;
+    ring->cq_ptr = ring->sq_ptr;
+
+    ring->sqes_len = params.sq_entries*sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED){
+        ring->sqes = NULL;
+        return -1;
+    }
+
+    ring->sq_head = ring->sq_ptr + params.sq_off.head;
+    ring->sq_tail = ring->sq_ptr + params.sq_off.tail;
+    ring->sq_mask = ring->sq_ptr + params.sq_off.ring_mask;
+    ring->sq_array = ring->sq_ptr + params.sq_off.array;
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = ring->cq_ptr + params.cq_off.head;
+    ring->cq_tail = ring->cq_ptr + params.cq_off.tail;
+    ring->cq_mask = ring->cq_ptr + params.cq_off.ring_mask;
+    ring->cqes = ring->cq_ptr + params.cq_off.cqes;
+
+    /* Provided buffers, multishot recv picks one per completion. */
+    ring->br = mmap(NULL, BUF_RING_ENTRIES*sizeof(struct io_uring_buf),
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->br == MAP_FAILED){
+        ring->br = NULL;
+        return -1;
+    }
+    ring->bufs = malloc((size_t)BUF_RING_ENTRIES * BUF_RING_SIZE);
+    if (ring->bufs == NULL)
+        return -1;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)ring->br;
+    reg.ring_entries = BUF_RING_ENTRIES;
+    reg.bgid = BUF_GROUP;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) != 0)
+        return -1;
+
+    ring->br_tail = 0;
+    FORONE(i, BUF_RING_ENTRIES)
+        uring_recycle(ring, i);
+    return 0;
+}
+
+/*
+* Name:         uring_teardown
+* Argument:     uring*
+* Return:       none
+* Purpose:      Unmap and close everything uring_setup created.
+* Note:         Safe on a partially set up ring.
+*/
+static void uring_teardown(uring *ring){
+    if (ring->br != NULL)
+        munmap(ring->br, BUF_RING_ENTRIES*sizeof(struct io_uring_buf));
+    if (ring->bufs != NULL){
+        FREE(ring->bufs);
+    }
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_len);
+    if (ring->fd != -1)
+        close(ring->fd);
+    memset(ring, 0, sizeof(uring));
+    ring->fd = -1;
+}
+
+/*
+* Name:         uring_arm_accept
+* Argument:     loop*
+* Return:       none
+* Purpose:      Queue a multishot accept on the listening socket.
+* Note:         none
+*/
+static void uring_arm_accept(loop *lp){
+    struct io_uring_sqe *sqe = uring_sqe(&lp->ring);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = lp->server_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+}
+
+/*
+* Name:         uring_arm_recv
+* Argument:     loop*, conn*
+* Return:       none
+* Purpose:      Queue a multishot recv into the provided buffer ring.
+* Note:         none
+*/
+static void uring_arm_recv(loop *lp, conn *c){
+    struct io_uring_sqe *sqe = uring_sqe(&lp->ring);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = UD_MAKE(OP_RECV, c->fd, c->gen);
+    c->recv_armed = 1;
+}
+
+/*
+* Name:         uring_flow
+* Argument:     loop*, conn*
+* Return:       none
+* Purpose:      Pause the client's recv while its pipelined input is past 
+*               lp->pause_input and resume it once half of it drained.
+* Note:         The epoll backend gets the same effect by dropping EPOLLIN.
+*               A paused recv is cancelled, its final completion is not 
+*               rearmed.
+*/
+static void uring_flow(loop *lp, conn *c){
+    struct io_uring_sqe *sqe;
+
+    if (lp->pause_input == 0 || c->eof)
+        return;
+    if (!c->recv_paused && c->in_len >= lp->pause_input){
+        c->recv_paused = 1;
+        if (c->recv_armed){
+            sqe = uring_sqe(&lp->ring);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = UD_MAKE(OP_RECV, c->fd, c->gen);
+            sqe->user_data = OP_CANCEL;
+        }
+    }
+    else if (c->recv_paused && c->in_len < lp->pause_input/2){
+        c->recv_paused = 0;
+        if (!c->recv_armed)
+            uring_arm_recv(lp, c);
+    }
+}
+
+/*
+* Name:         uring_send
+* Argument:     loop*, conn*
+* Return:       none
+* Purpose:      Queue a send of the rest of the response.
+* Note:         none
+*/
+static void uring_send(loop *lp, conn *c){
+    struct io_uring_sqe *sqe = uring_sqe(&lp->ring);
+    char *data;
+    size_t length = conn_next_chunk(c, &data);
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (unsigned long)data;
+    sqe->len = MIN(length, STREAM_CHUNK_SIZE);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = UD_MAKE(OP_SEND, c->fd, c->gen);
+}
+
+/*
+* Name:         uring_close
+* Argument:     loop*, conn*
+* Return:       none
+* Purpose:      Cancel the client's recv and queue its close.
+* Note:         Completions still in flight for this fd are dropped by the
+*               generation check. A client whose request is run by its 
+*               owner is closed once the response is back.
+*/
+static void uring_close(loop *lp, conn *c){
+    struct io_uring_sqe *sqe;
+
+    if (c->forward != FWD_NONE){
+        c->abandoned = 1;
+        return;
+    }
+    sqe = uring_sqe(&lp->ring);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = UD_MAKE(OP_RECV, c->fd, c->gen);
+    sqe->user_data = OP_CANCEL;
+
+    sqe = uring_sqe(&lp->ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = c->fd;
+    sqe->user_data = OP_CLOSE;
+    conn_release(lp, c);
+}
+
+/*
+* Name:         uring_valid
+* Argument:     loop*, unsigned long long
+* Return:       conn*
+* Purpose:      Find the connection a completion belongs to.
+* Note:         Returns NULL for completions of a closed connection.
+*/
+static conn* uring_valid(loop *lp, unsigned long long user_data){
+    int fd = UD_FD(user_data);
+    conn *c;
+
+    if (fd < 0 || fd >= lp->max_conns)
+        return NULL;
+    c = lp->conns[fd];
+    if (c == NULL || c->gen != UD_GEN(user_data))
+        return NULL;
+    return c;
+}
+
+/*
+* Name:         uring_arm_wake
+* Argument:     loop*
+* Return:       none
+* Purpose:      Queue a read of the wake eventfd of a sharded loop.
+* Note:         none
+*/
+static void uring_arm_wake(loop *lp){
+    struct io_uring_sqe *sqe = uring_sqe(&lp->ring);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = lp->wake_fd;
+    sqe->addr = (unsigned long)&lp->wake_value;
+    sqe->len = sizeof(lp->wake_value);
+    sqe->user_data = OP_WAKE;
+}
+
+/*
+* Name:         uring_resume
+* Argument:     loop*, conn*
+* Return:       none
+* Purpose:      Continue a client once the owner of its request answered.
+* Note:         The recv stayed armed meanwhile.
+*/
+static void uring_resume(loop *lp, conn *c){
+    int status;
+
+    if (c->abandoned){
+        uring_close(lp, c);
+        return;
+    }
+    status = conn_executed(lp, c);
+    if (status == -1){
+        uring_close(lp, c);
+        return;
+    }
+    if (status == 1)
+        uring_send(lp, c);
+    uring_flow(lp, c);
+}
+
+/*
+* Name:         uring_complete
+* Argument:     loop*, struct io_uring_cqe*
+* Return:       none
+* Purpose:      Handle one completion.
+* Note:         none
+*/
+static void uring_complete(loop *lp, struct io_uring_cqe *cqe){
+    int op = UD_OP(cqe->user_data), more = cqe->flags & IORING_CQE_F_MORE;
+    char *data;
+    conn *c;
+
+    if (op == OP_WAKE){
+        shard_receive(lp, uring_resume);
+        uring_arm_wake(lp);
+    }
+    else if (op == OP_STOP){
+        lp->accepting = 0;
+        struct io_uring_sqe *sqe = uring_sqe(&lp->ring);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = OP_ACCEPT;
+        sqe->user_data = OP_CANCEL;
+        FORONE(i, lp->max_conns)
+            if (lp->conns[i] != NULL && conn_idle(lp->conns[i]))
+                uring_close(lp, lp->conns[i]);
+    }
+    else if (op == OP_ACCEPT){
+        if (cqe->res >= 0){
+            c = conn_open(lp, cqe->res);
+            if (c == NULL){
+                struct io_uring_sqe *sqe = uring_sqe(&lp->ring);
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = cqe->res;
+                sqe->user_data = OP_CLOSE;
+            }
+            else
+                uring_arm_recv(lp, c);
+        }
+        if (!more && lp->accepting)
+            uring_arm_accept(lp);
+    }
+    else if (op == OP_RECV){
+        int status = 0;
+        c = uring_valid(lp, cqe->user_data);
+
+        /* Bytes arriving while a response is sent are kept for the next
+         * request, the response is only sent once. */
+        if (cqe->flags & IORING_CQE_F_BUFFER){
+            int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if (c != NULL && cqe->res > 0)
+                status = conn_input(lp, c,
+                                    lp->ring.bufs + (size_t)bid*BUF_RING_SIZE,
+                                    cqe->res, 0);
+            uring_recycle(&lp->ring, bid);
+        }
+        if (c == NULL)
+            return;
+
+        if (!more)
+            c->recv_armed = 0;
+        if (cqe->res == 0)
+            status = conn_input(lp, c, NULL, 0, 1);
+        else if (cqe->res < 0 && cqe->res != -ENOBUFS 
+                 && !(cqe->res == -ECANCELED && c->recv_paused))
+            status = -1;
+
+        if (status == -1)
+            uring_close(lp, c);
+        else{
+            if (status == 1)
+                uring_send(lp, c);
+            if (!more && !c->eof && !c->recv_paused)
+                uring_arm_recv(lp, c);
+            uring_flow(lp, c);
+        }
+    }
+    else if (op == OP_SEND){
+        int status;
+
+        c = uring_valid(lp, cqe->user_data);
+        if (c == NULL)
+            return;
+        if (cqe->res < 0){
+            uring_close(lp, c);
+            return;
+        }
+        conn_sent(c, cqe->res);
+        if (conn_next_chunk(c, &data) > 0){
+            uring_send(lp, c);
+            return;
+        }
+        TRACE3(response_write, c->fd, c->cmd, (int)c->out_sent);
+        status = conn_done(lp, c);
+        if (status == 1)
+            uring_send(lp, c);
+        else if (status == -1)
+            uring_close(lp, c);
+        if (status != -1)
+            uring_flow(lp, c);
+    }
+}
+
+/*
+* Name:         uring_run
+* Argument:     loop*
+* Return:       int
+* Purpose:      Run the io_uring backend until stopped and drained.
+* Note:         Returns 0 on a clean stop, -1 on errors, -2 when io_uring
+*               cannot be set up and epoll should be used instead.
+*/
+static int uring_run(loop *lp){
+    uring *ring = &lp->ring;
+    struct io_uring_sqe *sqe;
+
+    if (uring_setup(ring) == -1){
+        uring_teardown(ring);
+        return -2;
+    }
+
+    uring_arm_accept(lp);
+    sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = lp->stop_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = OP_STOP;
+    if (lp->group != NULL)
+        uring_arm_wake(lp);
+
+    while (loop_running(lp)){
+        /* One syscall submits everything queued and waits, no longer 
+         * than captured records may. */
+        if (uring_enter(ring, 1, capture_timeout()) == -1 && 
+            errno != EINTR && errno != EBUSY && errno != ETIME){
+            uring_teardown(ring);
+            return -1;
+        }
+        capture_tick();
+
+        unsigned int head = *ring->cq_head;
+        unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail){
+            uring_complete(lp, &ring->cqes[head & *ring->cq_mask]);
+            head++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        if (lp->n_dirty > 0)
+            shard_flush(lp);
+    }
+
+    /* Let the last closes go out before the ring goes away. */
+    if (ring->to_submit > 0)
+        uring_enter(ring, 0, -1);
+    uring_teardown(ring);
+    return 0;
+}
+
+
+/*
+* Name:         event_loop_run
+* Argument:     int, void*, int, int, int
+* Return:       int
+* Purpose:      Serve clients accepted on server_socket until stop_fd
+*               become readable and every accepted client is answered.
+* Note:         none
+*/
+int event_loop_run(int server_socket, void *hashtable, int backend,
+                   int stop_fd, int keep_alive){
+    return event_loop_run_shard(server_socket, hashtable, NULL, 0, backend,
+                                stop_fd, keep_alive);
+}
+
+/*
+* Name:         event_loop_run_shard
+* Argument:     int, void*, shard_group*, int, int, int, int
+* Return:       int
+* Purpose:      Serve clients like event_loop_run(), as shard of group.
+* Note:         group is NULL for a loop serving the whole table.
+*/
+int event_loop_run_shard(int server_socket, void *hashtable, 
+                         shard_group *group, int shard, int backend, 
+                         int stop_fd, int keep_alive){
+    loop lp;
+    int status;
+
+    if (loop_init(&lp, server_socket, hashtable, group, shard, stop_fd, 
+                  keep_alive) == -1)
+        return -1;
+
+    backend = event_loop_supported(backend);
+    if (backend == EVLOOP_URING){
+        status = uring_run(&lp);
+        if (status == -2){
+            fprintf(stderr, "io_uring unavailable, falling back to epoll.\n");
+            backend = EVLOOP_EPOLL;
+        }
+    }
+    if (backend == EVLOOP_EPOLL)
+        status = epoll_run(&lp);
+
+    loop_free(&lp);
+    return status;
+}
@@ -0,0 +1,117 @@
+/*
+ *  File:        event_loop.h
+ *  Purpose:     Event driven networking backends for memcache, serving
+ *               many clients from one thread without fork().
+ *
+ *               EVLOOP_EPOLL:  non-blocking sockets driven by epoll.
+ *               EVLOOP_URING:  io_uring with multishot accept, multishot
+ *                              recv into a provided buffer ring and sends
+ *                              batched into one io_uring_enter() per loop.
+ *
+ *  Note:        Requests are parsed and executed by protocol.c, so every
+ *               backend answers exactly like the forked server.
+ *
+ *               Sharded loops each own a table of their own, a request for
+ *               a name of another shard is handed to its owner over a
+ *               single producer, single consumer ring and the response
+ *               comes back the same way.
+ */
+
+#ifndef _EVENT_LOOP_H_
+#define _EVENT_LOOP_H_
+
+#define EVLOOP_NONE         -1              /* Blocking accept()/read(). */
+#define EVLOOP_EPOLL        0               /* epoll backend. */
+#define EVLOOP_URING        1               /* io_uring backend. */
+
+/* Loops of a sharded server and the rings between them. */
+typedef struct shard_group_struct shard_group;
+
+
+/*
+* Name:         event_loop_supported
+* Argument:     int
+* Return:       int
+* Purpose:      Check if backend can run on this kernel.
+* Note:         Returns backend when it is usable, otherwise the backend
+*               to fall back to (EVLOOP_EPOLL for io_uring).
+*/
+int event_loop_supported(int backend);
+
+
+/*
+* Name:         event_loop_run
+* Argument:     int, void*, int, int, int
+* Return:       int
+* Purpose:      Serve clients accepted on server_socket until stop_fd
+*               become readable and every accepted client is answered.
+* Note:         server_socket may be shared by several loops, each running
+*               in its own thread. stop_fd is never read, so one eventfd
+*               stops every loop. An io_uring loop that cannot be set up
+*               runs the epoll backend instead. With keep_alive clients 
+*               are answered until they close and may pipeline requests,
+*               those idle are closed on stop. Returns 0 on a clean stop,
+*               -1 on errors.
+*/
+int event_loop_run(int server_socket, void *hashtable, int backend,
+                   int stop_fd, int keep_alive);
+
+
+/*
+* Name:         shard_group_create
+* Argument:     int
+* Return:       shard_group*
+* Purpose:      Make the rings and wakeups of n_shards sharded loops.
+* Note:         Returns NULL if memory or eventfds run out. Call before
+*               starting the loops.
+*/
+shard_group* shard_group_create(int n_shards);
+
+
+/*
+* Name:         shard_group_free
+* Argument:     shard_group*
+* Return:       none
+* Purpose:      Free a group once every loop of it returned.
+* Note:         none
+*/
+void shard_group_free(shard_group *group);
+
+
+/*
+* Name:         shard_of
+* Argument:     shard_group*, const char*
+* Return:       int
+* Purpose:      Shard owning a name.
+* Note:         Independent of the table's own hash, so each shard keeps 
+*               its names spread over all of its slots.
+*/
+int shard_of(shard_group *group, const char *name);
+
+
+/*
+* Name:         event_loop_run_shard
+* Argument:     int, void*, shard_group*, int, int, int, int
+* Return:       int
+* Purpose:      Like event_loop_run(), serving shard of group from 
+*               hashtable, which only this loop executes requests on.
+* Note:         Every loop of the group must run, a loop only returns 
+*               once all of them stopped so none waits on a response 
+*               forever. Streamed values finish on their owner's table 
+*               from the client's loop, the tables keep their lock.
+*/
+int event_loop_run_shard(int server_socket, void *hashtable, 
+                         shard_group *group, int shard, int backend, 
+                         int stop_fd, int keep_alive);
+
+
+/*
+* Name:         event_loop_name
+* Argument:     int
+* Return:       const char*
+* Purpose:      Name of a backend for logs, "epoll", "io_uring" or "none".
+* Note:         none
+*/
+const char* event_loop_name(int backend);
+
+#endif      /* _EVENT_LOOP_H_ */
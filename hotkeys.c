@@ -0,0 +1,520 @@
+/*
+ *  File:        hotkeys.c
+ *  Purpose:     Streaming detection of the hottest names of GET and SET
+ *               traffic, and the HOTKEYS report of them, see hotkeys.h.
+ *
+ *  Note:        A request not sampled costs a thread local decrement. A
+ *               sampled one costs a clock read and 4 counters of the
+ *               sketch (conservative update: only the lowest grow); the
+ *               heap is only written, under the board's sequence count,
+ *               when the name is in it or now counts more than its last.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "utility_macros.h"
+#include "hotkeys.h"
+
+#define HOT_RETRIES     8           /* Copies of a board a report tries. */
+#define HOT_MIN_NS      1000000000L /* Least time a rate is taken over. */
+#define HOT_MAX_AGING   64          /* Halvings that empty a board. */
+
+/* A name of a board's heap. */
+typedef struct hot_entry_struct {
+    char name[HOT_NAME_SIZE];
+    unsigned long hash;             /* name_hash() of the name. */
+    unsigned long count;            /* Sampled requests, the sketch's
+                                       estimate. */
+    unsigned long ops;              /* Sampled requests since it entered. */
+    unsigned long gets;             /* Of them, GETs. */
+    unsigned long bytes;            /* Value bytes they moved. */
+} hot_entry;
+
+/* The counts of one worker, written by its owner only. */
+typedef struct hot_board_struct {
+    int owner;                      /* Thread id of the writer, 0 free. */
+    unsigned int seq;               /* Odd while the writer changes the
+                                       heap. */
+    long since_ns;                  /* Last halving, 0 before the first
+                                       count. */
+    long covered_ns;                /* Time the counts covered then. */
+    int n_top;                      /* Names in top. */
+    hot_entry top[HOT_TOP];         /* Min-heap on count. */
+    unsigned int sketch[HOT_ROWS][HOT_WIDTH];
+} __attribute__((aligned(64))) hot_board;
+
+/* A name of the report, boards merged. */
+typedef struct hot_rate_struct {
+    char name[HOT_NAME_SIZE];
+    unsigned long hash;
+    double ops;                     /* Requests per second. */
+    double bytes;                   /* Value bytes per second. */
+    double seen;                    /* Requests per second since it entered
+                                       a heap, the share of GETs is over
+                                       these. */
+    double gets;
+} hot_rate;
+
+int hot_sample = 0;
+__thread long hot_countdown = 0;
+
+static hot_board *boards = NULL;
+
+/* The calling worker's board and sampling state. */
+static __thread hot_board *board = NULL;
+static __thread unsigned long seed = 0;
+static __thread long claim_failed_ns = 0;
+
+
+/*
+* Name:         now_ns
+* Argument:     none
+* Return:       long
+* Purpose:      Monotonic clock in nanoseconds.
+* Note:         none
+*/
+static long now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+/*
+* Name:         next_random
+* Argument:     none
+* Return:       unsigned long
+* Purpose:      xorshift64* of the calling worker.
+* Note:         none
+*/
+static unsigned long next_random(void){
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return seed*0x2545f4914f6cdd1dUL;
+}
+
+/*
+* Name:         next_gap
+* Argument:     none
+* Return:       long
+* Purpose:      Requests until the next one counted, sample on average.
+* Note:         none
+*/
+static long next_gap(void){
+    if (hot_sample == 1)
+        return 1;
+    return 1 + next_random() % (2*(unsigned long)hot_sample - 1);
+}
+
+/*
+* Name:         name_hash
+* Argument:     const char*
+* Return:       unsigned long
+* Purpose:      FNV-1a of a name.
+* Note:         Its halves are the two hashes of the sketch's rows.
+*/
+static unsigned long name_hash(const char *name){
+    unsigned long hash = 0xcbf29ce484222325UL;
+
+    while (*name != '\0'){
+        hash ^= (unsigned char)*name++;
+        hash *= 0x100000001b3UL;
+    }
+    return hash;
+}
+
+/*
+* Name:         hotkeys_create
+* Argument:     int
+* Return:       int
+* Purpose:      Map the boards and count 1 in sample GETs and SETs.
+* Note:         none
+*/
+int hotkeys_create(int sample){
+    void *allocated = mmap(NULL, HOT_BOARDS*sizeof(hot_board),
+                           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                           -1, 0);
+    if (allocated == MAP_FAILED || sample < 1)
+        return -1;
+    boards = (hot_board*)allocated;
+    hot_sample = sample;
+    return 0;
+}
+
+/*
+* Name:         claim_board
+* Argument:     none
+* Return:       hot_board*
+* Purpose:      Make a free board the calling worker's.
+* Note:         Free boards first, then those of workers gone. Returns
+*               NULL if none, and until a window has passed.
+*/
+static hot_board* claim_board(void){
+    int self = syscall(SYS_gettid);
+    long now = now_ns();
+
+    if (claim_failed_ns != 0 && now - claim_failed_ns < HOT_WINDOW_NS)
+        return NULL;
+    FORONE(pass, 2){
+        FORONE(i, HOT_BOARDS){
+            int owner = __atomic_load_n(&boards[i].owner, __ATOMIC_RELAXED);
+
+            if (pass == 0 ? owner != 0
+                          : owner == 0 || kill(owner, 0) == 0 ||
+                            errno != ESRCH)
+                continue;
+            if (!__atomic_compare_exchange_n(&boards[i].owner, &owner, self,
+                                             0, __ATOMIC_ACQUIRE,
+                                             __ATOMIC_RELAXED))
+                continue;
+            board = &boards[i];
+            /* Its last writer may have died changing the heap. */
+            if (board->seq & 1)
+                __atomic_store_n(&board->seq, board->seq + 1,
+                                 __ATOMIC_RELEASE);
+            claim_failed_ns = 0;
+            return board;
+        }
+    }
+    claim_failed_ns = now;
+    return NULL;
+}
+
+/*
+* Name:         write_begin
+* Argument:     hot_board*
+* Return:       none
+* Purpose:      Make the sequence count odd before the heap changes.
+* Note:         none
+*/
+static void write_begin(hot_board *b){
+    __atomic_store_n(&b->seq, b->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*
+* Name:         write_end
+* Argument:     hot_board*
+* Return:       none
+* Purpose:      Make it even again once the heap is whole.
+* Note:         none
+*/
+static void write_end(hot_board *b){
+    __atomic_store_n(&b->seq, b->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+* Name:         age_board
+* Argument:     hot_board*, long
+* Return:       none
+* Purpose:      Halve the counts once per window passed since the last
+*               halving.
+* Note:         A board idle for HOT_MAX_AGING windows is left empty.
+*/
+static void age_board(hot_board *b, long now){
+    int steps = 0;
+
+    if (now - b->since_ns < HOT_WINDOW_NS)
+        return;
+    write_begin(b);
+    while (now - b->since_ns >= HOT_WINDOW_NS && steps++ < HOT_MAX_AGING){
+        FORONE(row, HOT_ROWS)
+            FORONE(i, HOT_WIDTH)
+                b->sketch[row][i] >>= 1;
+        FORONE(i, b->n_top){
+            b->top[i].count >>= 1;
+            b->top[i].ops >>= 1;
+            b->top[i].gets >>= 1;
+            b->top[i].bytes >>= 1;
+        }
+        b->covered_ns = (b->covered_ns + HOT_WINDOW_NS) / 2;
+        b->since_ns += HOT_WINDOW_NS;
+    }
+    if (now - b->since_ns >= HOT_WINDOW_NS)
+        b->since_ns = now;
+    write_end(b);
+}
+
+/*
+* Name:         sketch_count
+* Argument:     hot_board*, unsigned long
+* Return:       unsigned long
+* Purpose:      Count a name in the sketch and return its estimate.
+* Note:         Conservative update: only the counters at the minimum
+*               grow, the estimate stays as close as the sketch allows.
+*/
+static unsigned long sketch_count(hot_board *b, unsigned long hash){
+    unsigned int *counters[HOT_ROWS], least = UINT_MAX;
+
+    FORONE(row, HOT_ROWS){
+        counters[row] = &b->sketch[row][((hash & 0xffffffffUL) +
+                                         row*((hash >> 32) | 1)) %
+                                        HOT_WIDTH];
+        least = MIN(least, *counters[row]);
+    }
+    if (least == UINT_MAX)
+        return least;
+    FORONE(row, HOT_ROWS)
+        if (*counters[row] == least)
+            (*counters[row])++;
+    return least + 1;
+}
+
+/*
+* Name:         sift_down
+* Argument:     hot_board*, int
+* Return:       none
+* Purpose:      Move a heap entry whose count grew below larger ones.
+* Note:         none
+*/
+static void sift_down(hot_board *b, int i){
+    hot_entry entry = b->top[i];
+
+    while (2*i + 1 < b->n_top){
+        int child = 2*i + 1;
+
+        if (child + 1 < b->n_top && b->top[child + 1].count <
+                                    b->top[child].count)
+            child++;
+        if (entry.count <= b->top[child].count)
+            break;
+        b->top[i] = b->top[child];
+        i = child;
+    }
+    b->top[i] = entry;
+}
+
+/*
+* Name:         sift_up
+* Argument:     hot_board*, int
+* Return:       none
+* Purpose:      Move a new heap entry above larger ones.
+* Note:         none
+*/
+static void sift_up(hot_board *b, int i){
+    hot_entry entry = b->top[i];
+
+    while (i > 0 && b->top[(i - 1) / 2].count > entry.count){
+        b->top[i] = b->top[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    b->top[i] = entry;
+}
+
+/*
+* Name:         hotkeys_record
+* Argument:     int, const char*, int
+* Return:       none
+* Purpose:      Count a sampled request of name moving bytes of value.
+* Note:         none
+*/
+void hotkeys_record(int op, const char *name, int bytes){
+    unsigned long hash, count;
+    hot_entry *entry = NULL;
+    int appended = 0;
+    long now;
+
+    if (seed == 0){
+        seed = ((unsigned long)syscall(SYS_gettid) << 32) ^ now_ns();
+        seed |= 1;
+        /* A child's first request is as likely to count as any other. */
+        if (next_random() % hot_sample != 0){
+            hot_countdown = next_gap();
+            return;
+        }
+    }
+    hot_countdown = next_gap();
+    if (board == NULL && claim_board() == NULL)
+        return;
+
+    now = now_ns();
+    if (board->since_ns == 0)
+        board->since_ns = now;
+    age_board(board, now);
+    hash = name_hash(name);
+    count = sketch_count(board, hash);
+
+    FORONE(i, board->n_top)
+        if (board->top[i].hash == hash &&
+            strcmp(board->top[i].name, name) == 0){
+            entry = &board->top[i];
+            break;
+        }
+    if (entry == NULL && board->n_top == HOT_TOP &&
+        count <= board->top[0].count)
+        return;
+
+    write_begin(board);
+    if (entry == NULL){
+        /* A new name, in a free place or instead of the coldest. */
+        appended = board->n_top < HOT_TOP;
+        entry = &board->top[appended ? board->n_top++ : 0];
+        snprintf(entry->name, HOT_NAME_SIZE, "%s", name);
+        entry->hash = hash;
+        entry->ops = entry->gets = entry->bytes = 0;
+    }
+    /* Counts only grow between halvings, an entry only moves down. */
+    entry->count = count;
+    entry->ops++;
+    entry->gets += op == HOT_OP_GET;
+    entry->bytes += MAX(bytes, 0);
+    if (appended)
+        sift_up(board, entry - board->top);
+    else
+        sift_down(board, entry - board->top);
+    write_end(board);
+}
+
+/*
+* Name:         hotkeys_release
+* Argument:     none
+* Return:       none
+* Purpose:      Give the calling worker's board up.
+* Note:         none
+*/
+void hotkeys_release(void){
+    if (board == NULL)
+        return;
+    __atomic_store_n(&board->owner, 0, __ATOMIC_RELEASE);
+    board = NULL;
+}
+
+/*
+* Name:         copy_board
+* Argument:     hot_board*, hot_entry*, long*, long*
+* Return:       int
+* Purpose:      Copy the heap of a board while its writer may change it.
+* Note:         Returns the names copied, or -1 if every retry overlapped
+*               a change.
+*/
+static int copy_board(hot_board *b, hot_entry *top, long *since,
+                      long *covered){
+    FORONE(retry, HOT_RETRIES){
+        unsigned int seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+        int n;
+
+        if (seq & 1)
+            continue;
+        n = MIN(MAX(b->n_top, 0), HOT_TOP);
+        memcpy(top, b->top, n*sizeof(hot_entry));
+        *since = b->since_ns;
+        *covered = b->covered_ns;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&b->seq, __ATOMIC_RELAXED) == seq)
+            return n;
+    }
+    return -1;
+}
+
+/*
+* Name:         compare_names
+* Argument:     const void*, const void*
+* Return:       int
+* Purpose:      qsort() order of names, the same ones next to each other.
+* Note:         none
+*/
+static int compare_names(const void *a, const void *b){
+    const hot_rate *x = a, *y = b;
+
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+/*
+* Name:         compare_rates
+* Argument:     const void*, const void*
+* Return:       int
+* Purpose:      qsort() order of the report: most requests first.
+* Note:         none
+*/
+static int compare_rates(const void *a, const void *b){
+    const hot_rate *x = a, *y = b;
+
+    if (x->ops != y->ops)
+        return x->ops > y->ops ? -1 : 1;
+    return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+/*
+* Name:         hotkeys_format
+* Argument:     char*, size_t
+* Return:       int
+* Purpose:      Write the HOTKEY lines of the hottest names of all boards
+*               into out.
+* Note:         A board's rates are its counts over the time they cover,
+*               boards of the same name add up.
+*/
+int hotkeys_format(char *out, size_t size){
+    hot_entry top[HOT_TOP];
+    hot_rate *rates;
+    long now = now_ns(), since, covered;
+    int n = 0, merged = 0, used = 0;
+
+    if (hot_sample == 0 || boards == NULL)
+        return -1;
+    rates = malloc(HOT_BOARDS*HOT_TOP*sizeof(hot_rate));
+    if (rates == NULL)
+        return 0;
+
+    FORONE(i, HOT_BOARDS){
+        int n_top = copy_board(&boards[i], top, &since, &covered);
+        double scale;
+
+        if (n_top <= 0 || since == 0)
+            continue;
+        /* Sampled counts per second, as all requests. */
+        scale = 1e9*hot_sample / MAX(covered + now - since, HOT_MIN_NS);
+        FORONE(j, n_top){
+            memcpy(rates[n].name, top[j].name, HOT_NAME_SIZE);
+            rates[n].name[HOT_NAME_SIZE - 1] = '\0';
+            rates[n].hash = top[j].hash;
+            rates[n].ops = top[j].count*scale;
+            rates[n].bytes = top[j].bytes*scale;
+            rates[n].seen = top[j].ops*scale;
+            rates[n].gets = top[j].gets*scale;
+            n++;
+        }
+    }
+
+    qsort(rates, n, sizeof(hot_rate), compare_names);
+    FORONE(i, n){
+        if (merged > 0 && compare_names(&rates[merged - 1], &rates[i]) == 0){
+            rates[merged - 1].ops += rates[i].ops;
+            rates[merged - 1].bytes += rates[i].bytes;
+            rates[merged - 1].seen += rates[i].seen;
+            rates[merged - 1].gets += rates[i].gets;
+        }
+        else
+            rates[merged++] = rates[i];
+    }
+    qsort(rates, merged, sizeof(hot_rate), compare_rates);
+
+    FORONE(i, MIN(merged, HOT_TOP)){
+        int length;
+
+        if ((size_t)used >= size)
+            break;
+        length = snprintf(out + used, size - used,
+                          "HOTKEY %s %.1f %.0f %d\r\n", rates[i].name,
+                          rates[i].ops, rates[i].bytes,
+                          rates[i].seen > 0 ? (int)(100*rates[i].gets /
+                                                    rates[i].seen + 0.5)
+                                            : 0);
+        if (length < 0 || (size_t)(used + length) >= size)
+            break;
+        used += length;
+    }
+    free(rates);
+    return used;
+}
@@ -0,0 +1,99 @@
+/*
+ *  File:        hotkeys.h
+ *  Purpose:     Streaming detection of the hottest names of GET and SET
+ *               traffic, and the HOTKEYS report of them.
+ *
+ *               Board:     a worker's count-min sketch of HOT_ROWS rows
+ *                          of HOT_WIDTH counters, and a min-heap of the
+ *                          HOT_TOP names it counted most.
+ *               Report:    "HOTKEY <name> <ops/s> <bytes/s> <get %>\r\n"
+ *                          per name, hottest first, boards merged.
+ *
+ *  Note:        Boards live in a shared anonymous mapping, so forked
+ *               children report too. A worker (thread, or child) claims a
+ *               board on its first sampled request and writes it alone;
+ *               a released board keeps its counts for the next claimer.
+ *               Counts, bytes and the time they cover halve every
+ *               HOT_WINDOW_NS, rates are over about the last two windows.
+ *               Bytes of a name are counted from when it entered the
+ *               heap, its count is the sketch's estimate from before.
+ */
+
+#ifndef _HOTKEYS_H_
+#define _HOTKEYS_H_
+
+#include <stddef.h>
+
+#define HOT_BOARDS          64              /* Workers counting at once,
+                                               more count nothing. */
+#define HOT_TOP             32              /* Names per board, and per
+                                               report. */
+#define HOT_ROWS            4               /* Rows of a board's sketch. */
+#define HOT_WIDTH           1024            /* Counters of a row. */
+#define HOT_NAME_SIZE       120             /* Longest name, NUL included. */
+#define HOT_WINDOW_NS       10000000000L    /* Counts halve this often. */
+
+#define HOT_OP_SET          0               /* Same values as CAPTURE_OP_*. */
+#define HOT_OP_GET          1
+
+/* 1 in how many requests is counted, 0 while off. */
+extern int hot_sample;
+
+/* Requests of the calling worker until the next one counted. */
+extern __thread long hot_countdown;
+
+#define HOTKEY(op, name, bytes) \
+        do { if (hot_sample > 0 && --hot_countdown <= 0) \
+            hotkeys_record((op), (name), (bytes)); \
+        } while (0)
+
+
+/*
+* Name:         hotkeys_create
+* Argument:     int
+* Return:       int
+* Purpose:      Map the boards and count 1 in sample GETs and SETs.
+* Note:         Call before fork() or creating threads. Returns 0, or -1
+*               if the mapping fails.
+*/
+int hotkeys_create(int sample);
+
+
+/*
+* Name:         hotkeys_record
+* Argument:     int, const char*, int
+* Return:       none
+* Purpose:      Count a sampled request of name moving bytes of value.
+* Note:         Use HOTKEY(). Requests are sampled at random, a gap of 1
+*               to 2*sample - 1 between two, so the first request of a
+*               child is counted 1 in sample times too. Nothing is counted
+*               while no board is free, a claim is retried a window later.
+*/
+void hotkeys_record(int op, const char *name, int bytes);
+
+
+/*
+* Name:         hotkeys_release
+* Argument:     none
+* Return:       none
+* Purpose:      Give the calling worker's board up.
+* Note:         Call before a counting thread or child ends. A board of a
+*               process that died without is taken back once none is
+*               free.
+*/
+void hotkeys_release(void);
+
+
+/*
+* Name:         hotkeys_format
+* Argument:     char*, size_t
+* Return:       int
+* Purpose:      Write the HOTKEY lines of the hottest names of all boards
+*               into out.
+* Note:         Returns the number of bytes written, or -1 while counting
+*               is off. Boards are copied without stopping their writers,
+*               one changing through every retry is skipped.
+*/
+int hotkeys_format(char *out, size_t size);
+
+#endif      /* _HOTKEYS_H_ */
@@ -0,0 +1,499 @@
+/*
+ *  File:        loadgen.c
+ *  Purpose:     Load generator of a running memcache server (-k), with
+ *               latency percentiles honest about queueing.
+ *
+ *               ./loadgen [-t threads] [-c connections] [-d seconds]
+ *                         [-r rate] [-m get:set:delete] [-k keys]
+ *                         [-z theta] [-s size[:max]] [-q depth] [-l]
+ *                         <host> <port>
+ *               -t threads:    client threads, default 1.
+ *               -c connections: connections over all threads, default 8.
+ *               -d seconds:    length of the run, default 10.
+ *               -r rate:       requests per second, fixed-rate open loop.
+ *                              0 (default) is closed loop, one request in
+ *                              flight per connection.
+ *               -m mix:        percent of GET, SET and DELETE, default
+ *                              90:10:0.
+ *               -k keys:       distinct names, default 100000.
+ *               -z theta:      Zipfian popularity, 0 (default) uniform,
+ *                              0.99 the usual skew.
+ *               -s size[:max]: value size, or uniform between size and
+ *                              max, default 32.
+ *               -q depth:      requests in flight per connection before
+ *                              an open loop sender waits, default 1024.
+ *               -l:            SET every name before the run.
+ *
+ *  Note:        In the open loop each request has an intended start on a
+ *               fixed schedule, and its latency runs from there, not from
+ *               when it was sent. A server (or sender) falling behind
+ *               then shows as the queueing it causes instead of being
+ *               left out of the samples (coordinated omission). In the
+ *               closed loop the next request starts when one completes,
+ *               latency runs from the send. Latencies go to log-linear
+ *               histograms, within 1.6% of the true value.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "utility_macros.h"
+#include "mcclient.h"
+
+#define SUB_BITS        6               /* Histogram buckets per power of
+                                           two, 2^SUB_BITS. */
+#define SUB_BUCKETS     (1 << SUB_BITS)
+#define N_BUCKETS       ((64 - SUB_BITS)*SUB_BUCKETS)
+#define N_OPS           3               /* MC_OP_SET, GET, DELETE. */
+#define DRAIN_MS        5000            /* Wait for late responses. */
+#define NAME_SIZE       32
+
+/* Latencies of one kind of request, in ns. */
+typedef struct histogram_struct {
+    unsigned long counts[N_BUCKETS];
+    unsigned long total;
+    long max;
+} histogram;
+
+/* A client thread and what it measured. */
+typedef struct worker_struct {
+    pthread_t thread;
+    int id;
+    int connections;
+    double rate;                    /* This thread's share, 0 closed. */
+    mc_client *client;
+    uint64_t seed;                  /* xorshift64* state. */
+    long end_ns;                    /* Stop starting requests. */
+    long sent;
+    long errors;
+    long misses;                    /* GET/DELETE of absent names. */
+    long unanswered;                /* Still in flight after the drain. */
+    long lag_ns;                    /* Most the sender ran late. */
+    histogram hist[N_OPS];
+} worker;
+
+static char *host;
+static int port, n_threads = 1, n_connections = 8, seconds = 10, depth = 1024;
+static int mix[N_OPS] = {10, 90, 0};    /* Indexed by MC_OP_*. */
+static int n_keys = 100000, min_size = 32, max_size = 32, prefill = 0;
+static double rate = 0, theta = 0;
+static double zipf_zetan, zipf_alpha, zipf_eta;
+static char *value;
+
+/* The worker running callbacks on this thread. */
+static __thread worker *self;
+
+
+/*
+* Name:         now_ns
+* Argument:     none
+* Return:       long
+* Purpose:      Monotonic clock in nanoseconds.
+* Note:         none
+*/
+static long now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+/*
+* Name:         next_random
+* Argument:     worker*
+* Return:       uint64_t
+* Purpose:      xorshift64* of the worker.
+* Note:         none
+*/
+static uint64_t next_random(worker *w){
+    w->seed ^= w->seed >> 12;
+    w->seed ^= w->seed << 25;
+    w->seed ^= w->seed >> 27;
+    return w->seed*0x2545f4914f6cdd1dULL;
+}
+
+/*
+* Name:         uniform
+* Argument:     worker*
+* Return:       double
+* Purpose:      Uniform in [0, 1).
+* Note:         none
+*/
+static double uniform(worker *w){
+    return (next_random(w) >> 11)*(1.0/9007199254740992.0);
+}
+
+/*
+* Name:         zipf_init
+* Argument:     none
+* Return:       none
+* Purpose:      Constants of the Zipfian generator for n_keys and theta.
+* Note:         Gray et al., "Quickly generating billion-record synthetic
+*               databases", as YCSB uses. O(n_keys) once.
+*/
+static void zipf_init(void){
+    double zeta2 = 0;
+
+    zipf_zetan = 0;
+    FORONE(i, n_keys)
+        zipf_zetan += 1.0/pow(i + 1, theta);
+    FORONE(i, 2)
+        zeta2 += 1.0/pow(i + 1, theta);
+    zipf_alpha = 1.0/(1.0 - theta);
+    zipf_eta = (1.0 - pow(2.0/n_keys, 1.0 - theta))/(1.0 - zeta2/zipf_zetan);
+}
+
+/*
+* Name:         pick_key
+* Argument:     worker*
+* Return:       unsigned long
+* Purpose:      Name number of the next request.
+* Note:         Zipfian ranks are scattered over the names by a hash, the
+*               hot names are not neighbours in the table.
+*/
+static unsigned long pick_key(worker *w){
+    unsigned long rank;
+    double u, uz;
+
+    if (theta <= 0)
+        return next_random(w) % n_keys;
+    u = uniform(w);
+    uz = u*zipf_zetan;
+    if (uz < 1.0)
+        rank = 0;
+    else if (uz < 1.0 + pow(0.5, theta))
+        rank = 1;
+    else
+        rank = (unsigned long)(n_keys*pow(zipf_eta*u - zipf_eta + 1,
+                                          zipf_alpha));
+    if (rank >= (unsigned long)n_keys)
+        rank = n_keys - 1;
+    return (rank*0x9e3779b97f4a7c15UL >> 17) % n_keys;
+}
+
+/*
+* Name:         bucket_of
+* Argument:     long
+* Return:       int
+* Purpose:      Histogram bucket of a latency.
+* Note:         Values below SUB_BUCKETS have a bucket each, above that
+*               each power of two has SUB_BUCKETS.
+*/
+static int bucket_of(long ns){
+    int power;
+
+    if (ns < SUB_BUCKETS)
+        return ns < 0 ? 0 : (int)ns;
+    power = 63 - __builtin_clzl(ns);
+    return (power - SUB_BITS + 1)*SUB_BUCKETS +
+           (int)((ns >> (power - SUB_BITS)) - SUB_BUCKETS);
+}
+
+/*
+* Name:         bucket_value
+* Argument:     int
+* Return:       long
+* Purpose:      Middle of the latencies a bucket holds.
+* Note:         none
+*/
+static long bucket_value(int bucket){
+    int power;
+    long low;
+
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+    power = bucket/SUB_BUCKETS + SUB_BITS - 1;
+    low = (long)(bucket % SUB_BUCKETS + SUB_BUCKETS) << (power - SUB_BITS);
+    return low + ((1L << (power - SUB_BITS)) >> 1);
+}
+
+/*
+* Name:         percentile
+* Argument:     histogram*, double
+* Return:       long
+* Purpose:      Latency at or below which q of the samples are.
+* Note:         0 without samples.
+*/
+static long percentile(histogram *h, double q){
+    unsigned long want = (unsigned long)ceil(q*h->total), seen = 0;
+
+    if (h->total == 0)
+        return 0;
+    if (want == 0)
+        want = 1;
+    FORONE(i, N_BUCKETS){
+        seen += h->counts[i];
+        if (seen >= want)
+            return MIN(bucket_value(i), h->max);
+    }
+    return h->max;
+}
+
+/*
+* Name:         request_done
+* Argument:     mc_result*, void*
+* Return:       none
+* Purpose:      Record a response, and in the closed loop start the next
+*               request on the freed connection.
+* Note:         arg is the request's intended start in ns.
+*/
+static void issue(worker *w, long intended);
+static void request_done(mc_result *result, void *arg){
+    worker *w = self;
+    long now = now_ns(), latency = now - (long)(intptr_t)arg;
+    histogram *h = &w->hist[result->op];
+
+    if (result->status == MC_ERR_NOT_FOUND)
+        w->misses++;
+    else if (result->status != MC_OK)
+        w->errors++;
+    h->counts[bucket_of(latency)]++;
+    h->total++;
+    h->max = MAX(h->max, latency);
+    if (w->rate == 0 && now < w->end_ns)
+        issue(w, now);
+}
+
+/*
+* Name:         issue
+* Argument:     worker*, long
+* Return:       none
+* Purpose:      Queue one request of the mix, intended to start at
+*               intended ns.
+* Note:         A request the client refuses counts as an error.
+*/
+static void issue(worker *w, long intended){
+    char name[NAME_SIZE];
+    int pick = next_random(w) % 100, status, size;
+
+    sprintf(name, "key%lu", pick_key(w));
+    w->sent++;
+    if (pick < mix[MC_OP_GET])
+        status = mc_get_async(w->client, name, request_done,
+                              (void*)(intptr_t)intended);
+    else if (pick < mix[MC_OP_GET] + mix[MC_OP_SET]){
+        size = min_size + (int)(next_random(w) % (max_size - min_size + 1));
+        status = mc_set_async(w->client, name, value, size, request_done,
+                              (void*)(intptr_t)intended);
+    }
+    else
+        status = mc_delete_async(w->client, name, request_done,
+                                 (void*)(intptr_t)intended);
+    if (status != MC_OK)
+        w->errors++;
+}
+
+/*
+* Name:         worker_main
+* Argument:     void*
+* Return:       void*
+* Purpose:      Thread body, run the closed or open loop until end_ns.
+* Note:         none
+*/
+static void* worker_main(void *arg){
+    worker *w = (worker*)arg;
+    long next, interval;
+
+    self = w;
+    if (w->rate == 0){
+        /* One request in flight per connection, each answer starts one. */
+        FORONE(i, w->connections)
+            issue(w, now_ns());
+        while (now_ns() < w->end_ns && mc_pending(w->client) > 0)
+            mc_poll(w->client, 10);
+    }
+    else{
+        /* Intended starts every interval, threads staggered. */
+        interval = (long)(1e9/w->rate);
+        next = now_ns() + interval*w->id/n_threads;
+        while (next < w->end_ns){
+            long now = now_ns();
+
+            while (next <= now && next < w->end_ns){
+                w->lag_ns = MAX(w->lag_ns, now - next);
+                issue(w, next);
+                next += interval;
+            }
+            /* Under a millisecond to the next start poll once and sleep,
+             * spinning would take the CPU from the server. */
+            int wait_ms = (int)((next - now)/1000000), pending, done = 0;
+
+            pending = mc_pending(w->client);
+            if (pending > 0)
+                done = mc_poll(w->client, wait_ms);
+            if (done == 0 && (pending == 0 || wait_ms == 0) && next > now){
+                struct timespec ts = {(next - now)/1000000000L,
+                                      (next - now) % 1000000000L};
+                nanosleep(&ts, NULL);
+            }
+        }
+    }
+    w->unanswered = mc_wait(w->client, DRAIN_MS);
+    return NULL;
+}
+
+/*
+* Name:         print_histogram
+* Argument:     const char*, histogram*, double
+* Return:       none
+* Purpose:      Print the count, rate and percentiles of one histogram.
+* Note:         none
+*/
+static void print_histogram(const char *label, histogram *h, double elapsed){
+    if (h->total == 0)
+        return;
+    printf("%-7s %10lu %10.0f/s  p50 %8.1f  p90 %8.1f  p99 %8.1f  "
+           "p99.9 %8.1f  p99.99 %8.1f  max %8.1f us\n", label, h->total,
+           h->total/elapsed, percentile(h, 0.5)/1e3,
+           percentile(h, 0.9)/1e3, percentile(h, 0.99)/1e3,
+           percentile(h, 0.999)/1e3, percentile(h, 0.9999)/1e3,
+           h->max/1e3);
+}
+
+/*
+* Name:         load_keys
+* Argument:     none
+* Return:       int
+* Purpose:      SET every name once, pipelined on one connection.
+* Note:         Returns the number of SETs that failed.
+*/
+static int load_keys(void){
+    mc_options options = {1, depth, 0};
+    mc_client *client = mc_connect(host, port, &options);
+    char name[NAME_SIZE];
+    int failed = 0;
+
+    if (client == NULL)
+        return n_keys;
+    FORONE(i, n_keys){
+        sprintf(name, "key%d", i);
+        if (mc_set_async(client, name, value, max_size, NULL, NULL) != MC_OK)
+            failed++;
+    }
+    failed += mc_wait(client, -1);
+    mc_close(client);
+    return failed;
+}
+
+int main(int argc, char **argv){
+    const char *labels[N_OPS] = {"SET", "GET", "DELETE"};
+    int option;
+    long errors = 0, misses = 0, unanswered = 0, sent = 0, lag = 0;
+    histogram *all;
+
+    while ((option = getopt(argc, argv, "t:c:d:r:m:k:z:s:q:l")) != -1){
+        switch (option){
+            case 't': n_threads = atoi(optarg); break;
+            case 'c': n_connections = atoi(optarg); break;
+            case 'd': seconds = atoi(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 'm':
+                if (sscanf(optarg, "%d:%d:%d", &mix[MC_OP_GET],
+                           &mix[MC_OP_SET], &mix[MC_OP_DELETE]) != 3)
+                    mix[MC_OP_GET] = -1;
+                break;
+            case 'k': n_keys = atoi(optarg); break;
+            case 'z': theta = atof(optarg); break;
+            case 's':
+                if (sscanf(optarg, "%d:%d", &min_size, &max_size) == 1)
+                    max_size = min_size;
+                break;
+            case 'q': depth = atoi(optarg); break;
+            case 'l': prefill = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-t threads] [-c connections] "
+                        "[-d seconds] [-r rate] [-m get:set:delete] "
+                        "[-k keys] [-z theta] [-s size[:max]] [-q depth] "
+                        "[-l] <host> <port>\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    EXIT_NOT_ON_VALUE(argc - optind, 2, "TOO MANY OR TO FEW ARGUMENTS, EXIT.\n",
+                      EXIT_FAILURE);
+    EXIT_ON_VALUE(n_threads < 1 || n_connections < n_threads ||
+                  seconds < 1 || rate < 0 || n_keys < 1 || depth < 1 ||
+                  mix[MC_OP_GET] < 0 || mix[MC_OP_SET] < 0 ||
+                  mix[MC_OP_DELETE] < 0 || mix[MC_OP_GET] + mix[MC_OP_SET] +
+                  mix[MC_OP_DELETE] != 100 || theta < 0 || theta >= 1 ||
+                  min_size < 1 || max_size < min_size, 1,
+                  "BAD COMMANDLINE ARGUMENT, EXIT.\n", EXIT_FAILURE);
+    host = argv[optind];
+    port = atoi(argv[optind+1]);
+
+    value = malloc(max_size);
+    worker *workers = calloc(n_threads, sizeof(worker));
+    all = calloc(N_OPS + 1, sizeof(histogram));
+    EXIT_ON_VALUE(value == NULL || workers == NULL || all == NULL, 1,
+                  "CANNOT ALLOCATE MEMORY, EXIT.\n", EXIT_FAILURE);
+    FORONE(i, max_size)
+        value[i] = 'a' + i % 26;
+    if (theta > 0)
+        zipf_init();
+    if (prefill){
+        int failed = load_keys();
+        printf("loaded:      %d names, %d failed\n", n_keys, failed);
+    }
+
+    long start = now_ns();
+    FORONE(i, n_threads){
+        mc_options options = {0, rate > 0 ? depth : 1, DRAIN_MS};
+        worker *w = &workers[i];
+
+        w->id = i;
+        w->connections = n_connections/n_threads +
+                         (i < n_connections % n_threads);
+        w->rate = rate/n_threads;
+        w->seed = 0x9e3779b97f4a7c15ULL*(i + 1);
+        w->end_ns = start + seconds*1000000000L;
+        options.links = w->connections;
+        w->client = mc_connect(host, port, &options);
+        EXIT_ON_VALUE(w->client, NULL, "CANNOT CONNECT, EXIT.\n",
+                      EXIT_FAILURE);
+    }
+    FORONE(i, n_threads)
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    FORONE(i, n_threads){
+        worker *w = &workers[i];
+
+        pthread_join(w->thread, NULL);
+        sent += w->sent;
+        errors += w->errors;
+        misses += w->misses;
+        unanswered += w->unanswered;
+        lag = MAX(lag, w->lag_ns);
+        FORONE(op, N_OPS){
+            FORONE(b, N_BUCKETS){
+                all[op].counts[b] += w->hist[op].counts[b];
+                all[N_OPS].counts[b] += w->hist[op].counts[b];
+            }
+            all[op].total += w->hist[op].total;
+            all[op].max = MAX(all[op].max, w->hist[op].max);
+        }
+        mc_close(w->client);
+    }
+    double elapsed = (now_ns() - start)/1e9;
+    FORONE(op, N_OPS){
+        all[N_OPS].total += all[op].total;
+        all[N_OPS].max = MAX(all[N_OPS].max, all[op].max);
+    }
+
+    printf("mode:        %s, %d connections, %d threads\n",
+           rate > 0 ? "open loop" : "closed loop", n_connections, n_threads);
+    if (rate > 0)
+        printf("target:      %.0f req/s, sender lag max %.1f ms\n", rate,
+               lag/1e6);
+    printf("requests:    %ld sent, %ld errors, %ld misses, %ld unanswered\n",
+           sent, errors, misses, unanswered);
+    printf("elapsed:     %.3f s\n", elapsed);
+    print_histogram("ALL", &all[N_OPS], elapsed);
+    FORONE(op, N_OPS)
+        print_histogram(labels[op], &all[op], elapsed);
+
+    FREE_ON_VAL(value, workers, all);
+    return errors || unanswered ? EXIT_FAILURE : EXIT_SUCCESS;
+}
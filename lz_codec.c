@@ -0,0 +1,227 @@
+/*
+ *  File:        lz_codec.c
+ *  Purpose:     LZ4 block format compressor and decompressor.
+ *
+ *               A block is a list of sequences:
+ *                   token:     high 4 bits literal count, low 4 bits
+ *                              match length - 4, 15 means more follows.
+ *                   [255..]    extra literal count bytes.
+ *                   literals
+ *                   offset:    2 bytes little endian, 1..65535 back.
+ *                   [255..]    extra match length bytes.
+ *               The last sequence has literals only. The last 5 bytes are
+ *               always literals and no match starts in the last 12.
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "utility_macros.h"
+#include "lz_codec.h"
+
+#define LZ_HASH_BITS        12              /* Entries in the match table. */
+#define LZ_MIN_MATCH        4               /* Shortest match encoded. */
+#define LZ_LAST_LITERALS    5               /* Bytes kept as literals at end. */
+#define LZ_MF_LIMIT         12              /* No match starts this close to end. */
+#define LZ_MAX_OFFSET       65535           /* Farthest match reachable. */
+
+
+/*
+* Name:         lz_hash
+* Argument:     const unsigned char*
+* Return:       unsigned int
+* Purpose:      Hash the 4 bytes at p into the match table.
+* Note:         Knuth multiplicative hash.
+*/
+static unsigned int lz_hash(const unsigned char *p){
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+* Name:         lz_put_length
+* Argument:     unsigned char*, unsigned char*, size_t
+* Return:       unsigned char*
+* Purpose:      Write the extra bytes of a length that did not fit its
+*               4 bits of the token (length already minus 15).
+* Note:         Returns the next output position, NULL if out of space.
+*/
+static unsigned char* lz_put_length(unsigned char *op, unsigned char *oend,
+                                    size_t length){
+    while (length >= 255){
+        if (op >= oend)
+            return NULL;
+        *op++ = 255;
+        length -= 255;
+    }
+    if (op >= oend)
+        return NULL;
+    *op++ = (unsigned char)length;
+    return op;
+}
+
+/*
+* Name:         lz_put_sequence
+* Argument:     unsigned char*, unsigned char*, const unsigned char*,
+*               size_t, size_t, size_t
+* Return:       unsigned char*
+* Purpose:      Write a sequence of n_literals literals followed by a match
+*               of match_length bytes offset back, no match if 0.
+* Note:         Returns the next output position, NULL if out of space.
+*/
+static unsigned char* lz_put_sequence(unsigned char *op, unsigned char *oend,
+                                      const unsigned char *literals,
+                                      size_t n_literals, size_t offset,
+                                      size_t match_length){
+    unsigned char *token = op++;
+    size_t extra = match_length ? match_length - LZ_MIN_MATCH : 0;
+
+    if (token >= oend)
+        return NULL;
+    *token = (unsigned char)(MIN(n_literals, 15) << 4);
+    if (n_literals >= 15 &&
+        (op = lz_put_length(op, oend, n_literals - 15)) == NULL)
+        return NULL;
+    if ((size_t)(oend - op) < n_literals)
+        return NULL;
+    memcpy(op, literals, n_literals);
+    op += n_literals;
+
+    if (match_length == 0)
+        return op;
+    if (oend - op < 2)
+        return NULL;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    *token |= MIN(extra, 15);
+    if (extra >= 15 && (op = lz_put_length(op, oend, extra - 15)) == NULL)
+        return NULL;
+    return op;
+}
+
+/*
+* Name:         lz_compress
+* Argument:     const char*, int, char*, int
+* Return:       int
+* Purpose:      Compress size bytes of source into dest.
+* Note:         Returns 0 when the output does not fit in capacity.
+*/
+int lz_compress(const char *source, int size, char *dest, int capacity){
+    const unsigned char *src = (const unsigned char*)source;
+    const unsigned char *ip = src, *anchor = src, *iend = src + size;
+    const unsigned char *mflimit = iend - LZ_MF_LIMIT;
+    const unsigned char *matchlimit = iend - LZ_LAST_LITERALS;
+    unsigned char *op = (unsigned char*)dest, *oend = op + capacity;
+    int table[1 << LZ_HASH_BITS];       /* Position + 1, 0 for none. */
+
+    if (size < 0 || capacity <= 0)
+        return 0;
+    memset(table, 0, sizeof(table));
+
+    while (size > LZ_MF_LIMIT && ip < mflimit){
+        unsigned int h = lz_hash(ip);
+        int candidate = table[h];
+        const unsigned char *match = src + candidate - 1;
+        size_t length = LZ_MIN_MATCH;
+
+        table[h] = ip - src + 1;
+        if (candidate == 0 || ip - match > LZ_MAX_OFFSET ||
+            memcmp(match, ip, LZ_MIN_MATCH) != 0){
+            ip++;
+            continue;
+        }
+
+        while (ip + length < matchlimit && match[length] == ip[length])
+            length++;
+        op = lz_put_sequence(op, oend, anchor, ip - anchor, ip - match,
+                             length);
+        if (op == NULL)
+            return 0;
+        ip += length;
+        anchor = ip;
+
+        /* Index the end of the match so runs chain into each other. */
+        if (ip < mflimit)
+            table[lz_hash(ip - 2)] = ip - 2 - src + 1;
+    }
+
+    op = lz_put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    if (op == NULL)
+        return 0;
+    return op - (unsigned char*)dest;
+}
+
+/*
+* Name:         lz_get_length
+* Argument:     const unsigned char**, const unsigned char*, size_t*
+* Return:       int
+* Purpose:      Add the extra length bytes at *ip to *length.
+* Note:         Returns -1 if the input ends first.
+*/
+static int lz_get_length(const unsigned char **ip, const unsigned char *iend,
+                         size_t *length){
+    unsigned char byte;
+
+    do {
+        if (*ip >= iend)
+            return -1;
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+/*
+* Name:         lz_decompress
+* Argument:     const char*, int, char*, int
+* Return:       int
+* Purpose:      Decompress size bytes of source into dest.
+* Note:         Returns -1 on corrupt input or when dest is too small.
+*/
+int lz_decompress(const char *source, int size, char *dest, int capacity){
+    const unsigned char *ip = (const unsigned char*)source, *iend = ip + size;
+    unsigned char *op = (unsigned char*)dest, *oend = op + capacity;
+
+    if (size <= 0 || capacity < 0)
+        return -1;
+
+    while (ip < iend){
+        unsigned char token = *ip++;
+        size_t length = token >> 4, offset;
+        const unsigned char *match;
+
+        if (length == 15 && lz_get_length(&ip, iend, &length) == -1)
+            return -1;
+        if (length > (size_t)(iend - ip) || length > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, length);
+        ip += length;
+        op += length;
+
+        /* The last sequence has no match. */
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (unsigned char*)dest))
+            return -1;
+
+        length = token & 15;
+        if (length == 15 && lz_get_length(&ip, iend, &length) == -1)
+            return -1;
+        length += LZ_MIN_MATCH;
+        if (length > (size_t)(oend - op))
+            return -1;
+
+        /* Byte by byte, the match may overlap what it writes. */
+        match = op - offset;
+        while (length--)
+            *op++ = *match++;
+    }
+    return op - (unsigned char*)dest;
+}
@@ -0,0 +1,38 @@
+/*
+ *  File:        lz_codec.h
+ *  Purpose:     Small LZ77 codec for values stored in the hashtable,
+ *               producing the LZ4 block format (no frame header).
+ *
+ *  Note:        Greedy single pass compressor with a 4096 entry hash of
+ *               4 byte sequences, fast enough to run on every SET.
+ *               Thread safe, all state is on the stack.
+ */
+
+#ifndef _LZ_CODEC_H_
+#define _LZ_CODEC_H_
+
+
+/*
+* Name:         lz_compress
+* Argument:     const char*, int, char*, int
+* Return:       int
+* Purpose:      Compress size bytes of source into dest.
+* Note:         Returns the compressed size, or 0 when it does not fit in
+*               capacity bytes. Pass capacity = size - 1 to only keep
+*               output that is smaller than the input.
+*/
+int lz_compress(const char *source, int size, char *dest, int capacity);
+
+
+/*
+* Name:         lz_decompress
+* Argument:     const char*, int, char*, int
+* Return:       int
+* Purpose:      Decompress size bytes of source into dest.
+* Note:         Returns the decompressed size, or -1 if source is corrupt
+*               or does not fit in capacity bytes. Never reads or writes
+*               out of bounds.
+*/
+int lz_decompress(const char *source, int size, char *dest, int capacity);
+
+#endif      /* _LZ_CODEC_H_ */
@@ -0,0 +1,143 @@
+/*
+ *  File:        mcbulk.c
+ *  Purpose:     Standalone dump file tool, creates dumps and measures
+ *               bulk loading and exporting without a running server.
+ *
+ *               ./mcbulk gen <dump> <count> <size>
+ *               Write count JSON-like values of size bytes named key<i>.
+ *
+ *               ./mcbulk load [-j workers] [-z threshold [-v max_value]]
+ *                             [-o dump] <dump> <num_elements> <element_size>
+ *               Load a dump into a new table the way memcache -l does,
+ *               print the rate and optionally export the table again.
+ *               -j workers:    threads, default one per online core.
+ *               -z threshold:  compress values like memcache -z.
+ *               -v max_value:  largest value accepted like memcache -v.
+ *               -o dump:       export the loaded table to this file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utility_macros.h"
+#include "shared_hashtable.h"
+#include "bulk.h"
+
+#define NAME_SIZE       120
+
+
+/*
+* Name:         usage
+* Argument:     char*
+* Return:       none
+* Purpose:      Print usage and exit.
+* Note:         none
+*/
+static void usage(char *program){
+    fprintf(stderr, "Usage: %s gen <dump> <count> <size>\n"
+            "       %s load [-j workers] [-z threshold [-v max_value]] "
+            "[-o dump] <dump> <num_elements> <element_size>\n", 
+            program, program);
+    exit(EXIT_FAILURE);
+}
+
+/*
+* Name:         print_result
+* Argument:     const char*, bulk_result*
+* Return:       none
+* Purpose:      Print what a load or export did.
+* Note:         none
+*/
+static void print_result(const char *what, bulk_result *result){
+    printf("%s: %ld entries (%ld refused), %.1f MB in %.3f s, "
+           "%.0f entries/s, %.1f MB/s\n", what, result->records,
+           result->errors, result->bytes/MILLION, result->seconds,
+           result->records/result->seconds,
+           result->bytes/MILLION/result->seconds);
+}
+
+/*
+* Name:         generate
+* Argument:     const char*, int, int
+* Return:       int
+* Purpose:      Write a dump of count values of size bytes.
+* Note:         Values repeat a small JSON record, so they compress.
+*/
+static int generate(const char *path, int count, int size){
+    char name[NAME_SIZE], *value = malloc(size);
+    FILE *file = fopen(path, "w");
+    int status = 0;
+
+    if (value == NULL || file == NULL){
+        fprintf(stderr, "CANNOT CREATE DUMP FILE.\n");
+        exit(EXIT_FAILURE);
+    }
+    fwrite(BULK_MAGIC, BULK_MAGIC_SIZE, 1, file);
+    FORONE(i, count){
+        int length = 0;
+
+        while (length < size)
+            length += snprintf(value + length, size - length,
+                               "{\"id\":%d,\"seq\":%d,\"name\":\"user%d\"},",
+                               i, length, (i*31 + length) % 997);
+        snprintf(name, sizeof(name), "key%d", i);
+        if (bulk_write_record(file, name, value, size) == -1){
+            status = -1;
+            break;
+        }
+    }
+    if (fclose(file) != 0)
+        status = -1;
+    free(value);
+    return status;
+}
+
+int main(int argc, char **argv){
+    int option, n_workers = sysconf(_SC_NPROCESSORS_ONLN), status;
+    hash_options options = {HASH_LOCK_THREAD};
+    char *export_path = NULL;
+    bulk_result result = {0};
+    void *table;
+
+    if (argc < 2)
+        usage(argv[0]);
+
+    if (strcmp(argv[1], "gen") == 0){
+        if (argc != 5 || atoi(argv[3]) < 0 || atoi(argv[4]) < 1)
+            usage(argv[0]);
+        return generate(argv[2], atoi(argv[3]), atoi(argv[4])) == 0
+               ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (strcmp(argv[1], "load") != 0)
+        usage(argv[0]);
+
+    optind = 2;
+    while ((option = getopt(argc, argv, "j:z:v:o:")) != -1){
+        switch (option){
+            case 'j': n_workers = atoi(optarg);                  break;
+            case 'z': options.compress_threshold = atoi(optarg); break;
+            case 'v': options.max_value_size = atoi(optarg);     break;
+            case 'o': export_path = optarg;                      break;
+            default:  usage(argv[0]);
+        }
+    }
+    if (argc - optind != 3 || atoi(argv[optind + 1]) < 1 ||
+        atoi(argv[optind + 2]) < 1)
+        usage(argv[0]);
+
+    table = make_hashtable_opt(atoi(argv[optind + 1]),
+                               atoi(argv[optind + 2]), &options);
+    EXIT_ON_VALUE(table, NULL, "CANNOT CREATE HASHTABLE, EXIT.\n",
+                  EXIT_FAILURE);
+
+    status = bulk_load(table, argv[optind], n_workers, &result);
+    print_result("load", &result);
+    if (status == 0 && export_path != NULL){
+        status = bulk_export(table, export_path, n_workers, &result);
+        print_result("export", &result);
+    }
+    hash_detach(table);
+    return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,865 @@
+/*
+ *  File:        mcclient.c
+ *  Purpose:     Client library of the memcache protocol, see mcclient.h.
+ *
+ *  Note:        Links are non-blocking sockets driven by poll(). A link
+ *               keeps the bytes of its queued requests, a ring of the
+ *               requests in flight (responses come back in order, so the
+ *               oldest is at its head) and the bytes received but not
+ *               parsed yet. read_in_full()/write_in_full() block until
+ *               done, which on a pipelined link would stop reading
+ *               responses while the server waits for them to be read, so
+ *               the links do their own partial reads and writes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "utility_macros.h"
+#include "mcclient.h"
+
+#define DEFAULT_LINKS       1
+#define DEFAULT_DEPTH       64
+#define DEFAULT_TIMEOUT_MS  5000
+#define READ_SIZE           65536           /* Bytes asked per read(). */
+#define MAX_LINE            64              /* Longest response line. */
+#define HEADER_SIZE         160             /* "SET <name> <size>\r\n". */
+
+/* A request in flight. */
+typedef struct mc_op_struct {
+    int op;                         /* MC_OP_*. */
+    mc_callback callback;           /* Or NULL. */
+    void *arg;
+    int index;                      /* result->index. */
+    char name[MC_MAX_NAME + 1];
+} mc_op;
+
+/* A connection of the pool. */
+typedef struct mc_link_struct {
+    int fd;                         /* -1 while closed. */
+    char *out;                      /* Requests not sent yet. */
+    size_t out_len, out_sent, out_size;
+    char *in;                       /* Responses not parsed yet. */
+    size_t in_off, in_len, in_size;
+    mc_op *ops;                     /* Ring of requests in flight. */
+    int head, count, capacity;
+    long progress_ms;               /* Last response, or first request
+                                       after the link was idle. */
+} mc_link;
+
+struct mc_client_struct {
+    struct addrinfo *server;
+    mc_link *links;
+    int n_links;
+    int depth;
+    int timeout_ms;
+    int pending;                    /* Requests of every link. */
+    int in_callback;                /* A callback is running. */
+};
+
+/* Blocking call waiting for its request. */
+typedef struct waiter_struct {
+    int done;
+    int status;
+    void *data;                     /* GET copy. */
+    int size;
+} waiter;
+
+/* mc_get_many() in progress. */
+typedef struct many_struct {
+    mc_callback callback;
+    void *arg;
+    int remaining;
+    int found;
+} many;
+
+
+/*
+* Name:         now_ms
+* Argument:     none
+* Return:       long
+* Purpose:      Monotonic clock in milliseconds.
+* Note:         none
+*/
+static long now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000L + ts.tv_nsec/1000000;
+}
+
+/*
+* Name:         check_name
+* Argument:     const char*
+* Return:       int
+* Purpose:      Check a name is one the server accepts without closing.
+* Note:         Returns MC_OK or MC_ERR_ARG.
+*/
+static int check_name(const char *name){
+    size_t length;
+
+    if (name == NULL)
+        return MC_ERR_ARG;
+    length = strlen(name);
+    if (length == 0 || length > MC_MAX_NAME)
+        return MC_ERR_ARG;
+    FORONE(i, (int)length)
+        if (!isalnum((unsigned char)name[i]))
+            return MC_ERR_ARG;
+    return MC_OK;
+}
+
+/*
+* Name:         reserve
+* Argument:     char**, size_t*, size_t
+* Return:       int
+* Purpose:      Grow a buffer to hold at least need bytes.
+* Note:         Returns 0, or -1 if memory runs out (buffer unchanged).
+*/
+static int reserve(char **buffer, size_t *size, size_t need){
+    size_t larger = *size > 0 ? *size : 4096;
+    char *grown;
+
+    if (need <= *size)
+        return 0;
+    while (larger < need)
+        larger *= 2;
+    grown = realloc(*buffer, larger);
+    if (grown == NULL)
+        return -1;
+    *buffer = grown;
+    *size = larger;
+    return 0;
+}
+
+/*
+* Name:         complete
+* Argument:     mc_client*, mc_op*, int, const void*, int
+* Return:       none
+* Purpose:      Run the callback of a request that finished.
+* Note:         op must be off its ring already, the callback may queue
+*               new requests.
+*/
+static void complete(mc_client *c, mc_op *op, int status, const void *data,
+                     int size){
+    mc_result result;
+
+    c->pending--;
+    if (op->callback == NULL)
+        return;
+    result.op = op->op;
+    result.status = status;
+    result.name = op->name;
+    result.data = data;
+    result.size = size;
+    result.index = op->index;
+    c->in_callback++;
+    op->callback(&result, op->arg);
+    c->in_callback--;
+}
+
+/*
+* Name:         link_open
+* Argument:     mc_client*, mc_link*
+* Return:       int
+* Purpose:      Connect a closed link, non-blocking once connected.
+* Note:         Returns 0 or -1.
+*/
+static int link_open(mc_client *c, mc_link *l){
+    int one = 1;
+
+    for (struct addrinfo *a = c->server; a != NULL; a = a->ai_next){
+        int fd = socket(a->ai_family, SOCK_STREAM, 0);
+
+        if (fd == -1)
+            continue;
+        if (connect(fd, a->ai_addr, a->ai_addrlen) == 0){
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            l->fd = fd;
+            return 0;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+/*
+* Name:         link_fail
+* Argument:     mc_client*, mc_link*, int
+* Return:       none
+* Purpose:      Close a link and complete its requests with status.
+* Note:         The link reconnects on its next request.
+*/
+static void link_fail(mc_client *c, mc_link *l, int status){
+    mc_op *ops = l->ops;
+    int head = l->head, count = l->count, capacity = l->capacity;
+
+    if (l->fd != -1)
+        close(l->fd);
+    l->fd = -1;
+    l->out_len = l->out_sent = 0;
+    l->in_off = l->in_len = 0;
+
+    /* Callbacks may queue on the link again, on a new ring. */
+    l->ops = NULL;
+    l->head = l->count = l->capacity = 0;
+    FORONE(i, count)
+        complete(c, &ops[(head + i) % capacity], status, NULL, 0);
+    FREE(ops);
+}
+
+/*
+* Name:         link_push
+* Argument:     mc_link*, mc_op*
+* Return:       int
+* Purpose:      Add a request at the tail of the link's ring.
+* Note:         Returns 0, or -1 if the ring cannot grow.
+*/
+static int link_push(mc_link *l, mc_op *op){
+    if (l->count == l->capacity){
+        int capacity = l->capacity > 0 ? l->capacity*2 : DEFAULT_DEPTH;
+        mc_op *ops = malloc((size_t)capacity*sizeof(mc_op));
+
+        if (ops == NULL)
+            return -1;
+        FORONE(i, l->count)
+            ops[i] = l->ops[(l->head + i) % l->capacity];
+        free(l->ops);
+        l->ops = ops;
+        l->head = 0;
+        l->capacity = capacity;
+    }
+    if (l->count == 0)
+        l->progress_ms = now_ms();
+    l->ops[(l->head + l->count) % l->capacity] = *op;
+    l->count++;
+    return 0;
+}
+
+/*
+* Name:         link_flush
+* Argument:     mc_client*, mc_link*
+* Return:       int
+* Purpose:      Send what the link can take of its queued requests.
+* Note:         Returns 0, or -1 after failing the link.
+*/
+static int link_flush(mc_client *c, mc_link *l){
+    while (l->out_sent < l->out_len){
+        ssize_t sent = send(l->fd, l->out + l->out_sent,
+                            l->out_len - l->out_sent, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (sent == -1){
+            link_fail(c, l, MC_ERR_IO);
+            return -1;
+        }
+        l->out_sent += sent;
+    }
+    l->out_len = l->out_sent = 0;
+    return 0;
+}
+
+/*
+* Name:         response_status
+* Argument:     const char*, size_t
+* Return:       int
+* Purpose:      MC_ERR_* of an "ERR <reason>" line.
+* Note:         none
+*/
+static int response_status(const char *line, size_t length){
+    static const struct {
+        const char *reason;
+        int status;
+    } reasons[] = {{"ERR NOT_FOUND", MC_ERR_NOT_FOUND},
+                   {"ERR NO_SPACE", MC_ERR_NO_SPACE},
+                   {"ERR TOO_LARGE", MC_ERR_TOO_LARGE},
+                   {"ERR NO_MEMORY", MC_ERR_NO_MEMORY},
+                   {"ERR READ_ONLY", MC_ERR_READ_ONLY}};
+
+    FORONE(i, (int)(sizeof(reasons)/sizeof(reasons[0]))){
+        size_t reason_length = strlen(reasons[i].reason);
+
+        if (length >= reason_length &&
+            memcmp(line, reasons[i].reason, reason_length) == 0)
+            return reasons[i].status;
+    }
+    return MC_ERR_SERVER;
+}
+
+/*
+* Name:         link_parse
+* Argument:     mc_client*, mc_link*
+* Return:       int
+* Purpose:      Complete the requests whose responses are whole in the
+*               link's input.
+* Note:         Returns the number completed, or -1 after failing the link
+*               on a response that does not parse.
+*/
+static int link_parse(mc_client *c, mc_link *l){
+    int completed = 0;
+
+    while (l->count > 0){
+        char *start = l->in + l->in_off, *line_end;
+        size_t available = l->in_len - l->in_off, line_size, used;
+        mc_op op = l->ops[l->head];
+        int status = MC_OK, size = 0;
+        char *data = NULL;
+
+        line_end = memchr(start, '\n', MIN(available, MAX_LINE));
+        if (line_end == NULL){
+            if (available >= MAX_LINE){
+                link_fail(c, l, MC_ERR_PROTOCOL);
+                return -1;
+            }
+            break;
+        }
+        used = line_end - start + 1;
+        line_size = used - 1;
+        if (line_size > 0 && start[line_size - 1] == '\r')
+            line_size--;
+
+        if (line_size >= 4 && memcmp(start, "ERR ", 4) == 0)
+            status = response_status(start, line_size);
+        else if (op.op == MC_OP_GET){
+            char number[MAX_LINE], *end;
+            long value_size;
+
+            if (line_size < 4 || memcmp(start, "OK ", 3) != 0){
+                link_fail(c, l, MC_ERR_PROTOCOL);
+                return -1;
+            }
+            memcpy(number, start + 3, line_size - 3);
+            number[line_size - 3] = '\0';
+            value_size = strtol(number, &end, 10);
+            if (*end != '\0' || value_size < 0 || value_size > INT_MAX){
+                link_fail(c, l, MC_ERR_PROTOCOL);
+                return -1;
+            }
+            if (available - used < (size_t)value_size)
+                break;
+            data = start + used;
+            size = (int)value_size;
+            used += value_size;
+        }
+        else if (op.op == MC_OP_DELETE && line_size == 4 &&
+                 memcmp(start, "OK ", 3) == 0 &&
+                 (start[3] == '0' || start[3] == '1'))
+            status = start[3] == '1' ? MC_OK : MC_ERR_NOT_FOUND;
+        else if (op.op != MC_OP_SET || line_size != 2 ||
+                 memcmp(start, "OK", 2) != 0){
+            link_fail(c, l, MC_ERR_PROTOCOL);
+            return -1;
+        }
+
+        l->in_off += used;
+        l->head = (l->head + 1) % l->capacity;
+        l->count--;
+        l->progress_ms = now_ms();
+        completed++;
+        complete(c, &op, status, data, size);
+    }
+
+    /* Move what is left to the start once it is only a partial response. */
+    if (l->in_off == l->in_len)
+        l->in_off = l->in_len = 0;
+    else if (l->in_off > l->in_size/2){
+        memmove(l->in, l->in + l->in_off, l->in_len - l->in_off);
+        l->in_len -= l->in_off;
+        l->in_off = 0;
+    }
+    return completed;
+}
+
+/*
+* Name:         link_read
+* Argument:     mc_client*, mc_link*
+* Return:       int
+* Purpose:      Read what arrived on a link and complete its requests.
+* Note:         Returns the number completed, or -1 after failing the
+*               link.
+*/
+static int link_read(mc_client *c, mc_link *l){
+    int completed = 0, status;
+
+    while (l->fd != -1){
+        ssize_t got;
+
+        if (reserve(&l->in, &l->in_size, l->in_len + READ_SIZE) == -1){
+            link_fail(c, l, MC_ERR_NOMEM);
+            return -1;
+        }
+        got = read(l->fd, l->in + l->in_len, l->in_size - l->in_len);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (got <= 0){
+            /* What arrived before the close is still answered. */
+            status = link_parse(c, l);
+            if (status > 0)
+                completed += status;
+            if (status != -1)
+                link_fail(c, l, MC_ERR_IO);
+            return completed;
+        }
+        l->in_len += got;
+        status = link_parse(c, l);
+        if (status == -1)
+            return completed;
+        completed += status;
+        if ((size_t)got < READ_SIZE)
+            break;
+    }
+    return completed;
+}
+
+/*
+* Name:         pick_link
+* Argument:     mc_client*
+* Return:       mc_link*
+* Purpose:      The link with the fewest requests in flight.
+* Note:         none
+*/
+static mc_link* pick_link(mc_client *c){
+    mc_link *best = &c->links[0];
+
+    FORTWO(i, c->n_links, 1)
+        if (c->links[i].count < best->count)
+            best = &c->links[i];
+    return best;
+}
+
+/*
+* Name:         submit
+* Argument:     mc_client*, int, const char*, const void*, int,
+*               mc_callback, void*, int
+* Return:       int
+* Purpose:      Queue a request on a link of the pool.
+* Note:         Returns MC_OK, or an MC_ERR_* without calling callback.
+*/
+static int submit(mc_client *c, int type, const char *name, const void *data,
+                  int size, mc_callback callback, void *arg, int index){
+    char header[HEADER_SIZE];
+    int length;
+    mc_link *l;
+    mc_op op;
+
+    if (c == NULL || check_name(name) != MC_OK)
+        return MC_ERR_ARG;
+    if (type == MC_OP_SET && (data == NULL || size < 1))
+        return MC_ERR_ARG;
+
+    /* A full pipeline drains first, a callback cannot wait. */
+    l = pick_link(c);
+    while (l->count >= c->depth && !c->in_callback){
+        if (mc_poll(c, -1) < 0)
+            return MC_ERR_ARG;
+        l = pick_link(c);
+    }
+    if (l->fd == -1 && link_open(c, l) == -1)
+        return MC_ERR_IO;
+
+    if (type == MC_OP_SET)
+        length = sprintf(header, "SET %s %d\r\n", name, size);
+    else
+        length = sprintf(header, "%s %s\r\n",
+                         type == MC_OP_GET ? "GET" : "DELETE", name);
+    if (type != MC_OP_SET)
+        size = 0;
+    if (reserve(&l->out, &l->out_size, l->out_len + length + size) == -1)
+        return MC_ERR_NOMEM;
+
+    op.op = type;
+    op.callback = callback;
+    op.arg = arg;
+    op.index = index;
+    strcpy(op.name, name);
+    if (link_push(l, &op) == -1)
+        return MC_ERR_NOMEM;
+    memcpy(l->out + l->out_len, header, length);
+    if (size > 0)
+        memcpy(l->out + l->out_len + length, data, size);
+    l->out_len += length + size;
+    c->pending++;
+    return MC_OK;
+}
+
+
+/*
+* Name:         mc_connect
+* Argument:     const char*, int, mc_options*
+* Return:       mc_client*
+* Purpose:      Resolve host and open the pool's connections.
+* Note:         none
+*/
+mc_client* mc_connect(const char *host, int port, mc_options *options){
+    struct addrinfo hints;
+    char service[16];
+    mc_client *c;
+
+    c = calloc(1, sizeof(mc_client));
+    if (c == NULL)
+        return NULL;
+    c->n_links = options != NULL && options->links > 0 ? options->links
+                                                        : DEFAULT_LINKS;
+    c->depth = options != NULL && options->depth > 0 ? options->depth
+                                                      : DEFAULT_DEPTH;
+    c->timeout_ms = options != NULL && options->timeout_ms != 0
+                    ? options->timeout_ms : DEFAULT_TIMEOUT_MS;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &c->server) != 0){
+        free(c);
+        return NULL;
+    }
+
+    c->links = calloc(c->n_links, sizeof(mc_link));
+    if (c->links == NULL){
+        mc_close(c);
+        return NULL;
+    }
+    FORONE(i, c->n_links)
+        c->links[i].fd = -1;
+    FORONE(i, c->n_links)
+        if (link_open(c, &c->links[i]) == -1){
+            mc_close(c);
+            return NULL;
+        }
+    return c;
+}
+
+/*
+* Name:         mc_close
+* Argument:     mc_client*
+* Return:       none
+* Purpose:      Close the connections and free the client.
+* Note:         none
+*/
+void mc_close(mc_client *client){
+    if (client == NULL)
+        return;
+    if (client->links != NULL)
+        FORONE(i, client->n_links){
+            mc_link *l = &client->links[i];
+
+            link_fail(client, l, MC_ERR_IO);
+            FREE_ON_VAL(l->out, l->in, l->ops);
+        }
+    FREE(client->links);
+    if (client->server != NULL)
+        freeaddrinfo(client->server);
+    free(client);
+}
+
+/*
+* Name:         mc_set_async
+* Argument:     mc_client*, const char*, const void*, int, mc_callback,
+*               void*
+* Return:       int
+* Purpose:      Queue a SET.
+* Note:         none
+*/
+int mc_set_async(mc_client *client, const char *name, const void *data,
+                 int size, mc_callback callback, void *arg){
+    return submit(client, MC_OP_SET, name, data, size, callback, arg, -1);
+}
+
+/*
+* Name:         mc_get_async
+* Argument:     mc_client*, const char*, mc_callback, void*
+* Return:       int
+* Purpose:      Queue a GET.
+* Note:         none
+*/
+int mc_get_async(mc_client *client, const char *name, mc_callback callback,
+                 void *arg){
+    return submit(client, MC_OP_GET, name, NULL, 0, callback, arg, -1);
+}
+
+/*
+* Name:         mc_delete_async
+* Argument:     mc_client*, const char*, mc_callback, void*
+* Return:       int
+* Purpose:      Queue a DELETE.
+* Note:         none
+*/
+int mc_delete_async(mc_client *client, const char *name,
+                    mc_callback callback, void *arg){
+    return submit(client, MC_OP_DELETE, name, NULL, 0, callback, arg, -1);
+}
+
+/*
+* Name:         mc_poll
+* Argument:     mc_client*, int
+* Return:       int
+* Purpose:      Send queued requests and complete arrived responses.
+* Note:         Requests are sent before waiting, a link whose buffer is
+*               full is polled for writing as well.
+*/
+int mc_poll(mc_client *client, int timeout_ms){
+    long deadline = timeout_ms >= 0 ? now_ms() + timeout_ms : -1;
+    int completed = 0;
+
+    if (client == NULL || client->in_callback)
+        return MC_ERR_ARG;
+    struct pollfd fds[client->n_links];
+    mc_link *polled[client->n_links];
+
+    while (client->pending > 0){
+        long now = now_ms(), wait = deadline >= 0 ? deadline - now : -1;
+        int n = 0;
+
+        FORONE(i, client->n_links){
+            mc_link *l = &client->links[i];
+
+            if (l->fd == -1 || l->count == 0)
+                continue;
+            if (link_flush(client, l) == -1)
+                continue;
+            /* A link silent for too long is given up. */
+            if (client->timeout_ms > 0){
+                long left = l->progress_ms + client->timeout_ms - now;
+
+                if (left <= 0){
+                    link_fail(client, l, MC_ERR_TIMEOUT);
+                    continue;
+                }
+                wait = wait < 0 ? left : MIN(wait, left);
+            }
+            fds[n].fd = l->fd;
+            fds[n].events = POLLIN | (l->out_len > 0 ? POLLOUT : 0);
+            polled[n++] = l;
+        }
+        if (n == 0)
+            break;
+        if (completed > 0)
+            wait = 0;
+        if (poll(fds, n, MAX(wait, 0)) > 0)
+            FORONE(i, n){
+                if (fds[i].revents & POLLOUT)
+                    link_flush(client, polled[i]);
+                if (polled[i]->fd != -1 &&
+                    fds[i].revents & (POLLIN | POLLHUP | POLLERR)){
+                    int status = link_read(client, polled[i]);
+
+                    if (status > 0)
+                        completed += status;
+                }
+            }
+        if (completed > 0 || (deadline >= 0 && now_ms() >= deadline))
+            break;
+    }
+    return completed;
+}
+
+/*
+* Name:         mc_wait
+* Argument:     mc_client*, int
+* Return:       int
+* Purpose:      mc_poll() until nothing is in flight or timeout_ms passed.
+* Note:         none
+*/
+int mc_wait(mc_client *client, int timeout_ms){
+    long deadline = timeout_ms >= 0 ? now_ms() + timeout_ms : -1;
+
+    if (client == NULL || client->in_callback)
+        return MC_ERR_ARG;
+    while (client->pending > 0){
+        long left = deadline >= 0 ? deadline - now_ms() : -1;
+
+        if (deadline >= 0 && left <= 0)
+            break;
+        mc_poll(client, (int)left);
+    }
+    return client->pending;
+}
+
+/*
+* Name:         mc_pending
+* Argument:     mc_client*
+* Return:       int
+* Purpose:      Requests queued or in flight.
+* Note:         none
+*/
+int mc_pending(mc_client *client){
+    return client != NULL ? client->pending : 0;
+}
+
+/*
+* Name:         wait_callback
+* Argument:     mc_result*, void*
+* Return:       none
+* Purpose:      Record the result of a blocking call in its waiter.
+* Note:         A GET value is copied, NUL terminated.
+*/
+static void wait_callback(mc_result *result, void *arg){
+    waiter *w = (waiter*)arg;
+
+    w->done = 1;
+    w->status = result->status;
+    if (result->op != MC_OP_GET || result->status != MC_OK)
+        return;
+    w->data = malloc(result->size + 1);
+    if (w->data == NULL){
+        w->status = MC_ERR_NOMEM;
+        return;
+    }
+    memcpy(w->data, result->data, result->size);
+    ((char*)w->data)[result->size] = '\0';
+    w->size = result->size;
+}
+
+/*
+* Name:         wait_for
+* Argument:     mc_client*, waiter*, int
+* Return:       int
+* Purpose:      Wait for the request a blocking call submitted.
+* Note:         status is what submit() returned. Returns the request's
+*               status.
+*/
+static int wait_for(mc_client *c, waiter *w, int status){
+    if (status != MC_OK)
+        return status;
+    while (!w->done)
+        mc_poll(c, -1);
+    return w->status;
+}
+
+/*
+* Name:         mc_set
+* Argument:     mc_client*, const char*, const void*, int
+* Return:       int
+* Purpose:      SET name and wait for the response.
+* Note:         none
+*/
+int mc_set(mc_client *client, const char *name, const void *data, int size){
+    waiter w = {0};
+
+    if (client == NULL || client->in_callback)
+        return MC_ERR_ARG;
+    return wait_for(client, &w, mc_set_async(client, name, data, size,
+                                             wait_callback, &w));
+}
+
+/*
+* Name:         mc_get
+* Argument:     mc_client*, const char*, void**, int*
+* Return:       int
+* Purpose:      GET name and wait for the response.
+* Note:         none
+*/
+int mc_get(mc_client *client, const char *name, void **data, int *size){
+    waiter w = {0};
+    int status;
+
+    if (client == NULL || client->in_callback || data == NULL ||
+        size == NULL)
+        return MC_ERR_ARG;
+    status = wait_for(client, &w, mc_get_async(client, name, wait_callback,
+                                               &w));
+    *data = w.data;
+    *size = w.size;
+    return status;
+}
+
+/*
+* Name:         mc_delete
+* Argument:     mc_client*, const char*
+* Return:       int
+* Purpose:      DELETE name and wait for the response.
+* Note:         none
+*/
+int mc_delete(mc_client *client, const char *name){
+    waiter w = {0};
+
+    if (client == NULL || client->in_callback)
+        return MC_ERR_ARG;
+    return wait_for(client, &w, mc_delete_async(client, name, wait_callback,
+                                                &w));
+}
+
+/*
+* Name:         many_callback
+* Argument:     mc_result*, void*
+* Return:       none
+* Purpose:      Count a result of mc_get_many() and pass it on.
+* Note:         none
+*/
+static void many_callback(mc_result *result, void *arg){
+    many *m = (many*)arg;
+
+    m->remaining--;
+    m->found += result->status == MC_OK;
+    if (m->callback != NULL)
+        m->callback(result, m->arg);
+}
+
+/*
+* Name:         mc_get_many
+* Argument:     mc_client*, int, const char**, mc_callback, void*
+* Return:       int
+* Purpose:      GET the n names pipelined over the pool.
+* Note:         Names already asked are waited for even when a later one
+*               cannot be, their callbacks point at this frame.
+*/
+int mc_get_many(mc_client *client, int n, const char **names,
+                mc_callback callback, void *arg){
+    many m = {callback, arg, 0, 0};
+    int status = MC_OK;
+
+    if (client == NULL || client->in_callback || n < 0 ||
+        (n > 0 && names == NULL))
+        return MC_ERR_ARG;
+    FORONE(i, n){
+        status = submit(client, MC_OP_GET, names[i], NULL, 0, many_callback,
+                        &m, i);
+        if (status != MC_OK)
+            break;
+        m.remaining++;
+    }
+    while (m.remaining > 0)
+        mc_poll(client, -1);
+    return status != MC_OK ? status : m.found;
+}
+
+/*
+* Name:         mc_strerror
+* Argument:     int
+* Return:       const char*
+* Purpose:      Text of an MC_* status.
+* Note:         none
+*/
+const char* mc_strerror(int status){
+    switch (status){
+        case MC_OK:             return "ok";
+        case MC_ERR_NOT_FOUND:  return "not found";
+        case MC_ERR_NO_SPACE:   return "no space left in the table";
+        case MC_ERR_TOO_LARGE:  return "value too large";
+        case MC_ERR_NO_MEMORY:  return "over the server's memory limit";
+        case MC_ERR_READ_ONLY:  return "server is read only";
+        case MC_ERR_SERVER:     return "server error";
+        case MC_ERR_ARG:        return "bad argument";
+        case MC_ERR_IO:         return "connection failed";
+        case MC_ERR_TIMEOUT:    return "timed out";
+        case MC_ERR_PROTOCOL:   return "bad response";
+        case MC_ERR_NOMEM:      return "out of memory";
+        default:                return "unknown status";
+    }
+}
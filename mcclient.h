@@ -0,0 +1,234 @@
+/*
+ *  File:        mcclient.h
+ *  Purpose:     Client library of the memcache protocol: a pool of kept
+ *               alive connections to one server, requests pipelined on
+ *               them and completed through callbacks.
+ *
+ *               mc_client *c = mc_connect("127.0.0.1", 9000, NULL);
+ *               mc_set(c, "name", "value", 5);
+ *               mc_get_async(c, "name", on_value, arg);
+ *               mc_wait(c, -1);                 runs on_value
+ *               mc_close(c);
+ *
+ *  Note:        The server must run with -k, like behind mcproxy: every
+ *               link carries many requests. A client is used by one
+ *               thread at a time, give each thread its own. Names and
+ *               sizes the server would close the connection for are
+ *               refused here with MC_ERR_ARG.
+ */
+
+#ifndef _MCCLIENT_H_
+#define _MCCLIENT_H_
+
+#include <stddef.h>
+
+#define MC_OK               0               /* Done, a GET found its value. */
+#define MC_ERR_NOT_FOUND    -1              /* No such name (GET, DELETE). */
+#define MC_ERR_NO_SPACE     -2              /* ERR NO_SPACE. */
+#define MC_ERR_TOO_LARGE    -3              /* ERR TOO_LARGE. */
+#define MC_ERR_NO_MEMORY    -4              /* ERR NO_MEMORY. */
+#define MC_ERR_READ_ONLY    -5              /* ERR READ_ONLY, a replica. */
+#define MC_ERR_SERVER       -6              /* Any other ERR response. */
+#define MC_ERR_ARG          -7              /* Bad name, size or call. */
+#define MC_ERR_IO           -8              /* Connection failed or closed. */
+#define MC_ERR_TIMEOUT      -9              /* No response in time. */
+#define MC_ERR_PROTOCOL     -10             /* Response does not parse. */
+#define MC_ERR_NOMEM        -11             /* Memory allocation failed. */
+
+#define MC_MAX_NAME         119             /* Longest name accepted. */
+
+#define MC_OP_SET           0
+#define MC_OP_GET           1
+#define MC_OP_DELETE        2
+
+/* Options for mc_connect(), zero is the default for every field. */
+typedef struct mc_options_struct {
+    int links;                              /* Connections in the pool,
+                                               default 1. */
+    int depth;                              /* Requests in flight per link
+                                               before a submit waits,
+                                               default 64. */
+    int timeout_ms;                         /* Longest wait for a response
+                                               before the link is dropped,
+                                               default 5000, -1 never. */
+} mc_options;
+
+/* Outcome of a request, passed to its callback. */
+typedef struct mc_result_struct {
+    int op;                                 /* MC_OP_*. */
+    int status;                             /* MC_OK or MC_ERR_*. */
+    const char *name;                       /* Name of the request. */
+    const void *data;                       /* GET value, valid during the
+                                               callback only. */
+    int size;                               /* Bytes of data. */
+    int index;                              /* Position in mc_get_many(),
+                                               -1 otherwise. */
+} mc_result;
+
+/* Called once per request from mc_poll()/mc_wait() or a blocking call.
+ * It may submit more requests but must not call the blocking functions,
+ * mc_poll() or mc_wait(), those return MC_ERR_ARG from a callback. */
+typedef void (*mc_callback)(mc_result *result, void *arg);
+
+/* A pool of connections to one server. */
+typedef struct mc_client_struct mc_client;
+
+
+/*
+* Name:         mc_connect
+* Argument:     const char*, int, mc_options*
+* Return:       mc_client*
+* Purpose:      Resolve host and open the pool's connections to port.
+* Note:         options may be NULL. Returns NULL if the host does not
+*               resolve, the first connection fails or memory runs out.
+*               Links that close later reconnect on their next request.
+*/
+mc_client* mc_connect(const char *host, int port, mc_options *options);
+
+
+/*
+* Name:         mc_close
+* Argument:     mc_client*
+* Return:       none
+* Purpose:      Close the connections and free the client.
+* Note:         Requests still in flight complete with MC_ERR_IO.
+*/
+void mc_close(mc_client *client);
+
+
+/*
+* Name:         mc_set_async
+* Argument:     mc_client*, const char*, const void*, int, mc_callback,
+*               void*
+* Return:       int
+* Purpose:      Queue a SET of size bytes of data under name, callback
+*               (may be NULL) gets its result.
+* Note:         Returns MC_OK once queued, data may be reused right away.
+*               Sent by the next mc_poll()/mc_wait(). The request goes to
+*               the link with the fewest in flight, when every link has
+*               depth in flight responses are read first (not from a
+*               callback). Returns MC_ERR_ARG, MC_ERR_NOMEM or MC_ERR_IO
+*               without calling callback.
+*/
+int mc_set_async(mc_client *client, const char *name, const void *data,
+                 int size, mc_callback callback, void *arg);
+
+
+/*
+* Name:         mc_get_async
+* Argument:     mc_client*, const char*, mc_callback, void*
+* Return:       int
+* Purpose:      Queue a GET of name.
+* Note:         As mc_set_async(). result->data points into the link's
+*               input, copy it to keep it.
+*/
+int mc_get_async(mc_client *client, const char *name, mc_callback callback,
+                 void *arg);
+
+
+/*
+* Name:         mc_delete_async
+* Argument:     mc_client*, const char*, mc_callback, void*
+* Return:       int
+* Purpose:      Queue a DELETE of name.
+* Note:         As mc_set_async(), MC_ERR_NOT_FOUND when the name was not
+*               there.
+*/
+int mc_delete_async(mc_client *client, const char *name,
+                    mc_callback callback, void *arg);
+
+
+/*
+* Name:         mc_poll
+* Argument:     mc_client*, int
+* Return:       int
+* Purpose:      Send queued requests and complete the responses that
+*               arrive within timeout_ms (0 do not wait, -1 until one
+*               does).
+* Note:         Returns the number of requests completed, or MC_ERR_ARG
+*               from a callback. A link whose oldest request waited
+*               longer than the client's timeout is closed, its requests
+*               complete with MC_ERR_TIMEOUT.
+*/
+int mc_poll(mc_client *client, int timeout_ms);
+
+
+/*
+* Name:         mc_wait
+* Argument:     mc_client*, int
+* Return:       int
+* Purpose:      mc_poll() until no request is in flight, or timeout_ms
+*               passed (-1 no limit).
+* Note:         Returns the number of requests still in flight, or
+*               MC_ERR_ARG from a callback.
+*/
+int mc_wait(mc_client *client, int timeout_ms);
+
+
+/*
+* Name:         mc_pending
+* Argument:     mc_client*
+* Return:       int
+* Purpose:      Requests queued or in flight.
+* Note:         none
+*/
+int mc_pending(mc_client *client);
+
+
+/*
+* Name:         mc_set
+* Argument:     mc_client*, const char*, const void*, int
+* Return:       int
+* Purpose:      SET name and wait for the response.
+* Note:         Returns MC_OK or an MC_ERR_*. Callbacks of other requests
+*               completing meanwhile are run.
+*/
+int mc_set(mc_client *client, const char *name, const void *data, int size);
+
+
+/*
+* Name:         mc_get
+* Argument:     mc_client*, const char*, void**, int*
+* Return:       int
+* Purpose:      GET name and wait for the response.
+* Note:         On MC_OK *data is a malloc()ed copy of *size bytes, with a
+*               NUL after them, free it. Else returns an MC_ERR_*.
+*/
+int mc_get(mc_client *client, const char *name, void **data, int *size);
+
+
+/*
+* Name:         mc_delete
+* Argument:     mc_client*, const char*
+* Return:       int
+* Purpose:      DELETE name and wait for the response.
+* Note:         Returns MC_OK, MC_ERR_NOT_FOUND or an other MC_ERR_*.
+*/
+int mc_delete(mc_client *client, const char *name);
+
+
+/*
+* Name:         mc_get_many
+* Argument:     mc_client*, int, const char**, mc_callback, void*
+* Return:       int
+* Purpose:      GET the n names, pipelined over the pool, and wait for
+*               them.
+* Note:         callback gets each result with result->index set to the
+*               name's position, in the order responses arrive. Returns
+*               the number of names found, or an MC_ERR_* if not every
+*               name could be asked.
+*/
+int mc_get_many(mc_client *client, int n, const char **names,
+                mc_callback callback, void *arg);
+
+
+/*
+* Name:         mc_strerror
+* Argument:     int
+* Return:       const char*
+* Purpose:      Text of an MC_* status.
+* Note:         none
+*/
+const char* mc_strerror(int status);
+
+#endif      /* _MCCLIENT_H_ */
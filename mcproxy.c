@@ -0,0 +1,1617 @@
+/*
+ *  File:        mcproxy.c
+ *  Purpose:     Sharding proxy, spreads the keys of one memcache protocol
+ *               endpoint over several memcache servers.
+ *
+ *               ./mcproxy [-n vnodes] [-c links] [-v max_value] [-k]
+ *                         <port> <host:port> [<host:port> ...]
+ *               Serve clients on port, each name goes to the server
+ *               owning it on a consistent hash ring.
+ *               -n vnodes:     points per server on the ring, default 160.
+ *               -c links:      connections kept open to each server,
+ *                              default 1.
+ *               -v max_value:  largest SET value forwarded, default 1 MB,
+ *                              at most what the servers accept.
+ *               -k:            keep client connections open like
+ *                              memcache -k.
+ *
+ *               ./mcproxy -d count [-n vnodes] <host:port> [...]
+ *               Print how count names spread over the servers and how
+ *               many move when the last server is added.
+ *
+ *               SET, GET and DELETE are forwarded as they are.
+ *               MGET <name> [<name> ...] is split into a GET per name,
+ *               sent to the owning servers, and answered with the GET
+ *               responses in order. MSET and MDELETE are split into a
+ *               batch per owning server and answered with one response,
+ *               each name's line in the order of the body. STATS answers
+ *               with the proxy's own counters.
+ *
+ *  Note:        Servers must run with -k: every link is a persistent
+ *               connection and requests from all clients are pipelined
+ *               on it, each event loop iteration writes what it queued
+ *               in one send() per link. Responses come back in order, a
+ *               queue per link tells which client slot each one fills.
+ *               Requests the servers would refuse while parsing close
+ *               their connection, so the proxy answers those itself.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "utility_macros.h"
+#include "protocol.h"
+
+#define DEFAULT_VNODES      160             /* Ring points per server. */
+#define DEFAULT_MAX_VALUE   (1 << 20)       /* Largest SET forwarded. */
+#define MAX_EVENTS          256             /* epoll_wait() batch. */
+#define MAX_IOV             64              /* Responses per writev(). */
+#define MAX_INFLIGHT        1024            /* Responses owed to a client
+                                               before it is read again. */
+#define INPUT_SLACK         (4 << 20)       /* Unparsed client bytes kept
+                                               beyond one largest SET or
+                                               batch. */
+#define READ_SIZE           65536           /* Bytes per read(). */
+#define RETRY_SECONDS       1.0             /* Wait before reconnecting. */
+#define MAX_TOKENS_PROXY    (MAX_INPUT_SIZE/2)
+
+#define KIND_LISTEN         0
+#define KIND_CLIENT         1
+#define KIND_LINK           2
+
+#define ERR_BACKEND         "ERR BACKEND\r\n"
+
+/* Growable byte buffer, bytes from off to len are unread. */
+typedef struct byte_buffer_struct {
+    char *data;
+    size_t off;
+    size_t len;
+    size_t size;
+} byte_buffer;
+
+/* One response, in the order the client asked. */
+typedef struct part_struct {
+    struct part_struct *next;
+    int done;                       /* data holds the whole response. */
+    char *data;
+    size_t len;
+} part;
+
+/* A client connection. */
+typedef struct client_struct {
+    int kind;                       /* KIND_CLIENT, first for epoll. */
+    int fd;
+    byte_buffer in;
+    part *head, *tail;              /* Responses, sent from head. */
+    size_t head_sent;               /* Bytes of head already sent. */
+    int n_parts;
+    int eof;                        /* Client stopped sending. */
+    int last;                       /* No more requests are parsed. */
+    int closed;                     /* fd closed, waiting for refs. */
+    int refs;                       /* Responses owed by links. */
+    unsigned int events;            /* Registered with epoll. */
+    int dirty;                      /* In the flush list. */
+    struct client_struct *next_dirty;
+} client;
+
+/* An MSET/MDELETE split over servers, answered once every share is. */
+typedef struct gather_struct {
+    part *slot;                     /* The client's response. */
+    int n;                          /* Names in the body. */
+    int waiting;                    /* Shares not answered yet. */
+    char *lines[MAX_BATCH_KEYS];    /* Each name's response line, NULL
+                                       when it could not be kept. */
+} gather;
+
+/* Names of an MSET/MDELETE body, pointing into it. */
+typedef struct split_struct {
+    int n;
+    char names[MAX_BATCH_KEYS][MAX_NAME_SIZE];
+    const char *errors[MAX_BATCH_KEYS];     /* valid_name() response, or
+                                               NULL for a good name. */
+    const char *entries[MAX_BATCH_KEYS];    /* Line and MSET value as 
+                                               sent, line end included. */
+    size_t entry_sizes[MAX_BATCH_KEYS];
+} split;
+
+/* A response a link owes. */
+typedef struct pending_struct {
+    struct pending_struct *next;
+    int cmd;                        /* CMD_* sent. */
+    client *owner;
+    part *slot;                     /* Filled by the response, or NULL
+                                       for a share of a batch. */
+    gather *batch;                  /* Batch the response is a share of. */
+    int *names;                     /* Its names' places in the batch. */
+    int n_names;
+} pending;
+
+/* A persistent connection to a server. */
+typedef struct link_struct {
+    int kind;                       /* KIND_LINK, first for epoll. */
+    int fd;                         /* -1 while down. */
+    int server;
+    int connecting;                 /* Non-blocking connect() running. */
+    double retry_at;                /* Down until then. */
+    byte_buffer out;                /* Requests not sent yet. */
+    byte_buffer in;                 /* Responses not parsed yet. */
+    pending *head, *tail;
+    unsigned int events;
+} backend_link;
+
+/* A server and its links. */
+typedef struct server_struct {
+    char address[256];              /* host:port as given. */
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    backend_link *links;
+    int next_link;                  /* Round robin. */
+    unsigned long requests;
+    unsigned long errors;
+} server;
+
+/* A point of the hash ring. */
+typedef struct vnode_struct {
+    uint64_t hash;
+    int server;
+} vnode;
+
+static server *servers;
+static int n_servers, n_links = 1, keep_alive = 0;
+static long max_value = DEFAULT_MAX_VALUE;
+static size_t input_limit;
+static vnode *ring;
+static int n_ring;
+static int epoll_fd;
+static client *dirty_clients;
+static unsigned long n_requests, n_mget_names, n_batch_names, n_clients;
+static volatile sig_atomic_t is_interrupted = 0;
+
+
+/*
+* Name:         sigint_received
+* Argument:     int
+* Return:       none
+* Purpose:      Set signal flag once received interrupt.
+* Note:         none
+*/
+static void sigint_received(int signum){
+    is_interrupted = 1;
+}
+
+/*
+* Name:         now_seconds
+* Argument:     none
+* Return:       double
+* Purpose:      Monotonic clock in seconds.
+* Note:         none
+*/
+static double now_seconds(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+
+/* ------------------------------------------------------------------ */
+/*  Hash ring.                                                         */
+/* ------------------------------------------------------------------ */
+
+/*
+* Name:         hash_bytes
+* Argument:     const void*, size_t
+* Return:       uint64_t
+* Purpose:      64 bit FNV-1a, finished with the murmur3 mixer so close
+*               names land far apart on the ring.
+* Note:         none
+*/
+static uint64_t hash_bytes(const void *data, size_t length){
+    const unsigned char *p = data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    FORONE(i, (int)length){
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/*
+* Name:         compare_vnode
+* Argument:     const void*, const void*
+* Return:       int
+* Purpose:      qsort() order of ring points.
+* Note:         none
+*/
+static int compare_vnode(const void *a, const void *b){
+    uint64_t x = ((const vnode*)a)->hash, y = ((const vnode*)b)->hash;
+    return (x > y) - (x < y);
+}
+
+/*
+* Name:         ring_build
+* Argument:     int, int
+* Return:       int
+* Purpose:      Place n_vnodes points for each of the first count servers
+*               on the ring.
+* Note:         A point depends only on its server's address, so adding a
+*               server only takes over the arcs its own points start.
+*               Returns 0, or -1 if memory runs out.
+*/
+static int ring_build(int count, int n_vnodes){
+    char point[300];
+
+    free(ring);
+    n_ring = count*n_vnodes;
+    ring = malloc(n_ring*sizeof(vnode));
+    RETURN_ON_VALUE(ring, NULL, "CANNOT ALLOCATE MEMORY.\n", -1);
+    FORONE(i, count)
+        FORONE(j, n_vnodes){
+            int length = snprintf(point, sizeof(point), "%s-%d",
+                                  servers[i].address, j);
+            ring[i*n_vnodes + j].hash = hash_bytes(point, length);
+            ring[i*n_vnodes + j].server = i;
+        }
+    qsort(ring, n_ring, sizeof(vnode), compare_vnode);
+    return 0;
+}
+
+/*
+* Name:         ring_lookup
+* Argument:     const char*, size_t
+* Return:       int
+* Purpose:      Server owning a name: the first point at or after the
+*               name's hash, wrapping around.
+* Note:         none
+*/
+static int ring_lookup(const char *name, size_t length){
+    uint64_t h = hash_bytes(name, length);
+    int low = 0, high = n_ring;
+
+    while (low < high){
+        int middle = low + (high - low)/2;
+        if (ring[middle].hash < h)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return ring[low == n_ring ? 0 : low].server;
+}
+
+/*
+* Name:         ring_report
+* Argument:     int, int
+* Return:       none
+* Purpose:      Print how count names spread over the servers and how
+*               many change server when the last one is added.
+* Note:         none
+*/
+static void ring_report(int count, int n_vnodes){
+    unsigned long *owned = calloc(n_servers, sizeof(unsigned long));
+    int *before = malloc(count*sizeof(int)), moved = 0;
+    char name[32];
+
+    if (owned == NULL || before == NULL){
+        fprintf(stderr, "CANNOT ALLOCATE MEMORY.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (n_servers > 1){
+        ring_build(n_servers - 1, n_vnodes);
+        FORONE(i, count)
+            before[i] = ring_lookup(name, snprintf(name, sizeof(name),
+                                                   "key%d", i));
+    }
+    ring_build(n_servers, n_vnodes);
+    FORONE(i, count){
+        int owner = ring_lookup(name, snprintf(name, sizeof(name),
+                                               "key%d", i));
+        owned[owner]++;
+        if (n_servers > 1 && owner != before[i])
+            moved++;
+    }
+
+    FORONE(i, n_servers)
+        printf("%-24s %8lu names %6.2f%%\n", servers[i].address, owned[i],
+               100.0*owned[i]/count);
+    if (n_servers > 1)
+        printf("adding %s moves %d names (%.2f%%, 1/N is %.2f%%)\n",
+               servers[n_servers - 1].address, moved, 100.0*moved/count,
+               100.0/n_servers);
+    free(owned);
+    free(before);
+}
+
+
+/* ------------------------------------------------------------------ */
+/*  Buffers.                                                           */
+/* ------------------------------------------------------------------ */
+
+/*
+* Name:         buffer_append
+* Argument:     byte_buffer*, const void*, size_t
+* Return:       int
+* Purpose:      Append length bytes.
+* Note:         Read bytes are dropped first when that makes room.
+*               Returns 0, or -1 if memory runs out.
+*/
+static int buffer_append(byte_buffer *b, const void *data, size_t length){
+    if (b->off > 0 && b->len + length > b->size){
+        memmove(b->data, b->data + b->off, b->len - b->off);
+        b->len -= b->off;
+        b->off = 0;
+    }
+    if (b->len + length > b->size){
+        size_t size = MAX(b->size*2, b->len + length);
+        char *larger = realloc(b->data, MAX(size, 4096));
+        if (larger == NULL)
+            return -1;
+        b->data = larger;
+        b->size = MAX(size, 4096);
+    }
+    memcpy(b->data + b->len, data, length);
+    b->len += length;
+    return 0;
+}
+
+/*
+* Name:         buffer_consume
+* Argument:     byte_buffer*, size_t
+* Return:       none
+* Purpose:      Mark length bytes read.
+* Note:         none
+*/
+static void buffer_consume(byte_buffer *b, size_t length){
+    b->off += length;
+    if (b->off == b->len)
+        b->off = b->len = 0;
+}
+
+/*
+* Name:         buffer_read
+* Argument:     byte_buffer*, int
+* Return:       ssize_t
+* Purpose:      read() once from fd into the buffer.
+* Note:         Returns like read(), -1 with ENOMEM if memory runs out.
+*/
+static ssize_t buffer_read(byte_buffer *b, int fd){
+    ssize_t n;
+
+    if (b->size - b->len < READ_SIZE/2){
+        if (buffer_append(b, "", 0) == -1 || b->size - b->len < READ_SIZE/2){
+            char *larger = realloc(b->data, b->len + READ_SIZE);
+            if (larger == NULL){
+                errno = ENOMEM;
+                return -1;
+            }
+            b->data = larger;
+            b->size = b->len + READ_SIZE;
+        }
+    }
+    n = read(fd, b->data + b->len, b->size - b->len);
+    if (n > 0)
+        b->len += n;
+    return n;
+}
+
+
+/* ------------------------------------------------------------------ */
+/*  epoll registration.                                                */
+/* ------------------------------------------------------------------ */
+
+/*
+* Name:         watch
+* Argument:     int, void*, unsigned int*, unsigned int
+* Return:       none
+* Purpose:      Register fd for events, only calling epoll_ctl() when
+*               they change.
+* Note:         *current is the mask registered, 0 for none yet.
+*/
+static void watch(int fd, void *owner, unsigned int *current,
+                  unsigned int events){
+    struct epoll_event event;
+
+    if (*current == events)
+        return;
+    event.events = events;
+    event.data.ptr = owner;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1 &&
+        errno == ENOENT)
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    *current = events;
+}
+
+
+/* ------------------------------------------------------------------ */
+/*  Clients.                                                           */
+/* ------------------------------------------------------------------ */
+
+/*
+* Name:         client_dirty
+* Argument:     client*
+* Return:       none
+* Purpose:      Queue a client for the flush at the end of the iteration.
+* Note:         none
+*/
+static void client_dirty(client *c){
+    if (c->dirty)
+        return;
+    c->dirty = 1;
+    c->next_dirty = dirty_clients;
+    dirty_clients = c;
+}
+
+/*
+* Name:         client_part
+* Argument:     client*
+* Return:       part*
+* Purpose:      Add an empty response slot at the end of the queue.
+* Note:         Returns NULL if memory runs out.
+*/
+static part* client_part(client *c){
+    part *p = calloc(1, sizeof(part));
+
+    if (p == NULL)
+        return NULL;
+    if (c->tail == NULL)
+        c->head = p;
+    else
+        c->tail->next = p;
+    c->tail = p;
+    c->n_parts++;
+    return p;
+}
+
+/*
+* Name:         part_fill
+* Argument:     part*, const char*, size_t
+* Return:       none
+* Purpose:      Complete a response slot with a copy of data.
+* Note:         Out of memory the client gets ERR BACKEND instead.
+*/
+static void part_fill(part *p, const char *data, size_t length){
+    p->data = malloc(length);
+    if (p->data == NULL){
+        data = ERR_BACKEND;
+        length = strlen(ERR_BACKEND);
+        p->data = strdup(ERR_BACKEND);
+    }
+    if (p->data != NULL)
+        memcpy(p->data, data, length);
+    p->len = p->data != NULL ? length : 0;
+    p->done = 1;
+}
+
+/*
+* Name:         client_reply
+* Argument:     client*, const char*
+* Return:       none
+* Purpose:      Queue a response made by the proxy itself.
+* Note:         none
+*/
+static void client_reply(client *c, const char *message){
+    part *p = client_part(c);
+
+    if (p != NULL)
+        part_fill(p, message, strlen(message));
+    client_dirty(c);
+}
+
+/*
+* Name:         client_free
+* Argument:     client*
+* Return:       none
+* Purpose:      Free a closed client once no link owes it a response.
+* Note:         none
+*/
+static void client_free(client *c){
+    while (c->head != NULL){
+        part *p = c->head;
+        c->head = p->next;
+        free(p->data);
+        free(p);
+    }
+    c->tail = NULL;
+    if (c->refs > 0 || c->dirty)
+        return;
+    free(c->in.data);
+    free(c);
+}
+
+/*
+* Name:         client_close
+* Argument:     client*
+* Return:       none
+* Purpose:      Close a client, responses still owed are dropped.
+* Note:         none
+*/
+static void client_close(client *c){
+    if (c->closed)
+        return;
+    close(c->fd);
+    c->closed = 1;
+    client_free(c);
+}
+
+
+/* ------------------------------------------------------------------ */
+/*  Links.                                                             */
+/* ------------------------------------------------------------------ */
+
+/*
+* Name:         gather_finish
+* Argument:     gather*, client*
+* Return:       none
+* Purpose:      Answer a batch whose shares all came back: "OK <size>"
+*               and each name's line in order, then free it.
+* Note:         A closed client gets nothing, its slot is already freed.
+*/
+static void gather_finish(gather *g, client *owner){
+    char header[RESPONSE_HEADER_SIZE];
+    size_t length = 0, header_len;
+    part *p = g->slot;
+
+    FORONE(i, g->n)
+        length += g->lines[i] != NULL ? strlen(g->lines[i])
+                                      : strlen(ERR_BACKEND);
+    if (!owner->closed){
+        header_len = snprintf(header, sizeof(header), "OK %zu\r\n", length);
+        p->data = malloc(header_len + length);
+        if (p->data != NULL){
+            memcpy(p->data, header, header_len);
+            p->len = header_len;
+            FORONE(i, g->n){
+                const char *line = g->lines[i] != NULL ? g->lines[i]
+                                                       : ERR_BACKEND;
+                memcpy(p->data + p->len, line, strlen(line));
+                p->len += strlen(line);
+            }
+        }
+        else
+            part_fill(p, ERR_BACKEND, strlen(ERR_BACKEND));
+        p->done = 1;
+        client_dirty(owner);
+    }
+    FORONE(i, g->n)
+        free(g->lines[i]);
+    free(g);
+}
+
+/*
+* Name:         gather_line
+* Argument:     gather*, int, const char*, size_t
+* Return:       none
+* Purpose:      Keep a copy of the response line of the batch's name i.
+* Note:         Out of memory the name gets ERR BACKEND.
+*/
+static void gather_line(gather *g, int i, const char *line, size_t length){
+    g->lines[i] = malloc(length + 1);
+    if (g->lines[i] == NULL)
+        return;
+    memcpy(g->lines[i], line, length);
+    g->lines[i][length] = '\0';
+}
+
+/*
+* Name:         gather_fill
+* Argument:     pending*, const char*, size_t
+* Return:       none
+* Purpose:      Hand each name of a share its line of the server's
+*               response, and answer the batch after its last share.
+* Note:         A response other than "OK <size>" (ERR BACKEND from a
+*               lost link, ERR BAD_BATCH) is every name's line.
+*/
+static void gather_fill(pending *p, const char *data, size_t length){
+    const char *at = data, *end = data + length;
+    int ok = length > 3 && strncmp(data, "OK ", 3) == 0;
+    gather *g = p->batch;
+
+    if (ok)
+        at = (const char*)memchr(data, '\n', length) + 1;
+    FORONE(i, p->n_names){
+        const char *line = data, *line_end;
+        size_t line_len = length;
+
+        if (ok){
+            line_end = at < end ? memchr(at, '\n', end - at) : NULL;
+            line = line_end != NULL ? at : ERR_BACKEND;
+            line_len = line_end != NULL ? (size_t)(line_end - at + 1)
+                                        : strlen(ERR_BACKEND);
+            if (line_end != NULL)
+                at = line_end + 1;
+        }
+        gather_line(g, p->names[i], line, line_len);
+    }
+    if (--g->waiting == 0)
+        gather_finish(g, p->owner);
+}
+
+/*
+* Name:         pending_done
+* Argument:     pending*, const char*, size_t
+* Return:       none
+* Purpose:      Complete a response a link owed with data and free it.
+* Note:         none
+*/
+static void pending_done(pending *p, const char *data, size_t length){
+    client *owner = p->owner;
+
+    owner->refs--;
+    if (p->batch != NULL)
+        gather_fill(p, data, length);
+    else if (!owner->closed){
+        part_fill(p->slot, data, length);
+        client_dirty(owner);
+    }
+    if (owner->closed)
+        client_free(owner);
+    free(p->names);
+    free(p);
+}
+
+/*
+* Name:         link_fail
+* Argument:     backend_link*
+* Return:       none
+* Purpose:      Drop a broken link, every response it owes becomes
+*               ERR BACKEND, and retry it later.
+* Note:         none
+*/
+static void link_fail(backend_link *l){
+    server *s = &servers[l->server];
+
+    if (l->fd != -1){
+        fprintf(stderr, "Lost %s.\n", s->address);
+        close(l->fd);
+    }
+    l->fd = -1;
+    l->connecting = 0;
+    l->events = 0;
+    l->retry_at = now_seconds() + RETRY_SECONDS;
+    l->out.off = l->out.len = 0;
+    l->in.off = l->in.len = 0;
+    while (l->head != NULL){
+        pending *p = l->head;
+        l->head = p->next;
+        s->errors++;
+        pending_done(p, ERR_BACKEND, strlen(ERR_BACKEND));
+    }
+    l->tail = NULL;
+}
+
+/*
+* Name:         link_connect
+* Argument:     backend_link*
+* Return:       int
+* Purpose:      Start a non-blocking connect() to the link's server.
+* Note:         Returns 0 when started, -1 while the server is down.
+*/
+static int link_connect(backend_link *l){
+    server *s = &servers[l->server];
+    int one = 1;
+
+    if (now_seconds() < l->retry_at)
+        return -1;
+    l->fd = socket(s->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK |
+                   SOCK_CLOEXEC, 0);
+    if (l->fd == -1){
+        l->retry_at = now_seconds() + RETRY_SECONDS;
+        return -1;
+    }
+    setsockopt(l->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(l->fd, (struct sockaddr*)&s->addr, s->addr_len) == -1 &&
+        errno != EINPROGRESS){
+        close(l->fd);
+        l->fd = -1;
+        l->retry_at = now_seconds() + RETRY_SECONDS;
+        return -1;
+    }
+    l->connecting = 1;
+    l->events = 0;
+    watch(l->fd, l, &l->events, EPOLLIN | EPOLLOUT);
+    return 0;
+}
+
+/*
+* Name:         link_pick
+* Argument:     int
+* Return:       backend_link*
+* Purpose:      Next link of a server, connecting it if needed.
+* Note:         Returns NULL while the server is down.
+*/
+static backend_link* link_pick(int index){
+    server *s = &servers[index];
+
+    FORONE(i, n_links){
+        backend_link *l = &s->links[s->next_link];
+        s->next_link = (s->next_link + 1) % n_links;
+        if (l->fd != -1 || link_connect(l) == 0)
+            return l;
+    }
+    return NULL;
+}
+
+/*
+* Name:         queue_request
+* Argument:     pending*, int, const char*, size_t, const char*, size_t
+* Return:       int
+* Purpose:      Queue a request on a link of server index, its response
+*               completes p.
+* Note:         The request is head followed by body (may be empty). A
+*               down server answers ERR BACKEND at once. Returns 0, or -1
+*               if memory runs out, p is then answered ERR BACKEND.
+*/
+static int queue_request(pending *p, int index, const char *head,
+                         size_t head_len, const char *body, size_t body_len){
+    backend_link *l;
+
+    p->owner->refs++;
+    servers[index].requests++;
+    l = link_pick(index);
+    if (l == NULL){
+        servers[index].errors++;
+        pending_done(p, ERR_BACKEND, strlen(ERR_BACKEND));
+        return 0;
+    }
+    if (buffer_append(&l->out, head, head_len) == -1 ||
+        buffer_append(&l->out, body, body_len) == -1){
+        pending_done(p, ERR_BACKEND, strlen(ERR_BACKEND));
+        return -1;
+    }
+    if (l->tail == NULL)
+        l->head = p;
+    else
+        l->tail->next = p;
+    l->tail = p;
+    return 0;
+}
+
+/*
+* Name:         forward
+* Argument:     client*, int, const char*, size_t, const char*, size_t,
+*               const char*, size_t
+* Return:       int
+* Purpose:      Queue a request on a link of the server owning name,
+*               its response fills a new slot of the client.
+* Note:         Same as queue_request(). Returns 0, or -1 if memory runs
+*               out.
+*/
+static int forward(client *c, int cmd, const char *name, size_t name_len,
+                   const char *head, size_t head_len, const char *body,
+                   size_t body_len){
+    part *slot = client_part(c);
+    pending *p = calloc(1, sizeof(pending));
+
+    if (slot == NULL || p == NULL){
+        free(p);
+        return -1;
+    }
+    p->cmd = cmd;
+    p->owner = c;
+    p->slot = slot;
+    return queue_request(p, ring_lookup(name, name_len), head, head_len,
+                         body, body_len);
+}
+
+/*
+* Name:         link_parse
+* Argument:     backend_link*
+* Return:       int
+* Purpose:      Hand every complete response received to its client.
+* Note:         The "OK <size>" of a GET or a batch is followed by size
+*               bytes, the rest of the responses are one line. Returns 0,
+*               or -1 when the server sent something unexpected.
+*/
+static int link_parse(backend_link *l){
+    while (l->head != NULL && l->in.len > l->in.off){
+        char *start = l->in.data + l->in.off, *line_end;
+        size_t available = l->in.len - l->in.off, need;
+        pending *p = l->head;
+
+        line_end = memchr(start, '\n', available);
+        if (line_end == NULL)
+            return available > MAX_INPUT_SIZE ? -1 : 0;
+        need = line_end - start + 1;
+        if ((p->cmd == CMD_GET || p->batch != NULL) &&
+            strncmp(start, "OK ", 3) == 0){
+            char *end;
+            long size = strtol(start + 3, &end, 10);
+            if (size < 0 || (*end != '\r' && *end != '\n'))
+                return -1;
+            need += size;
+        }
+        if (available < need)
+            return 0;
+
+        l->head = p->next;
+        if (l->head == NULL)
+            l->tail = NULL;
+        pending_done(p, start, need);
+        buffer_consume(&l->in, need);
+    }
+    /* Nothing is owed, anything else is a protocol error. */
+    return l->in.len > l->in.off ? -1 : 0;
+}
+
+/*
+* Name:         link_event
+* Argument:     backend_link*, unsigned int
+* Return:       none
+* Purpose:      Finish a connect(), read responses or send requests.
+* Note:         none
+*/
+static void link_event(backend_link *l, unsigned int events){
+    if (l->connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))){
+        int error = 0;
+        socklen_t length = sizeof(error);
+
+        getsockopt(l->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0){
+            fprintf(stderr, "Cannot connect to %s.\n",
+                    servers[l->server].address);
+            link_fail(l);
+            return;
+        }
+        l->connecting = 0;
+    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+        while (1){
+            ssize_t n = buffer_read(&l->in, l->fd);
+            if (n > 0)
+                continue;
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1 && errno == EAGAIN)
+                break;
+            /* Closed, even a server without -k answers first. */
+            link_parse(l);
+            link_fail(l);
+            return;
+        }
+        if (link_parse(l) == -1){
+            fprintf(stderr, "Bad response from %s.\n",
+                    servers[l->server].address);
+            link_fail(l);
+        }
+    }
+}
+
+/*
+* Name:         link_flush
+* Argument:     backend_link*
+* Return:       none
+* Purpose:      Send what was queued on a link, usually many requests in
+*               one send().
+* Note:         Waits for EPOLLOUT when the socket is full.
+*/
+static void link_flush(backend_link *l){
+    if (l->fd == -1 || l->connecting)
+        return;
+    while (l->out.len > l->out.off){
+        ssize_t n = send(l->fd, l->out.data + l->out.off,
+                         l->out.len - l->out.off, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && errno == EAGAIN)
+            break;
+        if (n == -1){
+            link_fail(l);
+            return;
+        }
+        buffer_consume(&l->out, n);
+    }
+    watch(l->fd, l, &l->events,
+          EPOLLIN | (l->out.len > l->out.off ? EPOLLOUT : 0));
+}
+
+
+/* ------------------------------------------------------------------ */
+/*  Requests.                                                          */
+/* ------------------------------------------------------------------ */
+
+/*
+* Name:         valid_name
+* Argument:     const char*
+* Return:       const char*
+* Purpose:      Check a name the way the servers do.
+* Note:         Returns NULL if valid, else the error response.
+*/
+static const char* valid_name(const char *name){
+    if (strlen(name) >= MAX_NAME_SIZE)
+        return "ERR NAME_TOO_LONG\r\n";
+    for (const char *p = name; *p != '\0'; p++)
+        if (!isalnum((unsigned char)*p))
+            return "ERR BAD_NAME\r\n";
+    return NULL;
+}
+
+/*
+* Name:         split_batch
+* Argument:     int, const char*, size_t, split*
+* Return:       int
+* Purpose:      Parse an MSET/MDELETE body the way the servers do.
+* Note:         Returns the number of names, or -1 when the body does not
+*               parse (ERR BAD_BATCH). Each entry keeps where it is in 
+*               body.
+*/
+static int split_batch(int cmd, const char *body, size_t size, split *b){
+    char line[MAX_INPUT_SIZE], *tokens[3], *save;
+    size_t at = 0, line_size, next;
+    int n_tokens, want = cmd == CMD_MSET ? 2 : 1;
+
+    b->n = 0;
+    while (at < size){
+        const char *line_end;
+
+        if (b->n == MAX_BATCH_KEYS)
+            return -1;
+
+        /* The last MDELETE name may end with the body. */
+        line_end = memchr(body + at, '\n', size - at);
+        if (line_end == NULL && cmd == CMD_MSET)
+            return -1;
+        line_size = line_end != NULL ? (size_t)(line_end - (body + at))
+                                     : size - at;
+        next = at + line_size + (line_end != NULL);
+        if (line_size > 0 && body[at + line_size - 1] == '\r')
+            line_size--;
+        if (line_size == 0 || line_size >= MAX_INPUT_SIZE)
+            return -1;
+        memcpy(line, body + at, line_size);
+        line[line_size] = '\0';
+
+        n_tokens = 0;
+        for (char *t = strtok_r(line, " \t", &save);
+             t != NULL && n_tokens <= want; t = strtok_r(NULL, " \t", &save))
+            tokens[n_tokens++] = t;
+        if (n_tokens != want)
+            return -1;
+
+        b->errors[b->n] = valid_name(tokens[0]);
+        b->names[b->n][0] = '\0';
+        if (b->errors[b->n] == NULL)
+            strcpy(b->names[b->n], tokens[0]);
+
+        if (cmd == CMD_MSET){
+            char *end;
+            long value_size;
+
+            errno = 0;
+            value_size = strtol(tokens[1], &end, 10);
+            if (!isdigit((unsigned char)tokens[1][0]) || *end != '\0' ||
+                errno != 0 || value_size < 1 ||
+                (size_t)value_size > size - next)
+                return -1;
+            next += value_size;
+        }
+        b->entries[b->n] = body + at;
+        b->entry_sizes[b->n] = next - at;
+        b->n++;
+        at = next;
+    }
+    return b->n;
+}
+
+/*
+* Name:         batch_share
+* Argument:     client*, int, split*, int, gather*
+* Return:       int
+* Purpose:      Send server index an MSET/MDELETE of the batch's good
+*               names it owns.
+* Note:         Entries are copied as the client sent them, line ends 
+*               included, so a share is never larger than the body. The 
+*               last MDELETE line of the body may lack its end, it is last
+*               in its share too. Returns 0, or -1 if memory runs out.
+*/
+static int batch_share(client *c, int cmd, split *b, int index, gather *g){
+    size_t body_len = 0, length;
+    pending *p = calloc(1, sizeof(pending));
+    int *owners = NULL, n = 0, head_len, status;
+    char *request, head[RESPONSE_HEADER_SIZE];
+
+    FORONE(i, b->n){
+        if (b->errors[i] != NULL || ring_lookup(b->names[i],
+                                                strlen(b->names[i])) != index)
+            continue;
+        body_len += b->entry_sizes[i];
+        n++;
+    }
+    if (n == 0){
+        free(p);
+        return 0;
+    }
+    owners = malloc(n*sizeof(int));
+    request = malloc(RESPONSE_HEADER_SIZE + body_len);
+    if (p == NULL || owners == NULL || request == NULL){
+        free(p);
+        free(owners);
+        free(request);
+        return -1;
+    }
+
+    /* The request line goes right before the body. */
+    length = RESPONSE_HEADER_SIZE;
+    n = 0;
+    FORONE(i, b->n){
+        if (b->errors[i] != NULL || ring_lookup(b->names[i],
+                                                strlen(b->names[i])) != index)
+            continue;
+        owners[n++] = i;
+        memcpy(request + length, b->entries[i], b->entry_sizes[i]);
+        length += b->entry_sizes[i];
+    }
+    head_len = snprintf(head, sizeof(head), "%s %zu\r\n",
+                        cmd == CMD_MSET ? "MSET" : "MDELETE", body_len);
+    memcpy(request + RESPONSE_HEADER_SIZE - head_len, head, head_len);
+
+    p->cmd = cmd;
+    p->owner = c;
+    p->batch = g;
+    p->names = owners;
+    p->n_names = n;
+    g->waiting++;
+    status = queue_request(p, index, request + RESPONSE_HEADER_SIZE - head_len,
+                           head_len + body_len, NULL, 0);
+    free(request);
+    return status;
+}
+
+/*
+* Name:         batch_request
+* Argument:     client*, int, const char*, size_t
+* Return:       int
+* Purpose:      Split an MSET/MDELETE body over the servers owning its
+*               names, answered once every share is.
+* Note:         Bad names are answered by the proxy in their place of the
+*               response. Returns 0, or -1 if memory runs out.
+*/
+static int batch_request(client *c, int cmd, const char *body, size_t size){
+    split *b = malloc(sizeof(split));
+    gather *g = calloc(1, sizeof(gather));
+    int status = 0;
+
+    if (b == NULL || g == NULL || (g->slot = client_part(c)) == NULL){
+        free(b);
+        free(g);
+        return -1;
+    }
+    if (split_batch(cmd, body, size, b) == -1){
+        part_fill(g->slot, "ERR BAD_BATCH\r\n", strlen("ERR BAD_BATCH\r\n"));
+        client_dirty(c);
+        free(b);
+        free(g);
+        return 0;
+    }
+    n_batch_names += b->n;
+    g->n = b->n;
+    FORONE(i, b->n)
+        if (b->errors[i] != NULL)
+            gather_line(g, i, b->errors[i], strlen(b->errors[i]));
+
+    /* Held until every share is queued, one may be answered at once. */
+    g->waiting = 1;
+    FORONE(i, n_servers)
+        if (status == 0)
+            status = batch_share(c, cmd, b, i, g);
+    if (--g->waiting == 0)
+        gather_finish(g, c);
+    free(b);
+    return status;
+}
+
+/*
+* Name:         stats_reply
+* Argument:     client*
+* Return:       none
+* Purpose:      Answer STATS with the proxy's counters.
+* Note:         Same format as the servers' STATS.
+*/
+static void stats_reply(client *c){
+    char body[MAX_STATS_SIZE], header[RESPONSE_HEADER_SIZE];
+    int length = 0, header_len;
+    part *p;
+
+    length += snprintf(body + length, sizeof(body) - length,
+                       "STAT clients %lu\r\nSTAT requests %lu\r\n"
+                       "STAT mget_names %lu\r\nSTAT batch_names %lu\r\n"
+                       "STAT servers %d\r\n", n_clients, n_requests,
+                       n_mget_names, n_batch_names, n_servers);
+    FORONE(i, n_servers){
+        int up = 0;
+        FORONE(j, n_links)
+            up += servers[i].links[j].fd != -1;
+        if (length < (int)sizeof(body))
+            length += snprintf(body + length, sizeof(body) - length,
+                               "STAT server_%d %s requests %lu errors %lu "
+                               "links %d\r\n", i, servers[i].address,
+                               servers[i].requests, servers[i].errors, up);
+    }
+    length = MIN(length, (int)sizeof(body) - 1);
+
+    p = client_part(c);
+    if (p == NULL)
+        return;
+    header_len = snprintf(header, sizeof(header), "OK %d\r\n", length);
+    p->data = malloc(header_len + length);
+    if (p->data != NULL){
+        memcpy(p->data, header, header_len);
+        memcpy(p->data + header_len, body, length);
+        p->len = header_len + length;
+    }
+    p->done = 1;
+    client_dirty(c);
+}
+
+/*
+* Name:         client_request
+* Argument:     client*
+* Return:       size_t
+* Purpose:      Route the request at the start of the client's input.
+* Note:         Returns the bytes it used, 0 to wait for more, or
+*               (size_t)-1 if memory runs out. Errors the servers would
+*               close on are answered here and stop the client.
+*/
+static size_t client_request(client *c){
+    char *start = c->in.data + c->in.off, *line_end, *save;
+    char line[MAX_INPUT_SIZE], *tokens[MAX_TOKENS_PROXY];
+    size_t available = c->in.len - c->in.off, header_len, line_len;
+    const char *error = NULL;
+    int n_tokens = 0;
+
+    line_end = memchr(start, '\n', available);
+    if (line_end == NULL){
+        if (available < MAX_INPUT_SIZE && !c->eof)
+            return 0;
+        client_reply(c, "ERR INVALID_COMMAND\r\n");
+        c->last = 1;
+        return available;
+    }
+    header_len = line_end - start + 1;
+    line_len = header_len - 1;
+    if (line_len > 0 && start[line_len - 1] == '\r')
+        line_len--;
+    if (line_len >= MAX_INPUT_SIZE){
+        client_reply(c, "ERR INVALID_COMMAND\r\n");
+        c->last = 1;
+        return available;
+    }
+    memcpy(line, start, line_len);
+    line[line_len] = '\0';
+    for (char *t = strtok_r(line, " \t", &save);
+         t != NULL && n_tokens < MAX_TOKENS_PROXY;
+         t = strtok_r(NULL, " \t", &save))
+        tokens[n_tokens++] = t;
+
+    if (n_tokens == 0)
+        error = "ERR INVALID_COMMAND\r\n";
+    else if (strcmp(tokens[0], "STATS") == 0 && n_tokens == 1){
+        n_requests++;
+        stats_reply(c);
+        return header_len;
+    }
+    else if (strcmp(tokens[0], "MGET") == 0 && n_tokens >= 2){
+        char get[MAX_INPUT_SIZE];
+
+        FORTWO(i, n_tokens, 1)
+            if ((error = valid_name(tokens[i])) != NULL)
+                break;
+        if (error == NULL){
+            n_requests++;
+            n_mget_names += n_tokens - 1;
+            FORTWO(i, n_tokens, 1){
+                int length = snprintf(get, sizeof(get), "GET %s\r\n",
+                                      tokens[i]);
+                if (forward(c, CMD_GET, tokens[i], strlen(tokens[i]), get,
+                            length, NULL, 0) == -1)
+                    return (size_t)-1;
+            }
+            return header_len;
+        }
+    }
+    else if ((strcmp(tokens[0], "MSET") == 0 ||
+              strcmp(tokens[0], "MDELETE") == 0) && n_tokens == 2){
+        int cmd = tokens[0][1] == 'S' ? CMD_MSET : CMD_MDELETE;
+        char *end;
+        long size;
+
+        errno = 0;
+        size = strtol(tokens[1], &end, 10);
+        if (!isdigit((unsigned char)tokens[1][0]) || *end != '\0' ||
+            errno != 0 || size < 1 || size > MAX_BATCH_SIZE)
+            error = "ERR INVALID_SIZE\r\n";
+        else if (available - header_len < (size_t)size){
+            if (!c->eof)
+                return 0;
+            error = "ERR TOO_SMALL\r\n";
+        }
+        else{
+            n_requests++;
+            if (batch_request(c, cmd, start + header_len, size) == -1)
+                return (size_t)-1;
+            return header_len + size;
+        }
+    }
+    else if ((strcmp(tokens[0], "GET") == 0 ||
+              strcmp(tokens[0], "DELETE") == 0) && n_tokens == 2){
+        error = valid_name(tokens[1]);
+        if (error == NULL){
+            n_requests++;
+            if (forward(c, tokens[0][0] == 'G' ? CMD_GET : CMD_DELETE,
+                        tokens[1], strlen(tokens[1]), start, header_len,
+                        NULL, 0) == -1)
+                return (size_t)-1;
+            return header_len;
+        }
+    }
+    else if (strcmp(tokens[0], "SET") == 0 && n_tokens == 3){
+        char *end;
+        long size;
+
+        error = valid_name(tokens[1]);
+        if (error == NULL){
+            errno = 0;
+            size = strtol(tokens[2], &end, 10);
+            if (!isdigit((unsigned char)tokens[2][0]) || *end != '\0' ||
+                errno != 0 || size < 1 || size > max_value)
+                error = "ERR INVALID_SIZE\r\n";
+            else if (available - header_len < (size_t)size){
+                if (!c->eof)
+                    return 0;
+                error = "ERR TOO_SMALL\r\n";
+            }
+            else{
+                n_requests++;
+                if (forward(c, CMD_SET, tokens[1], strlen(tokens[1]), start,
+                            header_len, start + header_len, size) == -1)
+                    return (size_t)-1;
+                return header_len + size;
+            }
+        }
+    }
+    else
+        error = "ERR INVALID_COMMAND\r\n";
+
+    client_reply(c, error != NULL ? error : "ERR INVALID_COMMAND\r\n");
+    c->last = 1;
+    return available;
+}
+
+/*
+* Name:         client_parse
+* Argument:     client*
+* Return:       none
+* Purpose:      Route every complete request of the client's input.
+* Note:         Stops after one request unless -k, and while too many
+*               responses are owed to the client.
+*/
+static void client_parse(client *c){
+    while (!c->last && !c->closed && c->n_parts < MAX_INFLIGHT &&
+           c->in.len > c->in.off){
+        size_t used = client_request(c);
+
+        if (used == (size_t)-1){
+            fprintf(stderr, "CANNOT ALLOCATE MEMORY, closing a client.\n");
+            client_close(c);
+            return;
+        }
+        if (used == 0)
+            break;
+        buffer_consume(&c->in, used);
+        if (!keep_alive)
+            c->last = 1;
+    }
+}
+
+/*
+* Name:         client_flush
+* Argument:     client*
+* Return:       none
+* Purpose:      Send the completed responses at the head of the queue,
+*               several per writev(), then parse what was held back or
+*               close when done.
+* Note:         none
+*/
+static void client_flush(client *c){
+    struct iovec iov[MAX_IOV];
+
+    while (!c->closed){
+        int n_iov = 0;
+        ssize_t n;
+
+        for (part *p = c->head; p != NULL && p->done && n_iov < MAX_IOV;
+             p = p->next){
+            iov[n_iov].iov_base = p->data + (n_iov == 0 ? c->head_sent : 0);
+            iov[n_iov].iov_len = p->len - (n_iov == 0 ? c->head_sent : 0);
+            n_iov++;
+        }
+        if (n_iov == 0)
+            break;
+        n = writev(c->fd, iov, n_iov);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && errno == EAGAIN)
+            break;
+        if (n == -1){
+            client_close(c);
+            return;
+        }
+        while (n > 0 || (c->head != NULL && c->head->done &&
+                         c->head_sent == c->head->len)){
+            part *p = c->head;
+            size_t left = p->len - c->head_sent;
+            if ((size_t)n < left){
+                c->head_sent += n;
+                break;
+            }
+            n -= left;
+            c->head = p->next;
+            if (c->head == NULL)
+                c->tail = NULL;
+            c->head_sent = 0;
+            c->n_parts--;
+            free(p->data);
+            free(p);
+        }
+        if (c->n_parts < MAX_INFLIGHT)
+            client_parse(c);
+    }
+    if (c->closed)
+        return;
+
+    /* Done once everything asked for is answered. */
+    if (c->head == NULL && (c->last || (c->eof && c->in.len == c->in.off))){
+        client_close(c);
+        return;
+    }
+    watch(c->fd, c, &c->events,
+          (c->eof || c->last || c->n_parts >= MAX_INFLIGHT ||
+           c->in.len - c->in.off >= input_limit ? 0 : EPOLLIN) |
+          (c->head != NULL && c->head->done ? EPOLLOUT : 0));
+}
+
+/*
+* Name:         client_event
+* Argument:     client*, unsigned int
+* Return:       none
+* Purpose:      Read what a client sent and route its requests.
+* Note:         Reading stops at input_limit unparsed bytes, enough for
+*               the largest SET, until responses drain.
+*/
+static void client_event(client *c, unsigned int events){
+    if (events & (EPOLLERR | EPOLLHUP)){
+        client_close(c);
+        return;
+    }
+    while (!c->eof && c->in.len - c->in.off < input_limit){
+        ssize_t n = buffer_read(&c->in, c->fd);
+        if (n > 0)
+            continue;
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && errno == EAGAIN)
+            break;
+        if (n == -1){
+            client_close(c);
+            return;
+        }
+        c->eof = 1;
+    }
+    client_parse(c);
+    client_dirty(c);
+}
+
+/*
+* Name:         accept_clients
+* Argument:     int
+* Return:       none
+* Purpose:      Accept every pending client.
+* Note:         none
+*/
+static void accept_clients(int listen_fd){
+    while (1){
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        client *c;
+
+        if (fd == -1){
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;
+        }
+        c = calloc(1, sizeof(client));
+        if (c == NULL){
+            close(fd);
+            continue;
+        }
+        c->kind = KIND_CLIENT;
+        c->fd = fd;
+        n_clients++;
+        watch(fd, c, &c->events, EPOLLIN);
+    }
+}
+
+
+/* ------------------------------------------------------------------ */
+/*  Main.                                                              */
+/* ------------------------------------------------------------------ */
+
+/*
+* Name:         usage
+* Argument:     char*
+* Return:       none
+* Purpose:      Print usage and exit.
+* Note:         none
+*/
+static void usage(char *program){
+    fprintf(stderr, "Usage: %s [-n vnodes] [-c links] [-v max_value] [-k] "
+            "<port> <host:port> [<host:port> ...]\n"
+            "       %s -d count [-n vnodes] <host:port> [...]\n",
+            program, program);
+    exit(EXIT_FAILURE);
+}
+
+/*
+* Name:         add_server
+* Argument:     server*, const char*
+* Return:       int
+* Purpose:      Resolve host:port for a server.
+* Note:         Returns 0, or -1 if it cannot be resolved.
+*/
+static int add_server(server *s, const char *address){
+    struct addrinfo hints = {0}, *result;
+    char host[256];
+    int port;
+
+    if (sscanf(address, "%255[^:]:%d", host, &port) != 2 || port < 0 ||
+        port > 65535)
+        return -1;
+    snprintf(s->address, sizeof(s->address), "%s", address);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, strchr(address, ':') + 1, &hints, &result) != 0)
+        return -1;
+    memcpy(&s->addr, result->ai_addr, result->ai_addrlen);
+    s->addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+
+int main(int argc, char **argv){
+    int option, n_vnodes = DEFAULT_VNODES, report = 0, port, listen_fd;
+    int reuse = 1;
+    struct epoll_event events[MAX_EVENTS];
+    struct sockaddr_in address;
+    struct sigaction action;
+    unsigned int listen_events = 0;
+
+    while ((option = getopt(argc, argv, "n:c:v:kd:")) != -1){
+        switch (option){
+            case 'n': n_vnodes = atoi(optarg);  break;
+            case 'c': n_links = atoi(optarg);   break;
+            case 'v': max_value = atol(optarg); break;
+            case 'k': keep_alive = 1;           break;
+            case 'd': report = atoi(optarg);    break;
+            default:  usage(argv[0]);
+        }
+    }
+    if (n_vnodes < 1 || n_links < 1 || max_value < 1 || report < 0 ||
+        argc - optind < (report ? 1 : 2))
+        usage(argv[0]);
+
+    if (!report)
+        port = atoi(argv[optind++]);
+    n_servers = argc - optind;
+    servers = calloc(n_servers, sizeof(server));
+    EXIT_ON_VALUE(servers, NULL, "CANNOT ALLOCATE MEMORY, EXIT.\n",
+                  EXIT_FAILURE);
+    FORONE(i, n_servers){
+        if (add_server(&servers[i], argv[optind + i]) == -1){
+            fprintf(stderr, "BAD SERVER ADDRESS %s, EXIT.\n",
+                    argv[optind + i]);
+            exit(EXIT_FAILURE);
+        }
+        servers[i].links = calloc(n_links, sizeof(backend_link));
+        EXIT_ON_VALUE(servers[i].links, NULL,
+                      "CANNOT ALLOCATE MEMORY, EXIT.\n", EXIT_FAILURE);
+        FORONE(j, n_links){
+            servers[i].links[j].kind = KIND_LINK;
+            servers[i].links[j].fd = -1;
+            servers[i].links[j].server = i;
+        }
+    }
+    if (report){
+        ring_report(report, n_vnodes);
+        return EXIT_SUCCESS;
+    }
+    input_limit = MAX(max_value, MAX_BATCH_SIZE) + MAX_INPUT_SIZE + INPUT_SLACK;
+    EXIT_ON_VALUE(ring_build(n_servers, n_vnodes), -1,
+                  "CANNOT BUILD HASH RING, EXIT.\n", EXIT_FAILURE);
+
+    action.sa_handler = sigint_received;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    EXIT_ON_VALUE(listen_fd, -1, "SOCKET CREATION FAILED, EXIT.\n",
+                  EXIT_FAILURE);
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    EXIT_ON_VALUE(bind(listen_fd, (struct sockaddr*)&address,
+                       sizeof(address)), -1, "BIND FAILED, EXIT.\n",
+                  EXIT_FAILURE);
+    EXIT_ON_VALUE(listen(listen_fd, SOMAXCONN), -1,
+                  "LISTEN CREATION FAILED, EXIT.\n", EXIT_FAILURE);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    EXIT_ON_VALUE(epoll_fd, -1, "EPOLL CREATION FAILED, EXIT.\n",
+                  EXIT_FAILURE);
+    static int listen_kind = KIND_LISTEN;
+    watch(listen_fd, &listen_kind, &listen_events, EPOLLIN);
+    fprintf(stderr, "Proxy on port %d for %d servers, %d points each.\n",
+            port, n_servers, n_vnodes);
+
+    while (!is_interrupted){
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n == -1){
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        FORONE(i, n){
+            int kind = *(int*)events[i].data.ptr;
+            if (kind == KIND_LISTEN)
+                accept_clients(listen_fd);
+            else if (kind == KIND_CLIENT){
+                client *c = events[i].data.ptr;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    client_event(c, events[i].events);
+                else
+                    client_dirty(c);
+            }
+            else
+                link_event(events[i].data.ptr, events[i].events);
+        }
+
+        /* One send() per link for everything routed this iteration. */
+        FORONE(i, n_servers)
+            FORONE(j, n_links)
+                link_flush(&servers[i].links[j]);
+        while (dirty_clients != NULL){
+            client *c = dirty_clients;
+            dirty_clients = c->next_dirty;
+            c->dirty = 0;
+            if (c->closed)
+                client_free(c);
+            else
+                client_flush(c);
+        }
+    }
+
+    fprintf(stderr, "\nReceived interrupt, %lu requests routed, exit now.\n",
+            n_requests);
+    close(listen_fd);
+    close(epoll_fd);
+    return EXIT_SUCCESS;
+}
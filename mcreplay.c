@@ -0,0 +1,498 @@
+/*
+ *  File:        mcreplay.c
+ *  Purpose:     Replay a trace captured by memcache -C against a running
+ *               server (-k), or against the shared hashtable in process,
+ *               and report throughput and latency.
+ *
+ *               ./mcreplay [-s speed] [-c connections] [-q depth]
+ *                          [-p size] <trace> <host> <port>
+ *               ./mcreplay -L elements:size [-m limit] [-a] [-s speed]
+ *                          [-p size] <trace>
+ *               -s speed:      pace relative to the capture, default 1,
+ *                              2 twice as fast, 0 as fast as possible.
+ *               -c connections: connections to the server, default 8.
+ *               -q depth:      requests in flight per connection before
+ *                              the sender waits, default 1024.
+ *               -p size:       SET every name of the trace with a value
+ *                              of size bytes before the replay, a trace
+ *                              captured on a warm server then finds what
+ *                              it found.
+ *               -L elements:size: replay on a table of shared_hashtable.c
+ *                              made in process instead of a server.
+ *               -m limit:      bytes the -L table may use, evicting.
+ *               -a:            TinyLFU admission on the -L table.
+ *
+ *  Note:        Requests run in the captured order, named after their key
+ *               ("k<16 hex digits>"), with the captured values or, when
+ *               none were captured, as many filler bytes: two replays of
+ *               a trace send the same requests. Paced requests have an
+ *               intended start and their latency runs from it, as in
+ *               loadgen, a replay falling behind shows as queueing. At
+ *               speed 0 latency runs from the send, and the requests of
+ *               different connections may run out of order: -c 1 keeps
+ *               it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+
+#include "utility_macros.h"
+#include "shared_hashtable.h"
+#include "capture.h"
+#include "mcclient.h"
+
+#define SUB_BITS        6               /* Histogram buckets per power of
+                                           two, 2^SUB_BITS. */
+#define SUB_BUCKETS     (1 << SUB_BITS)
+#define N_BUCKETS       ((64 - SUB_BITS)*SUB_BUCKETS)
+#define N_OPS           3               /* CAPTURE_OP_SET, GET, DELETE. */
+#define DRAIN_MS        5000            /* Wait for late responses. */
+#define NAME_SIZE       20              /* "k" and 16 hex digits. */
+#define SPIN_NS         1000000L        /* In process, the end of a wait
+                                           is spun: a sleep overshoots by
+                                           tens of microseconds. */
+
+/* Latencies of one kind of request, in ns. */
+typedef struct histogram_struct {
+    unsigned long counts[N_BUCKETS];
+    unsigned long total;
+    long max;
+} histogram;
+
+static capture_trace *trace;
+static double speed = 1;
+static int n_connections = 8, depth = 1024, preload = 0;
+static char *filler;                    /* Value of SETs captured without
+                                           theirs. */
+static long errors, misses, lag;
+static histogram hist[N_OPS + 1];
+
+
+/*
+* Name:         now_ns
+* Argument:     none
+* Return:       long
+* Purpose:      Monotonic clock in nanoseconds.
+* Note:         none
+*/
+static long now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+/*
+* Name:         bucket_of
+* Argument:     long
+* Return:       int
+* Purpose:      Histogram bucket of a latency.
+* Note:         As loadgen.
+*/
+static int bucket_of(long ns){
+    int power;
+
+    if (ns < SUB_BUCKETS)
+        return ns < 0 ? 0 : (int)ns;
+    power = 63 - __builtin_clzl(ns);
+    return (power - SUB_BITS + 1)*SUB_BUCKETS +
+           (int)((ns >> (power - SUB_BITS)) - SUB_BUCKETS);
+}
+
+/*
+* Name:         bucket_value
+* Argument:     int
+* Return:       long
+* Purpose:      Middle of the latencies a bucket holds.
+* Note:         none
+*/
+static long bucket_value(int bucket){
+    int power;
+    long low;
+
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+    power = bucket/SUB_BUCKETS + SUB_BITS - 1;
+    low = (long)(bucket % SUB_BUCKETS + SUB_BUCKETS) << (power - SUB_BITS);
+    return low + ((1L << (power - SUB_BITS)) >> 1);
+}
+
+/*
+* Name:         percentile
+* Argument:     histogram*, double
+* Return:       long
+* Purpose:      Latency at or below which q of the samples are.
+* Note:         0 without samples.
+*/
+static long percentile(histogram *h, double q){
+    unsigned long want = (unsigned long)ceil(q*h->total), seen = 0;
+
+    if (h->total == 0)
+        return 0;
+    if (want == 0)
+        want = 1;
+    FORONE(i, N_BUCKETS){
+        seen += h->counts[i];
+        if (seen >= want)
+            return MIN(bucket_value(i), h->max);
+    }
+    return h->max;
+}
+
+/*
+* Name:         record_latency
+* Argument:     int, long
+* Return:       none
+* Purpose:      Add a latency to the histogram of op and of every op.
+* Note:         none
+*/
+static void record_latency(int op, long latency){
+    histogram *h[2] = {&hist[op], &hist[N_OPS]};
+
+    FORONE(i, 2){
+        h[i]->counts[bucket_of(latency)]++;
+        h[i]->total++;
+        h[i]->max = MAX(h[i]->max, latency);
+    }
+}
+
+/*
+* Name:         print_histogram
+* Argument:     const char*, histogram*, double
+* Return:       none
+* Purpose:      Print the count, rate and percentiles of one histogram.
+* Note:         none
+*/
+static void print_histogram(const char *label, histogram *h, double elapsed){
+    if (h->total == 0)
+        return;
+    printf("%-7s %10lu %10.0f/s  p50 %8.1f  p90 %8.1f  p99 %8.1f  "
+           "p99.9 %8.1f  p99.99 %8.1f  max %8.1f us\n", label, h->total,
+           h->total/elapsed, percentile(h, 0.5)/1e3,
+           percentile(h, 0.9)/1e3, percentile(h, 0.99)/1e3,
+           percentile(h, 0.999)/1e3, percentile(h, 0.9999)/1e3,
+           h->max/1e3);
+}
+
+/*
+* Name:         name_of
+* Argument:     uint64_t, char*
+* Return:       none
+* Purpose:      Name replaying a key.
+* Note:         name holds NAME_SIZE bytes.
+*/
+static void name_of(uint64_t key, char *name){
+    sprintf(name, "k%016lx", (unsigned long)key);
+}
+
+/*
+* Name:         value_of
+* Argument:     long
+* Return:       char*
+* Purpose:      Value of the SET of record i.
+* Note:         none
+*/
+static char* value_of(long i){
+    return trace->values[i] != NULL ? trace->values[i] : filler;
+}
+
+/*
+* Name:         compare_keys
+* Argument:     const void*, const void*
+* Return:       int
+* Purpose:      qsort() order of keys.
+* Note:         none
+*/
+static int compare_keys(const void *a, const void *b){
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+* Name:         distinct_keys
+* Argument:     long*
+* Return:       uint64_t*
+* Purpose:      Every key of the trace once, their number in *n.
+* Note:         NULL if memory runs out.
+*/
+static uint64_t* distinct_keys(long *n){
+    uint64_t *keys = malloc(MAX(trace->n, 1)*sizeof(uint64_t));
+    long kept = 0;
+
+    if (keys == NULL)
+        return NULL;
+    FORONE(i, trace->n)
+        keys[i] = trace->records[i].key;
+    qsort(keys, trace->n, sizeof(uint64_t), compare_keys);
+    FORONE(i, trace->n)
+        if (kept == 0 || keys[kept - 1] != keys[i])
+            keys[kept++] = keys[i];
+    *n = kept;
+    return keys;
+}
+
+/*
+* Name:         wait_until
+* Argument:     long, long
+* Return:       none
+* Purpose:      Sleep until the monotonic clock reads at ns, spinning its
+*               last spin ns.
+* Note:         Against a server spin is 0, it may need the CPU.
+*/
+static void wait_until(long at, long spin){
+    long now = now_ns();
+
+    if (at - spin > now){
+        struct timespec ts = {(at - spin - now)/1000000000L,
+                              (at - spin - now) % 1000000000L};
+        nanosleep(&ts, NULL);
+    }
+    while (spin > 0 && now_ns() < at)
+        ;
+}
+
+/*
+* Name:         intended_start
+* Argument:     long, long
+* Return:       long
+* Purpose:      When record i should start, the replay starting at start.
+* Note:         0 at speed 0, none is intended.
+*/
+static long intended_start(long i, long start){
+    if (speed == 0)
+        return 0;
+    return start + (long)((trace->records[i].time_ns -
+                           trace->records[0].time_ns)/speed);
+}
+
+/*
+* Name:         request_done
+* Argument:     mc_result*, void*
+* Return:       none
+* Purpose:      Record a response of the server.
+* Note:         arg is the request's intended start in ns.
+*/
+static void request_done(mc_result *result, void *arg){
+    if (result->status == MC_ERR_NOT_FOUND)
+        misses++;
+    else if (result->status != MC_OK)
+        errors++;
+    record_latency(result->op, now_ns() - (long)(intptr_t)arg);
+}
+
+/*
+* Name:         replay_server
+* Argument:     const char*, int
+* Return:       long
+* Purpose:      Send the trace to a server, paced.
+* Note:         Returns the requests still unanswered after the drain, or
+*               -1 if the server cannot be reached.
+*/
+static long replay_server(const char *host, int port){
+    mc_options options = {n_connections, depth, DRAIN_MS};
+    mc_client *client = mc_connect(host, port, &options);
+    char name[NAME_SIZE];
+    long start, unanswered;
+
+    if (client == NULL)
+        return -1;
+    if (preload > 0){
+        long n_keys;
+        uint64_t *keys = distinct_keys(&n_keys);
+
+        EXIT_ON_VALUE(keys, NULL, "CANNOT ALLOCATE MEMORY, EXIT.\n",
+                      EXIT_FAILURE);
+        FORONE(i, n_keys){
+            name_of(keys[i], name);
+            mc_set_async(client, name, filler, preload, NULL, NULL);
+        }
+        printf("preloaded:   %ld names, %d failed\n", n_keys,
+               mc_wait(client, -1));
+        free(keys);
+    }
+
+    start = now_ns();
+    FORONE(i, trace->n){
+        capture_record *r = &trace->records[i];
+        long intended = intended_start(i, start);
+        int status;
+
+        /* Answers are taken while waiting for the next start. */
+        while (intended > 0 && now_ns() < intended){
+            long wait_ms = (intended - now_ns())/1000000;
+            int done = 0;
+
+            if (mc_pending(client) > 0)
+                done = mc_poll(client, (int)wait_ms);
+            if (done == 0 && (mc_pending(client) == 0 || wait_ms == 0))
+                wait_until(intended, 0);
+        }
+        if (intended == 0)
+            intended = now_ns();
+        lag = MAX(lag, now_ns() - intended);
+
+        name_of(r->key, name);
+        if (r->op == CAPTURE_OP_SET)
+            status = mc_set_async(client, name, value_of(i), r->size,
+                                  request_done, (void*)(intptr_t)intended);
+        else if (r->op == CAPTURE_OP_GET)
+            status = mc_get_async(client, name, request_done,
+                                  (void*)(intptr_t)intended);
+        else
+            status = mc_delete_async(client, name, request_done,
+                                     (void*)(intptr_t)intended);
+        if (status != MC_OK)
+            errors++;
+    }
+    unanswered = mc_wait(client, DRAIN_MS);
+    mc_close(client);
+    return unanswered;
+}
+
+/*
+* Name:         replay_local
+* Argument:     int, int, hash_options*
+* Return:       int
+* Purpose:      Run the trace on a table made in process, paced.
+* Note:         Returns -1 if the table cannot be made.
+*/
+static int replay_local(int elements, int element_size, hash_options *options){
+    void *table = make_hashtable_opt(elements, element_size, options);
+    char name[NAME_SIZE];
+    void *data;
+    int size, status;
+    long start;
+
+    if (table == NULL)
+        return -1;
+    if (preload > 0){
+        long n_keys, failed = 0;
+        uint64_t *keys = distinct_keys(&n_keys);
+
+        EXIT_ON_VALUE(keys, NULL, "CANNOT ALLOCATE MEMORY, EXIT.\n",
+                      EXIT_FAILURE);
+        FORONE(i, n_keys){
+            name_of(keys[i], name);
+            failed += hash_set(table, name, filler, preload) != HASH_OK;
+        }
+        printf("preloaded:   %ld names, %ld failed\n", n_keys, failed);
+        free(keys);
+    }
+
+    start = now_ns();
+    FORONE(i, trace->n){
+        capture_record *r = &trace->records[i];
+        long intended = intended_start(i, start);
+
+        if (intended > 0)
+            wait_until(intended, SPIN_NS);
+        else
+            intended = now_ns();
+        lag = MAX(lag, now_ns() - intended);
+
+        name_of(r->key, name);
+        if (r->op == CAPTURE_OP_SET)
+            status = hash_set(table, name, value_of(i), r->size);
+        else if (r->op == CAPTURE_OP_GET){
+            status = hash_get(table, name, &data, &size);
+            if (status == HASH_OK)
+                free(data);
+        }
+        else
+            status = hash_delete(table, name);
+        record_latency(r->op, now_ns() - intended);
+        if (status == HASH_ERR_NOEXIT)
+            misses++;
+        else if (status != HASH_OK)
+            errors++;
+    }
+    hash_detach(table);
+    return 0;
+}
+
+int main(int argc, char **argv){
+    const char *labels[N_OPS] = {"SET", "GET", "DELETE"};
+    int option, elements = 0, element_size = 0, local = 0;
+    long unanswered = 0, max_size = 1, start;
+    hash_options options = {0};
+
+    while ((option = getopt(argc, argv, "s:c:q:p:L:m:a")) != -1){
+        switch (option){
+            case 's': speed = atof(optarg); break;
+            case 'c': n_connections = atoi(optarg); break;
+            case 'q': depth = atoi(optarg); break;
+            case 'p': preload = atoi(optarg); break;
+            case 'L':
+                local = 1;
+                if (sscanf(optarg, "%d:%d", &elements, &element_size) != 2)
+                    elements = 0;
+                break;
+            case 'm': options.memory_limit = atol(optarg); break;
+            case 'a': options.admission = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-s speed] [-c connections] "
+                        "[-q depth] [-p size] <trace> <host> <port>\n"
+                        "       %s -L elements:size [-m limit] [-a] "
+                        "[-s speed] [-p size] <trace>\n", argv[0], argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    EXIT_NOT_ON_VALUE(argc - optind, local ? 1 : 3,
+                      "TOO MANY OR TO FEW ARGUMENTS, EXIT.\n", EXIT_FAILURE);
+    EXIT_ON_VALUE(speed < 0 || n_connections < 1 || depth < 1 ||
+                  preload < 0 || (local && (elements < 1 ||
+                                            element_size < 1)), 1,
+                  "BAD COMMANDLINE ARGUMENT, EXIT.\n", EXIT_FAILURE);
+
+    trace = capture_load(argv[optind]);
+    EXIT_ON_VALUE(trace, NULL, "CANNOT READ TRACE, EXIT.\n", EXIT_FAILURE);
+    EXIT_ON_VALUE(trace->n, 0, "EMPTY TRACE, EXIT.\n", EXIT_FAILURE);
+    FORONE(i, trace->n)
+        max_size = MAX(max_size, (long)trace->records[i].size);
+    max_size = MAX(max_size, preload);
+    filler = malloc(max_size);
+    EXIT_ON_VALUE(filler, NULL, "CANNOT ALLOCATE MEMORY, EXIT.\n",
+                  EXIT_FAILURE);
+    FORONE(i, max_size)
+        filler[i] = 'a' + i % 26;
+    printf("trace:       %ld requests over %.3f s, values %s\n", trace->n,
+           (trace->records[trace->n - 1].time_ns -
+            trace->records[0].time_ns)/1e9,
+           trace->flags & CAPTURE_VALUES ? "captured" : "filled");
+
+    start = now_ns();
+    if (local){
+        options.lock_type = HASH_LOCK_THREAD;
+        options.evict = options.memory_limit > 0;
+        EXIT_ON_VALUE(replay_local(elements, element_size, &options), -1,
+                      "CANNOT MAKE THE TABLE, EXIT.\n", EXIT_FAILURE);
+    }
+    else{
+        unanswered = replay_server(argv[optind + 1], atoi(argv[optind + 2]));
+        EXIT_ON_VALUE(unanswered, -1, "CANNOT CONNECT, EXIT.\n",
+                      EXIT_FAILURE);
+    }
+    double elapsed = (now_ns() - start)/1e9;
+
+    if (speed == 0)
+        printf("mode:        %s, as fast as possible\n",
+               local ? "in process" : "server");
+    else
+        printf("mode:        %s, speed %.2f, sender lag max %.1f ms\n",
+               local ? "in process" : "server", speed, lag/1e6);
+    printf("requests:    %ld sent, %ld errors, %ld misses, %ld unanswered\n",
+           trace->n, errors, misses, unanswered);
+    printf("elapsed:     %.3f s, %.0f req/s\n", elapsed, trace->n/elapsed);
+    print_histogram("ALL", &hist[N_OPS], elapsed);
+    FORONE(op, N_OPS)
+        print_histogram(labels[op], &hist[op], elapsed);
+
+    free(filler);
+    capture_free(trace);
+    return errors || unanswered ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -6,14 +6,76 @@
  *  Date:        2021.2.11
  *  Purpose:     A server create a TCP socket which will handle date from client.
  * 
- *               ./memcache <port> <num_elements> <element_size>
+ *               ./memcache [-t threads] [-e backend] <port> <num_elements> 
+ *                          <element_size>
  *               port:          should be between 0 and 65535.
  *               num_elements:  should be >= 1.
  *               elements_size: should be >= 1.
+ *               -t threads:    serve clients from a pool of worker threads
+ *                              instead of forking a child per client, 0 for
+ *                              one thread per online core.
+ *               -e backend:    serve clients from an event loop per thread,
+ *                              "epoll" or "uring" (falls back to epoll).
+ *               -z threshold:  compress values of at least threshold bytes.
+ *               -v max_value:  largest value accepted when compressing 
+ *                              or spilling by size (-s).
+ *               -l dump:       load a dump file (see bulk.h) before serving.
+ *               -d dump:       export the table to a dump file on SIGUSR1 
+ *                              and on controlled shutdown.
+ *               -r repl_port:  primary, stream every change to replicas
+ *                              connecting to repl_port (see replication.h).
+ *               -f host:port:  replica of the primary at host:repl_port,
+ *                              SET and DELETE get ERR READ_ONLY.
+ *               -k:            keep connections open after a response, 
+ *                              clients may send (and pipeline) requests
+ *                              until they close. With -t only together
+ *                              with -e, a worker thread without an event
+ *                              loop serves one connection at a time.
+ *               -m limit:      bytes the table may use (K, M, G suffixes),
+ *                              num_elements 0 maps as many slots as fit.
+ *               -M:            refuse SETs over the limit (ERR NO_MEMORY)
+ *                              instead of evicting.
+ *               -a:            TinyLFU admission, a new name only evicts a
+ *                              value accessed less often.
+ *               -b:            lay slots out as cache line aligned buckets
+ *                              instead of separate arrays.
+ *               -H:            cuckoo hashing instead of linear probing,
+ *                              a name is in one of two 4 slot buckets:
+ *                              lookups read at most two, the table fills
+ *                              to 95%.
+ *               -B counters:   Bloom filter counters per slot (8 is a 
+ *                              good start), GETs of absent names skip 
+ *                              the table lock.
+ *               -c entries:    near cache of hot values per worker, hits
+ *                              skip the table lock. Needs -t or -e, a
+ *                              forked child's cache dies with its client.
+ *               -S:            shared nothing, each event loop thread owns
+ *                              a table with its share of the names and
+ *                              runs the requests for them, needs -e.
+ *               -n name:       make the table the shared memory object 
+ *                              "/name", local processes hash_attach() it
+ *                              and skip the socket.
+ *               -u path:       zero downtime upgrade over the Unix socket 
+ *                              path: a server started with the same path
+ *                              takes the listening socket and the table
+ *                              (named "/memcache-<port>" without -n) 
+ *                              over, the old one finishes its clients 
+ *                              and exits. Not with -r, -f or -S.
+ *               -C trace:      capture every SET, GET and DELETE to the
+ *                              trace file (see capture.h), for mcreplay.
+ *               -V:            capture the values of SETs too.
+ *               -T file:       second tier in an extent file on local 
+ *                              disk: under -m values spill to it before 
+ *                              any is evicted, a background thread 
+ *                              compacts it. Not with -S.
+ *               -s threshold:  values of at least threshold bytes go 
+ *                              straight to the extent file.
+ *               -K sample:     count 1 in sample GETs and SETs per name,
+ *                              the HOTKEYS command lists the hottest.
  * 
  *               Read one lien of text from the client:
  *               <CMD> <name> <size>
- *               CMD:           SET, GET, DELETE.
+ *               CMD:           SET, GET, DELETE, STATS, MEMORY, HOTKEYS.
  *               name:          should be shorter than 120, must be a-z, A-Z, 0-9.
  *               size:          should only be with commend "SET".
  * 
@@ -23,6 +85,7 @@
  *               If no errors countered, "OK" would be sent. 
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -37,19 +100,77 @@
 #include <netinet/ip.h>
 #include <netdb.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <poll.h>
 
 #include "utility_macros.h"
 #include "socket_utils.h"
 #include "shared_hashtable.h"
+#include "protocol.h"
+#include "stats.h"
+#include "replication.h"
+#include "event_loop.h"
+#include "bulk.h"
+#include "capture.h"
+#include "hotkeys.h"
+#include "trace_probes.h"
 
 #define MAX_LIS_QUEUE   10
-#define MAX_INPUT_SIZE  1024
-#define DELIMETER_NW    "\r\t\n"
-#define DELIIMETER      " \t"
+#define UPGRADE_MAGIC   0x4d43555047524144UL    /* "MCUPGRAD". */
+#define UPGRADE_TIMEOUT 5                       /* Seconds a handoff may
+                                                   take before it is 
+                                                   given up. */
+#define COMPACT_INTERVAL_NS 100000000L          /* Between two compaction
+                                                   passes of the extent 
+                                                   file. */
+
+/* Buffers used to serve one client, reused between clients of a worker. */
+typedef struct conn_buffer_struct {
+    char *input;                    /* Bytes read from client. */
+    char *output;                   /* Response to client. */
+    size_t output_size;             /* Bytes allocated for output. */
+    size_t pending;                 /* Bytes of the next request already 
+                                       at the start of input. */
+    int served;                     /* Requests answered on this client. */
+    int eof;                        /* Client stopped sending. */
+    int stop_fd;                    /* Readable once the server stops. */
+    request req;                    /* Parsed request. */
+} conn_buffer;
+
+/* Arguments of a worker thread. */
+typedef struct worker_struct {
+    pthread_t thread;
+    int id;
+    int server_socket;
+    int backend;                    /* EVLOOP_* run by the thread. */
+    int stop_fd;                    /* eventfd stopping event loops. */
+    int cpu;                        /* Core the thread is pinned to. */
+    shard_group *group;             /* -S, shards of the worker loops. */
+    void *hash_table_ptr;
+} worker;
 
 int child_spawn;
-static int is_interrupted = 0;
-//static int client_number = 1;
+static volatile sig_atomic_t is_interrupted = 0;
+static volatile sig_atomic_t export_requested = 0;
+static char *export_path = NULL;     /* -d dump file, NULL for none. */
+static int n_bulk_workers = 1;       /* Threads loading or exporting. */
+static int keep_alive = 0;           /* -k, serve requests until the client
+                                        closes. */
+static int sharded = 0;              /* -S, a table per worker thread. */
+static hash_options shard_options;   /* Options of each worker's table. */
+static int shard_elements, shard_element_size;
+static char *upgrade_path = NULL;    /* -u Unix socket, NULL for none. */
+static int upgrade_socket = -1;      /* Listening on upgrade_path. */
+static pthread_t upgrade_thread, main_thread;
+static int upgrade_server_socket;    /* Listening socket to hand over. */
+static volatile sig_atomic_t handed_off = 0;
+                                     /* A new server took the listening 
+                                        socket and table over. */
+static pthread_t compact_thread;
+static int compacting = 0;           /* The compaction thread runs. */
 
 
 /*  
@@ -60,123 +181,765 @@ static int is_interrupted = 0;
 * Note:         none
 */
 void sigint_received(int signum) {
-    printf("%d\n", signum);
     is_interrupted = 1;
 }
 
 /*  
-* Name:         split_str
-* Argument:     char*, char**
-* Return:       Number of elements in out_str
-* Purpose:      Split a commend into form of the char** that recognizeable
-                by "exec()" family. 
+* Name:         sigusr1_received
+* Argument:     int
+* Return:       none
+* Purpose:      Ask the main loop to export the table.
 * Note:         none
 */
-int split_str(char *row_str, char **out_str){
-    char *pch = strtok(row_str, DELIIMETER);
-    int index = 0;
-    while(pch != NULL){
-        out_str[index] = malloc(MAX_INPUT_SIZE);
-        EXIT_ON_VALUE(out_str[index], NULL, "Cannot allocate memory, exit.\n",
-                      EXIT_FAILURE);
-        strcpy(out_str[index], pch);
-        pch = strtok(NULL, DELIIMETER); 
-        index++;  
+void sigusr1_received(int signum) {
+    export_requested = 1;
+}
+
+/*  
+* Name:         wake_received
+* Argument:     int
+* Return:       none
+* Purpose:      Nothing, SIGUSR2 only interrupts a blocked accept().
+* Note:         none
+*/
+void wake_received(int signum) {
+}
+
+/*  
+* Name:         export_table
+* Argument:     void*
+* Return:       none
+* Purpose:      Export the table to the -d dump file, if any.
+* Note:         Runs on the main thread or parent process while clients 
+*               keep being served.
+*/
+void export_table(void *hash_table_ptr){
+    bulk_result result;
+
+    export_requested = 0;
+    if (export_path == NULL)
+        return;
+    if (bulk_export(hash_table_ptr, export_path, n_bulk_workers, &result) == 0)
+        fprintf(stderr, "Exported %ld entries to %s in %.3f s.\n", 
+                result.records, export_path, result.seconds);
+}
+
+/*  
+* Name:         accept_client
+* Argument:     int
+* Return:       int
+* Purpose:      accept() a client, blocking even if the listening socket 
+*               was made non blocking.
+* Note:         A socket handed over by -u is shared with the old server,
+*               an event loop there or here sets O_NONBLOCK for both. 
+*               Returns -1 with errno EINTR once the socket is readable 
+*               or a signal came, the caller checks is_interrupted and 
+*               tries again. So it does when captured records are due 
+*               before a client comes, they are written first.
+*/
+int accept_client(int server_socket){
+    struct pollfd fds = {server_socket, POLLIN, 0};
+    int client, timeout = capture_timeout();
+
+    if (timeout != -1 && poll(&fds, 1, timeout) == 0){
+        STAT_ADD(syscalls, 1);
+        capture_tick();
+        errno = EINTR;
+        return -1;
+    }
+    client = accept(server_socket, NULL, NULL);
+    if (client == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+        poll(&fds, 1, capture_timeout());
+        STAT_ADD(syscalls, 1);
+        capture_tick();
+        errno = EINTR;
     }
-    /* Terminate the char** with NULL. */
-    out_str[index] = NULL;
-    return index;
+    return client;
 }
 
+/*  
+* Name:         upgrade_address
+* Argument:     struct sockaddr_un*
+* Return:       none
+* Purpose:      Address of the -u Unix socket.
+* Note:         The path length is checked with the options.
+*/
+void upgrade_address(struct sockaddr_un *address){
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, upgrade_path);
+}
 
 /*  
-* Name:         argv_check
-* Argument:     int*
+* Name:         upgrade_receive
+* Argument:     int*, int*
 * Return:       int
-* Purpose:      Check if argvs contain any error and mistake.
-* Note:         none
+* Purpose:      Take the listening socket and the table fd over from the 
+*               server running with the same -u path.
+* Note:         Returns 0 when no server listens on the path, 1 with both 
+*               fds once received, -1 on failure. The old server keeps 
+*               serving until the table is mapped here: *table_ptr is set 
+*               and acknowledged before returning 1.
 */
-int argv_check(int *argv_in){
-    if (argv_in[0]<0 || argv_in[0]>65535) return 0;
-    else if (argv_in[1]<1 || argv_in[2]<1) return 0;
-    child_spawn=0;      /*  <--- Pass error checking, initialize static variable. */
+int upgrade_receive(int *server_socket, void **table_ptr){
+    struct sockaddr_un address;
+    unsigned long magic = 0;
+    int fds[2], peer;
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {&magic, sizeof(magic)};
+    struct msghdr msg = {0};
+    struct cmsghdr *cmsg;
+    struct timeval timeout = {UPGRADE_TIMEOUT, 0};
+
+    upgrade_address(&address);
+    peer = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    RETURN_ON_VALUE(peer, -1, "SOCKET CREATION FAILED, EXIT.\n", -1);
+    if (connect(peer, (SA*)&address, sizeof(address)) == -1){
+        close(peer);
+        /* No file, or one left by a server gone. */
+        return errno == ENOENT || errno == ECONNREFUSED ? 0 : -1;
+    }
+    setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(peer, &msg, MSG_CMSG_CLOEXEC) != sizeof(magic) || 
+        magic != UPGRADE_MAGIC || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+        cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))){
+        close(peer);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    *table_ptr = hash_attach_fd(fds[1]);
+    close(fds[1]);
+    if (*table_ptr == NULL || write(peer, "1", 1) != 1){
+        if (*table_ptr != NULL)
+            hash_close(*table_ptr);
+        close(fds[0]);
+        close(peer);
+        return -1;
+    }
+    close(peer);
+    *server_socket = fds[0];
     return 1;
 }
 
-int main(int argc, char **argv){
-    int argv_in[3];     /*  <--- argv transformed to int. */
-    
-    /* 
-     * status_o: for storing operations status. 
-     * status_s: for special operations status, espacilly save for later use.
-     * flag:     for which commend mode it's in, -1 as defult. 
-     * status_hash: for reading result returned by hashtable function. 
-     */
-    int status, status_2, status_3, status_o, status_exit, flag=-1, 
-        status_hash, server_socket;
-
-    struct sockaddr_in address /*client_address*/;
-    //int client_address_size;
-
-    /* Initial cmd_list for compare. 
-    *  0 for SET.
-    *  1 for GET.
-    *  2 for DELETE.
-    */
-    char cmd_list[3][10] = {{"SET\0"}, {"GET\0"}, {"DELETE\0"}};
+/*  
+* Name:         upgrade_send
+* Argument:     int, int, void*
+* Return:       int
+* Purpose:      Pass the listening socket and the table fd to a new server
+*               connected on the -u socket.
+* Note:         Returns 0 once the new server mapped the table, from then
+*               it serves and this one must only drain. -1 otherwise, 
+*               this server keeps going.
+*/
+int upgrade_send(int peer, int server_socket, void *hash_table_ptr){
+    unsigned long magic = UPGRADE_MAGIC;
+    int fds[2] = {server_socket, hash_fd(hash_table_ptr)};
+    char control[CMSG_SPACE(sizeof(fds))], ack = 0;
+    struct iovec iov = {&magic, sizeof(magic)};
+    struct msghdr msg = {0};
+    struct cmsghdr *cmsg;
+    struct timeval timeout = {UPGRADE_TIMEOUT, 0};
+    ssize_t status;
+
+    if (fds[1] == -1)
+        return -1;
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    status = sendmsg(peer, &msg, MSG_NOSIGNAL);
+    close(fds[1]);
+    if (status != sizeof(magic))
+        return -1;
+    if (read(peer, &ack, 1) != 1 || ack != '1')
+        return -1;
+    return 0;
+}
 
-    /* Argument checking. */
-    EXIT_NOT_ON_VALUE(argc, 4, "TOO MANY OR TO FEW ARGUMENTS, EXIT.\n", 
-                      EXIT_FAILURE);
-    FORONE(i, 3){
-        status = sscanf(argv[i+1],"%d", &argv_in[i]);
-        EXIT_NOT_ON_VALUE(status, 1, "BAD COMMANDLINE ARGUMENT, EXIT.\n", 
-                          EXIT_FAILURE);
-    } 
-    if (!argv_check(argv_in)){
-        fprintf(stderr,"BAD COMMANDLINE ARGUMENT, EXIT.\n");
-        exit(EXIT_FAILURE);
+/*  
+* Name:         upgrade_main
+* Argument:     void*
+* Return:       void*
+* Purpose:      Thread body, hand the server over to the first new server 
+*               connecting on the -u socket.
+* Note:         Then the main thread is interrupted as by SIGINT: the 
+*               clients in flight are finished, the table is only closed. 
+*               Ends too once upgrade_stop() shuts the socket down.
+*/
+void* upgrade_main(void *hash_table_ptr){
+    while (!is_interrupted){
+        int peer = accept(upgrade_socket, NULL, NULL);
+        if (peer == -1){
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        if (!is_interrupted && 
+            upgrade_send(peer, upgrade_server_socket, hash_table_ptr) == 0){
+            handed_off = 1;
+            is_interrupted = 1;
+            close(peer);
+            fprintf(stderr, "\nHanded over to a new server.\n");
+            pthread_kill(main_thread, SIGINT);
+            break;
+        }
+        fprintf(stderr, "Upgrade handoff failed, still serving.\n");
+        close(peer);
     }
+    return NULL;
+}
 
-    /* ADD: Initialize a hashtable with shared memory. */
-    fprintf(stderr, "num_elements:%d\nmax_num_elements:%d\n", argv_in[1], argv_in[2]);
-    void *hash_table_ptr = make_hashtable(argv_in[1], argv_in[2]);
-    EXIT_ON_VALUE(hash_table_ptr, NULL, "Cannot locate share memory, exit.\n",
-                  EXIT_FAILURE);
+/*  
+* Name:         upgrade_start
+* Argument:     int, void*
+* Return:       int
+* Purpose:      Listen on the -u socket for the next server and start the
+*               thread handing this one over.
+* Note:         A file left on the path is replaced, upgrade_receive() 
+*               found no server there. The thread blocks the signals, 
+*               they stay for the main thread. Returns -1 on failure.
+*/
+int upgrade_start(int server_socket, void *hash_table_ptr){
+    struct sockaddr_un address;
+    sigset_t set, old_set;
+    int status;
+
+    upgrade_address(&address);
+    upgrade_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    RETURN_ON_VALUE(upgrade_socket, -1, "SOCKET CREATION FAILED, EXIT.\n", 
+                    -1);
+    unlink(upgrade_path);
+    if (bind(upgrade_socket, (SA*)&address, sizeof(address)) == -1 ||
+        listen(upgrade_socket, 1) == -1){
+        close(upgrade_socket);
+        return -1;
+    }
+    upgrade_server_socket = server_socket;
+    main_thread = pthread_self();
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old_set);
+    status = pthread_create(&upgrade_thread, NULL, upgrade_main, 
+                            hash_table_ptr);
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    if (status != 0){
+        close(upgrade_socket);
+        unlink(upgrade_path);
+        return -1;
+    }
+    return 0;
+}
 
-    /* Set up signal handler. */
-    struct sigaction sigint_handler;
+/*  
+* Name:         upgrade_stop
+* Argument:     none
+* Return:       int
+* Purpose:      Stop handing the server over, at shutdown.
+* Note:         Returns handed_off: a handoff in progress is finished 
+*               first. The path is removed unless the new server owns it.
+*/
+int upgrade_stop(void){
+    if (upgrade_socket == -1)
+        return 0;
+    /* Wakes the thread blocked in accept(), close() would not. */
+    shutdown(upgrade_socket, SHUT_RDWR);
+    pthread_join(upgrade_thread, NULL);
+    close(upgrade_socket);
+    upgrade_socket = -1;
+    if (!handed_off)
+        unlink(upgrade_path);
+    return handed_off;
+}
 
-    sigint_handler.sa_handler = sigint_received;
-    sigemptyset(&sigint_handler.sa_mask);
-    sigint_handler.sa_flags = 0;
-    
-    status_3 = sigaction(SIGINT, &sigint_handler, NULL);
-    if (status_3 != 0) {
-        perror(argv[0]);
-        exit(EXIT_FAILURE);
+/*  
+* Name:         compact_main
+* Argument:     void*
+* Return:       void*
+* Purpose:      Thread compacting the extent file of the table until 
+*               compact_stop().
+* Note:         Each pass reclaims stretches while there are some, the 
+*               lock is only held briefly within each.
+*/
+void* compact_main(void *arg){
+    struct timespec interval = {0, COMPACT_INTERVAL_NS};
+
+    while (__atomic_load_n(&compacting, __ATOMIC_ACQUIRE)){
+        while (__atomic_load_n(&compacting, __ATOMIC_ACQUIRE) &&
+               hash_tier_compact(arg) > 0)
+            continue;
+        nanosleep(&interval, NULL);
     }
+    return NULL;
+}
 
-    /* Define an address that means port defined by user on all my network interfaces. */
-    address.sin_family = AF_INET;
-    address.sin_port = htons(argv_in[0]);
-    address.sin_addr.s_addr = htonl(INADDR_ANY);
+/*  
+* Name:         compact_start
+* Argument:     void*
+* Return:       int
+* Purpose:      Start the compaction thread if the table has an extent 
+*               file.
+* Note:         A table taken over brings its extent file, -T or not. The
+*               thread blocks the signals. Returns -1 on failure.
+*/
+int compact_start(void *hash_table_ptr){
+    sigset_t set, old_set;
+    hash_stats table;
+    int status;
+
+    if (hash_table_ptr == NULL || 
+        hash_get_stats(hash_table_ptr, &table) != HASH_OK || !table.tiered)
+        return 0;
+    compacting = 1;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old_set);
+    status = pthread_create(&compact_thread, NULL, compact_main, 
+                            hash_table_ptr);
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    if (status != 0){
+        compacting = 0;
+        return -1;
+    }
+    return 0;
+}
 
-    /* Create a TCP socket. */
-    server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    EXIT_ON_VALUE(server_socket, -1, "SOCKET CREATION FAILED, EXIT.\n", 
-        EXIT_FAILURE);
-    fprintf(stderr, "socket created: %d\n", server_socket);
+/*  
+* Name:         compact_stop
+* Argument:     none
+* Return:       none
+* Purpose:      Stop the compaction thread, before the table goes.
+* Note:         Waits for the pass in progress.
+*/
+void compact_stop(void){
+    if (!compacting)
+        return;
+    __atomic_store_n(&compacting, 0, __ATOMIC_RELEASE);
+    pthread_join(compact_thread, NULL);
+}
 
-    /* Assign it the address defined above. */
-    status = bind(server_socket, (SA*)&address, sizeof(address));
-    EXIT_ON_VALUE(status, -1, "BIND FAILED, EXIT.\n", EXIT_FAILURE);
-    fprintf(stderr, "bound: %d\n", status);
+/*  
+* Name:         write_response
+* Argument:     int, int, char*, size_t
+* Return:       int
+* Purpose:      Write a response back to client, firing the response_write 
+*               probe with the command flag and the bytes written.
+* Note:         Return value is the same as write_in_full().
+*/
+int write_response(int client, int flag, char *msg, size_t size){
+    int status = write_in_full(client, msg, size);
+    TRACE3(response_write, client, flag, status);
+    return status;
+}
 
-    /* Ask the kernel to make it a listening socket with a queue of 10 */
-    status = listen(server_socket, MAX_LIS_QUEUE);
-    EXIT_ON_VALUE(status, -1, "LISTEN CREATION FAILED, EXIT.\n", EXIT_FAILURE);
-    fprintf(stderr, "Server is running, waiting for connections..\n");
+/*  
+* Name:         print_summary
+* Argument:     none
+* Return:       none
+* Purpose:      Print requests served and syscalls per request on exit.
+* Note:         none
+*/
+void print_summary(void){
+    unsigned long requests;
+
+    if (stats == NULL)
+        return;
+    requests = STAT_GET(requests);
+    fprintf(stderr, "Requests served: %lu, syscalls: %lu (%.2f per request)\n",
+            requests, STAT_GET(syscalls), 
+            requests ? (double)STAT_GET(syscalls)/requests : 0.0);
+}
+
+/*  
+* Name:         alloc_conn_buffer
+* Argument:     conn_buffer*, void*
+* Return:       int
+* Purpose:      Allocate the buffers needed to serve a client.
+* Note:         Returns 0 on success, -1 if memory allocation fail.
+*/
+int alloc_conn_buffer(conn_buffer *buf, void *hash_table_ptr){
+    buf->output_size = response_buffer_size(hash_table_ptr);
+    buf->pending = 0;
+    buf->served = 0;
+    buf->eof = 0;
+    buf->stop_fd = -1;
+    buf->input = malloc(MAX_INPUT_SIZE + 1);
+    buf->output = malloc(buf->output_size);
+    if (buf->input == NULL || buf->output == NULL){
+        FREE_ON_VAL(buf->input, buf->output, NULL);
+        return -1;
+    }
+    return 0;
+}
+
+/*  
+* Name:         free_conn_buffer
+* Argument:     conn_buffer*
+* Return:       none
+* Purpose:      Free buffers allocated by alloc_conn_buffer.
+* Note:         none
+*/
+void free_conn_buffer(conn_buffer *buf){
+    FREE(buf->input);
+    FREE(buf->output);
+}
+
+/*  
+* Name:         wait_request
+* Argument:     int, conn_buffer*
+* Return:       int
+* Purpose:      Wait on a kept alive client for its next request.
+* Note:         Returns 0 once the client sent something or closed, -1 
+*               when the server stops first. Captured records are written
+*               meanwhile once due.
+*/
+int wait_request(int client, conn_buffer *buf){
+    struct pollfd fds[2] = {{client, POLLIN, 0}, {buf->stop_fd, POLLIN, 0}};
+
+    while (!is_interrupted){
+        int status = poll(fds, buf->stop_fd == -1 ? 1 : 2, 
+                          capture_timeout());
+        STAT_ADD(syscalls, 1);
+        if (status == 0)
+            capture_tick();
+        if (status == 0 || (status == -1 && errno == EINTR)) continue;
+        if (status == -1 || fds[1].revents != 0)
+            return -1;
+        return 0;
+    }
+    return -1;
+}
+
+/*  
+* Name:         handle_client
+* Argument:     int, void*, conn_buffer*
+* Return:       int
+* Purpose:      Read one request from client, perform it on the hashtable
+*               and write the response back.
+* Note:         Returns EXIT_SUCCESS or EXIT_FAILURE, the client is not 
+*               closed. Used by both the forked child and worker threads.
+*               Values that do not fit the buffers are read into and 
+*               written from their slot directly. Bytes read past the 
+*               request are kept in buf for the next call.
+*/
+int handle_client(int client, void *hash_table_ptr, conn_buffer *buf){
+    request *req = &buf->req;
+    value_stream stream;
+    size_t total = buf->pending, used;
+    int status, length, eof = 0;
+
+    TRACE1(request_start, client);
+
+    /* A kept alive client may take its time, or never send again. */
+    if (buf->served > 0 && total == 0 && wait_request(client, buf) == -1)
+        return EXIT_FAILURE;
+
+    /* Read until the command line is complete, the client stop or full. */
+    while (total < MAX_INPUT_SIZE && 
+           memchr(buf->input, '\n', total) == NULL){
+        status = read(client, buf->input + total, MAX_INPUT_SIZE - total);
+        STAT_ADD(syscalls, 1);
+        if (status == -1 && errno == EINTR) continue;
+        RETURN_ON_VALUE(status, -1, "CANNOT READ, EXIT.\n", EXIT_FAILURE);
+        if (status == 0){
+            eof = 1;
+            break;
+        }
+        total += status;
+    }
+    buf->input[total] = '\0';
+    buf->pending = 0;
+
+    /* A kept alive client closing between requests is not an error. */
+    if (buf->served > 0 && total == 0 && eof){
+        buf->eof = 1;
+        return EXIT_SUCCESS;
+    }
+    buf->served++;
+
+    #ifdef DEBUG
+    fprintf(stderr, "bytes read:%ld\nrow_r is :%s\n", total, buf->input);
+    #endif /* DEBUG */
+
+    /* Without a full line nothing more will be read, parse what we have. */
+    if (memchr(buf->input, '\n', total) == NULL)
+        eof = 1;
+    status = parse_request(buf->input, total, eof, 
+                           hash_get_max_value_size(hash_table_ptr), req);
+    TRACE3(request_parse, client, total, req->n_tokens);
+
+    if (status == PARSE_ERROR){
+        STAT_ADD(requests, 1);
+        STAT_ADD(bad_requests, 1);
+        STAT_ADD(syscalls, 1);
+        status = write_response(client, req->cmd, (char*)req->error, 
+                                strlen(req->error));
+        RETURN_ON_VALUE(status, -1, "ERR OTHER\r\n", EXIT_FAILURE);
+        return EXIT_FAILURE;
+    }
+
+    /* Start performing operations depends on different commend. */
+    TRACE3(command_dispatch, client, req->cmd, req->name);
+    length = execute_request(hash_table_ptr, req, buf->output, 
+                             buf->output_size, &stream);
+
+    /* Keep what a pipelining client sent after this request. */
+    used = req->header_len + req->data_len;
+    if (stream.type != STREAM_SET && used < total){
+        buf->pending = total - used;
+        memmove(buf->input, buf->input + used, buf->pending);
+    }
+    if (stream.type == STREAM_SET){
+        status = 0;
+        if (!eof)
+            status = read_in_full(client, stream.data + stream.done, 
+                                  stream.size - stream.done);
+        STAT_ADD(syscalls, 1);
+        if (status > 0)
+            stream.done += status;
+        length = finish_request(hash_table_ptr, &stream, buf->output);
+    }
+    STAT_ADD(syscalls, 1);
+    status = write_response(client, req->cmd, buf->output, length);
+    if (stream.type == STREAM_GET){
+        if (status != -1){
+            status = write_in_full(client, stream.data + stream.done, 
+                                   stream.size - stream.done);
+            STAT_ADD(syscalls, 1);
+        }
+        finish_request(hash_table_ptr, &stream, buf->output);
+    }
+    RETURN_ON_VALUE(status, -1, "ERR OTHER\r\n", EXIT_FAILURE);
+    buf->eof = eof;
+    return EXIT_SUCCESS;
+}
+
+/*  
+* Name:         serve_client
+* Argument:     int, void*, conn_buffer*
+* Return:       int
+* Purpose:      Answer one request, or with -k every request until the 
+*               client closes or the server stops.
+* Note:         Returns the status of the last handle_client().
+*/
+int serve_client(int client, void *hash_table_ptr, conn_buffer *buf){
+    int status;
+
+    buf->pending = 0;
+    buf->served = 0;
+    buf->eof = 0;
+    do
+        status = handle_client(client, hash_table_ptr, buf);
+    while (keep_alive && status == EXIT_SUCCESS && !buf->eof && 
+           !is_interrupted);
+    return status;
+}
+
+/*  
+* Name:         worker_main
+* Argument:     void*
+* Return:       void*
+* Purpose:      Thread body, accept clients on the shared listening socket 
+*               and serve them until the server is interrupted.
+* Note:         Each worker keeps its own connection buffers. A sharded
+*               worker makes its table once pinned, so its pages are 
+*               first touched from its own core and NUMA node.
+*/
+void* worker_main(void *arg){
+    worker *self = (worker*)arg;
+    conn_buffer buf;
+    cpu_set_t cpus;
+
+    /* One thread per core, ignore failure on restricted cpusets. */
+    CPU_ZERO(&cpus);
+    CPU_SET(self->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    if (self->group != NULL){
+        self->hash_table_ptr = make_hashtable_opt(shard_elements, 
+                                                  shard_element_size, 
+                                                  &shard_options);
+        EXIT_ON_VALUE(self->hash_table_ptr, NULL, 
+                      "Cannot locate share memory, exit.\n", EXIT_FAILURE);
+        event_loop_run_shard(self->server_socket, self->hash_table_ptr, 
+                             self->group, self->id, self->backend, 
+                             self->stop_fd, keep_alive);
+        capture_flush();
+        hotkeys_release();
+        hash_detach(self->hash_table_ptr);
+        return NULL;
+    }
+
+    if (self->backend != EVLOOP_NONE){
+        event_loop_run(self->server_socket, self->hash_table_ptr, 
+                       self->backend, self->stop_fd, keep_alive);
+        capture_flush();
+        hotkeys_release();
+        return NULL;
+    }
+
+    if (alloc_conn_buffer(&buf, self->hash_table_ptr) == -1){
+        fprintf(stderr, "CANNOT ALLOCATE MEMORY, worker %d stop.\n", self->id);
+        return NULL;
+    }
+    buf.stop_fd = self->stop_fd;
+
+    while (!is_interrupted){
+        int client = accept_client(self->server_socket);
+        if (client == -1){
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            /* Listening socket shut down by the main thread. */
+            break;
+        }
+        STAT_ADD(connections, 1);
+        serve_client(client, self->hash_table_ptr, &buf);
+        close(client);
+        STAT_ADD(syscalls, 2);
+    }
+
+    free_conn_buffer(&buf);
+    capture_flush();
+    hotkeys_release();
+    return NULL;
+}
+
+/*  
+* Name:         run_threads
+* Argument:     int, void*, int, int
+* Return:       int
+* Purpose:      Serve clients with n_threads worker threads, each pinned 
+*               to a core, until SIGINT.
+* Note:         Workers block SIGINT, the main thread wait for it and shut
+*               down the listening socket to wake every blocked accept().
+*               With an event loop backend each thread runs its own loop 
+*               and the stop eventfd wakes them instead. After a -u 
+*               handoff the socket is the new server's, SIGUSR2 wakes the
+*               workers. Sharded workers make their own tables, 
+*               hash_table_ptr is NULL then.
+*/
+int run_threads(int server_socket, void *hash_table_ptr, int n_threads,
+                int backend){
+    int n_cpus = sysconf(_SC_NPROCESSORS_ONLN), stop_fd;
+    sigset_t set, old_set;
+    shard_group *group = NULL;
+    worker *workers;
+
+    if (n_threads == 0)
+        n_threads = n_cpus;
+    workers = calloc(n_threads, sizeof(worker));
+    RETURN_ON_VALUE(workers, NULL, "CANNOT ALLOCATE MEMORY, EXIT.\n", 
+                    EXIT_FAILURE);
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    RETURN_ON_VALUE(stop_fd, -1, "EVENTFD CREATION FAILED, EXIT.\n", 
+                    EXIT_FAILURE);
+    if (sharded){
+        /* Names and bytes are split evenly, rounded up. */
+        group = shard_group_create(n_threads);
+        RETURN_ON_VALUE(group, NULL, "CANNOT CREATE SHARDS, EXIT.\n", 
+                        EXIT_FAILURE);
+        shard_elements = (shard_elements + n_threads - 1) / n_threads;
+        shard_options.memory_limit = (shard_options.memory_limit + 
+                                      n_threads - 1) / n_threads;
+    }
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, &old_set);
+
+    FORONE(i, n_threads){
+        workers[i].id = i;
+        workers[i].server_socket = server_socket;
+        workers[i].backend = backend;
+        workers[i].stop_fd = stop_fd;
+        workers[i].cpu = i % n_cpus;
+        workers[i].group = group;
+        workers[i].hash_table_ptr = hash_table_ptr;
+        if (pthread_create(&workers[i].thread, NULL, worker_main, 
+                           &workers[i]) != 0){
+            fprintf(stderr, "THREAD CREATION FAILED, EXIT.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    fprintf(stderr, "%d worker threads running, event loop: %s.\n", 
+            n_threads, event_loop_name(backend));
+    if (sharded)
+        fprintf(stderr, "%d shards of %d elements.\n", n_threads, 
+                shard_elements);
+
+    /* Wait for SIGINT and SIGUSR1 on the main thread only. */
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    while (!is_interrupted){
+        pause();
+        if (export_requested)
+            export_table(hash_table_ptr);
+    }
+
+    fprintf(stderr, "\nReceived interrupt, ready to controlled shutdown.\n");
+    upgrade_stop();
+    eventfd_write(stop_fd, 1);
+    /* The new server accepts on the socket handed over, it must not be 
+     * shut down: workers blocked in accept() are signalled until out. */
+    if (backend == EVLOOP_NONE && !handed_off)
+        shutdown(server_socket, SHUT_RDWR);
+    FORONE(i, n_threads){
+        if (backend == EVLOOP_NONE && handed_off)
+            while (pthread_tryjoin_np(workers[i].thread, NULL) == EBUSY){
+                pthread_kill(workers[i].thread, SIGUSR2);
+                usleep(1000);
+            }
+        else
+            pthread_join(workers[i].thread, NULL);
+    }
+    fprintf(stderr, "All worker threads are finished, Detaching memory...\n");
+    compact_stop();
+    repl_stop();
+    if (!handed_off)
+        export_table(hash_table_ptr);
+
+    FREE(workers);
+    close(stop_fd);
+    if (group != NULL)
+        shard_group_free(group);
+    capture_close();
+    print_summary();
+    if (hash_table_ptr != NULL && handed_off)
+        hash_close(hash_table_ptr);
+    else if (hash_table_ptr != NULL)
+        hash_detach(hash_table_ptr);
+    fprintf(stderr, "Shared memory detached, exit now.\n");
+    return EXIT_SUCCESS;
+}
+
+/*  
+* Name:         run_fork
+* Argument:     int, void*
+* Return:       int
+* Purpose:      Serve every client in a forked child process until SIGINT.
+* Note:         Children hold the read end of a pipe, closing the write end
+*               on shutdown tells those waiting on kept alive clients.
+*/
+int run_fork(int server_socket, void *hash_table_ptr){
+    int status_exit, stop_pipe[2];
+    conn_buffer buf;
+
+    /* Allocated once, every child gets its own copy. */
+    EXIT_ON_VALUE(alloc_conn_buffer(&buf, hash_table_ptr), -1, 
+                  "CANNOT ALLOCATE MEMORY, EXIT. \n", EXIT_FAILURE);
+    EXIT_ON_VALUE(pipe(stop_pipe), -1, "PIPE CREATION FAILED, EXIT.\n",
+                  EXIT_FAILURE);
+    buf.stop_fd = stop_pipe[0];
 
     while(1){
         /* Handle signal interrupt. */
@@ -185,6 +948,8 @@ int main(int argc, char **argv){
                 "controlled shutdown.\n");
             fprintf(stderr, "Number of max child now is: "
                 "%d\nWaiting..\n", (child_spawn));
+            upgrade_stop();
+            close(stop_pipe[1]);
             FORONE(i, child_spawn){
                 int result;
                 int status_55;
@@ -193,17 +958,29 @@ int main(int argc, char **argv){
             }
             fprintf(stderr, 
                     "All child process are finished, Detaching memory...\n");
-            /* ADD: detach hashtable while control shutdown. */
-            hash_detach(hash_table_ptr);
+            compact_stop();
+            repl_stop();
+            if (!handed_off)
+                export_table(hash_table_ptr);
+            capture_close();
+            print_summary();
+            /* ADD: detach hashtable while control shutdown. The new 
+             * server of a handoff owns it now. */
+            if (handed_off)
+                hash_close(hash_table_ptr);
+            else
+                hash_detach(hash_table_ptr);
             fprintf(stderr, "Shared memory detached, exit now.\n");
-            exit(EXIT_SUCCESS);
+            free_conn_buffer(&buf);
+            close(stop_pipe[0]);
+            return EXIT_SUCCESS;
         }
 
-        struct sockaddr_in client_address;
-        socklen_t address_size;
+        if (export_requested)
+            export_table(hash_table_ptr);
 
         /* Wait to accept a new connection from a client */
-        int client = accept(server_socket, (SA*)&client_address, &address_size);
+        int client = accept_client(server_socket);
         if (client==-1 && errno == EINTR) continue;
         EXIT_ON_VALUE(client, -1, 
             "------------------\nACCEPT FAILED, EXIT.\n", EXIT_FAILURE);
@@ -217,383 +994,403 @@ int main(int argc, char **argv){
                       EXIT_FAILURE);
 
         if(child_pid==0){
-            fprintf(stderr, "----------------\nIn child #: %d\n", child_spawn);
-            
-            /* Read in data from client, romove \r\n from back. */
-            char *row_r = malloc(MAX_INPUT_SIZE);
-            EXIT_ON_VALUE(row_r, NULL, "CANNOT ALLOCATE MEMORY, EXIT. \n",
-                          EXIT_FAILURE);
-
-            status = read(client, row_r, MAX_INPUT_SIZE);
-            EXIT_ON_VALUE(status, -1, "CANNOT READ, EXIT.\n", EXIT_FAILURE);
-
-            size_t row_size = strlen(row_r);
-
-            fprintf(stderr, "bytes read:%d, real size:%ld\n -With client:%d\n",
-                    status, row_size,(child_spawn+1));
-            fprintf(stderr, "row_r is :%s\n", row_r);
-            
-            char *temp_pch = strtok(row_r, "\r");
-            char *row = malloc(MAX_INPUT_SIZE);
-            EXIT_ON_VALUE(row, NULL, "CANNOT ALLOCATE MEMORY, EXIT. \n",
-                          EXIT_FAILURE);
-
-            strcpy(row, temp_pch);
-
-            char *remain_row = malloc(MAX_INPUT_SIZE);
-            EXIT_ON_VALUE(remain_row, NULL, "CANNOT ALLOCATE MEMORY, EXIT. \n",
-                          EXIT_FAILURE);
-
-            fprintf(stderr, "row:%s\n", row);
-
-            size_t compare_status = (status-2);
-
-            /* 
-             * Data send always ended with \r\n, compare bytes read in to
-             * decide if there are any remaining data. 
-             */
-            if (row_size > compare_status){
-                temp_pch = strtok(NULL, "");
-                strcpy(remain_row, (temp_pch+1));
-                fprintf(stderr, "Remaining row is :%s\nWith bytes:%ld\n", 
-                        remain_row, strlen(remain_row));
-                fprintf(stderr, "Row commend include 'r' is :%ld\n", 
-                        strlen(row));
-            }
-
-            /* 
-             *   Do not perform read_in_full() and write_in_full() on unknow 
-             *   length of data. 
-             */
-            
-
-            fprintf(stderr, "DATA is:%s\nwith length:%ld\n -With client:%d\n",
-                    row, strlen(row), (child_spawn+1));
-            
- 
-            char *cmd = malloc(MAX_INPUT_SIZE); 
-            EXIT_ON_VALUE(cmd, NULL, "CANNOT ALLOCATE MEMORY, EXIT. \n", 
-                          EXIT_FAILURE);
-
-            /* size appear SET commend. */
-            int size;
-
-            /* String list for commend. */
-            char **input_cmd = malloc(MAX_INPUT_SIZE*sizeof(input_cmd[0]));
-            EXIT_ON_VALUE(input_cmd, NULL, "CANNOT ALLOCATE MEMORY, EXIT. \n",
-                EXIT_FAILURE);
-            /* cmd_size should be 3 with SET, 2 with others. */
-            int cmd_size = split_str(row, input_cmd);
-
-            /* name(key) for hash. */
-            char *name = input_cmd[1];
-
-            fprintf(stderr, "DEBUG: cmd_size is:%d\n", cmd_size);
-
-            /* Error checking process. */
-            FORONE(i, 3){
-                status_2 = strcmp(cmd_list[i], input_cmd[0]);
-                if (status_2 == 0) {
-                    flag = i;
-                    break;
-                }
-                status_2 = 100;
-            }
-            fprintf(stderr, "CMD is :%s\n - With client:%d\n",cmd_list[flag], 
-                (child_spawn+1));
-            fprintf(stderr, "DEBUG: the flag is:%d\n", flag);
-
-            /* First element is not command. */
-            if (status_2 == 100){
-                char err_msg[] = "ERR INVALID_COMMAND\r\n";
-                status_o = write_in_full(client, err_msg, strlen(err_msg));
-                //status = write(client, err_msg, strlen(err_msg));
-                EXIT_ON_VALUE(status, -1, "ERR OTHER\r\n", EXIT_FAILURE);
-
-                /* Prepare to close. */
-                status_o = close(client);
-                EXIT_ON_VALUE(status_o, -1, "ERR OTHER\r\n", EXIT_FAILURE);
+            STAT_ADD(connections, 1);
+            STAT_ADD(syscalls, 2);      /* accept() and fork(). */
+            close(stop_pipe[1]);
+            if (upgrade_socket != -1)
+                close(upgrade_socket);
+            int status = serve_client(client, hash_table_ptr, &buf);
+            STAT_ADD(syscalls, 2);      /* close() in child and parent. */
+
+            /* Prepare to close. */
+            EXIT_ON_VALUE(close(client), -1, "ERR OTHER\r\n", EXIT_FAILURE);
+            capture_flush();
+            hotkeys_release();
+            exit(status);
+        }
+        else{
+            close(client);
+            while(waitpid(0, &status_exit, WNOHANG|WUNTRACED) > 0){
+                STAT_ADD(syscalls, 1);
                 child_spawn--;
-                FREE_ON_VAL(row, cmd, name);
-                
-                exit(EXIT_FAILURE);
             }
+            STAT_ADD(syscalls, 1);
+            child_spawn++;
+        }
+    }
+}
 
-            /* Commend "SET" requires 3 exzact arguments. */
-            if(flag == 0 && cmd_size != 3){
-
-                char err_msg[] = "ERR INVALID_COMMAND\r\n";
-                fprintf(stderr, "DEBUG: triggered. \n");
-
-                status_o = write_in_full(client, err_msg, strlen(err_msg));
-                //status = write(client, err_msg, strlen(err_msg));
-                EXIT_ON_VALUE(status, -1, "ERR OTHER\r\n", EXIT_FAILURE);
-
-                /* Prepare to close. */
-                status_o = close(client);
-                EXIT_ON_VALUE(status_o, -1, "ERR OTHER\r\n", EXIT_FAILURE);
-                child_spawn--;
-                FREE_ON_VAL(row, cmd, name);
-
-                
-                exit(EXIT_FAILURE);
-                
-            }
-            /* Commend "GET" requires 2 exzact arguments. */
-            else if(flag==1 && cmd_size != 2){
-                char err_msg[] = "ERR INVALID_COMMAND\r\n";
-                status_o = write_in_full(client, err_msg, strlen(err_msg));
-                //status = write(client, err_msg, strlen(err_msg));
-                EXIT_ON_VALUE(status, -1, "ERR OTHER\r\n", EXIT_FAILURE);
-
-                /* Prepare to close. */
-                status_o = close(client);
-                EXIT_ON_VALUE(status_o, -1, "ERR OTHER\r\n", EXIT_FAILURE);
-                child_spawn--;
-                FREE_ON_VAL(row, cmd, name);
+/*  
+* Name:         parse_bytes
+* Argument:     const char*, size_t*
+* Return:       int
+* Purpose:      Read a byte count with an optional K, M or G suffix.
+* Note:         Returns 1 on success, 0 for a bad or zero count.
+*/
+int parse_bytes(const char *text, size_t *bytes){
+    char *end;
+    unsigned long long value;
+
+    if (!isdigit((unsigned char)text[0]))
+        return 0;
+    value = strtoull(text, &end, 10);
+    switch (toupper((unsigned char)*end)){
+        case 'G': value <<= 10;     /* Fall through. */
+        case 'M': value <<= 10;     /* Fall through. */
+        case 'K': value <<= 10; end++; break;
+    }
+    if (*end != '\0' || value == 0)
+        return 0;
+    *bytes = value;
+    return 1;
+}
 
-                
-                exit(EXIT_FAILURE);
-            }
-            /* Commend "DELETE" requries 2 exzact arguements. */
-            else if(flag==2 && cmd_size != 2){
-                char err_msg[] = "ERR INVALID_COMMAND\r\n";
-                status_o = write_in_full(client, err_msg, strlen(err_msg));
-                //status = write(client, err_msg, strlen(err_msg));
-                EXIT_ON_VALUE(status, -1, "ERR OTHER\r\n", EXIT_FAILURE);
-
-                /* Prepare to close. */
-                status_o = close(client);
-                EXIT_ON_VALUE(status_o, -1, "ERR OTHER\r\n", EXIT_FAILURE);
-                child_spawn--;
-                FREE_ON_VAL(row, cmd, name);
+/*  
+* Name:         argv_check
+* Argument:     int*
+* Return:       int
+* Purpose:      Check if argvs contain any error and mistake.
+* Note:         num_elements may be 0 when -m sizes the table.
+*/
+int argv_check(int *argv_in){
+    if (argv_in[0]<0 || argv_in[0]>65535) return 0;
+    else if (argv_in[1]<0 || argv_in[2]<1) return 0;
+    child_spawn=0;      /*  <--- Pass error checking, initialize static variable. */
+    return 1;
+}
 
-                
+int main(int argc, char **argv){
+    int argv_in[3];     /*  <--- argv transformed to int. */
+    int status, option, server_socket, n_threads = -1, backend = EVLOOP_NONE;
+    hash_options options = {0};
+    struct sockaddr_in address;
+    char *load_path = NULL, primary_host[256] = "", shm_name[HASH_NAME_SIZE];
+    int repl_port = -1, primary_port = -1, refuse = 0, near_entries = 0;
+    int taken_over = 0, capture_values = 0, hot_every = 0;
+    char *capture_path = NULL;
+    void *repl_log = NULL, *hash_table_ptr = NULL;
+
+    /* Options come before the positional arguments. */
+    while ((option = getopt(argc, argv, "t:e:z:v:l:d:r:f:km:MabHB:c:Sn:u:C:VT:s:K:")) != -1){
+        switch (option){
+            case 't':
+                status = sscanf(optarg, "%d", &n_threads);
+                EXIT_NOT_ON_VALUE(status, 1, "BAD COMMANDLINE ARGUMENT, EXIT.\n",
+                                  EXIT_FAILURE);
+                EXIT_ON_VALUE(n_threads < 0, 1, 
+                              "BAD COMMANDLINE ARGUMENT, EXIT.\n", EXIT_FAILURE);
+                break;
+            case 'e':
+                if (strcmp(optarg, "epoll") == 0)
+                    backend = EVLOOP_EPOLL;
+                else if (strcmp(optarg, "uring") == 0)
+                    backend = EVLOOP_URING;
+                else{
+                    fprintf(stderr, "BAD COMMANDLINE ARGUMENT, EXIT.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'z':
+                status = sscanf(optarg, "%d", &options.compress_threshold);
+                EXIT_NOT_ON_VALUE(status, 1, "BAD COMMANDLINE ARGUMENT, EXIT.\n",
+                                  EXIT_FAILURE);
+                EXIT_ON_VALUE(options.compress_threshold < 1, 1, 
+                              "BAD COMMANDLINE ARGUMENT, EXIT.\n", EXIT_FAILURE);
+                break;
+            case 'v':
+                status = sscanf(optarg, "%d", &options.max_value_size);
+                EXIT_NOT_ON_VALUE(status, 1, "BAD COMMANDLINE ARGUMENT, EXIT.\n",
+                                  EXIT_FAILURE);
+                EXIT_ON_VALUE(options.max_value_size < 1, 1, 
+                              "BAD COMMANDLINE ARGUMENT, EXIT.\n", EXIT_FAILURE);
+                break;
+            case 'l':
+                load_path = optarg;
+                break;
+            case 'd':
+                export_path = optarg;
+                break;
+            case 'r':
+                status = sscanf(optarg, "%d", &repl_port);
+                EXIT_NOT_ON_VALUE(status, 1, "BAD COMMANDLINE ARGUMENT, EXIT.\n",
+                                  EXIT_FAILURE);
+                break;
+            case 'k':
+                keep_alive = 1;
+                break;
+            case 'm':
+                EXIT_NOT_ON_VALUE(parse_bytes(optarg, &options.memory_limit),
+                                  1, "BAD COMMANDLINE ARGUMENT, EXIT.\n",
+                                  EXIT_FAILURE);
+                break;
+            case 'M':
+                refuse = 1;
+                break;
+            case 'b':
+                options.layout = HASH_LAYOUT_BUCKETS;
+                break;
+            case 'H':
+                options.engine = HASH_ENGINE_CUCKOO;
+                break;
+            case 'B':
+                status = sscanf(optarg, "%d", &options.bloom);
+                EXIT_NOT_ON_VALUE(status, 1, "BAD COMMANDLINE ARGUMENT, EXIT.\n",
+                                  EXIT_FAILURE);
+                EXIT_ON_VALUE(options.bloom < 1, 1, 
+                              "BAD COMMANDLINE ARGUMENT, EXIT.\n", EXIT_FAILURE);
+                break;
+            case 'c':
+                status = sscanf(optarg, "%d", &near_entries);
+                EXIT_NOT_ON_VALUE(status, 1, "BAD COMMANDLINE ARGUMENT, EXIT.\n",
+                                  EXIT_FAILURE);
+                EXIT_ON_VALUE(near_entries < 1, 1, 
+                              "BAD COMMANDLINE ARGUMENT, EXIT.\n", EXIT_FAILURE);
+                options.near_cache = 1;
+                break;
+            case 'S':
+                sharded = 1;
+                break;
+            case 'a':
+                options.admission = 1;
+                break;
+            case 'n':
+                EXIT_ON_VALUE(strlen(optarg) + 2 > HASH_NAME_SIZE || 
+                              strchr(optarg, '/') != NULL, 1, 
+                              "BAD COMMANDLINE ARGUMENT, EXIT.\n", 
+                              EXIT_FAILURE);
+                sprintf(shm_name, "/%s", optarg);
+                options.name = shm_name;
+                break;
+            case 'u':
+                EXIT_ON_VALUE(strlen(optarg) >= 
+                              sizeof(((struct sockaddr_un*)0)->sun_path), 1,
+                              "BAD COMMANDLINE ARGUMENT, EXIT.\n", 
+                              EXIT_FAILURE);
+                upgrade_path = optarg;
+                break;
+            case 'C':
+                capture_path = optarg;
+                break;
+            case 'V':
+                capture_values = 1;
+                break;
+            case 'T':
+                EXIT_ON_VALUE(strlen(optarg) >= HASH_PATH_SIZE, 1,
+                              "BAD COMMANDLINE ARGUMENT, EXIT.\n", 
+                              EXIT_FAILURE);
+                options.tier_path = optarg;
+                break;
+            case 's':
+                status = sscanf(optarg, "%d", &options.tier_threshold);
+                EXIT_NOT_ON_VALUE(status, 1, "BAD COMMANDLINE ARGUMENT, EXIT.\n",
+                                  EXIT_FAILURE);
+                EXIT_ON_VALUE(options.tier_threshold < 1, 1, 
+                              "BAD COMMANDLINE ARGUMENT, EXIT.\n", EXIT_FAILURE);
+                break;
+            case 'K':
+                status = sscanf(optarg, "%d", &hot_every);
+                EXIT_NOT_ON_VALUE(status, 1, "BAD COMMANDLINE ARGUMENT, EXIT.\n",
+                                  EXIT_FAILURE);
+                EXIT_ON_VALUE(hot_every < 1, 1, 
+                              "BAD COMMANDLINE ARGUMENT, EXIT.\n", EXIT_FAILURE);
+                break;
+            case 'f':
+                status = sscanf(optarg, "%255[^:]:%d", primary_host, 
+                                &primary_port);
+                EXIT_NOT_ON_VALUE(status, 2, "BAD COMMANDLINE ARGUMENT, EXIT.\n",
+                                  EXIT_FAILURE);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-t threads] [-e epoll|uring] "
+                        "[-z compress_threshold [-v max_value_size]] "
+                        "[-l dump] [-d dump] [-r repl_port | -f host:port] "
+                        "[-k] [-m limit [-M]] [-a] [-b] [-H] [-B counters] "
+                        "[-c entries] [-S] [-n name] [-u path] [-C trace [-V]] "
+                        "[-T extent_file [-s spill_threshold]] [-K sample] "
+                        "<port> <num_elements> <element_size>\n", argv[0]);
                 exit(EXIT_FAILURE);
-            }
-            else fprintf(stderr, "Error checking: arguments # Passed!\n");
-
-            /* Name should be shorter than 120. */
-            fprintf(stderr, "DEBUG: name size is:%ld\n", strlen(name));
-            if (strlen(name)>120){
-                char err_msg[] = "ERR NAME_TOO_LONG\r\n";
-                status_o = write_in_full(client, err_msg, strlen(err_msg));
-                EXIT_ON_VALUE(status_o, -1, "ERR OTHER\r\n", EXIT_FAILURE);
-                fprintf(stderr, "DEBUG: message:%d\n", status_o);
-
-                /* Prepare to close. */
-                status_o = close(client);
-                EXIT_ON_VALUE(status_o, -1, "ERR OTHER\r\n", EXIT_FAILURE);
-                child_spawn--;
-                FREE_ON_VAL(row, cmd, name);
+        }
+    }
 
-                exit(EXIT_FAILURE);
-            }
-            fprintf(stderr, "Error checking: name length Passed!\n");
-
-            /* Name should not contain except a-z, A-Z, 0-9. */
-            FORONE(i, (int)strlen(name)){
-                if (!((name[i]>=48 && name[i]<=57)||
-                    (name[i]>=65 && name[i]<=90)||
-                    (name[i]>=97 && name[i]<=122))){
-                        char err_msg[] = "ERR BAD_NAME\r\n";
-                        status_o = write_in_full(client, err_msg, 
-                            strlen(err_msg));
-                        EXIT_ON_VALUE(status_o, -1, "ERR OTHER\r\n", 
-                            EXIT_FAILURE);
-
-                        /* Prepare to close. */
-                        status_o = close(client);
-                        EXIT_ON_VALUE(status_o, -1, "ERR OTHER\r\n", 
-                            EXIT_FAILURE);
-                        child_spawn--;
-                        FREE_ON_VAL(row, cmd, name);
-
-                        exit(EXIT_FAILURE);
-                    }
-            }
-            fprintf(stderr, "Error checking: name character Passed!\n");
-            
-
-            /* Size should be an int where at least 1. */
-            if (flag == 0){
-                fprintf(stderr, "INTO THIS STEP1\ninput_cmd[2] is:%s\n", 
-                    input_cmd[2]);
-                for (size_t i = 0; i < strlen(input_cmd[2]); i++){
-                    if (!isdigit(input_cmd[2][i])){
-                        fprintf(stderr, "INTO THIS STEP\n");
-                        char err_msg[] = "ERR INVALID_SIZE\r\n";
-                        status_o = write_in_full(client, err_msg, 
-                            strlen(err_msg));
-                        EXIT_ON_VALUE(status_o, -1, "ERR OTHER\r\n", 
-                            EXIT_FAILURE);
-
-                        /* Prepare to close. */
-                        status_o = close(client);
-                        EXIT_ON_VALUE(status_o, -1, "ERR OTHER\r\n", 
-                            EXIT_FAILURE);
-                        child_spawn--;
-                        FREE_ON_VAL(row, cmd, name);
-
-                        exit(EXIT_FAILURE);
-                    }
-                }
+    /* Argument checking. */
+    EXIT_NOT_ON_VALUE(argc - optind, 3, "TOO MANY OR TO FEW ARGUMENTS, EXIT.\n", 
+                      EXIT_FAILURE);
+    FORONE(i, 3){
+        status = sscanf(argv[optind+i],"%d", &argv_in[i]);
+        EXIT_NOT_ON_VALUE(status, 1, "BAD COMMANDLINE ARGUMENT, EXIT.\n", 
+                          EXIT_FAILURE);
+    } 
+    if (!argv_check(argv_in)){
+        fprintf(stderr,"BAD COMMANDLINE ARGUMENT, EXIT.\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((repl_port != -1 && primary_port != -1) || repl_port > 65535 ||
+        primary_port > 65535 || 
+        (argv_in[1] == 0 && options.memory_limit == 0) ||
+        (sharded && (backend == EVLOOP_NONE || load_path != NULL || 
+                     export_path != NULL || repl_port != -1 || 
+                     primary_port != -1 || options.name != NULL)) ||
+        (upgrade_path != NULL && (sharded || repl_port != -1 || 
+                                  primary_port != -1)) ||
+        (keep_alive && n_threads >= 0 && backend == EVLOOP_NONE) ||
+        (near_entries > 0 && n_threads < 0 && backend == EVLOOP_NONE) ||
+        (capture_values && capture_path == NULL) ||
+        (options.tier_path != NULL && sharded) ||
+        (options.tier_threshold > 0 && options.tier_path == NULL)){
+        fprintf(stderr,"BAD COMMANDLINE ARGUMENT, EXIT.\n");
+        exit(EXIT_FAILURE);
+    }
 
-                sscanf(input_cmd[2], "%d", &size);
-
-                /* ADD: compare size with max_elements_size. */
-                if (size<1 || sizeof(size)!=sizeof(int) || 
-                    size > hash_get_max_elements_size(hash_table_ptr)){
-                        char err_msg[] = "ERR INVALID_SIZE\r\n";
-                        status_o = write_in_full(client, err_msg, 
-                            strlen(err_msg));
-                        EXIT_ON_VALUE(status_o, -1, "ERR OTHER\r\n", 
-                            EXIT_FAILURE);
-
-                        /* Prepare to close. */
-                        status_o = close(client);
-                        EXIT_ON_VALUE(status_o, -1, "ERR OTHER\r\n", 
-                            EXIT_FAILURE);
-                        child_spawn--;
-                        FREE_ON_VAL(row, cmd, name);
-
-                        exit(EXIT_FAILURE);
-                }
-            }
-            fprintf(stderr, "Error checking: SET size Passed!\n");
-
-            /* End of error checking.*/
-
-            /* Start performing operations depends on different commend. */
-            /* flag status: 0 for SET, 1 for GET, 2 for DELETE. */
-            if (flag == 0){
-                /* Data with everythiing after commend. */
-                void *buffer_1 = malloc(MAX_INPUT_SIZE);
-                //status_s = read(client, buffer_1, MAX_INPUT_SIZE);
-                size_t compare_size = size;
-
-                // char *pch = strtok(buffer_1, DELIMETER_NW);
-                // fprintf(stderr, "Status_s is original: %d\n", status_s);
-                // if (strlen(pch)<=strlen(buffer_1)) status_s = strlen(pch);
-                
-                fprintf(stderr, "size is %d\nremaining row is %ld\n", 
-                    size, strlen(remain_row));
-                /* Check if client send to much data. */
-                if (strlen(remain_row) < compare_size){
-                    char err_msg[] = "ERR TOO_SMALL\r\n";
-                    status_o = write_in_full(client, err_msg, strlen(err_msg));
-                    EXIT_ON_VALUE(status, -1, "ERR OTHER\r\n", EXIT_FAILURE);
-
-                    /* Prepare to close. */
-                    status_o = close(client);
-                    EXIT_ON_VALUE(status, -1, "ERR OTHER\r\n", EXIT_FAILURE);
-                    child_spawn--;
-                    FREE_ON_VAL(row, cmd, name); FREE(buffer_1);
+    /* An event loop runs in one worker thread unless -t ask for more, 
+     * shards on every core. */
+    if (backend != EVLOOP_NONE && n_threads < 0)
+        n_threads = sharded ? 0 : 1;
+    if (backend == EVLOOP_URING && event_loop_supported(backend) != backend){
+        fprintf(stderr, "io_uring needs Linux 6.0, falling back to epoll.\n");
+        backend = EVLOOP_EPOLL;
+    }
 
-                    exit(EXIT_FAILURE);
-                }
-                /* SET commend all error checking pass, handling data. */
-                else{
-                    memcpy(buffer_1, remain_row, size);
-                    fprintf(stderr, "Reamining data waiting for handling is"
-                        " :%s\n", buffer_1);
-
-                    /* ADD: set the value in the shared hashtable for the give
-                    *  name and value (the first <size> bytes after the first 
-                    *  line of the request read above in (g)).*/
-                    status_hash = hash_set(hash_table_ptr, name, buffer_1, size);
-
-                    char *err_msg = malloc(20*sizeof(char));
-                    if (status_hash == HASH_OK) 
-                        strcpy(err_msg, "OK\r\n");
-                    else if (status_hash == HASH_ERR_COLISION)
-                        strcpy(err_msg, "ERR NO_SPACE\r\n");
-                    else
-                        strcpy(err_msg, "ERR OTHER\r\n");
-                    
-                    status_o = write_in_full(client, err_msg, strlen(err_msg));
-                    EXIT_ON_VALUE(status_o, -1, "ERR OTHER\r\n", EXIT_FAILURE);
-
-                    /* Prepare to close. */
-                    status_o = close(client);
-                    EXIT_ON_VALUE(status_o, -1, "ERR OTHER\r\n", EXIT_FAILURE);
-
-                    fprintf(stderr, "DEBUG: close OK successful.\n");
-                    child_spawn--;
-                    FREE_ON_VAL(row, cmd, name); FREE(buffer_1);
-                    FREE(err_msg);
-
-                    exit(EXIT_SUCCESS);
-                }
-            }
-            /* GET commend all error checking pass, handling data. */
-            else if (flag == 1){
-                /* ADD: The process should attempt to get the value of 
-                *  the element from the hashtable from the entry with 
-                *  the given name, and the size in bytes of the element.
-                */ 
-                
-                int size_from_hash;
-                void *data_out;
-                status_hash = hash_get(hash_table_ptr, name, &(data_out), 
-                                       &size_from_hash);   
-
-                char *err_msg = malloc(20*sizeof(char));
-                if (status_hash == HASH_OK)
-                    sprintf(err_msg, "OK %d\r\n%s", size_from_hash, 
-                            (char*)data_out);
-                else if (status_hash == HASH_ERR_NOEXIT)
-                    strcpy(err_msg, "ERR NOT_FOUND\r\n");
-                else
-                    strcpy(err_msg, "ERR OTHER\r\n");
-
-                status_o = write_in_full(client, err_msg, strlen(err_msg));
-                EXIT_ON_VALUE(status_o, -1, "ERR OTHER\r\n", EXIT_FAILURE);
-
-                /* Prepare to close. */
-                status_o = close(client);
-                EXIT_ON_VALUE(status_o, -1, "ERR OTHER\r\n", EXIT_FAILURE);
-                child_spawn--;
-                FREE_ON_VAL(row, cmd, name); FREE(err_msg);
+    /* The table is handed over as a shared memory object, named after 
+     * the port unless -n names it. */
+    if (upgrade_path != NULL && options.name == NULL){
+        sprintf(shm_name, "/memcache-%d", argv_in[0]);
+        options.name = shm_name;
+    }
+    if (upgrade_path != NULL){
+        taken_over = upgrade_receive(&server_socket, &hash_table_ptr);
+        EXIT_ON_VALUE(taken_over, -1, "UPGRADE HANDOFF FAILED, EXIT.\n", 
+                      EXIT_FAILURE);
+    }
 
-                exit(EXIT_SUCCESS);
-            }
-            /* DELETE commend all error checking pass, hadnling data. */
-            else{
-                /* ADD: The process should attempt to delete the element 
-                *  in the hashtable with the given name.
-                */
-                status_hash = hash_delete(hash_table_ptr, name);
-                char *err_msg = malloc(20*sizeof(char));
-                if (status_hash == HASH_OK)
-                    strcpy(err_msg, "OK 1\r\n");
-                else if (status_hash == HASH_ERR_NOEXIT)
-                    strcpy(err_msg, "OK 0\r\n");
-                else
-                    strcpy(err_msg, "ERR OTHER\r\n");
-
-                status_o = write_in_full(client, err_msg, strlen(err_msg));
-                EXIT_ON_VALUE(status_o, -1, "ERR OTHER\r\n", EXIT_FAILURE);
-
-                /* Prepare to close. */
-                status_o = close(client);
-                EXIT_ON_VALUE(status_o, -1, "ERR OTHER\r\n", EXIT_FAILURE);
-                child_spawn--;
-                FREE_ON_VAL(row, cmd, name); FREE(err_msg);
+    /* ADD: Initialize a hashtable with shared memory. Threads share the
+     * process, a mutex is enough for them unless others attach. */
+    if (n_threads >= 0 && options.name == NULL)
+        options.lock_type = HASH_LOCK_THREAD;
+    /* A primary journals every change, forked children included. */
+    if (repl_port != -1){
+        repl_log = repl_log_create(REPL_LOG_SIZE);
+        EXIT_ON_VALUE(repl_log, NULL, "CANNOT CREATE REPLICATION LOG, EXIT.\n",
+                      EXIT_FAILURE);
+        options.journal = repl_journal;
+        options.journal_arg = repl_log;
+    }
+    /* A byte budget evicts to make room unless -M asks to refuse. */
+    options.evict = options.memory_limit > 0 && !refuse;
+    if (taken_over)
+        fprintf(stderr, "Took over %s, the table and its options are the "
+                "old server's.\n", upgrade_path);
+    else if (sharded){
+        /* Each worker makes its share once running on its core. */
+        shard_options = options;
+        shard_elements = argv_in[1];
+        shard_element_size = argv_in[2];
+    }
+    else{
+        hash_table_ptr = make_hashtable_opt(argv_in[1], argv_in[2], &options);
+        EXIT_ON_VALUE(hash_table_ptr, NULL, 
+                      "Cannot locate share memory, exit.\n", EXIT_FAILURE);
+        hash_stats table;
+        hash_get_stats(hash_table_ptr, &table);
+        fprintf(stderr, "num_elements:%d\nmax_num_elements:%d\n", 
+                table.num_elements, argv_in[2]);
+    }
+    if (stats_create() == NULL)
+        fprintf(stderr, "Cannot map server stats, counting disabled.\n");
+
+    /* Bulk load and export use every core, the table is not served yet. */
+    n_bulk_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (load_path != NULL && !taken_over){
+        bulk_result result = {0};
+
+        status = bulk_load(hash_table_ptr, load_path, n_bulk_workers, &result);
+        fprintf(stderr, "Loaded %ld entries (%ld refused) from %s in %.3f s.\n",
+                result.records, result.errors, load_path, result.seconds);
+        EXIT_ON_VALUE(status, -1, "CANNOT LOAD DUMP FILE, EXIT.\n", 
+                      EXIT_FAILURE);
+    }
 
-                exit(EXIT_SUCCESS);
-            }
+    if (repl_port != -1)
+        EXIT_ON_VALUE(repl_primary_start(hash_table_ptr, repl_log, repl_port),
+                      -1, "CANNOT SERVE REPLICAS, EXIT.\n", EXIT_FAILURE);
+    protocol_set_near_cache(near_entries);
+    if (capture_path != NULL)
+        EXIT_ON_VALUE(capture_open(capture_path, capture_values), -1,
+                      "CANNOT OPEN CAPTURE FILE, EXIT.\n", EXIT_FAILURE);
+    if (hot_every > 0)
+        EXIT_ON_VALUE(hotkeys_create(hot_every), -1,
+                      "CANNOT MAP HOT KEY BOARDS, EXIT.\n", EXIT_FAILURE);
+    if (primary_port != -1){
+        protocol_set_read_only(1);
+        EXIT_ON_VALUE(repl_replica_start(hash_table_ptr, primary_host, 
+                                         primary_port), 
+                      -1, "CANNOT START REPLICA, EXIT.\n", EXIT_FAILURE);
+    }
 
-            write(client, "TEST, no errors.\n", 17);
+    /* Set up signal handler. */
+    struct sigaction sigint_handler;
 
-        }
-        else{
-            close(client);
-            while(waitpid(0, &status_exit, WNOHANG|WUNTRACED)!= 0)
-                ;
-            child_spawn++;
-        }
+    sigint_handler.sa_handler = sigint_received;
+    sigemptyset(&sigint_handler.sa_mask);
+    sigint_handler.sa_flags = 0;
+    
+    status = sigaction(SIGINT, &sigint_handler, NULL);
+    if (status != 0) {
+        perror(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    sigint_handler.sa_handler = sigusr1_received;
+    status = sigaction(SIGUSR1, &sigint_handler, NULL);
+    if (status != 0) {
+        perror(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    /* No SA_RESTART either, accept() must return. */
+    sigint_handler.sa_handler = wake_received;
+    status = sigaction(SIGUSR2, &sigint_handler, NULL);
+    if (status != 0) {
+        perror(argv[0]);
+        exit(EXIT_FAILURE);
     }
 
-    exit(EXIT_SUCCESS);
+    /* A client gone while its responses are written fails the write, it
+     * must not kill every thread of the server. */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* A server taking over accepts on the old one's socket. */
+    if (!taken_over){
+        /* Define an address that means port defined by user on all my network interfaces. */
+        address.sin_family = AF_INET;
+        address.sin_port = htons(argv_in[0]);
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+        /* Create a TCP socket. */
+        server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        EXIT_ON_VALUE(server_socket, -1, "SOCKET CREATION FAILED, EXIT.\n", 
+            EXIT_FAILURE);
+        fprintf(stderr, "socket created: %d\n", server_socket);
+
+        /* Allow a restart while old connections are still in TIME_WAIT. */
+        int reuse = 1;
+        setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        /* Assign it the address defined above. */
+        status = bind(server_socket, (SA*)&address, sizeof(address));
+        EXIT_ON_VALUE(status, -1, "BIND FAILED, EXIT.\n", EXIT_FAILURE);
+        fprintf(stderr, "bound: %d\n", status);
+
+        /* Ask the kernel to make it a listening socket with a queue of 10 */
+        status = listen(server_socket, MAX_LIS_QUEUE);
+        EXIT_ON_VALUE(status, -1, "LISTEN CREATION FAILED, EXIT.\n", 
+                      EXIT_FAILURE);
+    }
+    fprintf(stderr, "Server is running, waiting for connections..\n");
+    if (upgrade_path != NULL)
+        EXIT_ON_VALUE(upgrade_start(server_socket, hash_table_ptr), -1, 
+                      "CANNOT LISTEN FOR UPGRADES, EXIT.\n", EXIT_FAILURE);
+    EXIT_ON_VALUE(compact_start(hash_table_ptr), -1, 
+                  "CANNOT START COMPACTION, EXIT.\n", EXIT_FAILURE);
+
+    if (n_threads >= 0)
+        exit(run_threads(server_socket, hash_table_ptr, n_threads, backend));
+    exit(run_fork(server_socket, hash_table_ptr));
 }
@@ -0,0 +1,645 @@
+/* 
+ *  File:        protocol.c
+ *  Purpose:     Parsing and executing memcache requests, shared by every 
+ *               server mode in memcache.c.
+ * 
+ *  Note:        Error checking happens in the same order as the original
+ *               forked handler, so clients see the same error for the 
+ *               same bad request.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "utility_macros.h"
+#include "shared_hashtable.h"
+#include "trace_probes.h"
+#include "stats.h"
+#include "capture.h"
+#include "hotkeys.h"
+#include "protocol.h"
+
+#define DELIIMETER      " \t"
+#define NEAR_VALUE_SIZE 1024        /* Largest value kept in a near cache. */
+
+/* Initial cmd_list for compare, index is the CMD_* value. */
+static const char cmd_list[N_COMMANDS][10] = {{"SET\0"}, {"GET\0"}, 
+                                              {"DELETE\0"}, {"STATS\0"},
+                                              {"MEMORY\0"}, {"MSET\0"},
+                                              {"MDELETE\0"}, {"HOTKEYS\0"}};
+
+/* Number of tokens each command requires, index is the CMD_* value. */
+static const int cmd_tokens[N_COMMANDS] = {3, 2, 2, 1, 1, 2, 2, 1};
+
+/* Names of an MSET/MDELETE body, copied out of it. */
+typedef struct batch_struct {
+    int n;                                  /* Names in the body. */
+    char names[MAX_BATCH_KEYS][MAX_NAME_SIZE];
+    const char *errors[MAX_BATCH_KEYS];     /* check_name() response, or 
+                                               NULL for a good name. */
+    void *data[MAX_BATCH_KEYS];             /* MSET values, in the body. */
+    int sizes[MAX_BATCH_KEYS];
+} batch;
+
+/* Set on replicas, SET and DELETE are refused. */
+static int read_only = 0;
+
+/* Entries of each worker's near cache, 0 for none. */
+static int near_entries = 0;
+
+/* The calling worker's near cache, made on its first GET. */
+static __thread hash_near *near = NULL;
+
+
+/*  
+* Name:         parse_error
+* Argument:     request*, const char*
+* Return:       int
+* Purpose:      Record the response for a bad request.
+* Note:         Always returns PARSE_ERROR.
+*/
+static int parse_error(request *req, const char *message){
+    req->error = message;
+    return PARSE_ERROR;
+}
+
+/*  
+* Name:         check_name
+* Argument:     char*
+* Return:       const char*
+* Purpose:      Check a name is short enough and only contain a-z, A-Z, 
+*               0-9.
+* Note:         Returns NULL if the name is good, else the error response.
+*/
+static const char* check_name(char *name){
+    size_t length = strlen(name);
+
+    if (length >= MAX_NAME_SIZE)
+        return "ERR NAME_TOO_LONG\r\n";
+
+    FORONE(i, (int)length){
+        if (!isalnum((unsigned char)name[i]))
+            return "ERR BAD_NAME\r\n";
+    }
+    return NULL;
+}
+
+/*  
+* Name:         parse_request
+* Argument:     char*, size_t, int, int, request*
+* Return:       int
+* Purpose:      Parse a request from the first length bytes of buffer.
+* Note:         Returns PARSE_OK, PARSE_NEED_MORE or PARSE_ERROR.
+*/
+int parse_request(char *buffer, size_t length, int complete, int max_size,
+                  request *req){
+    char *line_end, *pch, *save;
+    size_t line_size;
+
+    req->cmd = CMD_INVALID;
+    req->n_tokens = 0;
+    req->name = NULL;
+    req->size = 0;
+    req->data = NULL;
+    req->data_len = 0;
+    req->error = NULL;
+
+    /* Line ends with \r\n, a bare \n is accepted as well. */
+    line_end = memchr(buffer, '\n', length);
+    if (line_end == NULL){
+        if (!complete && length < MAX_INPUT_SIZE)
+            return PARSE_NEED_MORE;
+        line_size = length;
+        req->header_len = length;
+    }
+    else{
+        line_size = line_end - buffer;
+        req->header_len = line_size + 1;
+    }
+    if (line_size > 0 && buffer[line_size-1] == '\r')
+        line_size--;
+    if (line_size >= MAX_INPUT_SIZE)
+        return parse_error(req, "ERR INVALID_COMMAND\r\n");
+
+    memcpy(req->line, buffer, line_size);
+    req->line[line_size] = '\0';
+
+    /* Split the line, only MAX_TOKENS are kept but all are counted. */
+    char *tokens[MAX_TOKENS];
+    pch = strtok_r(req->line, DELIIMETER, &save);
+    while (pch != NULL){
+        if (req->n_tokens < MAX_TOKENS)
+            tokens[req->n_tokens] = pch;
+        req->n_tokens++;
+        pch = strtok_r(NULL, DELIIMETER, &save);
+    }
+
+    /* First element should be a command. */
+    if (req->n_tokens == 0)
+        return parse_error(req, "ERR INVALID_COMMAND\r\n");
+    FORONE(i, N_COMMANDS){
+        if (strcmp(cmd_list[i], tokens[0]) == 0){
+            req->cmd = i;
+            break;
+        }
+    }
+    if (req->cmd == CMD_INVALID)
+        return parse_error(req, "ERR INVALID_COMMAND\r\n");
+
+    /* Commend "SET" requires 3 exzact arguments, STATS, MEMORY and HOTKEYS
+     * 1, others 2. */
+    if (req->n_tokens != cmd_tokens[req->cmd])
+        return parse_error(req, "ERR INVALID_COMMAND\r\n");
+    if (req->cmd == CMD_STATS || req->cmd == CMD_MEMORY ||
+        req->cmd == CMD_HOTKEYS)
+        return PARSE_OK;
+
+    /* A batch carries its names in a body of the given size. */
+    char *size_token = tokens[1];
+    if (req->cmd == CMD_MSET || req->cmd == CMD_MDELETE)
+        max_size = MAX_BATCH_SIZE;
+    else{
+        req->name = tokens[1];
+        req->error = check_name(req->name);
+        if (req->error != NULL)
+            return PARSE_ERROR;
+
+        if (req->cmd != CMD_SET)
+            return PARSE_OK;
+        size_token = tokens[2];
+    }
+
+    /* Size should be an int where at least 1 and fit in a slot. */
+    long size;
+    FORONE(i, (int)strlen(size_token)){
+        if (!isdigit((unsigned char)size_token[i]))
+            return parse_error(req, "ERR INVALID_SIZE\r\n");
+    }
+    errno = 0;
+    size = strtol(size_token, NULL, 10);
+    if (errno != 0 || size < 1 || size > max_size)
+        return parse_error(req, "ERR INVALID_SIZE\r\n");
+    req->size = (int)size;
+
+    /* Data follows the line, check if client send to few data. */
+    req->data = buffer + req->header_len;
+    req->data_len = MIN(length - req->header_len, (size_t)req->size);
+    if (complete && req->data_len < (size_t)req->size)
+        return parse_error(req, "ERR TOO_SMALL\r\n");
+    return PARSE_OK;
+}
+
+
+/*  
+* Name:         set_response
+* Argument:     int, char*
+* Return:       int
+* Purpose:      Write the response of a SET for status_hash into out.
+* Note:         Returns the number of bytes in out.
+*/
+static int set_response(int status_hash, char *out){
+    if (status_hash == HASH_OK) 
+        strcpy(out, "OK\r\n");
+    else if (status_hash == HASH_ERR_COLISION)
+        strcpy(out, "ERR NO_SPACE\r\n");
+    else if (status_hash == HASH_ERR_DATASIZE)
+        strcpy(out, "ERR TOO_LARGE\r\n");
+    else if (status_hash == HASH_ERR_NOMEM)
+        strcpy(out, "ERR NO_MEMORY\r\n");
+    else
+        strcpy(out, "ERR OTHER\r\n");
+    return strlen(out);
+}
+
+/*  
+* Name:         delete_response
+* Argument:     int, char*
+* Return:       int
+* Purpose:      Write the response of a DELETE for status_hash into out.
+* Note:         Returns the number of bytes in out.
+*/
+static int delete_response(int status_hash, char *out){
+    if (status_hash == HASH_OK)
+        strcpy(out, "OK 1\r\n");
+    else if (status_hash == HASH_ERR_NOEXIT)
+        strcpy(out, "OK 0\r\n");
+    else
+        strcpy(out, "ERR OTHER\r\n");
+    return strlen(out);
+}
+
+/*  
+* Name:         body_response
+* Argument:     char*, int
+* Return:       int
+* Purpose:      Put "OK <length>\r\n" in front of the length bytes written
+*               at out + RESPONSE_HEADER_SIZE.
+* Note:         Returns the number of bytes in out.
+*/
+static int body_response(char *out, int length){
+    char header[RESPONSE_HEADER_SIZE];
+    int header_length = sprintf(header, "OK %d\r\n", length);
+
+    memmove(out + header_length, out + RESPONSE_HEADER_SIZE, length);
+    memcpy(out, header, header_length);
+    return header_length + length;
+}
+
+/*  
+* Name:         parse_batch
+* Argument:     int, char*, size_t, batch*
+* Return:       int
+* Purpose:      Split the body of an MSET or MDELETE into its names and 
+*               values.
+* Note:         Returns the number of names, or -1 if the body is not a
+*               whole number of records or holds too many. A bad name is
+*               kept with its error, it does not spoil the batch. body is
+*               not modified.
+*/
+static int parse_batch(int cmd, char *body, size_t size, batch *b){
+    char line[MAX_INPUT_SIZE], *tokens[3], *pch, *save, *line_end;
+    size_t at = 0, line_size, next;
+    int n_tokens, want = cmd == CMD_MSET ? 2 : 1;
+
+    b->n = 0;
+    while (at < size){
+        if (b->n == MAX_BATCH_KEYS)
+            return -1;
+
+        /* The last MDELETE name may end with the body. */
+        line_end = memchr(body + at, '\n', size - at);
+        if (line_end == NULL && cmd == CMD_MSET)
+            return -1;
+        line_size = line_end != NULL ? (size_t)(line_end - (body + at))
+                                     : size - at;
+        next = at + line_size + (line_end != NULL);
+        if (line_size > 0 && body[at + line_size - 1] == '\r')
+            line_size--;
+        if (line_size == 0 || line_size >= MAX_INPUT_SIZE)
+            return -1;
+        memcpy(line, body + at, line_size);
+        line[line_size] = '\0';
+
+        n_tokens = 0;
+        pch = strtok_r(line, DELIIMETER, &save);
+        while (pch != NULL && n_tokens <= want){
+            tokens[n_tokens++] = pch;
+            pch = strtok_r(NULL, DELIIMETER, &save);
+        }
+        if (n_tokens != want)
+            return -1;
+
+        b->errors[b->n] = check_name(tokens[0]);
+        b->names[b->n][0] = '\0';
+        if (b->errors[b->n] == NULL)
+            strcpy(b->names[b->n], tokens[0]);
+
+        if (cmd == CMD_MSET){
+            long value_size;
+
+            FORONE(i, (int)strlen(tokens[1]))
+                if (!isdigit((unsigned char)tokens[1][i]))
+                    return -1;
+            errno = 0;
+            value_size = strtol(tokens[1], NULL, 10);
+            if (errno != 0 || value_size < 1 || 
+                (size_t)value_size > size - next)
+                return -1;
+            b->data[b->n] = body + next;
+            b->sizes[b->n] = (int)value_size;
+            next += value_size;
+        }
+        b->n++;
+        at = next;
+    }
+    return b->n;
+}
+
+/*  
+* Name:         batch_response
+* Argument:     void*, int, char*, size_t, char*
+* Return:       int
+* Purpose:      Apply the body of an MSET or MDELETE and write the 
+*               response into out.
+* Note:         Returns the number of bytes in out. The good names go to
+*               hash_set_many()/hash_delete_many() in one call.
+*/
+static int batch_response(void *hashtable, int cmd, char *body, size_t size,
+                          char *out){
+    batch *b;
+    char *names[MAX_BATCH_KEYS];
+    void *data[MAX_BATCH_KEYS];
+    int sizes[MAX_BATCH_KEYS], status[MAX_BATCH_KEYS], n = 0, length = 0;
+
+    if (read_only){
+        strcpy(out, "ERR READ_ONLY\r\n");
+        return strlen(out);
+    }
+    b = malloc(sizeof(batch));
+    if (b == NULL){
+        strcpy(out, "ERR OTHER\r\n");
+        return strlen(out);
+    }
+    if (parse_batch(cmd, body, size, b) == -1){
+        STAT_ADD(bad_requests, 1);
+        free(b);
+        strcpy(out, "ERR BAD_BATCH\r\n");
+        return strlen(out);
+    }
+    if (cmd == CMD_MSET)
+        STAT_ADD(cmd_set, b->n);
+    else
+        STAT_ADD(cmd_delete, b->n);
+
+    FORONE(i, b->n){
+        if (b->errors[i] != NULL)
+            continue;
+        if (cmd == CMD_MSET){
+            CAPTURE(CAPTURE_OP_SET, b->names[i], b->sizes[i], b->data[i],
+                    b->sizes[i]);
+            HOTKEY(HOT_OP_SET, b->names[i], b->sizes[i]);
+        }
+        else
+            CAPTURE(CAPTURE_OP_DELETE, b->names[i], 0, NULL, 0);
+        names[n] = b->names[i];
+        data[n] = b->data[i];
+        sizes[n] = b->sizes[i];
+        n++;
+    }
+    FORONE(i, n)
+        status[i] = HASH_ERR_OTHER;
+    if (cmd == CMD_MSET)
+        hash_set_many(hashtable, n, names, data, sizes, status);
+    else
+        hash_delete_many(hashtable, n, names, status);
+
+    /* One line per name, in the order of the body. */
+    n = 0;
+    FORONE(i, b->n){
+        char *line = out + RESPONSE_HEADER_SIZE + length;
+
+        if (b->errors[i] != NULL){
+            strcpy(line, b->errors[i]);
+            length += strlen(line);
+        }
+        else if (cmd == CMD_MSET)
+            length += set_response(status[n++], line);
+        else
+            length += delete_response(status[n++], line);
+    }
+    free(b);
+    return body_response(out, length);
+}
+
+/*  
+* Name:         execute_request
+* Argument:     void*, request*, char*, size_t, value_stream*
+* Return:       int
+* Purpose:      Run a parsed request on the hashtable and write the 
+*               response into out.
+* Note:         Returns the number of bytes in out.
+*/
+int execute_request(void *hashtable, request *req, char *out, 
+                    size_t out_size, value_stream *stream){
+    int status_hash, size_from_hash, length;
+    void *data_out;
+
+    stream->type = STREAM_NONE;
+    stream->cmd = req->cmd;
+    stream->handle = -1;
+    stream->copy = NULL;
+    STAT_ADD(requests, 1);
+
+    /* flag status: 0 for SET, 1 for GET, 2 for DELETE, 3 for STATS, 4 for
+     * MEMORY, 5 for MSET, 6 for MDELETE, 7 for HOTKEYS. */
+    if (req->cmd == CMD_STATS || req->cmd == CMD_MEMORY){
+        if (req->cmd == CMD_STATS)
+            length = stats_format(hashtable, out + RESPONSE_HEADER_SIZE, 
+                                  out_size - RESPONSE_HEADER_SIZE);
+        else
+            length = memory_format(hashtable, out + RESPONSE_HEADER_SIZE, 
+                                   out_size - RESPONSE_HEADER_SIZE);
+        return body_response(out, length);
+    }
+    else if (req->cmd == CMD_HOTKEYS){
+        length = hotkeys_format(out + RESPONSE_HEADER_SIZE,
+                                out_size - RESPONSE_HEADER_SIZE);
+        if (length < 0){
+            strcpy(out, "ERR DISABLED\r\n");
+            return strlen(out);
+        }
+        return body_response(out, length);
+    }
+    else if (req->cmd == CMD_MSET || req->cmd == CMD_MDELETE){
+        /* Whole body arrived with the line, apply it from the input. */
+        if (req->data_len == (size_t)req->size)
+            return batch_response(hashtable, req->cmd, req->data, req->size,
+                                  out);
+
+        /* Else receive it in memory and apply it once complete. */
+        data_out = stream->copy = malloc(req->size);
+        if (data_out == NULL){
+            strcpy(out, "ERR OTHER\r\n");
+            return strlen(out);
+        }
+        memcpy(data_out, req->data, req->data_len);
+        stream->type = STREAM_SET;
+        stream->data = data_out;
+        stream->size = req->size;
+        stream->done = req->data_len;
+        return 0;
+    }
+    else if (req->cmd == CMD_SET){
+        STAT_ADD(cmd_set, 1);
+        CAPTURE(CAPTURE_OP_SET, req->name, req->size, req->data, 
+                req->data_len);
+        HOTKEY(HOT_OP_SET, req->name, req->size);
+
+        /* Whole value arrived with the line, copy it under the lock. */
+        if (req->data_len == (size_t)req->size){
+            if (read_only){
+                strcpy(out, "ERR READ_ONLY\r\n");
+                return strlen(out);
+            }
+            return set_response(hash_set(hashtable, req->name, req->data, 
+                                         req->size), out);
+        }
+
+        /* Larger than a slot, it only fits compressed or in the extent
+         * file: receive it in memory and hash_set() it once complete. A 
+         * refused value is still received so the next request is found. */
+        if (read_only || req->size > hash_get_max_elements_size(hashtable)){
+            data_out = stream->copy = malloc(req->size);
+            if (data_out == NULL)
+                return set_response(HASH_ERR_OTHER, out);
+            strcpy(stream->name, req->name);
+        }
+        /* Otherwise receive it straight into a reserved slot. */
+        else{
+            status_hash = hash_reserve(hashtable, req->name, req->size, 
+                                       &data_out);
+            if (status_hash < 0)
+                return set_response(status_hash, out);
+            stream->handle = status_hash;
+        }
+        memcpy(data_out, req->data, req->data_len);
+        stream->type = STREAM_SET;
+        stream->data = data_out;
+        stream->size = req->size;
+        stream->done = req->data_len;
+        return 0;
+    }
+    else if (req->cmd == CMD_GET){
+        STAT_ADD(cmd_get, 1);
+        CAPTURE(CAPTURE_OP_GET, req->name, 0, NULL, 0);
+
+        /* A hot value is copied from the worker's own cache. */
+        if (near_entries > 0 && near == NULL)
+            near = hash_near_create(hashtable, near_entries, NEAR_VALUE_SIZE);
+        if (near != NULL && hash_near_get(hashtable, near, req->name, 
+                                          &data_out, &size_from_hash) == 1){
+            STAT_ADD(get_hits, 1);
+            STAT_ADD(near_hits, 1);
+            HOTKEY(HOT_OP_GET, req->name, size_from_hash);
+            length = sprintf(out, "OK %d\r\n", size_from_hash);
+            memcpy(out + length, data_out, size_from_hash);
+            return length + size_from_hash;
+        }
+
+        /* Pin the value, only what fits in out is copied. */
+        status_hash = hash_acquire(hashtable, req->name, &data_out, 
+                                   &size_from_hash);
+        STAT_ADD(get_hits, status_hash >= 0);
+        STAT_ADD(get_misses, status_hash == HASH_ERR_NOEXIT);
+        HOTKEY(HOT_OP_GET, req->name, status_hash >= 0 ? size_from_hash : 0);
+        if (status_hash >= 0){
+            /* A compressed value is sent from a decompressed copy. */
+            stream->handle = status_hash;
+            length = hash_unpack(hashtable, status_hash, &data_out, 
+                                 &size_from_hash);
+            if (length != 0){
+                hash_release(hashtable, status_hash);
+                stream->handle = -1;
+            }
+            if (length < 0){
+                strcpy(out, "ERR OTHER\r\n");
+                return strlen(out);
+            }
+            if (length == 1)
+                stream->copy = data_out;
+
+            length = sprintf(out, "OK %d\r\n", size_from_hash);
+            size_t copied = MIN((size_t)size_from_hash, out_size - length);
+            memcpy(out + length, data_out, copied);
+            if (copied == (size_t)size_from_hash){
+                stream->type = STREAM_GET;
+                finish_request(hashtable, stream, out);
+                return length + copied;
+            }
+            stream->type = STREAM_GET;
+            stream->data = data_out;
+            stream->size = size_from_hash;
+            stream->done = copied;
+            return length + copied;
+        }
+        else if (status_hash == HASH_ERR_NOEXIT)
+            strcpy(out, "ERR NOT_FOUND\r\n");
+        else
+            strcpy(out, "ERR OTHER\r\n");
+        return strlen(out);
+    }
+    else{
+        STAT_ADD(cmd_delete, 1);
+        CAPTURE(CAPTURE_OP_DELETE, req->name, 0, NULL, 0);
+        if (read_only){
+            strcpy(out, "ERR READ_ONLY\r\n");
+            return strlen(out);
+        }
+        return delete_response(hash_delete(hashtable, req->name), out);
+    }
+}
+
+
+/*  
+* Name:         finish_request
+* Argument:     void*, value_stream*, char*
+* Return:       int
+* Purpose:      Finish a streamed request.
+* Note:         Returns the number of bytes in out.
+*/
+int finish_request(void *hashtable, value_stream *stream, char *out){
+    int type = stream->type, length = 0;
+
+    stream->type = STREAM_NONE;
+    if (type == STREAM_SET){
+        if (stream->done < stream->size){
+            if (stream->copy == NULL)
+                hash_abort(hashtable, stream->handle);
+            strcpy(out, "ERR TOO_SMALL\r\n");
+        }
+        else if (stream->cmd != CMD_SET){
+            length = batch_response(hashtable, stream->cmd, stream->copy,
+                                    stream->size, out);
+            FREE(stream->copy);
+            stream->handle = -1;
+            return length;
+        }
+        else if (stream->copy != NULL && read_only)
+            strcpy(out, "ERR READ_ONLY\r\n");
+        else if (stream->copy != NULL)
+            set_response(hash_set(hashtable, stream->name, stream->copy,
+                                  stream->size), out);
+        else
+            set_response(hash_commit(hashtable, stream->handle), out);
+        length = strlen(out);
+    }
+    else if (type == STREAM_GET && stream->handle >= 0)
+        hash_release(hashtable, stream->handle);
+    FREE(stream->copy);
+    stream->handle = -1;
+    return length;
+}
+
+
+/*  
+* Name:         protocol_set_read_only
+* Argument:     int
+* Return:       none
+* Purpose:      Refuse (enable != 0) or accept SET and DELETE.
+* Note:         none
+*/
+void protocol_set_read_only(int enable){
+    read_only = enable;
+}
+
+
+/*  
+* Name:         protocol_set_near_cache
+* Argument:     int
+* Return:       none
+* Purpose:      Give every worker a near cache of n_entries hot values.
+* Note:         none
+*/
+void protocol_set_near_cache(int n_entries){
+    near_entries = n_entries;
+}
+
+
+/*  
+* Name:         response_buffer_size
+* Argument:     void*
+* Return:       size_t
+* Purpose:      Bytes needed to hold any response for this hashtable.
+* Note:         none
+*/
+size_t response_buffer_size(void *hashtable){
+    size_t max_size = hash_get_max_value_size(hashtable);
+
+    /* Values larger than a chunk are streamed from their slot. */
+    max_size = MIN(max_size, STREAM_CHUNK_SIZE);
+    max_size = MAX(max_size, MAX_BATCH_KEYS*MAX_STATUS_SIZE);
+    return MAX(max_size, MAX_STATS_SIZE) + RESPONSE_HEADER_SIZE;
+}
@@ -0,0 +1,172 @@
+/* 
+ *  File:        protocol.h
+ *  Purpose:     Parsing and executing memcache requests, independent of 
+ *               how the bytes were read from the client.
+ * 
+ *               <CMD> <name> [<size>]\r\n[<data>]
+ *               CMD:           SET, GET, DELETE, STATS, MEMORY, HOTKEYS.
+ *               name:          should be shorter than 120, must be a-z, A-Z, 0-9.
+ *               size:          should only be with commend "SET".
+ *
+ *               MSET <size>\r\n<name> <size>\r\n<data>[<name> ...]
+ *               MDELETE <size>\r\n<name>\r\n[<name>\r\n ...]
+ *               Batches of up to MAX_BATCH_KEYS names in a body of size 
+ *               bytes, applied under few lock acquisitions. Answered with
+ *               "OK <size>\r\n" and the response of each name's SET or 
+ *               DELETE, one line each in order, or ERR BAD_BATCH when the
+ *               body does not parse.
+ */
+
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+#include <stddef.h>
+
+#define MAX_INPUT_SIZE      1024            /* Max bytes of a command line. */
+#define MAX_NAME_SIZE       120             /* Max length of a name. */
+#define MAX_TOKENS          4               /* Tokens kept from a line. */
+
+#define CMD_INVALID         -1              /* Unknown command. */
+#define CMD_SET             0               /* SET <name> <size>. */
+#define CMD_GET             1               /* GET <name>. */
+#define CMD_DELETE          2               /* DELETE <name>. */
+#define CMD_STATS           3               /* STATS. */
+#define CMD_MEMORY          4               /* MEMORY. */
+#define CMD_MSET            5               /* MSET <size>. */
+#define CMD_MDELETE         6               /* MDELETE <size>. */
+#define CMD_HOTKEYS         7               /* HOTKEYS. */
+#define N_COMMANDS          8
+
+#define MAX_BATCH_KEYS      256             /* Names in an MSET/MDELETE. */
+#define MAX_BATCH_SIZE      (4 << 20)       /* Bytes of their body. */
+
+#define PARSE_OK            0               /* Request can be executed. */
+#define PARSE_NEED_MORE     1               /* Wait for more bytes. */
+#define PARSE_ERROR         -1              /* Reply with req->error. */
+
+/* A parsed request, name and data point into the caller's buffers. */
+typedef struct request_struct {
+    char line[MAX_INPUT_SIZE];      /* Copy of the command line, tokenized. */
+    int cmd;                        /* CMD_*, flag in the old server. */
+    int n_tokens;                   /* Number of tokens in the line. */
+    char *name;                     /* Key, inside line. */
+    int size;                       /* Value size of a SET, body size of
+                                       an MSET/MDELETE. */
+    char *data;                     /* Value or body, inside the input 
+                                       buffer. */
+    size_t data_len;                /* Bytes of the value in the buffer. */
+    size_t header_len;              /* Bytes of the line including \r\n. */
+    const char *error;              /* Response to send on PARSE_ERROR. */
+} request;
+
+
+#define STREAM_NONE         0               /* Response is complete. */
+#define STREAM_SET          1               /* Value still to be received. */
+#define STREAM_GET          2               /* Value still to be sent. */
+
+/* A value moving between a socket and its slot, without a copy unless
+ * it is stored compressed. */
+typedef struct value_stream_struct {
+    int type;                       /* STREAM_*. */
+    int cmd;                        /* CMD_SET, CMD_MSET or CMD_MDELETE 
+                                       for STREAM_SET. */
+    int handle;                     /* From hash_reserve()/hash_acquire(). */
+    char *data;                     /* Value inside the table or copy. */
+    size_t size;                    /* Bytes of the value. */
+    size_t done;                    /* Bytes received or sent so far. */
+    char *copy;                     /* malloc()ed value when not in a slot. */
+    char name[MAX_NAME_SIZE];       /* Name for a SET received in copy. */
+} value_stream;
+
+
+/*  
+* Name:         parse_request
+* Argument:     char*, size_t, int, int, request*
+* Return:       int
+* Purpose:      Parse a request from the first length bytes of buffer.
+* Note:         Returns PARSE_OK, PARSE_NEED_MORE or PARSE_ERROR. A SET is
+*               PARSE_OK once its line is complete, req->data_len tells 
+*               how much of the value is already in buffer. When complete
+*               is set no more bytes will arrive, so a missing line end 
+*               closes the line and missing data is ERR TOO_SMALL. 
+*               max_size is the largest value the table accepts. buffer is
+*               not modified.
+*/
+int parse_request(char *buffer, size_t length, int complete, int max_size,
+                  request *req);
+
+
+/*  
+* Name:         execute_request
+* Argument:     void*, request*, char*, size_t, value_stream*
+* Return:       int
+* Purpose:      Run a parsed request on the hashtable and write the 
+*               response into out.
+* Note:         Returns the number of bytes in out. out_size must be at 
+*               least response_buffer_size(). Large values are streamed:
+*               STREAM_SET: the value did not all arrive with the line, it
+*                   has a reserved slot (a buffer if it needs compressing
+*                   to fit one, or is a batch body) and nothing is in out
+*                   yet. Receive the rest into stream->data + 
+*                   stream->done, then call finish_request() for the 
+*                   response.
+*               STREAM_GET: out holds the header and the start of the 
+*                   value, send the rest from stream->data + stream->done
+*                   and then call finish_request() to unpin or free it.
+*/
+int execute_request(void *hashtable, request *req, char *out, 
+                    size_t out_size, value_stream *stream);
+
+
+/*  
+* Name:         finish_request
+* Argument:     void*, value_stream*, char*
+* Return:       int
+* Purpose:      Finish a streamed request.
+* Note:         STREAM_SET publish the value if every byte arrived, else 
+*               drop it, and write the response into out. STREAM_GET 
+*               unpin the value. Returns the number of bytes in out.
+*/
+int finish_request(void *hashtable, value_stream *stream, char *out);
+
+
+/*  
+* Name:         protocol_set_read_only
+* Argument:     int
+* Return:       none
+* Purpose:      Refuse (enable != 0) or accept SET and DELETE.
+* Note:         Refused requests get ERR READ_ONLY, GET and STATS still
+*               work. Used on replicas, call before serving clients.
+*/
+void protocol_set_read_only(int enable);
+
+
+/*  
+* Name:         protocol_set_near_cache
+* Argument:     int
+* Return:       none
+* Purpose:      Serve hot GETs of up to 1024 bytes from a near cache of 
+*               n_entries values per worker thread or process.
+* Note:         The table must be made with the near_cache option, see 
+*               hash_near_get(). Call before serving clients.
+*/
+void protocol_set_near_cache(int n_entries);
+
+
+/*  
+* Name:         response_buffer_size
+* Argument:     void*
+* Return:       size_t
+* Purpose:      Bytes needed to hold any response for this hashtable.
+* Note:         none
+*/
+size_t response_buffer_size(void *hashtable);
+
+#define RESPONSE_HEADER_SIZE    32          /* "OK <size>\r\n" and errors. */
+#define STREAM_CHUNK_SIZE       65536       /* Value bytes in a response buffer. */
+#define MAX_STATS_SIZE          8192        /* Body of a STATS or HOTKEYS
+                                               response. */
+#define MAX_STATUS_SIZE         20          /* A name's line in a batch 
+                                               response. */
+
+#endif      /* _PROTOCOL_H_ */
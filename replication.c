@@ -0,0 +1,712 @@
+/*
+ *  File:        replication.c
+ *  Purpose:     Ring log, primary sender threads and replica applier,
+ *               see replication.h.
+ *
+ *  Note:        Log entries are <op:4><name_len:4><value_len:4><name>
+ *               <value> in host order, written with wrap around. head
+ *               counts every byte ever appended, entries older than
+ *               head - size are overwritten. An entry larger than the
+ *               whole log only moves head, so every replica behind it
+ *               falls out of the log and gets a full sync.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "utility_macros.h"
+#include "socket_utils.h"
+#include "shared_hashtable.h"
+#include "stats.h"
+#include "replication.h"
+
+#define ENTRY_HEADER        12              /* op, name_len, value_len. */
+#define MAX_LINKS           64              /* Replicas served at once. */
+#define SEND_BATCH          (1 << 20)       /* Log bytes copied per lock. */
+#define NAME_SIZE           120             /* Key slot, NUL included. */
+
+#define LINK_FREE           0
+#define LINK_RUNNING        1
+#define LINK_DONE           2               /* Thread ended, not joined. */
+
+/* Shared ring log, mapped before fork(). */
+typedef struct repl_log_struct {
+    pthread_mutex_t mutex;          /* Process-shared. */
+    pthread_cond_t cond;            /* Process-shared, signaled on append. */
+    unsigned long long head;        /* Bytes appended since start. */
+    size_t size;                    /* Bytes of data. */
+    char run_id[REPL_RUN_ID_SIZE];  /* Changes on every start. */
+    char data[];
+} repl_log;
+
+/* A connected replica on the primary. */
+typedef struct repl_link_struct {
+    pthread_t thread;
+    int state;                      /* LINK_*. */
+    int fd;
+    void *hashtable;
+    repl_log *log;
+    unsigned long long offset;      /* Frame offset of snapshot entries. */
+} repl_link;
+
+/* Replica side. */
+typedef struct repl_follow_struct {
+    void *hashtable;
+    char host[256];
+    int port;
+} repl_follow;
+
+static volatile int stopping = 0;
+static pthread_mutex_t links_mutex = PTHREAD_MUTEX_INITIALIZER;
+static repl_link links[MAX_LINKS];
+static int listen_fd = -1, follow_fd = -1;
+static int primary_running = 0, replica_running = 0;
+static pthread_t primary_thread, replica_thread;
+static repl_follow follow;
+
+
+/*
+* Name:         start_thread
+* Argument:     pthread_t*, void* (*)(void*), void*
+* Return:       int
+* Purpose:      pthread_create() with every signal blocked.
+* Note:         SIGINT and SIGUSR1 must reach the server's own threads.
+*/
+static int start_thread(pthread_t *thread, void* (*body)(void*), void *arg){
+    sigset_t all, old;
+    int status;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    status = pthread_create(thread, NULL, body, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return status;
+}
+
+
+/* ------------------------------------------------------------------ */
+/*  Ring log.                                                          */
+/* ------------------------------------------------------------------ */
+
+/*
+* Name:         repl_log_create
+* Argument:     size_t
+* Return:       void*
+* Purpose:      Map a shared ring log of size bytes with a new run id.
+* Note:         Pages are only touched once written.
+*/
+void* repl_log_create(size_t size){
+    pthread_mutexattr_t mutex_attr;
+    pthread_condattr_t cond_attr;
+    uint64_t id = 0;
+    repl_log *log;
+
+    log = mmap(NULL, sizeof(repl_log) + size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    RETURN_ON_VALUE(log, MAP_FAILED, "Cannot allocate replication log.\n",
+                    NULL);
+
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&log->mutex, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&log->cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    if (getrandom(&id, sizeof(id), 0) != sizeof(id))
+        id = ((uint64_t)getpid() << 32) ^ time(NULL);
+    snprintf(log->run_id, REPL_RUN_ID_SIZE, "%016llx",
+             (unsigned long long)id);
+    log->size = size;
+    log->head = 0;
+    return log;
+}
+
+/*
+* Name:         ring_write
+* Argument:     repl_log*, unsigned long long, const void*, size_t
+* Return:       none
+* Purpose:      Copy length bytes into the ring at log position pos.
+* Note:         Mutex must be held.
+*/
+static void ring_write(repl_log *log, unsigned long long pos,
+                       const void *source, size_t length){
+    size_t start = pos % log->size, first = MIN(length, log->size - start);
+
+    memcpy(log->data + start, source, first);
+    memcpy(log->data, (const char*)source + first, length - first);
+}
+
+/*
+* Name:         ring_read
+* Argument:     repl_log*, unsigned long long, void*, size_t
+* Return:       none
+* Purpose:      Copy length bytes out of the ring at log position pos.
+* Note:         Mutex must be held.
+*/
+static void ring_read(repl_log *log, unsigned long long pos, void *dest,
+                      size_t length){
+    size_t start = pos % log->size, first = MIN(length, log->size - start);
+
+    memcpy(dest, log->data + start, first);
+    memcpy((char*)dest + first, log->data, length - first);
+}
+
+/*
+* Name:         repl_journal
+* Argument:     int, char*, void*, int, void*
+* Return:       none
+* Purpose:      hash_journal_fn appending a change to the log.
+* Note:         The table lock orders the entries, the log mutex only
+*               guards against sender threads reading.
+*/
+void repl_journal(int op, char *name, void *data, int size, void *arg){
+    repl_log *log = (repl_log*)arg;
+    uint32_t header[3] = {op, strlen(name), size};
+    size_t length = ENTRY_HEADER + header[1] + header[2];
+
+    pthread_mutex_lock(&log->mutex);
+    if (length <= log->size){
+        ring_write(log, log->head, header, ENTRY_HEADER);
+        ring_write(log, log->head + ENTRY_HEADER, name, header[1]);
+        ring_write(log, log->head + ENTRY_HEADER + header[1], data,
+                   header[2]);
+    }
+    log->head += length;
+    STAT_SET(repl_offset, log->head);
+    pthread_cond_broadcast(&log->cond);
+    pthread_mutex_unlock(&log->mutex);
+}
+
+
+/* ------------------------------------------------------------------ */
+/*  Primary.                                                           */
+/* ------------------------------------------------------------------ */
+
+/*
+* Name:         send_all
+* Argument:     int, const void*, size_t, int
+* Return:       int
+* Purpose:      send() every byte, without SIGPIPE.
+* Note:         Returns 0, or -1 once the replica is gone.
+*/
+static int send_all(int fd, const void *data, size_t length, int flags){
+    while (length > 0){
+        ssize_t n = send(fd, data, length, flags | MSG_NOSIGNAL);
+        if (n == -1){
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data = (const char*)data + n;
+        length -= n;
+    }
+    return 0;
+}
+
+/*
+* Name:         send_frame
+* Argument:     int, int, const char*, uint32_t, const void*, uint32_t,
+*               unsigned long long
+* Return:       int
+* Purpose:      Send one frame to a replica.
+* Note:         Returns 0, or -1 once the replica is gone.
+*/
+static int send_frame(int fd, int type, const char *name, uint32_t name_len,
+                      const void *value, uint32_t value_len,
+                      unsigned long long offset){
+    unsigned char header[REPL_FRAME_HEADER];
+
+    header[0] = type;
+    FORONE(i, 4){
+        header[1 + i] = (name_len >> (8*i)) & 0xff;
+        header[5 + i] = (value_len >> (8*i)) & 0xff;
+    }
+    FORONE(i, 8)
+        header[9 + i] = (offset >> (8*i)) & 0xff;
+
+    if (send_all(fd, header, REPL_FRAME_HEADER, MSG_MORE) == -1 ||
+        send_all(fd, name, name_len, MSG_MORE) == -1 ||
+        send_all(fd, value, value_len, 0) == -1)
+        return -1;
+    return 0;
+}
+
+/*
+* Name:         snapshot_entry
+* Argument:     char*, void*, int, void*
+* Return:       int
+* Purpose:      hash_scan() callback sending one value of a full sync.
+* Note:         none
+*/
+static int snapshot_entry(char *name, void *data, int size, void *arg){
+    repl_link *link = (repl_link*)arg;
+
+    return send_frame(link->fd, REPL_FRAME_SET, name, strlen(name), data,
+                      size, link->offset);
+}
+
+/*
+* Name:         full_sync
+* Argument:     repl_link*
+* Return:       int
+* Purpose:      Send the whole table to a replica.
+* Note:         The scan is not atomic, but every change it may miss or
+*               see early is in the log after the returned offset, and
+*               replaying it in order ends in the same table. Returns
+*               the offset to stream the log from, -1 on errors.
+*/
+static long long full_sync(repl_link *link){
+    repl_log *log = link->log;
+    hash_stats table;
+
+    pthread_mutex_lock(&log->mutex);
+    link->offset = log->head;
+    pthread_mutex_unlock(&log->mutex);
+
+    if (hash_get_stats(link->hashtable, &table) != HASH_OK ||
+        send_frame(link->fd, REPL_FRAME_FULL, log->run_id,
+                   REPL_RUN_ID_SIZE - 1, NULL, 0, link->offset) == -1 ||
+        hash_scan(link->hashtable, 0, table.num_elements, snapshot_entry,
+                  link) < 0 ||
+        send_frame(link->fd, REPL_FRAME_END, NULL, 0, NULL, 0,
+                   link->offset) == -1)
+        return -1;
+    return link->offset;
+}
+
+/*
+* Name:         stream_log
+* Argument:     repl_link*, unsigned long long
+* Return:       none
+* Purpose:      Send log entries from offset on until the replica is
+*               gone, falls out of the log or replication stops.
+* Note:         Entries are copied out in batches under the mutex and
+*               sent without it.
+*/
+static void stream_log(repl_link *link, unsigned long long offset){
+    repl_log *log = link->log;
+    size_t capacity = SEND_BATCH, used;
+    char *buffer = malloc(capacity);
+    struct timespec deadline;
+    uint32_t header[3];
+    int gone = 0;
+
+    while (buffer != NULL && !stopping && !gone){
+        pthread_mutex_lock(&log->mutex);
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += 1;
+        while (log->head == offset && !stopping &&
+               pthread_cond_timedwait(&log->cond, &log->mutex,
+                                      &deadline) != ETIMEDOUT);
+        if (log->head - offset > log->size){
+            pthread_mutex_unlock(&log->mutex);
+            fprintf(stderr, "Replica fell out of the replication log.\n");
+            break;
+        }
+
+        /* Copy whole entries, at least one even if over a batch. */
+        used = 0;
+        while (offset + used < log->head){
+            size_t length;
+
+            ring_read(log, offset + used, header, ENTRY_HEADER);
+            length = ENTRY_HEADER + header[1] + header[2];
+            if (used + length > capacity){
+                char *larger;
+                if (used > 0)
+                    break;
+                larger = realloc(buffer, length);
+                if (larger == NULL){
+                    gone = 1;
+                    break;
+                }
+                buffer = larger;
+                capacity = length;
+            }
+            ring_read(log, offset + used, buffer + used, length);
+            used += length;
+        }
+        pthread_mutex_unlock(&log->mutex);
+
+        if (used == 0 && !gone &&
+            send_frame(link->fd, REPL_FRAME_PING, NULL, 0, NULL, 0,
+                       offset) == -1)
+            gone = 1;
+
+        for (size_t done = 0; done < used && !gone;){
+            char *entry = buffer + done;
+
+            memcpy(header, entry, ENTRY_HEADER);
+            done += ENTRY_HEADER + header[1] + header[2];
+            gone = send_frame(link->fd, header[0] == HASH_JOURNAL_SET ?
+                              REPL_FRAME_SET : REPL_FRAME_DELETE,
+                              entry + ENTRY_HEADER, header[1],
+                              entry + ENTRY_HEADER + header[1], header[2],
+                              offset + done) == -1;
+        }
+        offset += used;
+    }
+    free(buffer);
+}
+
+/*
+* Name:         sender_main
+* Argument:     void*
+* Return:       void*
+* Purpose:      Thread body serving one replica.
+* Note:         none
+*/
+static void* sender_main(void *arg){
+    repl_link *link = (repl_link*)arg;
+    char line[128], run_id[REPL_RUN_ID_SIZE];
+    unsigned long long offset, head;
+    size_t length = 0;
+    long long start;
+
+    /* SYNC <run_id> <offset>\r\n */
+    while (length < sizeof(line) - 1){
+        ssize_t n = read(link->fd, line + length, 1);
+        if (n <= 0 || line[length] == '\n')
+            break;
+        length++;
+    }
+    line[length] = '\0';
+    if (sscanf(line, "SYNC %16s %llu", run_id, &offset) != 2){
+        fprintf(stderr, "Bad replication handshake.\n");
+        goto done;
+    }
+
+    STAT_ADD(repl_links, 1);
+    pthread_mutex_lock(&link->log->mutex);
+    head = link->log->head;
+    pthread_mutex_unlock(&link->log->mutex);
+
+    start = offset;
+    if (strcmp(run_id, link->log->run_id) != 0 || offset > head ||
+        head - offset > link->log->size)
+        start = full_sync(link);
+    if (start != -1)
+        stream_log(link, start);
+    STAT_ADD(repl_links, -1);
+
+done:
+    close(link->fd);
+    pthread_mutex_lock(&links_mutex);
+    link->fd = -1;
+    link->state = LINK_DONE;
+    pthread_mutex_unlock(&links_mutex);
+    return NULL;
+}
+
+/*
+* Name:         primary_main
+* Argument:     void*
+* Return:       void*
+* Purpose:      Thread body accepting replicas.
+* Note:         Stops when repl_stop() shuts the socket down.
+*/
+static void* primary_main(void *arg){
+    repl_link *config = (repl_link*)arg;
+
+    while (!stopping){
+        int fd = accept(listen_fd, NULL, NULL), slot = -1;
+
+        if (fd == -1){
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+
+        pthread_mutex_lock(&links_mutex);
+        FORONE(i, MAX_LINKS)
+            if (links[i].state != LINK_RUNNING){
+                slot = i;
+                break;
+            }
+        if (slot != -1){
+            if (links[slot].state == LINK_DONE)
+                pthread_join(links[slot].thread, NULL);
+            links[slot] = *config;
+            links[slot].fd = fd;
+            links[slot].state = LINK_RUNNING;
+            if (start_thread(&links[slot].thread, sender_main,
+                             &links[slot]) != 0){
+                links[slot].state = LINK_FREE;
+                slot = -1;
+            }
+        }
+        pthread_mutex_unlock(&links_mutex);
+        if (slot == -1){
+            fprintf(stderr, "Cannot serve another replica.\n");
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+/*
+* Name:         repl_primary_start
+* Argument:     void*, void*, int
+* Return:       int
+* Purpose:      Serve replicas on port from a thread of this process.
+* Note:         none
+*/
+int repl_primary_start(void *hashtable, void *log, int port){
+    static repl_link config;
+    struct sockaddr_in address;
+    int reuse = 1;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    RETURN_ON_VALUE(listen_fd, -1, "Cannot create replication socket.\n", -1);
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+        listen(listen_fd, MAX_LINKS) == -1){
+        fprintf(stderr, "Cannot listen on replication port %d.\n", port);
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    config.hashtable = hashtable;
+    config.log = (repl_log*)log;
+    if (start_thread(&primary_thread, primary_main, &config) != 0){
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    primary_running = 1;
+    fprintf(stderr, "Serving replicas on port %d, run id %s.\n", port,
+            config.log->run_id);
+    return 0;
+}
+
+
+/* ------------------------------------------------------------------ */
+/*  Replica.                                                           */
+/* ------------------------------------------------------------------ */
+
+/*
+* Name:         connect_primary
+* Argument:     const char*, int
+* Return:       int
+* Purpose:      Open a connection to the primary.
+* Note:         Returns the socket, or -1.
+*/
+static int connect_primary(const char *host, int port){
+    struct addrinfo hints = {0}, *result;
+    char service[16];
+    int fd = -1;
+
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &result) != 0)
+        return -1;
+    fd = socket(result->ai_family, result->ai_socktype | SOCK_CLOEXEC,
+                result->ai_protocol);
+    if (fd != -1 && connect(fd, result->ai_addr, result->ai_addrlen) == -1){
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    return fd;
+}
+
+/*
+* Name:         get_le
+* Argument:     const unsigned char*, int
+* Return:       unsigned long long
+* Purpose:      Read an n byte little endian integer.
+* Note:         none
+*/
+static unsigned long long get_le(const unsigned char *p, int n){
+    unsigned long long value = 0;
+
+    FORONE(i, n)
+        value |= (unsigned long long)p[i] << (8*i);
+    return value;
+}
+
+/*
+* Name:         apply_stream
+* Argument:     int, void*, char*, unsigned long long*
+* Return:       none
+* Purpose:      Apply frames from the primary until the connection ends.
+* Note:         run_id and *offset are updated as frames are applied. A
+*               full sync only takes the primary's run id and offset at 
+*               its end: cut short, run_id stays "none" and the next SYNC
+*               gets a full sync again.
+*/
+static void apply_stream(int fd, void *hashtable, char *run_id,
+                         unsigned long long *offset){
+    unsigned char header[REPL_FRAME_HEADER];
+    char name[NAME_SIZE], *value = NULL;
+    char pending[REPL_RUN_ID_SIZE] = "";
+    size_t capacity = 0;
+
+    while (!stopping &&
+           read_in_full(fd, header, REPL_FRAME_HEADER) == REPL_FRAME_HEADER){
+        uint32_t name_len = get_le(header + 1, 4);
+        uint32_t value_len = get_le(header + 5, 4);
+
+        if (name_len >= NAME_SIZE)
+            break;
+        if (value_len > capacity){
+            char *larger = realloc(value, value_len);
+            if (larger == NULL)
+                break;
+            value = larger;
+            capacity = value_len;
+        }
+        if (read_in_full(fd, name, name_len) != name_len ||
+            read_in_full(fd, value, value_len) != value_len)
+            break;
+        name[name_len] = '\0';
+
+        switch (header[0]){
+            case REPL_FRAME_FULL:
+                fprintf(stderr, "Full sync from primary %s.\n", name);
+                hash_clear(hashtable);
+                name[REPL_RUN_ID_SIZE - 1] = '\0';
+                memcpy(pending, name, REPL_RUN_ID_SIZE);
+                strcpy(run_id, "none");
+                break;
+            case REPL_FRAME_SET:
+                if (hash_set(hashtable, name, value, value_len) != HASH_OK)
+                    fprintf(stderr, "Replica cannot store %s.\n", name);
+                break;
+            case REPL_FRAME_DELETE:
+                hash_delete(hashtable, name);
+                break;
+            case REPL_FRAME_END:
+                fprintf(stderr, "Full sync done.\n");
+                memcpy(run_id, pending, REPL_RUN_ID_SIZE);
+                pending[0] = '\0';
+                break;
+        }
+        /* Snapshot frames carry where the log resumes, not yet reached. */
+        if (pending[0] != '\0')
+            continue;
+        *offset = get_le(header + 9, 8);
+        STAT_SET(repl_offset, *offset);
+    }
+    free(value);
+}
+
+/*
+* Name:         replica_main
+* Argument:     void*
+* Return:       void*
+* Purpose:      Thread body following the primary, reconnecting while
+*               replication runs.
+* Note:         none
+*/
+static void* replica_main(void *arg){
+    repl_follow *config = (repl_follow*)arg;
+    char run_id[REPL_RUN_ID_SIZE] = "none", line[64];
+    unsigned long long offset = 0;
+    int fd, length;
+
+    while (!stopping){
+        fd = connect_primary(config->host, config->port);
+        if (fd == -1){
+            sleep(1);
+            continue;
+        }
+        pthread_mutex_lock(&links_mutex);
+        follow_fd = fd;
+        pthread_mutex_unlock(&links_mutex);
+
+        length = snprintf(line, sizeof(line), "SYNC %s %llu\r\n", run_id,
+                          offset);
+        if (!stopping && write_in_full(fd, line, length) == length){
+            STAT_SET(repl_links, 1);
+            apply_stream(fd, config->hashtable, run_id, &offset);
+            STAT_SET(repl_links, 0);
+        }
+
+        pthread_mutex_lock(&links_mutex);
+        follow_fd = -1;
+        pthread_mutex_unlock(&links_mutex);
+        close(fd);
+        if (!stopping){
+            fprintf(stderr, "Lost the primary, reconnecting.\n");
+            sleep(1);
+        }
+    }
+    return NULL;
+}
+
+/*
+* Name:         repl_replica_start
+* Argument:     void*, const char*, int
+* Return:       int
+* Purpose:      Follow the primary at host:port from a thread of this
+*               process, applying its changes to hashtable.
+* Note:         none
+*/
+int repl_replica_start(void *hashtable, const char *host, int port){
+    follow.hashtable = hashtable;
+    snprintf(follow.host, sizeof(follow.host), "%s", host);
+    follow.port = port;
+    if (start_thread(&replica_thread, replica_main, &follow) != 0)
+        return -1;
+    replica_running = 1;
+    return 0;
+}
+
+/*
+* Name:         repl_stop
+* Argument:     none
+* Return:       none
+* Purpose:      Stop and join every replication thread.
+* Note:         Sockets are shut down to wake blocked threads, senders
+*               waiting for the log notice within a second.
+*/
+void repl_stop(void){
+    stopping = 1;
+
+    pthread_mutex_lock(&links_mutex);
+    if (listen_fd != -1)
+        shutdown(listen_fd, SHUT_RDWR);
+    if (follow_fd != -1)
+        shutdown(follow_fd, SHUT_RDWR);
+    FORONE(i, MAX_LINKS)
+        if (links[i].state == LINK_RUNNING)
+            shutdown(links[i].fd, SHUT_RDWR);
+    pthread_mutex_unlock(&links_mutex);
+
+    if (primary_running){
+        pthread_join(primary_thread, NULL);
+        close(listen_fd);
+        listen_fd = -1;
+        primary_running = 0;
+    }
+    FORONE(i, MAX_LINKS)
+        if (links[i].state != LINK_FREE){
+            pthread_join(links[i].thread, NULL);
+            links[i].state = LINK_FREE;
+        }
+    if (replica_running){
+        pthread_join(replica_thread, NULL);
+        replica_running = 0;
+    }
+}
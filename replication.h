@@ -0,0 +1,101 @@
+/*
+ *  File:        replication.h
+ *  Purpose:     Asynchronous primary to replica replication.
+ *
+ *               The primary's hashtable journals every SET and DELETE
+ *               into a ring log in shared memory, forked children
+ *               included. A replica connects to the primary's
+ *               replication port and sends
+ *                   SYNC <run_id> <offset>\r\n
+ *               If run_id is the primary's and offset is still in the
+ *               log, the primary streams the log from offset on.
+ *               Otherwise it sends a full sync first: the table as
+ *               scanned, then the log from where the scan started.
+ *
+ *               Frames from the primary, integers little endian:
+ *               <type:1><name_len:4><value_len:4><offset:8><name><value>
+ *               REPL_FRAME_FULL:   full sync starts, name is the run id,
+ *                                  the replica empties its table.
+ *               REPL_FRAME_SET:    SET name to value.
+ *               REPL_FRAME_DELETE: DELETE name.
+ *               REPL_FRAME_END:    full sync done.
+ *               REPL_FRAME_PING:   nothing to send for a second.
+ *               offset is the log position after the frame, the one to
+ *               SYNC from after a reconnect.
+ *
+ *  Note:        Replicas lag behind and a mutation is acknowledged to
+ *               the client before any replica has it.
+ */
+
+#ifndef _REPLICATION_H_
+#define _REPLICATION_H_
+
+#include <stddef.h>
+
+#define REPL_LOG_SIZE       (64UL << 20)    /* Bytes of the ring log. */
+#define REPL_RUN_ID_SIZE    17              /* 16 hex digits and NUL. */
+
+#define REPL_FRAME_FULL     'F'
+#define REPL_FRAME_SET      'S'
+#define REPL_FRAME_DELETE   'D'
+#define REPL_FRAME_END      'E'
+#define REPL_FRAME_PING     'P'
+#define REPL_FRAME_HEADER   17              /* Bytes before name. */
+
+
+/*
+* Name:         repl_log_create
+* Argument:     size_t
+* Return:       void*
+* Purpose:      Map a shared ring log of size bytes with a new run id.
+* Note:         Call before make_hashtable_opt(), pass repl_journal and
+*               the log as its journal and journal_arg. Returns NULL on
+*               errors.
+*/
+void* repl_log_create(size_t size);
+
+
+/*
+* Name:         repl_journal
+* Argument:     int, char*, void*, int, void*
+* Return:       none
+* Purpose:      hash_journal_fn appending a change to the log.
+* Note:         Runs with the table lock held, in any process.
+*/
+void repl_journal(int op, char *name, void *data, int size, void *log);
+
+
+/*
+* Name:         repl_primary_start
+* Argument:     void*, void*, int
+* Return:       int
+* Purpose:      Serve replicas on port from a thread of this process.
+* Note:         Each replica gets its own sender thread. Returns 0, or -1
+*               if the port cannot be listened on.
+*/
+int repl_primary_start(void *hashtable, void *log, int port);
+
+
+/*
+* Name:         repl_replica_start
+* Argument:     void*, const char*, int
+* Return:       int
+* Purpose:      Follow the primary at host:port from a thread of this
+*               process, applying its changes to hashtable.
+* Note:         Reconnects every second while the primary is away,
+*               catching up from the last offset applied. Returns 0, or
+*               -1 if the thread cannot start.
+*/
+int repl_replica_start(void *hashtable, const char *host, int port);
+
+
+/*
+* Name:         repl_stop
+* Argument:     none
+* Return:       none
+* Purpose:      Stop and join every replication thread.
+* Note:         Call before hash_detach().
+*/
+void repl_stop(void);
+
+#endif      /* _REPLICATION_H_ */
@@ -0,0 +1,19 @@
+#!/bin/sh
+# bench_backends.sh - Run bench_net against every server mode.
+#
+# Usage (from the repository root, after make):
+#     scripts/bench_backends.sh [port] [bench_net options...]
+
+PORT=${1:-11211}
+[ $# -gt 0 ] && shift
+
+for MODE in "" "-t 0" "-e epoll" "-e uring" "-e uring -t 0"; do
+    ./memcache $MODE $PORT 100000 128 >/dev/null 2>&1 &
+    PID=$!
+    sleep 0.5
+    echo "=== memcache ${MODE:-(fork)}"
+    ./bench_net "$@" 127.0.0.1 $PORT
+    kill -INT $PID
+    wait $PID
+    PORT=$((PORT + 1))
+done
@@ -4,7 +4,7 @@
  *  Student ID:  100143687
  *  Version:     2.0
  *  Date:        2021.2.21
- *  Purpose:     Implementation of hashtable using semaphore lock and
+ *  Purpose:     Implementation of hashtable using a robust mutex and
  *               shared memory. 
  * 
  *  Note:        The program will allocate a piece of memory with exzact 
@@ -15,30 +15,592 @@
 #ifndef _SHARED_HASH_TABLE_H_
 #define _SHARED_HASH_TABLE_H_
 
+#define _GNU_SOURCE                 /* fallocate() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <semaphore.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <pthread.h>
+#include <limits.h>
+#include <stddef.h>
 #include "utility_macros.h"
+#include "trace_probes.h"
+#include "lz_codec.h"
 #include "shared_hashtable.h"
 
-/* Structure to represnt the header of hash table. */
+#define KEY_SIZE        120         /* Bytes of a key slot, NUL included. */
+#define CACHE_LINE      64          /* Bytes of a cache line. */
+#define BUCKET_INLINE   48          /* Value bytes kept inside a bucket. */
+
+/* Parts of the table are kept as offsets from its header, a process
+ * attaching by name may map it anywhere. */
+#define AT(t, offset)   ((char*)(t) + (offset))
+
+/* Per-slot fields, stride bytes apart: one int array each for 
+ * HASH_LAYOUT_ARRAYS, fields of the slot's bucket for HASH_LAYOUT_BUCKETS. */
+#define SLOT_INT(t, field, i) \
+        (*(int*)(AT(t, (t)->field) + (size_t)(i)*(t)->stride))
+#define FLAG(t, i)      SLOT_INT(t, flag, i)
+#define REAL_SIZE(t, i) SLOT_INT(t, real_size, i)
+#define RAW_SIZE(t, i)  SLOT_INT(t, raw_size, i)
+#define PINS(t, i)      SLOT_INT(t, pins, i)
+#define REF(t, i)       SLOT_INT(t, ref, i)
+#define TAG(t, i)       (*(unsigned int*)(AT(t, (t)->tag) + \
+                                          (size_t)(i)*(t)->stride))
+
+#define KEY(t, i)       (AT(t, (t)->keys) + (size_t)(i)*(t)->key_stride)
+#define VALUE(t, i)     (AT(t, (t)->value) + (size_t)(i)*(t)->max_element_size)
+#define BLOOM(t)        ((unsigned char*)AT(t, (t)->bloom))
+#define EPOCHS(t)       ((unsigned long*)AT(t, (t)->epochs))
+#define SKETCH(t)       ((unsigned char*)AT(t, (t)->sketch))
+#define SPILL(t, i)     (((unsigned char*)AT(t, (t)->spilled))[i])
+/* The slot's value is a tier_location in the extent file. */
+#define SPILLED(t, i)   ((t)->spilled != 0 && SPILL(t, i))
+#define TIER_NODE(t, i) (((tier_node*)AT(t, (t)->tier_nodes))[i])
+/* A SET of size bytes goes straight to the extent file. */
+#define SPILL_SIZE(t, size) \
+        ((t)->tier_threshold > 0 && (size) >= (t)->tier_threshold)
+
+/* Where a value of size bytes lives: inside the bucket when it fits, else
+ * in the slot's value area. */
+#define VALUE_AT(t, i, size) \
+        ((size) <= (t)->inline_size ? \
+         AT(t, (t)->inline_data) + (size_t)(i)*(t)->stride : VALUE(t, i))
+#define DATA(t, i)      VALUE_AT(t, i, REAL_SIZE(t, i))
+
+/* Slot states kept in flag[]. */
+#define SLOT_FREE       0           /* Never used, ends a probe. */
+#define SLOT_USED       1           /* Holds a value. */
+#define SLOT_DELETED    2           /* Tombstone, probes continue past it. */
+#define SLOT_PENDING    3           /* Reserved, value being written. */
+#define SLOT_DEAD       4           /* Deleted while pinned, freed on release. */
+#define SLOT_WRITING    5           /* Value changed in place, torn if the 
+                                       writer died. */
+
+/* Set a slot's state only after every store before it, a holder dying 
+ * halfway never leaves a used slot with a torn name or value. */
+#define PUBLISH(t, i, state) \
+        __atomic_store_n(&FLAG(t, i), (state), __ATOMIC_RELEASE)
+
+#define SCAN_BATCH      256         /* Slots pinned per lock by hash_scan(). */
+#define N_SLOT_ARRAYS   5           /* int arrays kept per slot. */
+#define BLOOM_HASHES    4           /* Counters a name maps to. */
+#define BLOOM_MAX       255         /* A counter this high sticks. */
+#define SPIN_MIN        10          /* Spins added to the adaptive count. */
+#define SPIN_MAX        100         /* Most trylocks before sleeping. */
+#define HOLD_SAMPLE     16          /* Lock holds timed, one in this many. */
+#define EPOCH_STRIPES   4096        /* Write epochs, names share them by 
+                                       hash. */
+#define SKETCH_ROWS     4           /* Count-min rows of the admission 
+                                       sketch. */
+#define SKETCH_MAX      15          /* Counters saturate at 4 bits. */
+#define SKETCH_SAMPLE   10          /* Counts per slot before they halve. */
+#define TABLE_MAGIC     0x5348415348544231UL
+                                    /* First word of a made table. */
+#define TABLE_VERSION   7           /* Layout of the header and slots, 
+                                       attaching needs the same. */
+#define CUCKOO_WAYS     4           /* Slots of a cuckoo bucket. */
+#define CUCKOO_DEPTH    5           /* Moves of a displacement path. */
+#define CUCKOO_QUEUE    512         /* Slots its search looks at. */
+#define MAX_JOURNALS    16          /* Journaled tables per process. */
+#define MAX_TIERS       16          /* Extent files open per process. */
+#define TIER_SEGMENT    (1UL << 20) /* Bytes of the extent file reclaimed
+                                       per hash_tier_compact(), about. */
+#define TIER_BATCH      1024        /* Extents one compaction moves, at 
+                                       most. */
+#define TIER_SWAPS      32          /* Moved extents swapped in per lock 
+                                       hold. */
+
+/* Report a change to the journal, lock must be held. */
+#define JOURNAL(t, op, name, data, size) \
+        do { if ((t)->journaled) \
+            journal_write((t), (op), (name), (data), (size)); \
+        } while (0)
+
+/* A slot of HASH_LAYOUT_BUCKETS: what a lookup reads starts on one cache 
+ * line, names shorter than 40 bytes end on it too. */
+typedef struct bucket_struct {
+    int flag;                       /* SLOT_* state. */
+    unsigned int tag;               /* Hash of the name, checked first. */
+    int real_size;                  /* Real size for current value. */
+    int raw_size;                   /* Size before compression. */
+    int pins;                       /* Readers streaming the value. */
+    int ref;                        /* CLOCK bit, set when used. */
+    char key[KEY_SIZE];             /* Name, NUL terminated. */
+    char data[BUCKET_INLINE];       /* Values of up to BUCKET_INLINE bytes. */
+} __attribute__((aligned(CACHE_LINE))) bucket;
+
+/* Where a spilled value is in the extent file, kept as its value. */
+typedef struct tier_location_struct {
+    unsigned long offset;           /* Of the extent. */
+    int size;                       /* Bytes of the extent, the value as 
+                                       stored. */
+} tier_location;
+
+/* A spilled slot in the list of them, by offset of their extent. */
+typedef struct tier_node_struct {
+    int prev;                       /* Slot of the previous extent, or -1. */
+    int next;                       /* Of the next one, or -1. */
+} tier_node;
+
+/* An extent compaction moves, from the stretch to the end of the file. */
+typedef struct tier_copy_struct {
+    int index;                      /* Slot holding it. */
+    tier_location from;
+    tier_location to;
+} tier_copy;
+
+/* A value make_room() moves to the extent file once the lock is dropped,
+ * its slot pinned meanwhile. */
+typedef struct tier_spill_struct {
+    int index;                      /* Slot holding it. */
+    tier_location to;
+} tier_spill;
+
+/* The spills of a SET, or of a batch of them. */
+typedef struct spill_list_struct {
+    int count;
+    int size;                       /* Spills items has room for. */
+    size_t bytes;                   /* Bytes they give back once done. */
+    tier_spill *items;
+} spill_list;
+
+/* A slot of a cuckoo displacement path being searched. */
+typedef struct cuckoo_step_struct {
+    int slot;                       /* Its value would move out. */
+    int parent;                     /* Step whose value would move in, -1
+                                       for a bucket of the new name. */
+    int depth;                      /* Steps before it. */
+} cuckoo_step;
+
+/* A name of a batch, applied in order of home slot. */
+typedef struct batch_entry_struct {
+    int home;                       /* Slot its probe starts at, -1 when 
+                                       refused before the lock. */
+    int position;                   /* Index in the caller's arrays. */
+} batch_entry;
+
+/* Structure to represnt the header of hash table. The lock, the fields 
+ * read without it and the counters written under it are on separate 
+ * cache lines. */
 typedef struct hash_table_struct {
-    sem_t lock;                    /* Semaphore lock. */
+    unsigned long magic;            /* TABLE_MAGIC, first whatever the 
+                                       version. */
+    int version;                    /* TABLE_VERSION. */
+
+    pthread_mutex_t lock __attribute__((aligned(CACHE_LINE)));
+                                    /* Robust and process-shared for 
+                                       HASH_LOCK_PROCESS. */
+
+    int lock_type __attribute__((aligned(CACHE_LINE)));
+                                    /* HASH_LOCK_PROCESS/HASH_LOCK_THREAD. */
+    int layout;                     /* HASH_LAYOUT_ARRAYS/BUCKETS. */
+    int engine;                     /* HASH_ENGINE_PROBING/CUCKOO. */
     size_t max_element_size;        /* max_element_size. */
     int num_elements;               /* max number of elements. */
     size_t memory_size;             /* Memory bytes allocate for hash_table. */
-    int n_items;                    /* Number of elements in current table. */
+    int compress_threshold;         /* Compress values this large, 0 never. */
+    int max_value_size;             /* Largest value before compression. */
+    size_t metadata_bytes;          /* Header and per-slot fields. */
+    size_t memory_limit;            /* Bytes the table may use, 0 no limit. */
+    int evict;                      /* Evict to make room, else refuse. */
+
+    /* Offsets from the header, see AT(). */
+    size_t keys;                    /* Keys(names), key_stride apart. */
+    size_t key_stride;
+    size_t value;                   /* Values(binary date). */
+    size_t flag;                    /* SLOT_* state. */
+    size_t real_size;               /* Real size for current value. */
+    size_t raw_size;                /* Size before compression. */
+    size_t pins;                    /* Readers streaming the value. */
+    size_t ref;                     /* CLOCK bit, set when used. */
+    size_t tag;                     /* Hash of the name, 0 for arrays. */
+    size_t stride;                  /* Bytes between two slots' fields. */
+    size_t inline_data;             /* Values kept in the bucket. */
+    int inline_size;                /* Largest of them, 0 for arrays. */
+    size_t bloom;                   /* Counting Bloom filter, or 0. */
+    size_t bloom_counters;          /* Counters in bloom. */
+    size_t epochs;                  /* EPOCH_STRIPES write epochs, or 0. */
+    size_t sketch;                  /* SKETCH_ROWS rows of sketch_width 
+                                       admission counters, or 0. */
+    size_t sketch_width;            /* A power of two. */
+    unsigned long sketch_sample;    /* Counts between two halvings. */
+    int journaled;                  /* Changes go to the maker's journal, 
+                                       see journal_write(). */
+    char name[HASH_NAME_SIZE];      /* Shared memory object, "" when 
+                                       anonymous. */
+    size_t spilled;                 /* A byte per slot, set while its value
+                                       is in the extent file, or 0 without
+                                       one. */
+    size_t tier_nodes;              /* A tier_node per slot, linked while 
+                                       it is spilled. */
+    int tier_threshold;             /* SET values this large go to it, 0 
+                                       only spilled ones. */
+    char tier_path[HASH_PATH_SIZE]; /* Extent file, see tier_fd(). */
 
-    void *keys;                    /* Keys(names). */
-    void *value;                   /* Values(binary date). */
-    int *flag;                      /* 0 for free, 1 for used. */
-    int *real_size;                 /* Real size for current value. */
+    int n_items __attribute__((aligned(CACHE_LINE)));
+                                    /* Number of elements in current table. */
+    int hand;                       /* CLOCK hand, next slot looked at. */
+    size_t raw_bytes;               /* Bytes of the values uncompressed. */
+    size_t stored_bytes;            /* Bytes the values take in slots. */
+    int value_slots;                /* Values in the value area, not 
+                                       inline. */
+    size_t key_bytes;               /* Bytes of the names, NUL included. */
+    unsigned long evictions;        /* Values evicted to make room. */
+    unsigned long refused;          /* SETs refused for lack of room. */
+    unsigned long rejected;         /* Of them, by the admission sketch. */
+    unsigned long displaced;        /* Values cuckoo moved. */
+    int scans;                      /* hash_scan() calls running, cuckoo 
+                                       moves nothing meanwhile. */
+    int spin;                       /* Adaptive spin count, read unlocked. */
+    int spin_max;                   /* 0 on a single CPU. */
+    long lock_since;                /* ns the holder got the lock, 0 when 
+                                       this hold is not timed. */
+    unsigned long lock_acquired;    /* Lock acquisitions. */
+    unsigned long lock_contended;   /* Acquisitions that found it held. */
+    unsigned long lock_wait_ns;     /* Time contended acquisitions waited. */
+    unsigned long lock_hold_ns;     /* Time the timed holds took. */
+    unsigned long lock_wait_max_ns;
+    unsigned long lock_hold_max_ns;
+    unsigned long owner_deaths;     /* Holders that died, recovered. */
+    unsigned long tier_head;        /* Extent file offset reclaimed up to. */
+    unsigned long tier_tail;        /* Where the next extent goes. */
+    int tier_first;                 /* Spilled slot of the lowest extent, 
+                                       or -1. */
+    int tier_last;                  /* Of the highest one, or -1. */
+    unsigned long tier_resets;      /* Truncations of the extent file. */
+    int tier_writers;               /* Extents taken, not yet written and
+                                       published (tier_reserve()). */
+    unsigned long tier_writing;     /* Offset of the lowest of them, while
+                                       any. */
+    int tier_items;                 /* Values in the extent file. */
+    size_t tier_bytes;              /* Bytes of their extents. */
+    unsigned long tier_spills;      /* Values spilled to make room. */
+    unsigned long tier_compacted;   /* Bytes compaction appended again. */
+    unsigned long memory_hits;      /* GETs served from slots. */
+    unsigned long tier_hits;        /* GETs read from the extent file. */
+    unsigned long get_misses;       /* GETs that found nothing under the 
+                                       lock. */
+
+    unsigned long bloom_negatives __attribute__((aligned(CACHE_LINE)));
+                                    /* GETs the filter answered, counted
+                                       without the lock. */
+    unsigned long bloom_false_positives;
+                                    /* GETs it let through for nothing. */
+    unsigned long sketch_ops;       /* Accesses counted, without the lock. */
 }hash_table;
 
 
+static void recover_table(hash_table *temp);
+
+/*  
+* Name:         now_ns
+* Argument:     none
+* Return:       long
+* Purpose:      Monotonic clock in nanoseconds.
+* Note:         none
+*/
+static long now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+/*  
+* Name:         cpu_relax
+* Argument:     none
+* Return:       none
+* Purpose:      Tell the CPU this is a spin loop.
+* Note:         none
+*/
+static inline void cpu_relax(void){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/*  
+* Name:         hash_lock
+* Argument:     hash_table*
+* Return:       int
+* Purpose:      Acquire the table lock, firing lock_wait before blocking
+*               and lock_acquire once the lock is held.
+* Note:         Returns 0 on success. A held lock is retried up to an 
+*               adaptive count of times before sleeping in the kernel, 
+*               the count follows the spins recent acquisitions needed 
+*               (as glibc's adaptive mutex). If the holder died, the lock
+*               is made consistent and the table repaired. Waits are 
+*               timed when the lock was found held, holds one time in 
+*               HOLD_SAMPLE, the clock costs more than most holds. The 
+*               counters are written under the lock.
+*/
+static int hash_lock(hash_table *temp){
+    int status, spins = 0, limit;
+    long start = 0, now;
+
+    TRACE1(lock_wait, temp);
+    status = pthread_mutex_trylock(&temp->lock);
+    if (status == EBUSY){
+        start = now_ns();
+        limit = MIN(__atomic_load_n(&temp->spin, __ATOMIC_RELAXED)*2 + 
+                    SPIN_MIN, temp->spin_max);
+        while (spins < limit && 
+               (status = pthread_mutex_trylock(&temp->lock)) == EBUSY){
+            cpu_relax();
+            spins++;
+        }
+        if (status == EBUSY)
+            status = pthread_mutex_lock(&temp->lock);
+    }
+    if (status == EOWNERDEAD){
+        pthread_mutex_consistent(&temp->lock);
+        recover_table(temp);
+        temp->owner_deaths++;
+        status = 0;
+    }
+    if (status != 0)
+        return status;
+
+    temp->lock_acquired++;
+    now = start != 0 || temp->lock_acquired % HOLD_SAMPLE == 0 ? now_ns() : 0;
+    if (start != 0){
+        temp->lock_contended++;
+        temp->lock_wait_ns += now - start;
+        temp->lock_wait_max_ns = MAX(temp->lock_wait_max_ns, 
+                                     (unsigned long)(now - start));
+        __atomic_store_n(&temp->spin, temp->spin + (spins - temp->spin)/8, 
+                         __ATOMIC_RELAXED);
+    }
+    temp->lock_since = temp->lock_acquired % HOLD_SAMPLE == 0 ? now : 0;
+    TRACE1(lock_acquire, temp);
+    return 0;
+}
+
+/*  
+* Name:         hash_unlock
+* Argument:     hash_table*
+* Return:       none
+* Purpose:      Release the table lock, firing lock_release.
+* Note:         none
+*/
+static void hash_unlock(hash_table *temp){
+    if (temp->lock_since != 0){
+        unsigned long held = now_ns() - temp->lock_since;
+
+        temp->lock_hold_ns += held*HOLD_SAMPLE;
+        temp->lock_hold_max_ns = MAX(temp->lock_hold_max_ns, held);
+    }
+    TRACE1(lock_release, temp);
+    pthread_mutex_unlock(&temp->lock);
+}
+
+
+/* Journals of the tables this process made, forked children inherit 
+ * them. A function pointer means nothing in another process, a process
+ * that attached finds no journal here. */
+typedef struct journal_entry_struct {
+    hash_table *table;              /* NULL when the entry is free. */
+    hash_journal_fn fn;
+    void *arg;
+} journal_entry;
+
+static journal_entry journals[MAX_JOURNALS];
+static pthread_mutex_t journals_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*  
+* Name:         journal_register
+* Argument:     hash_table*, hash_journal_fn, void*
+* Return:       int
+* Purpose:      Give a table made here its journal.
+* Note:         Returns 0, or -1 when MAX_JOURNALS tables have one. The 
+*               table pointer is published last, writers look entries up
+*               without the registry lock.
+*/
+static int journal_register(hash_table *temp, hash_journal_fn fn, void *arg){
+    int status = -1;
+
+    pthread_mutex_lock(&journals_lock);
+    FORONE(i, MAX_JOURNALS){
+        if (journals[i].table != NULL)
+            continue;
+        journals[i].fn = fn;
+        journals[i].arg = arg;
+        __atomic_store_n(&journals[i].table, temp, __ATOMIC_RELEASE);
+        status = 0;
+        break;
+    }
+    pthread_mutex_unlock(&journals_lock);
+    if (status == 0)
+        temp->journaled = 1;
+    return status;
+}
+
+/*  
+* Name:         journal_find
+* Argument:     hash_table*
+* Return:       journal_entry*
+* Purpose:      The journal this process keeps for a table.
+* Note:         NULL when the table has none here: not journaled, or 
+*               attached from another process.
+*/
+static journal_entry* journal_find(hash_table *temp){
+    if (!temp->journaled)
+        return NULL;
+    FORONE(i, MAX_JOURNALS)
+        if (__atomic_load_n(&journals[i].table, __ATOMIC_ACQUIRE) == temp)
+            return &journals[i];
+    return NULL;
+}
+
+/*  
+* Name:         journal_write
+* Argument:     hash_table*, int, char*, void*, int
+* Return:       none
+* Purpose:      Pass a change to the table's journal.
+* Note:         Lock must be held. Writers without the journal are 
+*               refused before, see read_only().
+*/
+static void journal_write(hash_table *temp, int op, char *name, void *data,
+                          int size){
+    journal_entry *entry = journal_find(temp);
+
+    if (entry != NULL)
+        entry->fn(op, name, data, size, entry->arg);
+}
+
+/*  
+* Name:         read_only
+* Argument:     hash_table*
+* Return:       int
+* Purpose:      Tell whether this process must not change the table.
+* Note:         A journaled table attached from another process: its 
+*               changes would miss the journal, and the replicas.
+*/
+static int read_only(hash_table *temp){
+    return temp->journaled && journal_find(temp) == NULL;
+}
+
+
+/* Extent files this process has open, forked children inherit them. A 
+ * process that attached opens its own on first use. */
+typedef struct tier_entry_struct {
+    hash_table *table;              /* NULL when the entry is free. */
+    int fd;
+} tier_entry;
+
+static tier_entry tiers[MAX_TIERS];
+static pthread_mutex_t tiers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*  
+* Name:         tier_register
+* Argument:     hash_table*, int
+* Return:       int
+* Purpose:      Remember fd as this process's extent file of a table.
+* Note:         tiers_lock must be held. Returns 0, or -1 when MAX_TIERS 
+*               tables have one. The table pointer is published last, as 
+*               for the journals.
+*/
+static int tier_register(hash_table *temp, int fd){
+    FORONE(i, MAX_TIERS){
+        if (tiers[i].table != NULL)
+            continue;
+        tiers[i].fd = fd;
+        __atomic_store_n(&tiers[i].table, temp, __ATOMIC_RELEASE);
+        return 0;
+    }
+    return -1;
+}
+
+/*  
+* Name:         tier_fd
+* Argument:     hash_table*
+* Return:       int
+* Purpose:      The extent file of a table, opened by its path the first 
+*               time this process needs it.
+* Note:         Returns -1 without an extent file or if it cannot be 
+*               opened. pread() and pwrite() leave the file offset alone,
+*               threads and forked children share the fd.
+*/
+static int tier_fd(hash_table *temp){
+    int fd = -1;
+
+    if (temp->spilled == 0)
+        return -1;
+    FORONE(i, MAX_TIERS)
+        if (__atomic_load_n(&tiers[i].table, __ATOMIC_ACQUIRE) == temp)
+            return tiers[i].fd;
+
+    /* Checked again under the registry lock, one open per process. */
+    pthread_mutex_lock(&tiers_lock);
+    FORONE(i, MAX_TIERS)
+        if (tiers[i].table == temp)
+            fd = tiers[i].fd;
+    if (fd == -1){
+        fd = open(temp->tier_path, O_RDWR | O_CLOEXEC);
+        if (fd != -1 && tier_register(temp, fd) != 0){
+            close(fd);
+            fd = -1;
+        }
+    }
+    pthread_mutex_unlock(&tiers_lock);
+    return fd;
+}
+
+/*  
+* Name:         tier_forget
+* Argument:     hash_table*
+* Return:       none
+* Purpose:      Close this process's extent file of a table being unmapped.
+* Note:         none
+*/
+static void tier_forget(hash_table *temp){
+    pthread_mutex_lock(&tiers_lock);
+    FORONE(i, MAX_TIERS)
+        if (tiers[i].table == temp){
+            close(tiers[i].fd);
+            __atomic_store_n(&tiers[i].table, NULL, __ATOMIC_RELEASE);
+        }
+    pthread_mutex_unlock(&tiers_lock);
+}
+
+/*  
+* Name:         map_named
+* Argument:     const char*, size_t
+* Return:       char*
+* Purpose:      Create the shared memory object name of memory_size bytes 
+*               and map it.
+* Note:         Returns MAP_FAILED if name already exists (a running 
+*               table, or one left by a crash: remove /dev/shm/<name>),
+*               errno is then EEXIST.
+*/
+static char* map_named(const char *name, size_t memory_size){
+    char *allocated;
+    int fd;
+
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd == -1)
+        return MAP_FAILED;
+    if (ftruncate(fd, memory_size) == -1){
+        close(fd);
+        shm_unlink(name);
+        return MAP_FAILED;
+    }
+    allocated = mmap(NULL, memory_size, PROT_READ | PROT_WRITE, MAP_SHARED, 
+                     fd, 0);
+    close(fd);
+    if (allocated == MAP_FAILED)
+        shm_unlink(name);
+    return allocated;
+}
+
+
 /*  
 * Name:         make_hashtable
 * Argument:     int, int
@@ -48,55 +610,274 @@ typedef struct hash_table_struct {
 * Note:         none
 */
 void* make_hashtable(int num_elements, int max_element_size){
-    size_t memory_size, temp_size;
-    void *allocated;
+    return make_hashtable_opt(num_elements, max_element_size, NULL);
+}
+
+
+/*  
+* Name:         make_hashtable_opt
+* Argument:     int, int, hash_options*
+* Return:       void*
+* Purpose:      Same as make_hashtable, with options. 
+* Note:         A NULL options is the same as make_hashtable. With 
+*               num_elements 0 the table gets as many slots as 
+*               memory_limit bytes map.
+*/
+void* make_hashtable_opt(int num_elements, int max_element_size, 
+                         hash_options *options){
+    size_t memory_size, temp_size, slot_size, bloom_size, epoch_size;
+    size_t sketch_width, spill_size, node_size;
+    char *allocated;
     hash_table *hash_table_ptr;
-    int status;
+    hash_options defaults = {0};
+    int status, fd;
 
-    /* Allocate memory for the hashtable. */
-    memory_size = sizeof(hash_table) + num_elements*120 +
-                  num_elements*max_element_size         +
-                  num_elements*sizeof(int) + num_elements*(sizeof(int));
+    if (options == NULL)
+        options = &defaults;
+    if (max_element_size < 1)
+        return NULL;
+    /* A spilled value's slot holds its location. */
+    if (options->tier_path != NULL && 
+        (strlen(options->tier_path) >= HASH_PATH_SIZE || 
+         max_element_size < (int)sizeof(tier_location) ||
+         options->tier_threshold < 0))
+        return NULL;
+    /* Other processes attach by name, a thread mutex would not hold 
+     * them off. */
+    if (options->name != NULL && 
+        (strlen(options->name) >= HASH_NAME_SIZE || 
+         options->lock_type == HASH_LOCK_THREAD))
+        return NULL;
+
+    /* Bytes of a slot without its value: the key and int arrays, or the
+     * bucket. */
+    if (options->layout == HASH_LAYOUT_BUCKETS)
+        slot_size = sizeof(bucket);
+    else
+        slot_size = KEY_SIZE + N_SLOT_ARRAYS*sizeof(int);
+
+    /* Size the table from the byte budget. */
+    if (num_elements == 0 && options->memory_limit > sizeof(hash_table)){
+        num_elements = MIN((options->memory_limit - sizeof(hash_table)) /
+                           (slot_size + (size_t)MAX(options->bloom, 0) + 
+                            (options->tier_path != NULL ? 
+                             1 + sizeof(tier_node) : 0) +
+                            (size_t)max_element_size), 
+                           (size_t)INT_MAX);
+        if (options->engine == HASH_ENGINE_CUCKOO)
+            num_elements -= num_elements % CUCKOO_WAYS;
+    }
+    /* Cuckoo buckets are whole. */
+    if (options->engine == HASH_ENGINE_CUCKOO){
+        if (num_elements > INT_MAX - CUCKOO_WAYS)
+            return NULL;
+        num_elements = (num_elements + CUCKOO_WAYS - 1) / CUCKOO_WAYS *
+                       CUCKOO_WAYS;
+    }
+    if (num_elements < 1)
+        return NULL;
+    bloom_size = (size_t)num_elements*MAX(options->bloom, 0);
+    bloom_size = (bloom_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    epoch_size = options->near_cache ? EPOCH_STRIPES*sizeof(unsigned long) 
+                                     : 0;
+    sketch_width = 0;
+    if (options->admission){
+        sketch_width = CACHE_LINE;
+        while (sketch_width < (size_t)num_elements)
+            sketch_width *= 2;
+    }
+    spill_size = node_size = 0;
+    if (options->tier_path != NULL){
+        spill_size = ((size_t)num_elements + CACHE_LINE - 1) / CACHE_LINE * 
+                     CACHE_LINE;
+        node_size = ((size_t)num_elements*sizeof(tier_node) + CACHE_LINE - 
+                     1) / CACHE_LINE * CACHE_LINE;
+    }
+
+    /* Allocate memory for the hashtable, values last so the int arrays
+     * and buckets stay aligned whatever max_element_size is. */
+    memory_size = sizeof(hash_table) + (size_t)num_elements*slot_size +
+                  bloom_size + epoch_size + SKETCH_ROWS*sketch_width +
+                  spill_size + node_size + 
+                  (size_t)num_elements*max_element_size;
     
-    allocated = mmap(NULL, memory_size, PROT_READ | PROT_WRITE,
-                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    RETURN_ON_VALUE(allocated, NULL, "Cannot allocate memory, return.\n", 
+    if (options->name != NULL)
+        allocated = map_named(options->name, memory_size);
+    else
+        allocated = mmap(NULL, memory_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (allocated == MAP_FAILED && options->name != NULL && errno == EEXIST){
+        fprintf(stderr, "Table %s already exists: remove /dev/shm%s unless "
+                "a server still uses it.\n", options->name, options->name);
+        return NULL;
+    }
+    RETURN_ON_VALUE(allocated, MAP_FAILED, "Cannot allocate memory, return.\n", 
         NULL);
 
     /* Cast first part of memory to the hashtable for return. */
     hash_table_ptr = (hash_table*)allocated;
 
+    hash_table_ptr->version = TABLE_VERSION;
     hash_table_ptr->memory_size = memory_size;
     hash_table_ptr->max_element_size = max_element_size;
     hash_table_ptr->num_elements = num_elements;
     hash_table_ptr->n_items = 0;
+    hash_table_ptr->layout = options->layout;
+    hash_table_ptr->engine = options->engine;
+    if (options->name != NULL)
+        strcpy(hash_table_ptr->name, options->name);
+    hash_table_ptr->memory_limit = options->memory_limit;
+    hash_table_ptr->evict = options->evict;
 
-    /* Initialize the semaphore lock to binary. */
-    status = sem_init(&(hash_table_ptr->lock), 1, 1);
-    RETURN_AND_FREE_MEM(status, -1, "Cannot initilize semaphore, return.\n",
+    /* A value larger than a slot only fits once compressed, or in the 
+     * extent file. */
+    hash_table_ptr->compress_threshold = MAX(options->compress_threshold, 0);
+    hash_table_ptr->tier_threshold = options->tier_path != NULL ? 
+                                     options->tier_threshold : 0;
+    hash_table_ptr->max_value_size = max_element_size;
+    if (options->compress_threshold > 0 || hash_table_ptr->tier_threshold > 0)
+        hash_table_ptr->max_value_size = MAX(options->max_value_size, 
+                                             max_element_size);
+
+    /* Initialize the lock, process-shared and robust unless the table 
+     * stays in one process: a process dying with it held hands it to the
+     * next locker instead of blocking everyone. */
+    hash_table_ptr->lock_type = options->lock_type;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    if (options->lock_type != HASH_LOCK_THREAD){
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    }
+    status = pthread_mutex_init(&(hash_table_ptr->lock), &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (status != 0 && options->name != NULL)
+        shm_unlink(options->name);
+    RETURN_AND_FREE_MEM(status!=0, 1, "Cannot initilize mutex, return.\n",
         NULL, allocated, memory_size);
+    /* Spinning only helps while the holder runs on another CPU. */
+    hash_table_ptr->spin_max = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_MAX 
+                                                                 : 0;
 
-    /* Initialize the string array for keys(name). */
     temp_size = sizeof(hash_table);
-    hash_table_ptr->keys = allocated + temp_size;
+    if (options->layout == HASH_LAYOUT_BUCKETS){
+        /* Every per-slot field is a member of the slot's bucket. */
+        hash_table_ptr->stride = sizeof(bucket);
+        hash_table_ptr->key_stride = sizeof(bucket);
+        hash_table_ptr->keys = temp_size + offsetof(bucket, key);
+        hash_table_ptr->flag = temp_size + offsetof(bucket, flag);
+        hash_table_ptr->real_size = temp_size + offsetof(bucket, real_size);
+        hash_table_ptr->raw_size = temp_size + offsetof(bucket, raw_size);
+        hash_table_ptr->pins = temp_size + offsetof(bucket, pins);
+        hash_table_ptr->ref = temp_size + offsetof(bucket, ref);
+        hash_table_ptr->tag = temp_size + offsetof(bucket, tag);
+        hash_table_ptr->inline_data = temp_size + offsetof(bucket, data);
+        hash_table_ptr->inline_size = BUCKET_INLINE;
+        hash_table_ptr->metadata_bytes = sizeof(hash_table) + 
+            (size_t)num_elements*offsetof(bucket, key);
+        temp_size += (size_t)num_elements*sizeof(bucket);
+    }
+    else{
+        /* Initialize the string array for keys(name), then an int array 
+         * each for flags, actual size of value, size before compression, 
+         * pin counts and CLOCK bits. */
+        hash_table_ptr->stride = sizeof(int);
+        hash_table_ptr->key_stride = KEY_SIZE;
+        hash_table_ptr->keys = temp_size;
+        temp_size += (size_t)num_elements*KEY_SIZE;
+        hash_table_ptr->flag = temp_size;
+        temp_size += num_elements*sizeof(int);
+        hash_table_ptr->real_size = temp_size;
+        temp_size += num_elements*sizeof(int);
+        hash_table_ptr->raw_size = temp_size;
+        temp_size += num_elements*sizeof(int);
+        hash_table_ptr->pins = temp_size;
+        temp_size += num_elements*sizeof(int);
+        hash_table_ptr->ref = temp_size;
+        temp_size += num_elements*sizeof(int);
+        hash_table_ptr->tag = 0;
+        hash_table_ptr->inline_data = 0;
+        hash_table_ptr->inline_size = 0;
+        hash_table_ptr->metadata_bytes = sizeof(hash_table) + 
+            N_SLOT_ARRAYS*(size_t)num_elements*sizeof(int);
+    }
+
+    /* The filter's counters sit between the slots and the values. */
+    hash_table_ptr->bloom = 0;
+    hash_table_ptr->bloom_counters = (size_t)num_elements*MAX(options->bloom, 0);
+    if (bloom_size > 0)
+        hash_table_ptr->bloom = temp_size;
+    temp_size += bloom_size;
+    hash_table_ptr->metadata_bytes += bloom_size;
+
+    /* Then the write epochs of near caches, zero from mmap. */
+    hash_table_ptr->epochs = 0;
+    if (epoch_size > 0)
+        hash_table_ptr->epochs = temp_size;
+    temp_size += epoch_size;
+    hash_table_ptr->metadata_bytes += epoch_size;
+
+    /* Then the admission sketch, zero from mmap too. */
+    hash_table_ptr->sketch = 0;
+    hash_table_ptr->sketch_width = sketch_width;
+    hash_table_ptr->sketch_sample = (unsigned long)SKETCH_SAMPLE*num_elements;
+    if (sketch_width > 0)
+        hash_table_ptr->sketch = temp_size;
+    temp_size += SKETCH_ROWS*sketch_width;
+    hash_table_ptr->metadata_bytes += SKETCH_ROWS*sketch_width;
+
+    /* Then the spilled flags, zero from mmap. */
+    hash_table_ptr->spilled = 0;
+    if (spill_size > 0)
+        hash_table_ptr->spilled = temp_size;
+    temp_size += spill_size;
+    hash_table_ptr->metadata_bytes += spill_size;
+
+    /* Then the list of spilled slots, empty. */
+    hash_table_ptr->tier_nodes = 0;
+    hash_table_ptr->tier_first = hash_table_ptr->tier_last = -1;
+    if (node_size > 0)
+        hash_table_ptr->tier_nodes = temp_size;
+    temp_size += node_size;
+    hash_table_ptr->metadata_bytes += node_size;
+
+    /* Flags and sizes, pins and CLOCK bits are zero from mmap. */
+    FORONE(i, num_elements){
+        FLAG(hash_table_ptr, i) = SLOT_FREE;
+        REAL_SIZE(hash_table_ptr, i) = -1;  /* <- -1 for no size. */
+    }
 
     /* Initialize the string array for value. */
-    temp_size += num_elements*120;
-    //hash_table_ptr->value = allocated + temp_size;
-    hash_table_ptr->value = (allocated+temp_size);
-
-    /* Initialize the int array for flags. */
-    temp_size += num_elements*max_element_size;;
-    hash_table_ptr->flag = (int*)(allocated + temp_size);
-    FORONE(i, num_elements)
-        hash_table_ptr->flag[i] = 0;
-
-    /* Initialize the int array for actual size of value. */
-    temp_size += num_elements*sizeof(int);
-    hash_table_ptr->real_size = (int*)(allocated + temp_size);
-    FORONE(i, num_elements)
-        hash_table_ptr->real_size[i] = -1;  /* <- -1 for no size. */
-    
+    hash_table_ptr->value = temp_size;
+
+    /* The extent file starts empty, other processes open it by path. */
+    if (options->tier_path != NULL){
+        fd = open(options->tier_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0600);
+        pthread_mutex_lock(&tiers_lock);
+        status = fd == -1 ? -1 : tier_register(hash_table_ptr, fd);
+        pthread_mutex_unlock(&tiers_lock);
+        if (status != 0){
+            if (fd != -1){
+                close(fd);
+                unlink(options->tier_path);
+            }
+            hash_detach(hash_table_ptr);
+            return NULL;
+        }
+        strcpy(hash_table_ptr->tier_path, options->tier_path);
+    }
+
+    /* The journal stays in this process, the table only says it has one. */
+    if (options->journal != NULL && 
+        journal_register(hash_table_ptr, options->journal, 
+                         options->journal_arg) != 0){
+        hash_detach(hash_table_ptr);
+        return NULL;
+    }
+
+    /* Attaching processes look for the magic last. */
+    __atomic_store_n(&hash_table_ptr->magic, TABLE_MAGIC, __ATOMIC_RELEASE);
 
     #ifdef DEBUG
     printf("Initializing hash table..\n");
@@ -104,10 +885,14 @@ void* make_hashtable(int num_elements, int max_element_size){
     printf("size of hash_table struct:%ld\n", sizeof(hash_table));
     printf("hash_table addr:                %p\n", hash_table_ptr);
     printf("allocate addr:                  %p\n", allocated);
-    printf("hash_table->keys addr:          %p\n", hash_table_ptr->keys);
-    printf("hash_table->values addr:        %p\n", hash_table_ptr->value);
-    printf("hash_table->flag addr:          %p\n", hash_table_ptr->flag);
-    printf("hash_table->real_size addr:     %p\n", hash_table_ptr->real_size);
+    printf("hash_table->keys addr:          %p\n", 
+           AT(hash_table_ptr, hash_table_ptr->keys));
+    printf("hash_table->values addr:        %p\n", 
+           AT(hash_table_ptr, hash_table_ptr->value));
+    printf("hash_table->flag addr:          %p\n", 
+           AT(hash_table_ptr, hash_table_ptr->flag));
+    printf("hash_table->real_size addr:     %p\n", 
+           AT(hash_table_ptr, hash_table_ptr->real_size));
     printf("Initialize complete. \n--------------------\n");
     #endif /* DEBUG */
 
@@ -115,6 +900,8 @@ void* make_hashtable(int num_elements, int max_element_size){
 }
 
 
+static unsigned long name_hash(char *str);
+
 /*  
 * Name:         hash
 * Argument:     char*, int
@@ -128,265 +915,2554 @@ void* make_hashtable(int num_elements, int max_element_size){
 *               prime or not) has never been adequately explained.
 */
 int hash_func(char *str, int scale){
+    return name_hash(str)%scale;
+}
+
+/*  
+* Name:         name_hash
+* Argument:     char*
+* Return:       unsigned long
+* Purpose:      djb2 of a name, before hash_func() scales it.
+* Note:         The low 32 bits are the bucket tag.
+*/
+static unsigned long name_hash(char *str){
     unsigned long hash = 5381;
-    int c, i=0;
+    int c;
 
-    while ((c = *str++) != 0){
+    while ((c = *str++) != 0)
         hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
-        i++;
-    }
-    return hash%scale;
+    return hash;
 }
 
 
 /*  
-* Name:         hash_set
-* Argument:     vpid*, char*, void*, int
-* Return:       int
-* Purpose:      Create an entry in the hashtable. 
-* Note:         Returns 0 on success. On errors, returns a value specific to 
-*               the source of error, as follows:
-*                   -1 if the hashtable is NULL
-*                   -2 if the name is too long or is NULL
-*                   -3 if data_size > maximum allowed element size
-*                   -4 if no space exists for the element in the hashtable
-*                   -99 if an error other than the above occurs.
-*               Error codes are defined in hashtable.h.
-*               The hash table is open addressing with quadratic probing with
-*               no looping(once hash index is out of boundary, return 
-*               HASH_ERR_COLISION). It will not go back from start.
+* Name:         mix_hash
+* Argument:     unsigned long
+* Return:       unsigned long
+* Purpose:      64 bit finalizer (murmur3's) of a name_hash().
+* Note:         Its two halves are the two hashes of double hashing, and
+*               pick the two cuckoo buckets.
 */
-int hash_set(void *hashtable, char *name, void *data, int data_size){
-    /* Cast hashtable pointer. */
-    hash_table *temp = (hash_table*)hashtable;
-
-    /* Check NULL pointers. */
-    if (hashtable == NULL)
-        return HASH_ERR_NULL;
-
-    if (name == NULL)
-        return HASH_ERR_NAME;
+static unsigned long mix_hash(unsigned long hash){
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdUL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53UL;
+    hash ^= hash >> 33;
+    return hash;
+}
 
-    if (strlen(name) > 120){
-        return HASH_ERR_NAME;
-    }
+/*  
+* Name:         bloom_counter
+* Argument:     hash_table*, unsigned char*, unsigned long, int
+* Return:       unsigned char*
+* Purpose:      Counter i of the BLOOM_HASHES a name's hash maps to, in 
+*               counters (the filter or a copy of its size).
+* Note:         Double hashing over a 64 bit finalizer of the djb2 hash, 
+*               whose low bits alone cluster.
+*/
+static unsigned char* bloom_counter(hash_table *temp, unsigned char *counters,
+                                    unsigned long hash, int i){
+    hash = mix_hash(hash);
+    return counters + ((hash & 0xffffffffUL) + 
+                       (unsigned long)i*((hash >> 32) | 1)) % 
+                      temp->bloom_counters;
+}
 
-    /* Lock semaphore. */
-    if (sem_wait(&temp->lock) != 0)
-        return HASH_ERR_OTHER;
+/*  
+* Name:         bloom_add
+* Argument:     hash_table*, char*, int
+* Return:       none
+* Purpose:      Count a name in (delta 1) or out (delta -1) of the filter.
+* Note:         Lock must be held, readers load the counters without it.
+*               A counter that reached BLOOM_MAX is never decremented, it
+*               may count more names than it can hold.
+*/
+static void bloom_add(hash_table *temp, char *name, int delta){
+    unsigned long hash;
 
-    if (data_size < 1){
-        sem_post(&temp->lock);
-        return HASH_ERR_OTHER;
-    }
+    if (temp->bloom == 0)
+        return;
+    hash = name_hash(name);
+    FORONE(i, BLOOM_HASHES){
+        unsigned char *counter = bloom_counter(temp, BLOOM(temp), hash, i);
+        unsigned char count = __atomic_load_n(counter, __ATOMIC_RELAXED);
 
-    if (data_size > temp->max_element_size){
-        sem_post(&temp->lock);
-        return HASH_ERR_DATASIZE;
+        if (count == BLOOM_MAX || (delta < 0 && count == 0))
+            continue;
+        __atomic_store_n(counter, count + delta, __ATOMIC_RELAXED);
     }
+}
 
+/*  
+* Name:         bloom_absent
+* Argument:     hash_table*, char*
+* Return:       int
+* Purpose:      Tell, without the lock, that name is not in the table.
+* Note:         Returns 1 when a counter of name is zero (counted in 
+*               bloom_negatives), 0 when it may be there or there is no 
+*               filter. Names are counted in before they become visible
+*               and out after they are gone, so a GET ordered after a SET 
+*               never misses it.
+*/
+static int bloom_absent(hash_table *temp, char *name){
+    unsigned long hash;
 
-    /* Find a hash location. */
-    int index = hash_func(name, temp->num_elements);
-    /* Track times of searching. */
-    int counter = 0;
-    
-    /* Linear probing. */
-    while(temp->flag[index]!=0){
-        if (memcmp(temp->keys+index*120, name, (strlen(name)+1)) == 0){
-            memset(temp->value+index*temp->max_element_size, '\0', 
-                   temp->real_size[index]);
-            temp->real_size[index] = data_size;
-            memcpy(temp->value+index*temp->max_element_size, data, data_size);
-            sem_post(&temp->lock);
-            return HASH_OK;
+    if (temp->bloom == 0)
+        return 0;
+    hash = name_hash(name);
+    FORONE(i, BLOOM_HASHES)
+        if (__atomic_load_n(bloom_counter(temp, BLOOM(temp), hash, i), 
+                            __ATOMIC_RELAXED) == 0){
+            __atomic_fetch_add(&temp->bloom_negatives, 1, __ATOMIC_RELAXED);
+            return 1;
         }
-        else{
-            index++;
-            index %= temp->num_elements;
-            if (index >= temp->num_elements)
-                index = 0;
-            counter ++;
-            if (counter > temp->num_elements){
-                sem_post(&temp->lock);
-                return HASH_ERR_COLISION;
-            }
-        }
-    }
-    
-    temp->n_items++;
+    return 0;
+}
 
-    memcpy(temp->keys+index*120, name, (strlen(name)+1));
-    memcpy(temp->value+index*temp->max_element_size, data, data_size);
-    temp->real_size[index] = data_size;
-    temp->flag[index] = 1;
+/*  
+* Name:         bloom_missed
+* Argument:     hash_table*
+* Return:       none
+* Purpose:      Count a GET the filter let through that found nothing.
+* Note:         none
+*/
+static void bloom_missed(hash_table *temp){
+    if (temp->bloom != 0)
+        __atomic_fetch_add(&temp->bloom_false_positives, 1, __ATOMIC_RELAXED);
+}
 
-    #ifdef DEBUG
-    printf("----------------------\n");
-    printf("Trigger set..\n");
-    printf("index now is :              %d\n", index);
-    printf("keys location:              %p\n", temp->keys+index*120);
-    printf("value start location:       %p\n", temp->value);
-    printf("temp->keys[%d] is:          %s\n", index, temp->keys+index*120);
-    printf("temp->value[%d] is:         %s\n", index, temp->value+index*temp->max_element_size);
-    printf("temp->real_size[%d] is:     %d\n", index, temp->real_size[index]);
-    printf("temp->flag[%d] is:          %d\n", index, temp->flag[index]);
-    printf("----------------------\n");
-    #endif /* DEBUG */
 
-    sem_post(&temp->lock);
-    return HASH_OK;
+/*  
+* Name:         epoch_bump
+* Argument:     hash_table*, char*
+* Return:       none
+* Purpose:      Advance the write epoch of name's stripe, near cache 
+*               entries of the stripe stop being served.
+* Note:         Lock must be held, call before the name's value changes
+*               or goes.
+*/
+static void epoch_bump(hash_table *temp, char *name){
+    if (temp->epochs != 0)
+        __atomic_fetch_add(&EPOCHS(temp)[name_hash(name) % EPOCH_STRIPES], 1,
+                           __ATOMIC_RELEASE);
 }
 
+
 /*  
-* Name:         hash_delete
-* Argument:     void*, char*
-* Return:       int
-* Purpose:      Delete an entry in the hashtable.
+* Name:         sketch_counter
+* Argument:     hash_table*, unsigned long, int
+* Return:       unsigned char*
+* Purpose:      Counter of a mix_hash() in a row of the admission sketch.
 * Note:         none
 */
-int hash_delete(void *hashtable, char *name){
-    /* Cast hashtable pointer. */
-    hash_table *temp = (hash_table*)hashtable;
+static unsigned char* sketch_counter(hash_table *temp, unsigned long hash, 
+                                     int row){
+    return SKETCH(temp) + row*temp->sketch_width + 
+           (((hash & 0xffffffffUL) + (unsigned long)row*((hash >> 32) | 1)) & 
+            (temp->sketch_width - 1));
+}
 
-    /* Check NULL pointers. */
-    if (hashtable == NULL)
-        return HASH_ERR_NULL;
+/*  
+* Name:         sketch_age
+* Argument:     hash_table*
+* Return:       none
+* Purpose:      Halve every counter of the sketch, a word at a time.
+* Note:         No lock needed. Counts racing with it may be lost, the 
+*               sketch is an estimate.
+*/
+static void sketch_age(hash_table *temp){
+    unsigned long *words = (unsigned long*)SKETCH(temp);
 
-    if (name == NULL)
-        return HASH_ERR_NAME;
+    FORONE(i, SKETCH_ROWS*temp->sketch_width/sizeof(unsigned long)){
+        unsigned long word = __atomic_load_n(&words[i], __ATOMIC_RELAXED);
 
-    if (strlen(name) > 120){
-        return HASH_ERR_NAME;
+        __atomic_store_n(&words[i], (word >> 1) & 0x7f7f7f7f7f7f7f7fUL,
+                         __ATOMIC_RELAXED);
     }
+}
 
-    /* Lock semaphore. */
-    if (sem_wait(&temp->lock) != 0)
-        return HASH_ERR_OTHER;
+/*  
+* Name:         sketch_add
+* Argument:     hash_table*, char*
+* Return:       none
+* Purpose:      Count an access to name, stored or not, in the admission
+*               sketch.
+* Note:         No lock needed. Every sketch_sample counts the sketch is 
+*               halved, old popularity fades.
+*/
+static void sketch_add(hash_table *temp, char *name){
+    unsigned long hash;
 
-    int index = hash_func(name, temp->num_elements);
-    /* Track times of searching. */
-    int counter = 0;
+    if (temp->sketch == 0)
+        return;
+    hash = mix_hash(name_hash(name));
+    FORONE(row, SKETCH_ROWS){
+        unsigned char *counter = sketch_counter(temp, hash, row);
+        unsigned char count = __atomic_load_n(counter, __ATOMIC_RELAXED);
 
-    /* Search through each quadratic probing entries. */
-    while(memcmp(temp->keys+index*120, name, (strlen(name)+1)) != 0){
-        index++;
-        index %= temp->num_elements;
-        if (index >= temp->num_elements)
-            index = 0;
-        counter ++;
-        if (counter >= temp->num_elements){
-            sem_post(&temp->lock);
-            return HASH_ERR_NOEXIT;
-        }
+        if (count < SKETCH_MAX)
+            __atomic_compare_exchange_n(counter, &count, count + 1, 0, 
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
     }
+    if (__atomic_add_fetch(&temp->sketch_ops, 1, __ATOMIC_RELAXED) % 
+        temp->sketch_sample == 0)
+        sketch_age(temp);
+}
 
-    temp->n_items--;
+/*  
+* Name:         sketch_estimate
+* Argument:     hash_table*, char*
+* Return:       int
+* Purpose:      Accesses to name counted by the sketch, since the halvings.
+* Note:         The smallest of its counters, an overestimate at worst.
+*/
+static int sketch_estimate(hash_table *temp, char *name){
+    unsigned long hash = mix_hash(name_hash(name));
+    int estimate = SKETCH_MAX;
 
-    /* Reset data. */
-    memset(temp->keys+index*120, '\0', 120);
-    memset(temp->value+index*temp->max_element_size, '\0', temp->real_size[index]);
-    temp->real_size[index] = -1;
-    temp->flag[index] = 0;
+    FORONE(row, SKETCH_ROWS)
+        estimate = MIN(estimate, __atomic_load_n(sketch_counter(temp, hash, 
+                                                                row),
+                                                 __ATOMIC_RELAXED));
+    return estimate;
+}
 
-    #ifdef DEBUG
-    printf("----------------------\n");
-    printf("Trigger delete:\n");
-    printf("temp->keys[%d] is:      %s\n", index, temp->keys+index*120);
-    printf("temp->value[%d] is:     %s\n", index, temp->value+index*temp->max_element_size);
-    printf("temp->real_size[%d] is: %d\n", index, temp->real_size[index]);
-    printf("temp->flag[%d] is:      %d\n", index, temp->flag[index]);
-    printf("----------------------\n");
-    #endif /* DEBUG */
 
-    sem_post(&temp->lock);
+/*  
+* Name:         check_name
+* Argument:     char*
+* Return:       int
+* Purpose:      Check a name fits in a key slot.
+* Note:         Returns HASH_OK or HASH_ERR_NAME.
+*/
+static int check_name(char *name){
+    if (name == NULL || strlen(name) >= KEY_SIZE)
+        return HASH_ERR_NAME;
     return HASH_OK;
 }
 
 /*  
-* Name:         hash_get
-* Argument:     void*, char*, void*, int*
-* Return:       int
-* Purpose:      Get an entry in the hashtable, if find, *buffer
-*               will be link to a new piece of memory with that data.
+* Name:         cuckoo_buckets
+* Argument:     hash_table*, unsigned long, int*
+* Return:       none
+* Purpose:      First slots of the two cuckoo buckets of a name_hash().
+* Note:         The halves of its 64 bit finalizer pick them, a second 
+*               equal to the first is moved to the next bucket.
+*/
+static void cuckoo_buckets(hash_table *temp, unsigned long hash, 
+                           int *buckets){
+    unsigned long n_buckets = temp->num_elements / CUCKOO_WAYS;
+
+    hash = mix_hash(hash);
+    buckets[0] = (hash & 0xffffffffUL) % n_buckets;
+    buckets[1] = (hash >> 32) % n_buckets;
+    if (buckets[1] == buckets[0])
+        buckets[1] = (buckets[0] + 1) % n_buckets;
+    buckets[0] *= CUCKOO_WAYS;
+    buckets[1] *= CUCKOO_WAYS;
+}
+
+/*  
+* Name:         cuckoo_find
+* Argument:     hash_table*, char*, unsigned long, int*
+* Return:       int
+* Purpose:      Find the used slot holding name in its two buckets.
+* Note:         Lock must be held. Returns the index or -1, *looked counts
+*               the slots read.
+*/
+static int cuckoo_find(hash_table *temp, char *name, unsigned long hash,
+                       int *looked){
+    unsigned int tag = (unsigned int)hash;
+    int buckets[2];
+
+    cuckoo_buckets(temp, hash, buckets);
+    FORONE(b, 2){
+        FORONE(way, CUCKOO_WAYS){
+            int index = buckets[b] + way;
+
+            (*looked)++;
+            if (FLAG(temp, index) == SLOT_USED && 
+                (temp->tag == 0 || TAG(temp, index) == tag) &&
+                strcmp(KEY(temp, index), name) == 0)
+                return index;
+        }
+    }
+    return -1;
+}
+
+/*  
+* Name:         find_slot
+* Argument:     hash_table*, char*, int
+* Return:       int
+* Purpose:      Find the used slot holding name.
+* Note:         Lock must be held. Probing stops at the first free slot, 
+*               tombstones are skipped. Returns the index or -1, a hit sets
+*               the slot's CLOCK bit. op is only passed to the probe_loop 
+*               probe. Buckets compare their tag before the name. Cuckoo
+*               tables read the name's two buckets instead.
+*/
+static int find_slot(hash_table *temp, char *name, int op){
+    unsigned long hash = name_hash(name);
+    unsigned int tag = (unsigned int)hash;
+    int index = hash%temp->num_elements;
+    /* Track times of searching. */
+    int counter = 0;
+
+    if (temp->engine == HASH_ENGINE_CUCKOO){
+        index = cuckoo_find(temp, name, hash, &counter);
+        TRACE3(probe_loop, op, index, counter);
+        if (index != -1 && REF(temp, index) == 0)
+            REF(temp, index) = 1;
+        return index;
+    }
+
+    /* Linear probing. */
+    while (FLAG(temp, index) != SLOT_FREE){
+        if (FLAG(temp, index) == SLOT_USED && 
+            (temp->tag == 0 || TAG(temp, index) == tag) &&
+            strcmp(KEY(temp, index), name) == 0){
+            TRACE3(probe_loop, op, index, counter);
+            if (REF(temp, index) == 0)
+                REF(temp, index) = 1;
+            return index;
+        }
+        index++;
+        if (index >= temp->num_elements)
+            index = 0;
+        counter ++;
+        if (counter >= temp->num_elements)
+            break;
+    }
+    TRACE3(probe_loop, op, index, counter);
+    return -1;
+}
+
+/*  
+* Name:         open_slot
+* Argument:     hash_table*, char*
+* Return:       int
+* Purpose:      Find the first free slot or tombstone on the probe path of
+*               name.
+* Note:         Lock must be held. Returns the index or -1 if the table is
+*               full.
+*/
+static int open_slot(hash_table *temp, char *name){
+    int index = hash_func(name, temp->num_elements);
+    int counter = 0;
+
+    while (FLAG(temp, index) != SLOT_FREE && FLAG(temp, index) != SLOT_DELETED){
+        index++;
+        if (index >= temp->num_elements)
+            index = 0;
+        counter ++;
+        if (counter >= temp->num_elements)
+            return -1;
+    }
+    return index;
+}
+
+/*  
+* Name:         set_key
+* Argument:     hash_table*, int, char*
+* Return:       none
+* Purpose:      Write name into a slot, with its tag for buckets.
+* Note:         Lock must be held.
+*/
+static void set_key(hash_table *temp, int index, char *name){
+    memcpy(KEY(temp, index), name, (strlen(name)+1));
+    if (temp->tag != 0)
+        TAG(temp, index) = (unsigned int)name_hash(name);
+}
+
+/*  
+* Name:         slot_location
+* Argument:     hash_table*, int
+* Return:       tier_location
+* Purpose:      Where the value of a spilled slot is in the extent file.
+* Note:         Lock must be held, or the slot pinned. Copied out, value 
+*               slots are not aligned.
+*/
+static tier_location slot_location(hash_table *temp, int index){
+    tier_location location;
+
+    memcpy(&location, DATA(temp, index), sizeof(location));
+    return location;
+}
+
+/*  
+* Name:         tier_link
+* Argument:     hash_table*, int
+* Return:       none
+* Purpose:      Put a slot just made spilled in the list of them, by 
+*               offset of its extent.
+* Note:         Lock must be held. Extents are mostly appended in order, 
+*               the place is looked for back from the last one.
+*/
+static void tier_link(hash_table *temp, int index){
+    unsigned long offset = slot_location(temp, index).offset;
+    int prev = temp->tier_last, next;
+
+    while (prev != -1 && slot_location(temp, prev).offset > offset)
+        prev = TIER_NODE(temp, prev).prev;
+    next = prev == -1 ? temp->tier_first : TIER_NODE(temp, prev).next;
+    TIER_NODE(temp, index).prev = prev;
+    TIER_NODE(temp, index).next = next;
+    if (prev == -1)
+        temp->tier_first = index;
+    else
+        TIER_NODE(temp, prev).next = index;
+    if (next == -1)
+        temp->tier_last = index;
+    else
+        TIER_NODE(temp, next).prev = index;
+}
+
+/*  
+* Name:         tier_unlink
+* Argument:     hash_table*, int
+* Return:       none
+* Purpose:      Take a spilled slot out of the list of them.
+* Note:         Lock must be held.
+*/
+static void tier_unlink(hash_table *temp, int index){
+    tier_node node = TIER_NODE(temp, index);
+
+    if (node.prev == -1)
+        temp->tier_first = node.next;
+    else
+        TIER_NODE(temp, node.prev).next = node.next;
+    if (node.next == -1)
+        temp->tier_last = node.prev;
+    else
+        TIER_NODE(temp, node.next).prev = node.prev;
+}
+
+/*  
+* Name:         tier_relink
+* Argument:     hash_table*, int, int
+* Return:       none
+* Purpose:      Put slot to in the place of spilled slot from in the list,
+*               its value moved there.
+* Note:         Lock must be held. from is left out of the list, its flag 
+*               still says spilled.
+*/
+static void tier_relink(hash_table *temp, int from, int to){
+    tier_node node = TIER_NODE(temp, from);
+
+    TIER_NODE(temp, to) = node;
+    if (node.prev == -1)
+        temp->tier_first = to;
+    else
+        TIER_NODE(temp, node.prev).next = to;
+    if (node.next == -1)
+        temp->tier_last = to;
+    else
+        TIER_NODE(temp, node.next).prev = to;
+}
+
+/*  
+* Name:         clear_slot
+* Argument:     hash_table*, int
+* Return:       none
+* Purpose:      Turn a slot into a tombstone.
+* Note:         Lock must be held. A tombstone followed by a free slot ends
+*               no probe path, so it and the tombstones before it become 
+*               free again and misses stay short. Cuckoo lookups read both
+*               buckets whatever they hold, their slots are freed at once.
+*/
+static void clear_slot(hash_table *temp, int index){
+    int next = (index + 1) % temp->num_elements;
+    int cuckoo = temp->engine == HASH_ENGINE_CUCKOO;
+
+    /* Reset data. */
+    PUBLISH(temp, index, cuckoo ? SLOT_FREE : SLOT_DELETED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memset(KEY(temp, index), '\0', KEY_SIZE);
+    REAL_SIZE(temp, index) = -1;
+    if (SPILLED(temp, index)){
+        tier_unlink(temp, index);
+        SPILL(temp, index) = 0;
+    }
+
+    if (cuckoo || FLAG(temp, next) != SLOT_FREE)
+        return;
+    while (FLAG(temp, index) == SLOT_DELETED){
+        FLAG(temp, index) = SLOT_FREE;
+        index = (index + temp->num_elements - 1) % temp->num_elements;
+    }
+}
+
+/*  
+* Name:         count_value
+* Argument:     hash_table*, int, int
+* Return:       none
+* Purpose:      Add the value of a slot to the byte counts (sign 1) or 
+*               take it out (sign -1).
+* Note:         Lock must be held. A spilled value takes its location in
+*               the slot and its extent in tier_bytes, raw_bytes only 
+*               counts values kept in slots.
+*/
+static void count_value(hash_table *temp, int index, int sign){
+    temp->stored_bytes += sign*REAL_SIZE(temp, index);
+    if (REAL_SIZE(temp, index) > temp->inline_size)
+        temp->value_slots += sign;
+    if (SPILLED(temp, index)){
+        temp->tier_items += sign;
+        temp->tier_bytes += sign*slot_location(temp, index).size;
+    }
+    else
+        temp->raw_bytes += sign*RAW_SIZE(temp, index);
+}
+
+/*  
+* Name:         copy_order
+* Argument:     const void*, const void*
+* Return:       int
+* Purpose:      qsort() order of tier_copy by offset of the extent.
+* Note:         none
+*/
+static int copy_order(const void *a, const void *b){
+    unsigned long x = ((const tier_copy*)a)->from.offset;
+    unsigned long y = ((const tier_copy*)b)->from.offset;
+
+    return (x > y) - (x < y);
+}
+
+/*  
+* Name:         relink_tier
+* Argument:     hash_table*
+* Return:       none
+* Purpose:      Make the list of spilled slots again from their flags.
+* Note:         Lock must be held. The slots are sorted by offset and 
+*               linked in that order, or one by one if there is no memory
+*               to sort them.
+*/
+static void relink_tier(hash_table *temp){
+    tier_copy *copies;
+    int count = 0;
+
+    if (temp->spilled == 0)
+        return;
+    temp->tier_first = temp->tier_last = -1;
+    copies = malloc((size_t)temp->num_elements*sizeof(tier_copy));
+    FORONE(i, temp->num_elements){
+        if (!SPILL(temp, i))
+            continue;
+        if (copies == NULL){
+            tier_link(temp, i);
+            continue;
+        }
+        copies[count].index = i;
+        copies[count].from = slot_location(temp, i);
+        count++;
+    }
+    if (copies == NULL)
+        return;
+    qsort(copies, count, sizeof(tier_copy), copy_order);
+    FORONE(i, count)
+        tier_link(temp, copies[i].index);
+    free(copies);
+}
+
+/*  
+* Name:         recover_table
+* Argument:     hash_table*
+* Return:       none
+* Purpose:      Repair what a lock holder that died may have left half 
+*               done.
+* Note:         Lock must be held. A slot only becomes used once its name
+*               and value are written (PUBLISH), so the used slots are 
+*               whole; a value the holder was overwriting in place 
+*               (SLOT_WRITING) is dropped, its extent if it was spilling 
+*               is dead. The byte and item counts are then recounted, the
+*               Bloom filter rebuilt (each counter only stored once, 
+*               readers never see it below the names it holds) and every
+*               write epoch advanced. Pins and reservations of the dead process stay,
+*               a pinned slot is not reused. A cuckoo move cut short may 
+*               leave a value in both its slots, the second is cleared.
+*               The list of spilled slots is made again first.
+*/
+static void recover_table(hash_table *temp){
+    unsigned char *counts = NULL;
+
+    FORONE(i, temp->num_elements)
+        if (FLAG(temp, i) == SLOT_WRITING){
+            if (SPILLED(temp, i))
+                SPILL(temp, i) = 0;
+            clear_slot(temp, i);
+        }
+    relink_tier(temp);
+
+    temp->n_items = temp->tier_items = 0;
+    temp->raw_bytes = temp->stored_bytes = temp->key_bytes = 0;
+    temp->value_slots = 0;
+    temp->tier_bytes = 0;
+    if (temp->bloom != 0)
+        counts = calloc(temp->bloom_counters, 1);
+    FORONE(i, temp->num_elements){
+        int looked = 0;
+
+        if (FLAG(temp, i) != SLOT_USED)
+            continue;
+        if (temp->engine == HASH_ENGINE_CUCKOO && 
+            cuckoo_find(temp, KEY(temp, i), name_hash(KEY(temp, i)), 
+                        &looked) != i){
+            clear_slot(temp, i);
+            continue;
+        }
+        temp->n_items++;
+        count_value(temp, i, 1);
+        temp->key_bytes += strlen(KEY(temp, i)) + 1;
+        if (counts == NULL)
+            continue;
+        FORONE(j, BLOOM_HASHES){
+            unsigned char *counter = bloom_counter(temp, counts, 
+                                                   name_hash(KEY(temp, i)), j);
+            if (*counter < BLOOM_MAX)
+                (*counter)++;
+        }
+    }
+    if (counts != NULL){
+        FORONE(i, temp->bloom_counters)
+            __atomic_store_n(&BLOOM(temp)[i], counts[i], __ATOMIC_RELAXED);
+        free(counts);
+    }
+    if (temp->epochs != 0)
+        FORONE(i, EPOCH_STRIPES)
+            __atomic_fetch_add(&EPOCHS(temp)[i], 1, __ATOMIC_RELEASE);
+}
+
+/*  
+* Name:         unpin_slot
+* Argument:     hash_table*, int
+* Return:       none
+* Purpose:      Drop a pin, clearing the slot if it was deleted meanwhile.
+* Note:         Lock must be held.
+*/
+static void unpin_slot(hash_table *temp, int index){
+    if (index >= 0 && index < temp->num_elements && PINS(temp, index) > 0){
+        PINS(temp, index)--;
+        if (PINS(temp, index) == 0 && FLAG(temp, index) == SLOT_DEAD)
+            clear_slot(temp, index);
+    }
+}
+
+/*  
+* Name:         remove_slot
+* Argument:     hash_table*, int
+* Return:       none
+* Purpose:      Remove a used slot from the table.
+* Note:         Lock must be held. A pinned slot is only marked dead, the 
+*               last hash_release() clears it.
+*/
+static void remove_slot(hash_table *temp, int index){
+    temp->n_items--;
+    count_value(temp, index, -1);
+    temp->key_bytes -= strlen(KEY(temp, index)) + 1;
+    bloom_add(temp, KEY(temp, index), -1);
+    epoch_bump(temp, KEY(temp, index));
+    REF(temp, index) = 0;
+    if (PINS(temp, index) > 0){
+        FLAG(temp, index) = SLOT_DEAD;
+        return;
+    }
+    clear_slot(temp, index);
+}
+
+/*  
+* Name:         used_bytes
+* Argument:     hash_table*
+* Return:       size_t
+* Purpose:      Bytes counted against memory_limit: metadata, names and 
+*               values as stored.
+* Note:         Lock must be held.
+*/
+static size_t used_bytes(hash_table *temp){
+    return temp->metadata_bytes + temp->key_bytes + temp->stored_bytes;
+}
+
+/*  
+* Name:         tier_write
+* Argument:     int, void*, size_t, unsigned long
+* Return:       int
+* Purpose:      Write size bytes at offset of the extent file fd.
+* Note:         Returns 0, or -1 if they cannot all be written.
+*/
+static int tier_write(int fd, void *data, size_t size, unsigned long offset){
+    size_t done = 0;
+
+    while (done < size){
+        ssize_t n = pwrite(fd, (char*)data + done, size - done, 
+                           offset + done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+/*  
+* Name:         tier_reserve
+* Argument:     hash_table*, int, tier_location*
+* Return:       int
+* Purpose:      Take size bytes at the end of the extent file for an 
+*               extent written without the lock, *location says where.
+* Note:         Lock must be held. Returns 0, or -1 without an extent 
+*               file. Until tier_settle() compaction neither punches nor
+*               truncates the bytes taken, an extent never published is 
+*               dead. A process dying before then leaves them taken.
+*/
+static int tier_reserve(hash_table *temp, int size, tier_location *location){
+    if (tier_fd(temp) == -1)
+        return -1;
+    if (temp->tier_writers++ == 0)
+        temp->tier_writing = temp->tier_tail;
+    location->offset = temp->tier_tail;
+    location->size = size;
+    temp->tier_tail += size;
+    return 0;
+}
+
+/*  
+* Name:         tier_settle
+* Argument:     hash_table*
+* Return:       none
+* Purpose:      End a tier_reserve(), its extent published or dead.
+* Note:         Lock must be held.
+*/
+static void tier_settle(hash_table *temp){
+    temp->tier_writers--;
+}
+
+/*  
+* Name:         tier_put
+* Argument:     hash_table*, void*, int, tier_location*
+* Return:       int
+* Purpose:      Write a value of a SET to the extent file before the SET
+*               takes the lock, *location says where.
+* Note:         Lock must not be held, it is only taken to reserve the 
+*               room. Returns 0 with the extent reserved until the SET 
+*               settles it, or -1 if it cannot all be written.
+*/
+static int tier_put(hash_table *temp, void *data, int size, 
+                    tier_location *location){
+    int status;
+
+    if (hash_lock(temp) != 0)
+        return -1;
+    status = tier_reserve(temp, size, location);
+    hash_unlock(temp);
+    if (status == 0 && 
+        tier_write(tier_fd(temp), data, size, location->offset) == -1){
+        if (hash_lock(temp) == 0){
+            tier_settle(temp);
+            hash_unlock(temp);
+        }
+        status = -1;
+    }
+    return status;
+}
+
+/*  
+* Name:         tier_read
+* Argument:     hash_table*, tier_location, int, void*
+* Return:       int
+* Purpose:      Read the value of an extent into buffer, raw_size bytes 
+*               once decompressed.
+* Note:         No lock needed while the slot holding location is locked 
+*               or pinned, compaction leaves such an extent where it is.
+*               Nor for compaction itself, only it frees extents. Returns
+*               0 or -1.
+*/
+static int tier_read(hash_table *temp, tier_location location, int raw_size,
+                     void *buffer){
+    int fd = tier_fd(temp), done = 0, status = 0;
+    char *extent = buffer;
+
+    if (fd == -1)
+        return -1;
+    if (location.size != raw_size){
+        extent = malloc(location.size);
+        if (extent == NULL)
+            return -1;
+    }
+    while (done < location.size && status == 0){
+        ssize_t n = pread(fd, extent + done, location.size - done, 
+                          location.offset + done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            status = -1;
+        else
+            done += n;
+    }
+    if (extent != buffer){
+        if (status == 0 && 
+            lz_decompress(extent, location.size, buffer, raw_size) == -1)
+            status = -1;
+        free(extent);
+    }
+    return status;
+}
+
+/*  
+* Name:         read_value
+* Argument:     hash_table*, int, void*
+* Return:       int
+* Purpose:      Copy the value of a slot into buffer, RAW_SIZE() bytes: 
+*               decompressed, or read from the extent file.
+* Note:         Lock must be held, or the slot pinned. Returns 0 or -1.
+*/
+static int read_value(hash_table *temp, int index, void *buffer){
+    if (SPILLED(temp, index))
+        return tier_read(temp, slot_location(temp, index), 
+                         RAW_SIZE(temp, index), buffer);
+    if (RAW_SIZE(temp, index) == REAL_SIZE(temp, index)){
+        memcpy(buffer, DATA(temp, index), REAL_SIZE(temp, index));
+        return 0;
+    }
+    if (lz_decompress(DATA(temp, index), REAL_SIZE(temp, index), buffer, 
+                      RAW_SIZE(temp, index)) == -1)
+        return -1;
+    return 0;
+}
+
+/*  
+* Name:         read_unlock
+* Argument:     hash_table*, int, void*
+* Return:       int
+* Purpose:      read_value() and release the lock, a spilled value is 
+*               read from the extent file after: its slot pinned, the 
+*               lock taken again only to unpin it.
+* Note:         Lock must be held, it is not on return. Returns 0 or -1.
+*/
+static int read_unlock(hash_table *temp, int index, void *buffer){
+    tier_location location;
+    int raw_size, status;
+
+    if (!SPILLED(temp, index)){
+        status = read_value(temp, index, buffer);
+        hash_unlock(temp);
+        return status;
+    }
+    location = slot_location(temp, index);
+    raw_size = RAW_SIZE(temp, index);
+    PINS(temp, index)++;
+    hash_unlock(temp);
+
+    status = tier_read(temp, location, raw_size, buffer);
+    if (hash_lock(temp) == 0){
+        unpin_slot(temp, index);
+        hash_unlock(temp);
+    }
+    return status;
+}
+
+/*  
+* Name:         store_location
+* Argument:     hash_table*, int, tier_location*, int
+* Return:       none
+* Purpose:      Make a slot hold the location of an extent, of a value of
+*               raw_size bytes, and count it.
+* Note:         Lock must be held, the slot must not be counted yet. It is 
+*               linked by its new offset.
+*/
+static void store_location(hash_table *temp, int index, 
+                           tier_location *location, int raw_size){
+    if (SPILL(temp, index))
+        tier_unlink(temp, index);
+    memcpy(VALUE_AT(temp, index, sizeof(tier_location)), location, 
+           sizeof(tier_location));
+    REAL_SIZE(temp, index) = sizeof(tier_location);
+    RAW_SIZE(temp, index) = raw_size;
+    SPILL(temp, index) = 1;
+    tier_link(temp, index);
+    count_value(temp, index, 1);
+}
+
+/*  
+* Name:         spill_slot
+* Argument:     hash_table*, int, spill_list*
+* Return:       int
+* Purpose:      Queue the value of a used slot for spill_finish() to move
+*               to the extent file, counting the bytes it gives back.
+* Note:         Lock must be held, the slot must not be pinned. It is 
+*               pinned and its extent reserved until then. Returns 0, or 
+*               -1 if it cannot be queued and the slot is unchanged.
+*/
+static int spill_slot(hash_table *temp, int index, spill_list *spills){
+    tier_spill *spill;
+
+    if (spills->count == spills->size){
+        int size = MAX(2*spills->size, 8);
+        tier_spill *items = realloc(spills->items, size*sizeof(tier_spill));
+
+        if (items == NULL)
+            return -1;
+        spills->items = items;
+        spills->size = size;
+    }
+    spill = &spills->items[spills->count];
+    if (tier_reserve(temp, REAL_SIZE(temp, index), &spill->to) == -1)
+        return -1;
+    spill->index = index;
+    PINS(temp, index)++;
+    spills->count++;
+    spills->bytes += REAL_SIZE(temp, index) - sizeof(tier_location);
+    return 0;
+}
+
+/*  
+* Name:         spill_finish
+* Argument:     hash_table*, spill_list*
+* Return:       none
+* Purpose:      Write the values spill_slot() queued to their extents, 
+*               then give each slot its location under the lock.
+* Note:         Lock must not be held. A pinned value stays the same, it
+*               is written without the lock. A slot deleted or pinned by
+*               a reader meanwhile, or whose value could not be written, 
+*               keeps its value and its extent is dead. The value stays 
+*               the same, so does its write epoch. spills is emptied.
+*/
+static void spill_finish(hash_table *temp, spill_list *spills){
+    int fd = tier_fd(temp);
+
+    if (spills->count == 0)
+        return;
+    FORONE(i, spills->count){
+        tier_spill *spill = &spills->items[i];
+
+        if (tier_write(fd, DATA(temp, spill->index), spill->to.size, 
+                       spill->to.offset) == -1)
+            spill->to.size = 0;
+    }
+
+    if (hash_lock(temp) == 0){
+        FORONE(i, spills->count){
+            int index = spills->items[i].index;
+
+            tier_settle(temp);
+            if (spills->items[i].to.size > 0 && 
+                FLAG(temp, index) == SLOT_USED && PINS(temp, index) == 1){
+                FLAG(temp, index) = SLOT_WRITING;
+                __atomic_thread_fence(__ATOMIC_RELEASE);
+                count_value(temp, index, -1);
+                store_location(temp, index, &spills->items[i].to, 
+                               RAW_SIZE(temp, index));
+                PUBLISH(temp, index, SLOT_USED);
+                temp->tier_spills++;
+            }
+            unpin_slot(temp, index);
+        }
+        hash_unlock(temp);
+    }
+    FREE(spills->items);
+    spills->count = spills->size = 0;
+    spills->bytes = 0;
+}
+
+/*  
+* Name:         evict_slot
+* Argument:     hash_table*, int, char*, spill_list*
+* Return:       int
+* Purpose:      Remove the value the CLOCK hand finds first: the next used
+*               slot, not pinned and not keep, whose bit was cleared by a 
+*               previous pass. With spills, queue it there for the extent
+*               file instead.
+* Note:         Lock must be held. The eviction is journaled as a DELETE.
+*               Returns 0, or -1 if nothing can be evicted. With the 
+*               admission sketch a new name, candidate (NULL for a name
+*               already stored), only replaces a victim the sketch counted
+*               fewer accesses for; else -1, counted in rejected, and the
+*               hand stays on the victim for the next candidate. Spilling
+*               passes over values already spilled or no larger than their
+*               location, once none is left values are evicted if the 
+*               table may.
+*/
+static int evict_slot(hash_table *temp, int keep, char *candidate, 
+                      spill_list *spills){
+    FORONE(step, 2*temp->num_elements){
+        int index = temp->hand;
+
+        temp->hand = (index + 1) % temp->num_elements;
+        if (FLAG(temp, index) != SLOT_USED || PINS(temp, index) > 0 || 
+            index == keep)
+            continue;
+        if (spills != NULL && (SPILLED(temp, index) || 
+                      REAL_SIZE(temp, index) <= (int)sizeof(tier_location)))
+            continue;
+        if (REF(temp, index)){
+            REF(temp, index) = 0;
+            continue;
+        }
+        if (candidate != NULL && temp->sketch != 0 &&
+            sketch_estimate(temp, candidate) <= 
+            sketch_estimate(temp, KEY(temp, index))){
+            temp->hand = index;
+            temp->rejected++;
+            return -1;
+        }
+        if (spills != NULL && spill_slot(temp, index, spills) == 0)
+            return 0;
+        if (!temp->evict)
+            return -1;
+        TRACE2(evict, index, REAL_SIZE(temp, index));
+        JOURNAL(temp, HASH_JOURNAL_DELETE, KEY(temp, index), NULL, 0);
+        remove_slot(temp, index);
+        temp->evictions++;
+        return 0;
+    }
+    /* Nothing left worth spilling. */
+    if (spills != NULL && temp->evict)
+        return evict_slot(temp, keep, candidate, NULL);
+    return -1;
+}
+
+/*  
+* Name:         make_room
+* Argument:     hash_table*, size_t, size_t, int, char*, spill_list*
+* Return:       int
+* Purpose:      Check add more bytes fit the memory limit once freed 
+*               bytes are given back, evicting values if it may.
+* Note:         Lock must be held, keep is never evicted. Returns 0, or -1
+*               (counted as refused) if the bytes do not fit the limit.
+*               candidate as evict_slot(). With an extent file values 
+*               spill to it first, whether the table may evict or not:
+*               they are queued in spills, counted as given back, and the
+*               caller runs spill_finish() once it dropped the lock. Till
+*               then the table is over its limit by them.
+*/
+static int make_room(hash_table *temp, size_t add, size_t freed, int keep,
+                     char *candidate, spill_list *spills){
+    if (temp->memory_limit == 0)
+        return 0;
+    if (temp->metadata_bytes + add > temp->memory_limit){
+        temp->refused++;
+        return -1;
+    }
+    while (used_bytes(temp) + add > temp->memory_limit + freed + 
+                                    spills->bytes){
+        if ((!temp->evict && temp->spilled == 0) || 
+            evict_slot(temp, keep, candidate, 
+                       temp->spilled != 0 ? spills : NULL) == -1){
+            temp->refused++;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*  
+* Name:         move_slot
+* Argument:     hash_table*, int, int
+* Return:       none
+* Purpose:      Move the value of a used slot to a free one.
+* Note:         Lock must be held, the slot must not be pinned. The copy 
+*               is published before the old slot is freed.
+*/
+static void move_slot(hash_table *temp, int from, int to){
+    int size = REAL_SIZE(temp, from);
+
+    set_key(temp, to, KEY(temp, from));
+    REAL_SIZE(temp, to) = size;
+    RAW_SIZE(temp, to) = RAW_SIZE(temp, from);
+    REF(temp, to) = REF(temp, from);
+    if (temp->spilled != 0)
+        SPILL(temp, to) = SPILL(temp, from);
+    memcpy(VALUE_AT(temp, to, size), DATA(temp, from), size);
+    PUBLISH(temp, to, SLOT_USED);
+    REF(temp, from) = 0;
+    if (SPILLED(temp, from)){
+        tier_relink(temp, from, to);
+        SPILL(temp, from) = 0;
+    }
+    clear_slot(temp, from);
+    temp->displaced++;
+}
+
+/*  
+* Name:         cuckoo_push
+* Argument:     hash_table*, cuckoo_step*, int*, int, int, int
+* Return:       none
+* Purpose:      Queue a slot whose value could move out, after parent.
+* Note:         Lock must be held. Skips slots that are not used, pinned,
+*               keep or already on the path, and a full queue.
+*/
+static void cuckoo_push(hash_table *temp, cuckoo_step *queue, int *tail,
+                        int slot, int parent, int keep){
+    if (*tail == CUCKOO_QUEUE || FLAG(temp, slot) != SLOT_USED || 
+        PINS(temp, slot) > 0 || slot == keep)
+        return;
+    for (int step = parent; step != -1; step = queue[step].parent)
+        if (queue[step].slot == slot)
+            return;
+    queue[*tail].slot = slot;
+    queue[*tail].parent = parent;
+    queue[*tail].depth = parent == -1 ? 0 : queue[parent].depth + 1;
+    (*tail)++;
+}
+
+/*  
+* Name:         cuckoo_slot
+* Argument:     hash_table*, char*, int
+* Return:       int
+* Purpose:      Find a free slot in the two buckets of name, moving values
+*               to their other bucket to make one.
+* Note:         Lock must be held, keep is not moved. Breadth first search
+*               for the shortest path to a free slot, at most CUCKOO_DEPTH
+*               moves and CUCKOO_QUEUE slots looked at; the moves run from
+*               its end, every value stays in one of its buckets. Nothing
+*               moves while a scan runs. Returns the index or -1.
+*/
+static int cuckoo_slot(hash_table *temp, char *name, int keep){
+    cuckoo_step queue[CUCKOO_QUEUE];
+    int buckets[2], head, tail = 0;
+
+    cuckoo_buckets(temp, name_hash(name), buckets);
+    FORONE(b, 2)
+        FORONE(way, CUCKOO_WAYS)
+            if (FLAG(temp, buckets[b] + way) == SLOT_FREE)
+                return buckets[b] + way;
+    if (temp->scans > 0)
+        return -1;
+
+    FORONE(b, 2)
+        FORONE(way, CUCKOO_WAYS)
+            cuckoo_push(temp, queue, &tail, buckets[b] + way, -1, keep);
+    for (head = 0; head < tail; head++){
+        int from = queue[head].slot, other[2], bucket;
+
+        cuckoo_buckets(temp, name_hash(KEY(temp, from)), other);
+        bucket = from - from % CUCKOO_WAYS == other[0] ? other[1] : other[0];
+        FORONE(way, CUCKOO_WAYS){
+            int to = bucket + way;
+
+            if (FLAG(temp, to) != SLOT_FREE)
+                continue;
+            for (int step = head; step != -1; step = queue[step].parent){
+                move_slot(temp, queue[step].slot, to);
+                to = queue[step].slot;
+            }
+            return to;
+        }
+        if (queue[head].depth < CUCKOO_DEPTH - 1)
+            FORONE(way, CUCKOO_WAYS)
+                cuckoo_push(temp, queue, &tail, bucket + way, head, keep);
+    }
+    return -1;
+}
+
+/*  
+* Name:         cuckoo_evict
+* Argument:     hash_table*, char*, int, char*
+* Return:       int
+* Purpose:      Evict a value of the two buckets of name, to make room 
+*               for it when no path frees a slot.
+* Note:         Lock must be held, keep is never evicted. CLOCK over the 
+*               two buckets: a used value loses its bit, the first without
+*               one is the victim. Returns 0, or -1 when every value is 
+*               pinned or the admission sketch prefers the victim, as 
+*               evict_slot().
+*/
+static int cuckoo_evict(hash_table *temp, char *name, int keep, 
+                        char *candidate){
+    int buckets[2], victim = -1;
+
+    cuckoo_buckets(temp, name_hash(name), buckets);
+    FORONE(step, 4*CUCKOO_WAYS){
+        int index = buckets[step / CUCKOO_WAYS % 2] + step % CUCKOO_WAYS;
+
+        if (FLAG(temp, index) != SLOT_USED || PINS(temp, index) > 0 || 
+            index == keep)
+            continue;
+        if (REF(temp, index)){
+            REF(temp, index) = 0;
+            continue;
+        }
+        victim = index;
+        break;
+    }
+    if (victim == -1)
+        return -1;
+    if (candidate != NULL && temp->sketch != 0 &&
+        sketch_estimate(temp, candidate) <= 
+        sketch_estimate(temp, KEY(temp, victim))){
+        temp->rejected++;
+        return -1;
+    }
+    TRACE2(evict, victim, REAL_SIZE(temp, victim));
+    JOURNAL(temp, HASH_JOURNAL_DELETE, KEY(temp, victim), NULL, 0);
+    remove_slot(temp, victim);
+    temp->evictions++;
+    return 0;
+}
+
+/*  
+* Name:         room_slot
+* Argument:     hash_table*, char*, int
+* Return:       int
+* Purpose:      open_slot(), evicting values while the table is full if it
+*               may.
+* Note:         Lock must be held, keep is never evicted. Returns the index
+*               or -1. name is a candidate of evict_slot() unless keep 
+*               holds it already. A cuckoo table takes cuckoo_slot() and
+*               only evicts from the name's buckets, a slot elsewhere 
+*               would not take it.
+*/
+static int room_slot(hash_table *temp, char *name, int keep){
+    int cuckoo = temp->engine == HASH_ENGINE_CUCKOO;
+    char *candidate = keep == -1 ? name : NULL;
+    int index = cuckoo ? cuckoo_slot(temp, name, keep) 
+                       : open_slot(temp, name);
+
+    while (index == -1 && temp->evict){
+        if (cuckoo ? cuckoo_evict(temp, name, keep, candidate) != 0
+                   : evict_slot(temp, keep, candidate, NULL) != 0)
+            break;
+        index = cuckoo ? cuckoo_slot(temp, name, keep) 
+                       : open_slot(temp, name);
+    }
+    if (index == -1)
+        temp->refused++;
+    return index;
+}
+
+/*  
+* Name:         pack_value
+* Argument:     hash_table*, void*, int, void**
+* Return:       int
+* Purpose:      Compress a value about to be stored if the table asks for
+*               it and it gets smaller.
+* Note:         No lock needed. Returns the bytes to store, *packed is a 
+*               malloc()ed compressed copy or NULL to store data as is. 
+*               Returns HASH_ERR_DATASIZE if the value does not fit a slot
+*               either way, a value going to the extent file always fits.
+*/
+static int pack_value(hash_table *temp, void *data, int data_size, 
+                      void **packed){
+    size_t room = SPILL_SIZE(temp, data_size) ? INT_MAX 
+                                              : temp->max_element_size;
+    int capacity = MIN((size_t)data_size - 1, room);
+    int size;
+
+    *packed = NULL;
+    if (temp->compress_threshold == 0 || data_size < temp->compress_threshold)
+        return data_size <= room ? data_size : HASH_ERR_DATASIZE;
+
+    *packed = malloc(capacity);
+    if (*packed == NULL)
+        return HASH_ERR_OTHER;
+    size = lz_compress(data, data_size, *packed, capacity);
+    if (size > 0)
+        return size;
+
+    FREE(*packed);
+    return data_size <= room ? data_size : HASH_ERR_DATASIZE;
+}
+
+/*  
+* Name:         store_slot
+* Argument:     hash_table*, int, void*, int, int
+* Return:       none
+* Purpose:      Copy stored_size bytes of a value into a slot, raw_size 
+*               before compression, and count them.
+* Note:         Lock must be held, the slot must not be counted yet.
+*/
+static void store_slot(hash_table *temp, int index, void *data, 
+                       int stored_size, int raw_size){
+    memcpy(VALUE_AT(temp, index, stored_size), data, stored_size);
+    REAL_SIZE(temp, index) = stored_size;
+    RAW_SIZE(temp, index) = raw_size;
+    if (SPILLED(temp, index)){
+        tier_unlink(temp, index);
+        SPILL(temp, index) = 0;
+    }
+    count_value(temp, index, 1);
+    REF(temp, index) = 1;
+}
+
+/*  
+* Name:         place_value
+* Argument:     hash_table*, int, void*, int, int, tier_location*
+* Return:       none
+* Purpose:      store_slot(), or store_location() for a value already in 
+*               the extent file at location.
+* Note:         Lock must be held, the slot must not be counted yet.
+*/
+static void place_value(hash_table *temp, int index, void *data, 
+                        int stored_size, int raw_size, 
+                        tier_location *location){
+    if (location == NULL){
+        store_slot(temp, index, data, stored_size, raw_size);
+        return;
+    }
+    store_location(temp, index, location, raw_size);
+    REF(temp, index) = 1;
+}
+
+
+/*  
+* Name:         prepare_set
+* Argument:     hash_table*, char*, void*, int, void**
+* Return:       int
+* Purpose:      Check a SET's arguments and compress its value.
+* Note:         Lock need not be held. Returns the bytes to store, from 
+*               *packed when it is not NULL (free it after), or an error.
+*/
+static int prepare_set(hash_table *temp, char *name, void *data, 
+                       int data_size, void **packed){
+    *packed = NULL;
+    if (check_name(name) != HASH_OK)
+        return HASH_ERR_NAME;
+
+    if (data_size < 1)
+        return HASH_ERR_OTHER;
+
+    if (data_size > temp->max_value_size)
+        return HASH_ERR_DATASIZE;
+
+    return pack_value(temp, data, data_size, packed);
+}
+
+/*  
+* Name:         set_locked
+* Argument:     hash_table*, char*, void*, int, void*, int, tier_location*,
+*               spill_list*
+* Return:       int
+* Purpose:      Store a value prepare_set() accepted.
+* Note:         Lock must be held. stored_size bytes are copied from 
+*               packed, or from data when packed is NULL, into the slot. 
+*               A value of tier_threshold bytes was tier_put() at 
+*               location instead, settled here. Values spilled to make 
+*               room are queued in spills. Returns like hash_set().
+*/
+static int set_locked(hash_table *temp, char *name, void *data, 
+                      int data_size, void *packed, int stored_size,
+                      tier_location *location, spill_list *spills){
+    /* Find a hash location, overwrite the name if already there. */
+    int index;
+    int old_index = find_slot(temp, name, TRACE_OP_SET);
+    size_t add = strlen(name) + 1 + (location ? sizeof(tier_location) 
+                                              : (size_t)stored_size);
+    size_t freed = 0;
+    if (location != NULL)
+        tier_settle(temp);
+    if (old_index != -1)
+        freed = strlen(name) + 1 + REAL_SIZE(temp, old_index);
+    sketch_add(temp, name);
+    if (make_room(temp, add, freed, old_index, 
+                  old_index == -1 ? name : NULL, spills) == -1)
+        return HASH_ERR_NOMEM;
+    if (old_index != -1 && PINS(temp, old_index) == 0){
+        epoch_bump(temp, name);
+        count_value(temp, old_index, -1);
+        FLAG(temp, old_index) = SLOT_WRITING;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        place_value(temp, old_index, packed ? packed : data, stored_size, 
+                    data_size, location);
+        PUBLISH(temp, old_index, SLOT_USED);
+        JOURNAL(temp, HASH_JOURNAL_SET, name, data, data_size);
+        return HASH_OK;
+    }
+
+    index = room_slot(temp, name, old_index);
+    if (index == -1)
+        return HASH_ERR_COLISION;
+    /* Counted in before the old slot goes, the name never looks absent. */
+    bloom_add(temp, name, 1);
+    epoch_bump(temp, name);
+    if (old_index != -1)
+        remove_slot(temp, old_index);
+
+    temp->n_items++;
+
+    set_key(temp, index, name);
+    temp->key_bytes += strlen(name) + 1;
+    place_value(temp, index, packed ? packed : data, stored_size, data_size,
+                location);
+    PUBLISH(temp, index, SLOT_USED);
+    JOURNAL(temp, HASH_JOURNAL_SET, name, data, data_size);
+
+    #ifdef DEBUG
+    printf("----------------------\n");
+    printf("Trigger set..\n");
+    printf("index now is :              %d\n", index);
+    printf("keys location:              %p\n", KEY(temp, index));
+    printf("value start location:       %p\n", VALUE(temp, 0));
+    printf("temp->keys[%d] is:          %s\n", index, KEY(temp, index));
+    printf("REAL_SIZE(temp, %d) is:     %d\n", index, REAL_SIZE(temp, index));
+    printf("FLAG(temp, %d) is:          %d\n", index, FLAG(temp, index));
+    printf("----------------------\n");
+    #endif /* DEBUG */
+
+    return HASH_OK;
+}
+
+/*  
+* Name:         hash_set
+* Argument:     vpid*, char*, void*, int
+* Return:       int
+* Purpose:      Create an entry in the hashtable. 
+* Note:         Returns 0 on success. On errors, returns a value specific to 
+*               the source of error, as follows:
+*                   -1 if the hashtable is NULL
+*                   -2 if the name is too long or is NULL
+*                   -3 if data_size > maximum allowed element size
+*                   -4 if no space exists for the element in the hashtable
+*                   -8 if it does not fit the memory limit
+*                   -99 if an error other than the above occurs.
+*               Error codes are defined in hashtable.h.
+*               The hash table is open addressing with linear probing and
+*               tombstones for deleted slots. With eviction on, values the
+*               CLOCK hand finds unused since its last pass are removed 
+*               until the new one fits. An existing value is 
+*               overwritten in place unless a reader has it pinned, then 
+*               the new value goes to a fresh slot. With compression on,
+*               the value is compressed before taking the lock. A value
+*               of tier_threshold bytes is appended to the extent file 
+*               before it too, and values spilled to make room after it.
+*/
+int hash_set(void *hashtable, char *name, void *data, int data_size){
+    /* Cast hashtable pointer. */
+    hash_table *temp = (hash_table*)hashtable;
+    spill_list spills = {0, 0, 0, NULL};
+    tier_location location;
+    void *packed;
+    int status, spill;
+
+    /* Check NULL pointers. */
+    if (hashtable == NULL)
+        return HASH_ERR_NULL;
+    if (read_only(temp))
+        return HASH_ERR_READONLY;
+
+    status = prepare_set(temp, name, data, data_size, &packed);
+    if (status < 0)
+        return status;
+    spill = SPILL_SIZE(temp, data_size);
+    if (spill && tier_put(temp, packed ? packed : data, status, 
+                          &location) == -1){
+        FREE(packed);
+        return HASH_ERR_OTHER;
+    }
+
+    /* Lock table. */
+    if (hash_lock(temp) != 0){
+        FREE(packed);
+        return HASH_ERR_OTHER;
+    }
+    status = set_locked(temp, name, data, data_size, packed, status,
+                        spill ? &location : NULL, &spills);
+    hash_unlock(temp);
+    spill_finish(temp, &spills);
+    FREE(packed);
+    return status;
+}
+
+/*  
+* Name:         delete_locked
+* Argument:     hash_table*, char*
+* Return:       int
+* Purpose:      Delete a checked name.
+* Note:         Lock must be held. Returns like hash_delete().
+*/
+static int delete_locked(hash_table *temp, char *name){
+    int index = find_slot(temp, name, TRACE_OP_DELETE);
+    if (index == -1)
+        return HASH_ERR_NOEXIT;
+
+    remove_slot(temp, index);
+    JOURNAL(temp, HASH_JOURNAL_DELETE, name, NULL, 0);
+
+    #ifdef DEBUG
+    printf("----------------------\n");
+    printf("Trigger delete:\n");
+    printf("temp->keys[%d] is:      %s\n", index, KEY(temp, index));
+    printf("REAL_SIZE(temp, %d) is: %d\n", index, REAL_SIZE(temp, index));
+    printf("FLAG(temp, %d) is:      %d\n", index, FLAG(temp, index));
+    printf("----------------------\n");
+    #endif /* DEBUG */
+
+    return HASH_OK;
+}
+
+/*  
+* Name:         hash_delete
+* Argument:     void*, char*
+* Return:       int
+* Purpose:      Delete an entry in the hashtable.
 * Note:         none
 */
-int hash_get(void *hashtable, char *name, void **buffer, int *size){
-    /* Cast hashtable pointer. */
+int hash_delete(void *hashtable, char *name){
+    /* Cast hashtable pointer. */
+    hash_table *temp = (hash_table*)hashtable;
+    int status;
+
+    /* Check NULL pointers. */
+    if (hashtable == NULL)
+        return HASH_ERR_NULL;
+    if (read_only(temp))
+        return HASH_ERR_READONLY;
+
+    if (check_name(name) != HASH_OK)
+        return HASH_ERR_NAME;
+
+    /* Lock table. */
+    if (hash_lock(temp) != 0)
+        return HASH_ERR_OTHER;
+    status = delete_locked(temp, name);
+    hash_unlock(temp);
+    return status;
+}
+
+
+/*  
+* Name:         home_slot
+* Argument:     hash_table*, char*
+* Return:       int
+* Purpose:      Slot a lookup of name reads first.
+* Note:         No lock needed.
+*/
+static int home_slot(hash_table *temp, char *name){
+    int buckets[2];
+
+    if (temp->engine != HASH_ENGINE_CUCKOO)
+        return hash_func(name, temp->num_elements);
+    cuckoo_buckets(temp, name_hash(name), buckets);
+    return buckets[0];
+}
+
+/*  
+* Name:         batch_compare
+* Argument:     const void*, const void*
+* Return:       int
+* Purpose:      qsort() order of a batch: by home slot, then as given.
+* Note:         none
+*/
+static int batch_compare(const void *a, const void *b){
+    const batch_entry *x = a, *y = b;
+
+    if (x->home != y->home)
+        return x->home < y->home ? -1 : 1;
+    return x->position - y->position;
+}
+
+/*  
+* Name:         batch_apply
+* Argument:     hash_table*, int, char**, void**, int*, int*
+* Return:       int
+* Purpose:      Apply a batch of SETs (data not NULL) or DELETEs, see 
+*               hash_set_many().
+* Note:         Values are checked and compressed into a list before the
+*               first lock, those of tier_threshold bytes written to the 
+*               extent file. Values spilled to make room are written 
+*               after each lock hold. Returns the number of names applied.
+*/
+static int batch_apply(hash_table *temp, int n, char **names, void **data,
+                       int *sizes, int *status){
+    batch_entry *order = malloc((size_t)n*sizeof(batch_entry));
+    void **packed = data != NULL ? calloc(n, sizeof(void*)) : NULL;
+    tier_location *locations = data != NULL && temp->tier_threshold > 0 ?
+                               malloc((size_t)n*sizeof(tier_location)) : NULL;
+    int *result = malloc((size_t)n*sizeof(int)), held = 0, done = 0;
+    spill_list spills = {0, 0, 0, NULL};
+
+    if (order == NULL || result == NULL || (data != NULL && packed == NULL) ||
+        (data != NULL && temp->tier_threshold > 0 && locations == NULL)){
+        FREE_ON_VAL(order, packed, result);
+        FREE(locations);
+        return HASH_ERR_OTHER;
+    }
+
+    /* result is the bytes to store (0 for a DELETE) until applied. */
+    FORONE(i, n){
+        if (data != NULL)
+            result[i] = prepare_set(temp, names[i], data[i], sizes[i], 
+                                    &packed[i]);
+        else
+            result[i] = check_name(names[i]);
+        if (data != NULL && result[i] >= 0 && SPILL_SIZE(temp, sizes[i]) &&
+            tier_put(temp, packed[i] ? packed[i] : data[i], result[i], 
+                     &locations[i]) == -1)
+            result[i] = HASH_ERR_OTHER;
+        order[i].home = result[i] < 0 ? -1 : home_slot(temp, names[i]);
+        order[i].position = i;
+    }
+    qsort(order, n, sizeof(batch_entry), batch_compare);
+
+    FORONE(i, n){
+        int k = order[i].position;
+
+        if (result[k] < 0)
+            continue;
+        if (held == 0 && hash_lock(temp) != 0){
+            result[k] = HASH_ERR_OTHER;
+            continue;
+        }
+        if (data != NULL)
+            result[k] = set_locked(temp, names[k], data[k], sizes[k], 
+                                   packed[k], result[k], 
+                                   SPILL_SIZE(temp, sizes[k]) ? 
+                                   &locations[k] : NULL, &spills);
+        else
+            result[k] = delete_locked(temp, names[k]);
+        done += result[k] == HASH_OK;
+        if (++held == HASH_BATCH_LOCK){
+            hash_unlock(temp);
+            spill_finish(temp, &spills);
+            held = 0;
+        }
+    }
+    if (held > 0){
+        hash_unlock(temp);
+        spill_finish(temp, &spills);
+    }
+
+    FORONE(i, n){
+        if (status != NULL)
+            status[i] = result[i];
+        if (packed != NULL)
+            free(packed[i]);
+    }
+    FREE_ON_VAL(order, packed, result);
+    FREE(locations);
+    return done;
+}
+
+/*  
+* Name:         hash_set_many
+* Argument:     void*, int, char**, void**, int*, int*
+* Return:       int
+* Purpose:      hash_set() a batch of names under few lock acquisitions.
+* Note:         Sorting by home slot walks the slot arrays forward, most
+*               names of a chunk share cache lines and pages with the 
+*               ones before.
+*/
+int hash_set_many(void *hashtable, int n, char **names, void **data,
+                  int *sizes, int *status){
+    if (hashtable == NULL)
+        return HASH_ERR_NULL;
+    if (read_only((hash_table*)hashtable))
+        return HASH_ERR_READONLY;
+    if (n <= 0)
+        return 0;
+    if (names == NULL || data == NULL || sizes == NULL)
+        return HASH_ERR_OTHER;
+    return batch_apply((hash_table*)hashtable, n, names, data, sizes, status);
+}
+
+/*  
+* Name:         hash_delete_many
+* Argument:     void*, int, char**, int*
+* Return:       int
+* Purpose:      hash_delete() a batch of names under few lock acquisitions.
+* Note:         none
+*/
+int hash_delete_many(void *hashtable, int n, char **names, int *status){
+    if (hashtable == NULL)
+        return HASH_ERR_NULL;
+    if (read_only((hash_table*)hashtable))
+        return HASH_ERR_READONLY;
+    if (n <= 0)
+        return 0;
+    if (names == NULL)
+        return HASH_ERR_OTHER;
+    return batch_apply((hash_table*)hashtable, n, names, NULL, NULL, status);
+}
+
+/*  
+* Name:         count_get
+* Argument:     hash_table*, int
+* Return:       none
+* Purpose:      Count a GET by the tier that served it, index -1 a miss.
+* Note:         Lock must be held.
+*/
+static void count_get(hash_table *temp, int index){
+    if (index == -1)
+        temp->get_misses++;
+    else if (SPILLED(temp, index))
+        temp->tier_hits++;
+    else
+        temp->memory_hits++;
+}
+
+/*  
+* Name:         hash_get
+* Argument:     void*, char*, void*, int*
+* Return:       int
+* Purpose:      Get an entry in the hashtable, if find, *buffer
+*               will be link to a new piece of memory with that data.
+* Note:         A compressed value is decompressed into the new memory,
+*               a spilled one read from the extent file without the lock,
+*               its slot pinned meanwhile.
+*               A name the Bloom filter rules out is answered without the
+*               lock.
+*/
+int hash_get(void *hashtable, char *name, void **buffer, int *size){
+    /* Cast hashtable pointer. */
+    hash_table *temp = (hash_table*)hashtable;
+
+    /* Check NULL pointers. */
+    if (hashtable == NULL)
+        return HASH_ERR_NULL;
+
+    if (check_name(name) != HASH_OK)
+        return HASH_ERR_NAME;
+
+    if (size == NULL)
+        return HASH_ERR_SIZENULL;
+
+    sketch_add(temp, name);
+    if (bloom_absent(temp, name))
+        return HASH_ERR_NOEXIT;
+
+    /* Lock table. */
+    if (hash_lock(temp) != 0)
+        return HASH_ERR_OTHER;
+
+    int index = find_slot(temp, name, TRACE_OP_GET);
+    count_get(temp, index);
+    if (index == -1){
+        bloom_missed(temp);
+        hash_unlock(temp);
+        return HASH_ERR_NOEXIT;
+    }
+
+    /* Create and return a new ptr. */
+    int raw_size = RAW_SIZE(temp, index);
+    void *temp_buffer = malloc(raw_size);
+    if (temp_buffer == NULL){
+        hash_unlock(temp);
+        return HASH_ERR_MEMALOFAIL;
+    }
+
+    if (read_unlock(temp, index, temp_buffer) == -1){
+        free(temp_buffer);
+        return HASH_ERR_OTHER;
+    }
+    *size = raw_size;
+    *buffer = temp_buffer;
+
+    #ifdef DEBUG
+    printf("----------------------\n");
+    printf("Triigger get..\n");
+    printf("----------------------\n");
+    #endif /* DEBUG */
+    
+    return HASH_OK;
+}
+
+/*  
+* Name:         hash_reserve
+* Argument:     void*, char*, int, void**
+* Return:       int
+* Purpose:      Reserve a slot for a value of data_size bytes, *slot points
+*               to where the caller writes it.
+* Note:         Returns a handle >= 0 for hash_commit()/hash_abort(), or 
+*               the same errors as hash_set(). The value is written 
+*               without the lock, readers keep seeing the old value until
+*               hash_commit().
+*/
+int hash_reserve(void *hashtable, char *name, int data_size, void **slot){
+    hash_table *temp = (hash_table*)hashtable;
+    int index;
+
+    if (hashtable == NULL || slot == NULL)
+        return HASH_ERR_NULL;
+    if (read_only(temp))
+        return HASH_ERR_READONLY;
+
+    if (check_name(name) != HASH_OK)
+        return HASH_ERR_NAME;
+
+    if (data_size < 1)
+        return HASH_ERR_OTHER;
+
+    if (data_size > temp->max_element_size)
+        return HASH_ERR_DATASIZE;
+
+    if (hash_lock(temp) != 0)
+        return HASH_ERR_OTHER;
+
+    sketch_add(temp, name);
+    index = room_slot(temp, name, -1);
+    if (index == -1){
+        hash_unlock(temp);
+        return HASH_ERR_COLISION;
+    }
+
+    set_key(temp, index, name);
+    REAL_SIZE(temp, index) = data_size;
+    RAW_SIZE(temp, index) = data_size;
+    FLAG(temp, index) = SLOT_PENDING;
+    *slot = VALUE_AT(temp, index, data_size);
+
+    hash_unlock(temp);
+    return index;
+}
+
+/*  
+* Name:         hash_commit
+* Argument:     void*, int
+* Return:       int
+* Purpose:      Publish a value written into a reserved slot, replacing 
+*               the old value of the name.
+* Note:         Returns HASH_OK, or HASH_ERR_OTHER for a bad handle. With
+*               compression on, the slot is compressed before taking the 
+*               lock, nobody else touches a reserved slot. It is only 
+*               replaced by the compressed copy after the journal saw it.
+*               A value over the memory limit is given back and 
+*               HASH_ERR_NOMEM returned. A value of tier_threshold bytes 
+*               is written to the extent file before the lock is taken, 
+*               and moves there; it stays in the slot if it cannot be 
+*               written. Values spilled to make room are written after.
+*/
+int hash_commit(void *hashtable, int handle){
     hash_table *temp = (hash_table*)hashtable;
+    int old_index, stored_size = 0, spilled = 0;
+    size_t key_size;
+    void *packed = NULL;
+    tier_location location;
+    spill_list spills = {0, 0, 0, NULL};
 
-    /* Check NULL pointers. */
     if (hashtable == NULL)
         return HASH_ERR_NULL;
 
-    if (name == NULL)
-        return HASH_ERR_NAME;
+    if (handle >= 0 && handle < temp->num_elements && 
+        FLAG(temp, handle) == SLOT_PENDING){
+        stored_size = pack_value(temp, DATA(temp, handle), 
+                                 RAW_SIZE(temp, handle), &packed);
+        if (SPILL_SIZE(temp, RAW_SIZE(temp, handle)))
+            spilled = tier_put(temp, packed ? packed : DATA(temp, handle),
+                               packed ? stored_size : REAL_SIZE(temp, handle),
+                               &location) == 0;
+    }
+
+    if (hash_lock(temp) != 0){
+        FREE(packed);
+        return HASH_ERR_OTHER;
+    }
+    if (spilled)
+        tier_settle(temp);
+
+    if (handle < 0 || handle >= temp->num_elements || 
+        FLAG(temp, handle) != SLOT_PENDING){
+        hash_unlock(temp);
+        FREE(packed);
+        return HASH_ERR_OTHER;
+    }
+
+    /* Room for the value, the old one of the name goes away. */
+    old_index = find_slot(temp, KEY(temp, handle), TRACE_OP_SET);
+    key_size = strlen(KEY(temp, handle)) + 1;
+    if (make_room(temp, key_size + (spilled ? sizeof(tier_location) 
+                                   : packed ? (size_t)stored_size 
+                                   : (size_t)REAL_SIZE(temp, handle)),
+                  old_index == -1 ? 0 : key_size + REAL_SIZE(temp, old_index),
+                  old_index, old_index == -1 ? KEY(temp, handle) : NULL,
+                  &spills) == -1){
+        clear_slot(temp, handle);
+        hash_unlock(temp);
+        spill_finish(temp, &spills);
+        FREE(packed);
+        return HASH_ERR_NOMEM;
+    }
+
+    JOURNAL(temp, HASH_JOURNAL_SET, KEY(temp, handle), DATA(temp, handle),
+            RAW_SIZE(temp, handle));
+    if (packed != NULL){
+        memcpy(VALUE_AT(temp, handle, stored_size), packed, stored_size);
+        REAL_SIZE(temp, handle) = stored_size;
+        FREE(packed);
+    }
+
+    bloom_add(temp, KEY(temp, handle), 1);
+    epoch_bump(temp, KEY(temp, handle));
+    if (old_index != -1)
+        remove_slot(temp, old_index);
+
+    if (spilled)
+        store_location(temp, handle, &location, RAW_SIZE(temp, handle));
+    else
+        count_value(temp, handle, 1);
+    PUBLISH(temp, handle, SLOT_USED);
+    temp->n_items++;
+    temp->key_bytes += key_size;
+    REF(temp, handle) = 1;
+
+    hash_unlock(temp);
+    spill_finish(temp, &spills);
+    return HASH_OK;
+}
+
+/*  
+* Name:         hash_abort
+* Argument:     void*, int
+* Return:       none
+* Purpose:      Give back a reserved slot without publishing it.
+* Note:         none
+*/
+void hash_abort(void *hashtable, int handle){
+    hash_table *temp = (hash_table*)hashtable;
+
+    if (hashtable == NULL || hash_lock(temp) != 0)
+        return;
+    if (handle >= 0 && handle < temp->num_elements && 
+        FLAG(temp, handle) == SLOT_PENDING)
+        clear_slot(temp, handle);
+    hash_unlock(temp);
+}
+
+/*  
+* Name:         hash_acquire
+* Argument:     void*, char*, void**, int*
+* Return:       int
+* Purpose:      Pin the value of name and point *data at it in the table,
+*               for sending it without a copy.
+* Note:         Returns a handle >= 0 for hash_release(), or the same 
+*               errors as hash_get(). The value stays unchanged until 
+*               released, a SET or DELETE meanwhile goes to another slot.
+*/
+int hash_acquire(void *hashtable, char *name, void **data, int *size){
+    hash_table *temp = (hash_table*)hashtable;
+    int index;
+
+    if (hashtable == NULL || data == NULL)
+        return HASH_ERR_NULL;
 
-    if (strlen(name) > 120)
+    if (check_name(name) != HASH_OK)
         return HASH_ERR_NAME;
 
     if (size == NULL)
         return HASH_ERR_SIZENULL;
 
-    /* Lock semaphore. */
-    if (sem_wait(&temp->lock) != 0)
+    sketch_add(temp, name);
+    if (bloom_absent(temp, name))
+        return HASH_ERR_NOEXIT;
+
+    if (hash_lock(temp) != 0)
         return HASH_ERR_OTHER;
 
-    int index = hash_func(name, temp->num_elements); 
-    /* Track times of searching. */
-    int counter = 0;
-    
-    /* Linear probing. */
-    /* Search through each quadratic probing entries. */
-    while(memcmp(temp->keys+index*120, name, (strlen(name)+1)) != 0){
-        index++;
-        index %= temp->num_elements;
-        if (index >= temp->num_elements)
-            index = 0;
-        counter ++;
-        if (counter >= temp->num_elements){
-            sem_post(&temp->lock);
-            return HASH_ERR_NOEXIT;
-        }
+    index = find_slot(temp, name, TRACE_OP_GET);
+    count_get(temp, index);
+    if (index == -1){
+        bloom_missed(temp);
+        hash_unlock(temp);
+        return HASH_ERR_NOEXIT;
     }
 
-    /* Create and return a new ptr. */
-    void *temp_buffer = malloc(temp->real_size[index]);
-    if (temp_buffer == NULL){
-        sem_post(&temp->lock);
+    PINS(temp, index)++;
+    *data = DATA(temp, index);
+    *size = REAL_SIZE(temp, index);
+
+    hash_unlock(temp);
+    return index;
+}
+
+/*  
+* Name:         hash_unpack
+* Argument:     void*, int, void**, int*
+* Return:       int
+* Purpose:      Decompress a value pinned by hash_acquire() if it is 
+*               stored compressed, read it if it is in the extent file.
+* Note:         Returns 0 if the value is stored as is, 1 if *data now 
+*               points to a malloc()ed copy of *size bytes. The slot is 
+*               pinned, so no lock is needed.
+*/
+int hash_unpack(void *hashtable, int handle, void **data, int *size){
+    hash_table *temp = (hash_table*)hashtable;
+    void *buffer;
+
+    if (hashtable == NULL || data == NULL || size == NULL)
+        return HASH_ERR_NULL;
+
+    if (handle < 0 || handle >= temp->num_elements || PINS(temp, handle) == 0)
+        return HASH_ERR_OTHER;
+
+    if (!SPILLED(temp, handle) && 
+        RAW_SIZE(temp, handle) == REAL_SIZE(temp, handle))
+        return 0;
+
+    buffer = malloc(RAW_SIZE(temp, handle));
+    if (buffer == NULL)
         return HASH_ERR_MEMALOFAIL;
+    if (read_value(temp, handle, buffer) == -1){
+        free(buffer);
+        return HASH_ERR_OTHER;
     }
+    *data = buffer;
+    *size = RAW_SIZE(temp, handle);
+    return 1;
+}
 
-    memcpy(temp_buffer, temp->value+index*temp->max_element_size, 
-           temp->real_size[index]);
-    memcpy(size, &temp->real_size[index], sizeof(temp->real_size[index]));
-    *buffer = temp_buffer;
+/*  
+* Name:         hash_release
+* Argument:     void*, int
+* Return:       none
+* Purpose:      Unpin a value pinned by hash_acquire().
+* Note:         none
+*/
+void hash_release(void *hashtable, int handle){
+    hash_table *temp = (hash_table*)hashtable;
 
-    
+    if (hashtable == NULL || hash_lock(temp) != 0)
+        return;
+    unpin_slot(temp, handle);
+    hash_unlock(temp);
+}
 
-    // *size = temp->real_size[index];
+/* One cached value of a near cache. */
+typedef struct near_entry_struct {
+    int valid;                      /* Holds a copy of name. */
+    unsigned long hash;             /* name_hash() of name. */
+    unsigned long epoch;            /* Stripe epoch the copy was made in. */
+    unsigned long candidate;        /* Hash of the last name missed here. */
+    int size;                       /* Bytes of data. */
+    char name[KEY_SIZE];
+    char *data;                     /* max_value bytes, or NULL. */
+} near_entry;
 
-    #ifdef DEBUG
-    printf("----------------------\n");
-    printf("Triigger get..\n");
-    printf("----------------------\n");
-    #endif /* DEBUG */
-    
-    sem_post(&temp->lock);
+/* Worker-local cache of hot values, see hash_near_create(). */
+struct hash_near_struct {
+    int n_entries;
+    int max_value;                  /* Largest value cached. */
+    near_entry *entries;            /* Direct mapped by name_hash(). */
+};
+
+/*  
+* Name:         hash_near_create
+* Argument:     void*, int, int
+* Return:       hash_near*
+* Purpose:      Make a near cache of n_entries values of up to max_value 
+*               bytes for one worker.
+* Note:         Returns NULL if the table keeps no write epochs (options 
+*               near_cache) or memory runs out. Value buffers are 
+*               allocated as entries fill.
+*/
+hash_near* hash_near_create(void *hashtable, int n_entries, int max_value){
+    hash_table *temp = (hash_table*)hashtable;
+    hash_near *near;
+
+    if (hashtable == NULL || temp->epochs == 0 || n_entries < 1 || 
+        max_value < 1)
+        return NULL;
+    near = calloc(1, sizeof(hash_near));
+    if (near == NULL)
+        return NULL;
+    near->entries = calloc(n_entries, sizeof(near_entry));
+    if (near->entries == NULL){
+        FREE(near);
+        return NULL;
+    }
+    near->n_entries = n_entries;
+    near->max_value = max_value;
+    return near;
+}
+
+/*  
+* Name:         near_fill
+* Argument:     hash_table*, near_entry*, char*, unsigned long, int
+* Return:       int
+* Purpose:      Copy the value of name into entry with its stripe's epoch.
+* Note:         Returns 1 when the entry holds the value, 0 when the name 
+*               is missing or its value too large, an error < 0 otherwise.
+*               The epoch is read under the lock, together with the value
+*               or, for a spilled one, with the pin that keeps it as is.
+*/
+static int near_fill(hash_table *temp, near_entry *entry, char *name, 
+                     unsigned long hash, int max_value){
+    unsigned long epoch;
+    int index, size;
+
+    if (entry->data == NULL){
+        entry->data = malloc(max_value);
+        if (entry->data == NULL)
+            return HASH_ERR_MEMALOFAIL;
+    }
+    if (hash_lock(temp) != 0)
+        return HASH_ERR_OTHER;
+    index = find_slot(temp, name, TRACE_OP_GET);
+    if (index == -1 || RAW_SIZE(temp, index) > max_value){
+        hash_unlock(temp);
+        return 0;
+    }
+    count_get(temp, index);
+    epoch = __atomic_load_n(&EPOCHS(temp)[hash % EPOCH_STRIPES], 
+                            __ATOMIC_RELAXED);
+    size = RAW_SIZE(temp, index);
+    if (read_unlock(temp, index, entry->data) == -1)
+        return HASH_ERR_OTHER;
+    entry->epoch = epoch;
+    entry->size = size;
+    entry->hash = hash;
+    entry->valid = 1;
+    strcpy(entry->name, name);
+    return 1;
+}
+
+/*  
+* Name:         hash_near_get
+* Argument:     void*, hash_near*, char*, void**, int*
+* Return:       int
+* Purpose:      Look name up in the worker's near cache.
+* Note:         Returns 1 with *data, *size pointing at the cached copy,
+*               valid until the next call on near; 0 when the caller has 
+*               to ask the table (missing, too large or not hot yet); or 
+*               an error < 0. A copy is only served 
+*               while the write epoch of its stripe is unchanged, so it 
+*               is never older than the table. An entry is replaced by a 
+*               name missing it twice in a row, one off names do not push
+*               hot ones out. Hits take no lock and write nothing shared,
+*               so they do not set the CLOCK bit either.
+*/
+int hash_near_get(void *hashtable, hash_near *near, char *name, void **data,
+                  int *size){
+    hash_table *temp = (hash_table*)hashtable;
+    unsigned long hash, epoch;
+    near_entry *entry;
+    int status;
+
+    if (hashtable == NULL || near == NULL || data == NULL || size == NULL)
+        return HASH_ERR_NULL;
+    if (check_name(name) != HASH_OK)
+        return HASH_ERR_NAME;
+
+    hash = name_hash(name);
+    entry = &near->entries[hash % near->n_entries];
+    epoch = __atomic_load_n(&EPOCHS(temp)[hash % EPOCH_STRIPES], 
+                            __ATOMIC_ACQUIRE);
+    if (entry->valid && entry->hash == hash && strcmp(entry->name, name) == 0){
+        if (entry->epoch == epoch){
+            *data = entry->data;
+            *size = entry->size;
+            return 1;
+        }
+        /* Stale, refresh it now the name is known to be hot. */
+        entry->valid = 0;
+        entry->candidate = hash;
+    }
+    if (entry->candidate != hash){
+        entry->candidate = hash;
+        return 0;
+    }
+
+    entry->candidate = 0;
+    entry->valid = 0;
+    status = near_fill(temp, entry, name, hash, near->max_value);
+    if (status != 1)
+        return status;
+    *data = entry->data;
+    *size = entry->size;
+    return 1;
+}
+
+/*  
+* Name:         hash_near_free
+* Argument:     hash_near*
+* Return:       none
+* Purpose:      Free a near cache.
+* Note:         none
+*/
+void hash_near_free(hash_near *near){
+    if (near == NULL)
+        return;
+    FORONE(i, near->n_entries)
+        free(near->entries[i].data);
+    FREE(near->entries);
+    free(near);
+}
+
+/*  
+* Name:         hash_scan
+* Argument:     void*, int, int, hash_scan_fn, void*
+* Return:       int
+* Purpose:      Call fn on every value in slots start to end - 1.
+* Note:         Slots are pinned a batch per lock and fn runs without the 
+*               lock, so scans of disjoint ranges run in parallel with 
+*               each other and with clients. Returns the number of values
+*               visited, or an error < 0. A cuckoo table counts the scan 
+*               in scans, a value moved behind it would be missed. 
+*               However it stops, the batch pinned is unpinned and the 
+*               scan uncounted.
+*/
+int hash_scan(void *hashtable, int start, int end, hash_scan_fn fn, 
+              void *arg){
+    hash_table *temp = (hash_table*)hashtable;
+    int batch[SCAN_BATCH], n_batch = 0, visited = 0, status = 0;
+    int counted = 0;
+    char name[KEY_SIZE];
+
+    if (hashtable == NULL || fn == NULL)
+        return HASH_ERR_NULL;
+    start = MAX(start, 0);
+    end = MIN(end, temp->num_elements);
+    if (temp->engine == HASH_ENGINE_CUCKOO && start < end){
+        if (hash_lock(temp) != 0)
+            return HASH_ERR_OTHER;
+        temp->scans++;
+        counted = 1;
+        hash_unlock(temp);
+    }
+
+    while (start < end && status == 0){
+        /* Pin the values of the next batch of slots. */
+        if (hash_lock(temp) != 0){
+            status = HASH_ERR_OTHER;
+            break;
+        }
+        for (; start < end && n_batch < SCAN_BATCH; start++)
+            if (FLAG(temp, start) == SLOT_USED){
+                PINS(temp, start)++;
+                batch[n_batch++] = start;
+            }
+        hash_unlock(temp);
+
+        FORONE(i, n_batch){
+            void *data = DATA(temp, batch[i]);
+            int size = REAL_SIZE(temp, batch[i]), copied;
+
+            if (status != 0)
+                break;
+            /* The key of a pinned slot does not change. */
+            memcpy(name, KEY(temp, batch[i]), KEY_SIZE);
+            copied = hash_unpack(hashtable, batch[i], &data, &size);
+            if (copied < 0)
+                status = copied;
+            else
+                status = fn(name, data, size, arg);
+            if (copied == 1)
+                free(data);
+            visited++;
+        }
+
+        if (hash_lock(temp) != 0){
+            status = HASH_ERR_OTHER;
+            break;
+        }
+        FORONE(i, n_batch)
+            unpin_slot(temp, batch[i]);
+        n_batch = 0;
+        hash_unlock(temp);
+    }
+
+    /* Whatever stopped the scan, leave nothing pinned or counted. */
+    if ((n_batch > 0 || counted) && hash_lock(temp) == 0){
+        FORONE(i, n_batch)
+            unpin_slot(temp, batch[i]);
+        if (counted)
+            temp->scans--;
+        hash_unlock(temp);
+    }
+    return status < 0 ? status : visited;
+}
+
+
+/*  
+* Name:         hash_clear
+* Argument:     void*
+* Return:       int
+* Purpose:      Delete every value.
+* Note:         Pinned values are freed on their last release.
+*/
+int hash_clear(void *hashtable){
+    hash_table *temp = (hash_table*)hashtable;
+
+    if (hashtable == NULL)
+        return HASH_ERR_NULL;
+    if (read_only(temp))
+        return HASH_ERR_READONLY;
+
+    if (hash_lock(temp) != 0)
+        return HASH_ERR_OTHER;
+    FORONE(i, temp->num_elements)
+        if (FLAG(temp, i) == SLOT_USED)
+            remove_slot(temp, i);
+    hash_unlock(temp);
     return HASH_OK;
 }
 
+/*  
+* Name:         tier_worth
+* Argument:     hash_table*
+* Return:       int
+* Purpose:      Whether the extent file is worth compacting: half of it 
+*               and a TIER_SEGMENT dead, or no value left.
+* Note:         Lock need not be held, unlocked it is only a hint the 
+*               caller checks again under the lock.
+*/
+static int tier_worth(hash_table *temp){
+    unsigned long head = __atomic_load_n(&temp->tier_head, __ATOMIC_RELAXED);
+    unsigned long tail = __atomic_load_n(&temp->tier_tail, __ATOMIC_RELAXED);
+    size_t bytes = __atomic_load_n(&temp->tier_bytes, __ATOMIC_RELAXED);
+    unsigned long dead = tail - head - bytes;
+
+    if (head == tail)
+        return 0;
+    return __atomic_load_n(&temp->tier_items, __ATOMIC_RELAXED) == 0 ||
+           (dead >= TIER_SEGMENT && dead >= bytes);
+}
+
+/*  
+* Name:         tier_swap
+* Argument:     hash_table*, tier_copy*
+* Return:       none
+* Purpose:      Give a slot the location its extent was copied to.
+* Note:         Lock must be held. A slot no longer holding the extent, or
+*               pinned, is left alone: the copy is dead, the extent stays.
+*/
+static void tier_swap(hash_table *temp, tier_copy *copy){
+    int index = copy->index;
+    tier_location location;
+
+    if (!SPILLED(temp, index) || FLAG(temp, index) != SLOT_USED || 
+        PINS(temp, index) > 0)
+        return;
+    location = slot_location(temp, index);
+    if (location.offset != copy->from.offset || 
+        location.size != copy->from.size)
+        return;
+    memcpy(DATA(temp, index), &copy->to, sizeof(tier_location));
+    tier_unlink(temp, index);
+    tier_link(temp, index);
+    temp->tier_compacted += copy->to.size;
+}
+
+/*  
+* Name:         hash_tier_compact
+* Argument:     void*
+* Return:       long
+* Purpose:      Reclaim the oldest TIER_SEGMENT bytes of the extent file 
+*               once half of it is dead, or all of it once no value is 
+*               left.
+* Note:         The file is a log. Under the lock the live extents of the
+*               stretch are taken from the head of the list of spilled 
+*               slots, up to TIER_BATCH of them and to the first pinned 
+*               one, and room for their copies is taken at the end. They
+*               are read and written there without it, then swapped in 
+*               TIER_SWAPS at a time, each only if its slot still holds 
+*               the old extent. What lies before the lowest extent still
+*               held is punched out. With no spilled slot left the file 
+*               is truncated and starts over, a compaction that started 
+*               before then reclaims nothing. Extents reserved and not 
+*               yet published are neither punched nor truncated. A file 
+*               system that cannot punch holes keeps the space until then.
+*/
+long hash_tier_compact(void *hashtable){
+    hash_table *temp = (hash_table*)hashtable;
+    unsigned long head, end, resets;
+    int fd, index, count = 0, status = 0;
+    tier_copy *copies;
+    size_t bytes = 0, done = 0;
+    char *buffer = NULL;
+    long reclaimed = 0;
+
+    if (hashtable == NULL)
+        return HASH_ERR_NULL;
+    if (temp->spilled == 0 || !tier_worth(temp))
+        return 0;
+    fd = tier_fd(temp);
+    if (fd == -1)
+        return HASH_ERR_OTHER;
+    copies = malloc(TIER_BATCH*sizeof(tier_copy));
+    if (copies == NULL)
+        return HASH_ERR_MEMALOFAIL;
+
+    if (hash_lock(temp) != 0){
+        free(copies);
+        return HASH_ERR_OTHER;
+    }
+    head = temp->tier_head;
+    if (!tier_worth(temp) || temp->tier_first == -1){
+        if (temp->tier_first == -1 && head != temp->tier_tail && 
+            temp->tier_writers == 0){
+            reclaimed = temp->tier_tail - head;
+            if (ftruncate(fd, 0) == 0){
+                temp->tier_head = temp->tier_tail = 0;
+                temp->tier_resets++;
+            }
+            else
+                status = -1;
+        }
+        hash_unlock(temp);
+        free(copies);
+        return status == 0 ? reclaimed : HASH_ERR_OTHER;
+    }
+    /* The stretch ends at the first extent left where it is. */
+    for (index = temp->tier_first; index != -1 && count < TIER_BATCH; 
+         index = TIER_NODE(temp, index).next){
+        tier_location location = slot_location(temp, index);
+
+        if (location.offset >= head + TIER_SEGMENT || PINS(temp, index) > 0)
+            break;
+        copies[count].index = index;
+        copies[count].from = location;
+        copies[count].to.offset = temp->tier_tail + bytes;
+        copies[count].to.size = location.size;
+        bytes += location.size;
+        count++;
+    }
+    end = index == -1 ? temp->tier_tail : slot_location(temp, index).offset;
+    temp->tier_tail += bytes;
+    resets = temp->tier_resets;
+    hash_unlock(temp);
+
+    /* Copy the stretch's live extents, in a row, to the room taken. */
+    if (bytes > 0){
+        buffer = malloc(bytes);
+        status = buffer == NULL ? -1 : 0;
+    }
+    FORONE(i, count){
+        if (status == 0)
+            status = tier_read(temp, copies[i].from, copies[i].from.size, 
+                               buffer + done);
+        done += copies[i].from.size;
+    }
+    if (status == 0 && bytes > 0)
+        status = tier_write(fd, buffer, bytes, copies[0].to.offset);
+    free(buffer);
+
+    for (int i = 0; status == 0 && i < count; i += TIER_SWAPS){
+        if (hash_lock(temp) != 0){
+            status = -1;
+            break;
+        }
+        if (temp->tier_resets == resets)
+            for (int j = i; j < MIN(i + TIER_SWAPS, count); j++)
+                tier_swap(temp, &copies[j]);
+        hash_unlock(temp);
+    }
+    free(copies);
+    if (status == -1 || hash_lock(temp) != 0)
+        return HASH_ERR_OTHER;
+
+    if (temp->tier_first != -1)
+        end = MIN(end, slot_location(temp, temp->tier_first).offset);
+    if (temp->tier_writers > 0)
+        end = MIN(end, temp->tier_writing);
+    if (temp->tier_resets == resets && end > temp->tier_head){
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 
+                  temp->tier_head, end - temp->tier_head);
+        reclaimed = end - temp->tier_head;
+        temp->tier_head = end;
+    }
+    hash_unlock(temp);
+    return reclaimed;
+}
 
 /*  
 * Name:         hash_detach
 * Argument:     void*
 * Return:       void
 * Purpose:      Clear map, free the memory.
-* Note:         none
+* Note:         For the table's maker. A named table is unlinked, the 
+*               processes attached keep their mapping until hash_close().
+*               So is the extent file, their fds keep it.
 */
 void hash_detach(void *hashtable){
     hash_table *temp = (hash_table*)hashtable;
-    sem_destroy(&temp->lock);
+    journal_entry *entry = journal_find(temp);
+
+    if (entry != NULL){
+        pthread_mutex_lock(&journals_lock);
+        __atomic_store_n(&entry->table, NULL, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&journals_lock);
+    }
+    if (temp->name[0] != '\0')
+        shm_unlink(temp->name);
+    tier_forget(temp);
+    if (temp->tier_path[0] != '\0')
+        unlink(temp->tier_path);
+    pthread_mutex_destroy(&temp->lock);
+    munmap(temp, temp->memory_size);
+}
+
+/*  
+* Name:         hash_attach
+* Argument:     const char*
+* Return:       void*
+* Purpose:      Map the table another process made under name (options
+*               name), for the calls of this file.
+* Note:         Returns NULL if there is no such table, it is not made 
+*               yet, or it is of another version of this file. Locking is
+*               the maker's: a process dying with the lock held is 
+*               recovered from like any other. Changes to a journaled 
+*               table return HASH_ERR_READONLY, the journal is the 
+*               maker's.
+*/
+void* hash_attach(const char *name){
+    hash_table *temp;
+    int fd;
+
+    if (name == NULL)
+        return NULL;
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1)
+        return NULL;
+    temp = hash_attach_fd(fd);
+    close(fd);
+    return temp;
+}
+
+/*  
+* Name:         hash_attach_fd
+* Argument:     int
+* Return:       void*
+* Purpose:      Map the table of the shared memory object open as fd, as
+*               hash_attach() does.
+* Note:         fd stays open, the mapping does not need it. 
+*/
+void* hash_attach_fd(int fd){
+    hash_table *temp;
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(hash_table))
+        return NULL;
+    temp = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    RETURN_ON_VALUE(temp, MAP_FAILED, "Cannot map shared memory, return.\n", 
+        NULL);
+    if (__atomic_load_n(&temp->magic, __ATOMIC_ACQUIRE) != TABLE_MAGIC ||
+        temp->version != TABLE_VERSION || 
+        temp->memory_size != (size_t)st.st_size ||
+        temp->lock_type != HASH_LOCK_PROCESS){
+        munmap(temp, st.st_size);
+        return NULL;
+    }
+    return temp;
+}
+
+/*  
+* Name:         hash_fd
+* Argument:     void*
+* Return:       int
+* Purpose:      Open the shared memory object of a named table, to pass
+*               to another process (SCM_RIGHTS) for hash_attach_fd().
+* Note:         Returns -1 for a table without a name. The caller closes
+*               the fd.
+*/
+int hash_fd(void *hashtable){
+    hash_table *temp = (hash_table*)hashtable;
+
+    if (temp->name[0] == '\0')
+        return -1;
+    return shm_open(temp->name, O_RDWR, 0);
+}
+
+/*  
+* Name:         hash_close
+* Argument:     void*
+* Return:       void
+* Purpose:      Unmap a table of hash_attach().
+* Note:         Pins and reservations must be given back first.
+*/
+void hash_close(void *hashtable){
+    hash_table *temp = (hash_table*)hashtable;
+
+    if (hashtable == NULL)
+        return;
+    tier_forget(temp);
     munmap(temp, temp->memory_size);
 }
 
@@ -402,4 +3478,85 @@ int hash_get_max_elements_size(void *hashtable){
     return temp->max_element_size;
 }
 
+/*  
+* Name:         hash_get_max_value_size
+* Argument:     void*
+* Return:       int
+* Purpose:      Getter method for the largest value accepted.
+* Note:         none
+*/
+int hash_get_max_value_size(void *hashtable){
+    hash_table *temp = (hash_table*)hashtable;
+    return temp->max_value_size;
+}
+
+/*  
+* Name:         hash_get_stats
+* Argument:     void*, hash_stats*
+* Return:       int
+* Purpose:      Fill out with a snapshot of the table counters.
+* Note:         A value holds its name's slot, of a bucket without its 
+*               int fields for HASH_LAYOUT_BUCKETS, and a value slot 
+*               unless it is inline. A spilled value's location is inline
+*               in a bucket, in the value slot of the arrays layout.
+*/
+int hash_get_stats(void *hashtable, hash_stats *out){
+    hash_table *temp = (hash_table*)hashtable;
+    size_t name_slot;
+
+    if (hashtable == NULL || out == NULL)
+        return HASH_ERR_NULL;
+
+    name_slot = temp->layout == HASH_LAYOUT_BUCKETS ? 
+                sizeof(bucket) - offsetof(bucket, key) : KEY_SIZE;
+
+    if (hash_lock(temp) != 0)
+        return HASH_ERR_OTHER;
+    out->num_elements = temp->num_elements;
+    out->max_element_size = temp->max_element_size;
+    out->n_items = temp->n_items;
+    out->memory_size = temp->memory_size;
+    out->compress_threshold = temp->compress_threshold;
+    out->raw_bytes = temp->raw_bytes;
+    out->stored_bytes = temp->stored_bytes;
+    out->key_bytes = temp->key_bytes;
+    out->metadata_bytes = temp->metadata_bytes;
+    out->slot_bytes = (size_t)temp->n_items*name_slot + 
+                      (size_t)temp->value_slots*temp->max_element_size;
+    out->memory_limit = temp->memory_limit;
+    out->evict = temp->evict;
+    out->evictions = temp->evictions;
+    out->refused = temp->refused;
+    out->rejected = temp->rejected;
+    out->sketch_counters = SKETCH_ROWS*temp->sketch_width;
+    out->layout = temp->layout;
+    out->engine = temp->engine;
+    out->displaced = temp->displaced;
+    out->lock_acquired = temp->lock_acquired;
+    out->lock_contended = temp->lock_contended;
+    out->lock_wait_ns = temp->lock_wait_ns;
+    out->lock_hold_ns = temp->lock_hold_ns;
+    out->lock_wait_max_ns = temp->lock_wait_max_ns;
+    out->lock_hold_max_ns = temp->lock_hold_max_ns;
+    out->lock_spin = temp->spin;
+    out->owner_deaths = temp->owner_deaths;
+    out->bloom_counters = temp->bloom_counters;
+    out->bloom_negatives = __atomic_load_n(&temp->bloom_negatives, 
+                                           __ATOMIC_RELAXED);
+    out->bloom_false_positives = __atomic_load_n(&temp->bloom_false_positives,
+                                                 __ATOMIC_RELAXED);
+    out->tiered = temp->spilled != 0;
+    out->tier_threshold = temp->tier_threshold;
+    out->tier_items = temp->tier_items;
+    out->tier_bytes = temp->tier_bytes;
+    out->tier_file_bytes = temp->tier_tail - temp->tier_head;
+    out->tier_spills = temp->tier_spills;
+    out->tier_compacted = temp->tier_compacted;
+    out->memory_hits = temp->memory_hits;
+    out->tier_hits = temp->tier_hits;
+    out->get_misses = temp->get_misses + out->bloom_negatives;
+    hash_unlock(temp);
+    return HASH_OK;
+}
+
 #endif      /* _HASH_TABLE_H_ */
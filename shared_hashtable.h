@@ -3,6 +3,10 @@
 
 #include <stddef.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define HASH_OK             0               /* HASH operation succeeded. */
 #define HASH_ERR_NULL       -1              /* Error: hashtable is NULL. */
 #define HASH_ERR_NAME       -2              /* Error: name is too long or NULL. */
@@ -11,8 +15,131 @@
 #define HASH_ERR_NOEXIT     -5              /* Error: the element doesn't exits. */
 #define HASH_ERR_MEMALOFAIL -6              /* Error: memory allocation fail when get. */
 #define HASH_ERR_SIZENULL   -7              /* Error: Size is null when get. */
+#define HASH_ERR_NOMEM      -8              /* Error: over the memory limit. */
+#define HASH_ERR_READONLY   -9              /* Error: attached to a journaled table. */
 #define HASH_ERR_OTHER      -99             /* Error: any other errors. */
 
+#define HASH_LOCK_PROCESS   0               /* Process-shared robust mutex. */
+#define HASH_LOCK_THREAD    1               /* Mutex, one process only. */
+
+#define HASH_LAYOUT_ARRAYS  0               /* An array per slot field. */
+#define HASH_LAYOUT_BUCKETS 1               /* A cache line aligned record 
+                                               per slot. */
+
+#define HASH_ENGINE_PROBING 0               /* Linear probing. */
+#define HASH_ENGINE_CUCKOO  1               /* Bucketized cuckoo hashing. */
+
+#define HASH_BATCH_LOCK     64              /* Names hash_set_many() and
+                                               hash_delete_many() apply per
+                                               lock hold. */
+
+#define HASH_NAME_SIZE      64              /* Longest shared memory name, NUL
+                                               included. */
+
+#define HASH_PATH_SIZE      256             /* Longest extent file path, NUL
+                                               included. */
+
+#define HASH_JOURNAL_SET    0               /* Journal entry of a SET. */
+#define HASH_JOURNAL_DELETE 1               /* Journal entry of a DELETE. */
+
+/* Called on every change of the table, see make_hashtable_opt(). */
+typedef void (*hash_journal_fn)(int op, char *name, void *data, int size, 
+                                void *arg);
+
+/* Options for make_hashtable_opt(), zero is the default for every field. */
+typedef struct hash_options_struct {
+    int lock_type;                          /* HASH_LOCK_PROCESS/THREAD. */
+    int compress_threshold;                 /* Compress values of at least 
+                                               this many bytes, 0 never. */
+    int max_value_size;                     /* Largest value accepted when 
+                                               compressing, it must still 
+                                               fit a slot once compressed.
+                                               0 for max_element_size. */
+    hash_journal_fn journal;                /* Called on changes, or NULL. */
+    void *journal_arg;                      /* Passed to journal. */
+    size_t memory_limit;                    /* Bytes of metadata, names and
+                                               stored values allowed, 0 
+                                               for no limit. */
+    int evict;                              /* Evict values when a SET 
+                                               does not fit, else refuse. */
+    int layout;                             /* HASH_LAYOUT_ARRAYS/BUCKETS. */
+    int engine;                             /* HASH_ENGINE_PROBING/CUCKOO. */
+    int bloom;                              /* Bloom filter counters per 
+                                               slot, 0 for no filter. */
+    int near_cache;                         /* Keep the write epochs 
+                                               hash_near_get() checks. */
+    int admission;                          /* TinyLFU admission sketch, a
+                                               new name only evicts a less
+                                               popular one. */
+    const char *name;                       /* Shared memory object other
+                                               processes hash_attach(), 
+                                               "/name". NULL anonymous. */
+    const char *tier_path;                  /* Extent file of the second 
+                                               tier, NULL for none. */
+    int tier_threshold;                     /* Values of at least this many
+                                               bytes go to the extent file,
+                                               0 only values spilled to 
+                                               make room. */
+} hash_options;
+
+/* Worker-local cache of hot values, see hash_near_create(). */
+typedef struct hash_near_struct hash_near;
+
+/* Called by hash_scan() for each value, a non-zero return stops the scan. */
+typedef int (*hash_scan_fn)(char *name, void *data, int size, void *arg);
+
+/* Snapshot of the table returned by hash_get_stats(). */
+typedef struct hash_stats_struct {
+    int num_elements;                       /* Number of slots. */
+    size_t max_element_size;                /* Bytes of a value slot. */
+    int n_items;                            /* Slots in use. */
+    size_t memory_size;                     /* Bytes mapped for the table. */
+    int compress_threshold;                 /* 0 when compression is off. */
+    size_t raw_bytes;                       /* Bytes of the values in 
+                                               slots. */
+    size_t stored_bytes;                    /* Bytes they take in slots. */
+    size_t key_bytes;                       /* Bytes of the names. */
+    size_t metadata_bytes;                  /* Header and slot arrays. */
+    size_t slot_bytes;                      /* Name slots (and bucket 
+                                               inline values) and value 
+                                               slots held by the values. */
+    size_t memory_limit;                    /* 0 for no limit. */
+    int evict;                              /* Eviction on. */
+    unsigned long evictions;                /* Values evicted. */
+    unsigned long refused;                  /* SETs refused for room. */
+    unsigned long rejected;                 /* Of them, by admission. */
+    size_t sketch_counters;                 /* 0 without admission. */
+    int layout;                             /* HASH_LAYOUT_*. */
+    int engine;                             /* HASH_ENGINE_*. */
+    unsigned long displaced;                /* Values cuckoo moved to their
+                                               other bucket. */
+    unsigned long lock_acquired;            /* Lock acquisitions. */
+    unsigned long lock_contended;           /* Of them, found it held. */
+    unsigned long lock_wait_ns;             /* Waited by contended ones. */
+    unsigned long lock_hold_ns;             /* Time the lock was held, 
+                                               estimated from 1 in 16. */
+    unsigned long lock_wait_max_ns;         /* Longest wait. */
+    unsigned long lock_hold_max_ns;         /* Longest hold sampled. */
+    int lock_spin;                          /* Adaptive spin count. */
+    unsigned long owner_deaths;             /* Lock holders that died. */
+    size_t bloom_counters;                  /* 0 without a filter. */
+    unsigned long bloom_negatives;          /* GETs answered by the filter. */
+    unsigned long bloom_false_positives;    /* GETs it passed that missed. */
+    int tiered;                             /* Extent file on. */
+    int tier_threshold;                     /* 0 when only spilling. */
+    int tier_items;                         /* Values in the extent file. */
+    size_t tier_bytes;                      /* Bytes of them there. */
+    size_t tier_file_bytes;                 /* Bytes of the file not 
+                                               reclaimed, dead extents 
+                                               included. */
+    unsigned long tier_spills;              /* Values spilled for room. */
+    unsigned long tier_compacted;           /* Bytes moved by compaction. */
+    unsigned long memory_hits;              /* GETs served from the table. */
+    unsigned long tier_hits;                /* GETs read from the file. */
+    unsigned long get_misses;               /* GETs of names in neither, 
+                                               filter included. */
+} hash_stats;
+
 
 /*  
 * Name:         make_hashtable
@@ -25,6 +152,85 @@
 void* make_hashtable(int num_elements, int max_element_size);
 
 
+/*  
+* Name:         make_hashtable_opt
+* Argument:     int, int, hash_options*
+* Return:       void*
+* Purpose:      Same as make_hashtable, with options. 
+* Note:         A NULL options is the same as make_hashtable. Use 
+*               HASH_LOCK_THREAD when the table is only shared between 
+*               threads of one process, its mutex is private and must not
+*               be used after fork(). HASH_LOCK_PROCESS makes it 
+*               process-shared and robust: when a process dies holding it
+*               the next locker takes it over and repairs the table's 
+*               counts (owner_deaths in hash_stats). Either lock spins an
+*               adaptive number of times before sleeping.
+*               With compress_threshold set, values that shrink are stored
+*               compressed with lz_codec.h, so slots can be sized for the
+*               compressed values and hold more of them.
+*               journal(op, name, data, size, journal_arg) is called with
+*               the lock held for every successful SET (value before 
+*               compression) and DELETE, in the order they apply. The 
+*               table may be shared with forked children, journal must 
+*               then work from any of them.
+*               memory_limit caps metadata plus the bytes of the names and
+*               stored values, a SET over it gets HASH_ERR_NOMEM unless 
+*               evict is set. With evict, a SET that does not fit the 
+*               limit or finds the table full removes values first, picked
+*               by CLOCK (second chance on a bit set by every hit), and 
+*               journals each as a DELETE. num_elements 0 with a 
+*               memory_limit maps as many slots as the limit holds.
+*               HASH_LAYOUT_ARRAYS keeps names, states and sizes in 
+*               separate arrays, a lookup touches a cache line in each.
+*               HASH_LAYOUT_BUCKETS keeps them in one 64 byte aligned 
+*               record per slot, with a tag of the name's hash compared
+*               before the name and values of up to 48 bytes inline.
+*               HASH_ENGINE_PROBING finds a name by linear probing from 
+*               its home slot, lookups grow long well before the table
+*               is full. HASH_ENGINE_CUCKOO groups slots into buckets of
+*               4 (num_elements is rounded up to a multiple) and keeps a
+*               name in one of two buckets picked by two hashes: a lookup
+*               reads at most those two, a SET finding both full moves 
+*               values to their other bucket along a path of at most 5 
+*               moves, and the table fills to 95% or more. Eviction for
+*               a full table then picks its victim in the two buckets.
+*               bloom adds a counting Bloom filter of bloom one byte 
+*               counters per slot to the mapping: every name is counted 
+*               in 4 of them, and hash_get()/hash_acquire() of a name with
+*               a zero counter return HASH_ERR_NOEXIT without the lock. 
+*               8 counters per slot keep false positives near 2% with the
+*               table full.
+*               near_cache maps 4096 write epochs, names share them by 
+*               hash and every change of a name advances its epoch, for 
+*               hash_near_get().
+*               admission maps a count-min sketch of 4 rows of 4 bit 
+*               counters (a row per slot, rounded up to a power of two), 
+*               counting every GET and SET of a name, stored or not, and
+*               halved every 10 accesses per slot. With evict, a SET of a
+*               new name that needs room only evicts the CLOCK victim if 
+*               the sketch counted the name more often, else it is 
+*               refused (rejected in hash_stats): one off names of a scan
+*               do not push out the hot ones.
+*               name creates the table as a shared memory object (see 
+*               shm_open()) with HASH_LOCK_PROCESS, fails if it exists. 
+*               Processes of the same host then hash_attach() it and call
+*               this file directly, no socket in between.
+*               tier_path creates (or truncates) an extent file, a second
+*               tier for values read rarely: a value of at least 
+*               tier_threshold bytes, or one the CLOCK hand picks while a
+*               SET needs room under memory_limit, is appended to it and 
+*               only its name and a 16 byte location stay in the slot. 
+*               Values spill before any is evicted, and without evict 
+*               too; a full table still evicts. With tier_threshold, 
+*               max_value_size may exceed max_element_size as with 
+*               compression. Extents are written and read with pwrite()
+*               and pread() outside the table lock, overwritten or 
+*               deleted ones are dead until hash_tier_compact().
+*/
+void* make_hashtable_opt(int num_elements, int max_element_size, 
+                         hash_options *options);
+
+
 /*  
 * Name:         hash
 * Argument:     char*, int
@@ -51,11 +257,13 @@ int hash_func(char *str, int scale);
 *                   -2 if the name is too long or is NULL
 *                   -3 if data_size > maximum allowed element size
 *                   -4 if no space exists for the element in the hashtable
+*                   -8 if it does not fit the memory limit
 *                   -99 if an error other than the above occurs.
 *               Error codes are defined in hashtable.h.
-*               The hash table is open addressing with quadratic probing with
-*               no looping(once hash index is out of boundary, return 
-*               HASH_ERR_COLISION). It will not go back from start.
+*               The hash table is open addressing with linear probing and
+*               tombstones for deleted slots, or cuckoo hashing (see 
+*               make_hashtable_opt()). Names must be shorter than 120 
+*               bytes.
 */
 int hash_set(void *hashtable, char *name, void *data, int data_size);
 
@@ -68,25 +276,251 @@ int hash_set(void *hashtable, char *name, void *data, int data_size);
 */
 int hash_delete(void *hashtable, char *name);
 
+/*
+* Name:         hash_set_many
+* Argument:     void*, int, char**, void**, int*, int*
+* Return:       int
+* Purpose:      hash_set() names[i] to sizes[i] bytes of data[i] for the n
+*               names, taking the lock once per HASH_BATCH_LOCK of them.
+* Note:         Values are compressed before the lock is taken. Names are
+*               applied in order of the slot their probe starts at, a name
+*               given twice is set in the order given. status[i] gets what
+*               hash_set() would have returned for names[i], status may be
+*               NULL. Returns the number of names set, or HASH_ERR_NULL /
+*               HASH_ERR_OTHER when nothing was tried.
+*/
+int hash_set_many(void *hashtable, int n, char **names, void **data,
+                  int *sizes, int *status);
+
+/*
+* Name:         hash_delete_many
+* Argument:     void*, int, char**, int*
+* Return:       int
+* Purpose:      hash_delete() the n names, taking the lock once per
+*               HASH_BATCH_LOCK of them.
+* Note:         Same order and status as hash_set_many(). Returns the
+*               number of names deleted, or HASH_ERR_NULL / HASH_ERR_OTHER
+*               when nothing was tried.
+*/
+int hash_delete_many(void *hashtable, int n, char **names, int *status);
+
 /*  
 * Name:         hash_get
 * Argument:     void*, char*, void*, int*
 * Return:       int
 * Purpose:      Get an entry in the hashtable, if find, *buffer
 *               will be link to a new piece of memory with that data.
-* Note:         none
+* Note:         A compressed value is decompressed into the new memory.
 */
 int hash_get(void *hashtable, char *name, void **buffer, int *size);
 
+/*  
+* Name:         hash_reserve
+* Argument:     void*, char*, int, void**
+* Return:       int
+* Purpose:      Reserve a slot for a value of data_size bytes, *slot points
+*               to where the caller writes it.
+* Note:         Returns a handle >= 0 for hash_commit()/hash_abort(), or 
+*               the same errors as hash_set(). The value is written 
+*               without the lock (e.g. straight from a socket), readers 
+*               keep seeing the old value until hash_commit(). data_size 
+*               must fit a slot uncompressed, use hash_set() for larger.
+*/
+int hash_reserve(void *hashtable, char *name, int data_size, void **slot);
+
+/*  
+* Name:         hash_commit
+* Argument:     void*, int
+* Return:       int
+* Purpose:      Publish a value written into a reserved slot, replacing 
+*               the old value of the name.
+* Note:         Returns HASH_OK, HASH_ERR_NOMEM if it does not fit the 
+*               memory limit (the slot is given back), or HASH_ERR_OTHER 
+*               for a bad handle. The value is compressed in its slot 
+*               first when enabled.
+*/
+int hash_commit(void *hashtable, int handle);
+
+/*  
+* Name:         hash_abort
+* Argument:     void*, int
+* Return:       void
+* Purpose:      Give back a reserved slot without publishing it.
+* Note:         none
+*/
+void hash_abort(void *hashtable, int handle);
+
+/*  
+* Name:         hash_acquire
+* Argument:     void*, char*, void**, int*
+* Return:       int
+* Purpose:      Pin the value of name and point *data at it in the table,
+*               for sending it without a copy.
+* Note:         Returns a handle >= 0 for hash_release(), or the same 
+*               errors as hash_get(). The value stays unchanged until 
+*               released, a SET or DELETE meanwhile goes to another slot.
+*               *data and *size are the bytes stored, see hash_unpack().
+*               A value in the extent file points at its location.
+*/
+int hash_acquire(void *hashtable, char *name, void **data, int *size);
+
+/*  
+* Name:         hash_unpack
+* Argument:     void*, int, void**, int*
+* Return:       int
+* Purpose:      Decompress a value pinned by hash_acquire() if it is 
+*               stored compressed, read it if it is in the extent file.
+* Note:         Returns 0 if the value is stored as is and *data, *size are
+*               left alone, 1 if *data now points to a malloc()ed copy of
+*               *size bytes (the pin may be released right away), or an 
+*               error < 0.
+*/
+int hash_unpack(void *hashtable, int handle, void **data, int *size);
+
+/*  
+* Name:         hash_release
+* Argument:     void*, int
+* Return:       void
+* Purpose:      Unpin a value pinned by hash_acquire().
+* Note:         none
+*/
+void hash_release(void *hashtable, int handle);
+
+/*  
+* Name:         hash_near_create
+* Argument:     void*, int, int
+* Return:       hash_near*
+* Purpose:      Make a near cache of n_entries values of up to max_value 
+*               bytes for one worker (thread or process).
+* Note:         Returns NULL if the table was made without near_cache or
+*               memory runs out. Not thread safe, each worker needs its 
+*               own.
+*/
+hash_near* hash_near_create(void *hashtable, int n_entries, int max_value);
+
+/*  
+* Name:         hash_near_get
+* Argument:     void*, hash_near*, char*, void**, int*
+* Return:       int
+* Purpose:      Serve name from the near cache, copying it in if it is 
+*               hot.
+* Note:         Returns 1 with *data, *size pointing at a decompressed 
+*               copy, valid until the next call on near; 0 when the 
+*               caller has to use hash_acquire(); or an error < 0. A copy
+*               is only served while no change of a name sharing its write
+*               epoch happened since it was made, so it never returns a 
+*               value older than hash_get() would. A hit takes no lock and
+*               writes no shared memory.
+*/
+int hash_near_get(void *hashtable, hash_near *near, char *name, void **data,
+                  int *size);
+
+/*  
+* Name:         hash_near_free
+* Argument:     hash_near*
+* Return:       none
+* Purpose:      Free a near cache.
+* Note:         none
+*/
+void hash_near_free(hash_near *near);
+
+/*  
+* Name:         hash_scan
+* Argument:     void*, int, int, hash_scan_fn, void*
+* Return:       int
+* Purpose:      Call fn(name, data, size, arg) on every value in slots 
+*               start to end - 1, decompressed if needed.
+* Note:         Returns the number of values visited, or an error < 0 
+*               (fn returning < 0 is passed through). fn runs without the 
+*               lock on a pinned value, so threads can scan disjoint slot 
+*               ranges of a live table in parallel. A value set or deleted
+*               during the scan may or may not be seen. Cuckoo hashing 
+*               moves no value while a scan runs, a SET that would need
+*               it evicts from its buckets or is refused.
+*/
+int hash_scan(void *hashtable, int start, int end, hash_scan_fn fn, 
+              void *arg);
+
+/*  
+* Name:         hash_clear
+* Argument:     void*
+* Return:       int
+* Purpose:      Delete every value.
+* Note:         Not journaled. Returns HASH_OK or an error.
+*/
+int hash_clear(void *hashtable);
+
+/*  
+* Name:         hash_tier_compact
+* Argument:     void*
+* Return:       long
+* Purpose:      Reclaim the oldest stretch of the extent file once half of
+*               the file is dead extents, the whole file once no value is
+*               left in it.
+* Note:         Returns the bytes reclaimed, 0 when there is nothing worth
+*               it yet, or an error < 0; call it again while it returns 
+*               more. Live extents of the stretch are copied to the end of
+*               the file without the lock, which is only held to pick them
+*               and to swap their locations in, then the stretch is 
+*               punched out of the file (FALLOC_FL_PUNCH_HOLE). It ends 
+*               at a value pinned by a reader, the rest is left for a 
+*               later call. For a background thread, any process using 
+*               the table may call it.
+*/
+long hash_tier_compact(void *hashtable);
+
 /*  
 * Name:         hash_detach
 * Argument:     void*
 * Return:       void
 * Purpose:      Clear map, free the memory.
-* Note:         none
+* Note:         For the table's maker, a named table and its extent file
+*               are unlinked.
 */
 void hash_detach(void *hashtable);
 
+/*  
+* Name:         hash_attach
+* Argument:     const char*
+* Return:       void*
+* Purpose:      Map the table made under options name by another process,
+*               to pass to the calls of this file.
+* Note:         Returns NULL if there is none, it is not made yet or of 
+*               another version of this file. A journaled table refuses 
+*               changes with HASH_ERR_READONLY. Only for trusted 
+*               processes: they can write anything into the mapping.
+*/
+void* hash_attach(const char *name);
+
+/*  
+* Name:         hash_attach_fd
+* Argument:     int
+* Return:       void*
+* Purpose:      hash_attach() of the shared memory object open as fd, 
+*               received from hash_fd() of another process.
+* Note:         fd stays open. Whoever ends up owning the table calls 
+*               hash_detach(), the others hash_close().
+*/
+void* hash_attach_fd(int fd);
+
+/*  
+* Name:         hash_fd
+* Argument:     void*
+* Return:       int
+* Purpose:      Open the shared memory object of a named table.
+* Note:         -1 for a table without a name, the caller closes the fd.
+*/
+int hash_fd(void *hashtable);
+
+/*  
+* Name:         hash_close
+* Argument:     void*
+* Return:       void
+* Purpose:      Unmap a table of hash_attach(), it stays for the others.
+* Note:         none
+*/
+void hash_close(void *hashtable);
+
 /*  
 * Name:         hash_get_max_elements_size
 * Argument:     void*
@@ -96,5 +530,28 @@ void hash_detach(void *hashtable);
 */
 int hash_get_max_elements_size(void *hashtable);
 
+/*  
+* Name:         hash_get_max_value_size
+* Argument:     void*
+* Return:       int
+* Purpose:      Getter method for the largest value accepted.
+* Note:         Larger than max_elements size only with compression or
+*               tier_threshold on.
+*/
+int hash_get_max_value_size(void *hashtable);
+
+/*  
+* Name:         hash_get_stats
+* Argument:     void*, hash_stats*
+* Return:       int
+* Purpose:      Fill out with a snapshot of the table counters.
+* Note:         Takes the lock, returns HASH_OK or HASH_ERR_NULL.
+*/
+int hash_get_stats(void *hashtable, hash_stats *out);
+
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif      /* _TH_HASH_TABLE_H_ */
\ No newline at end of file
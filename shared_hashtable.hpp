@@ -0,0 +1,334 @@
+/*
+ *  File:        shared_hashtable.hpp
+ *  Purpose:     Header only C++ front-end of shared_hashtable.h, typed by
+ *               the largest name and value it holds.
+ *
+ *               shm::table<KeyCap, ValueCap>:  names of up to KeyCap
+ *                              bytes, values of up to ValueCap bytes.
+ *               shm::table_of<T, KeyCap>:      values of one trivially
+ *                              copyable type T.
+ *
+ *  Note:        The table is the same mapping the C API makes and uses,
+ *               a C++ service and memcache can share one. Sizes are
+ *               constants of the type, names are copied into a stack
+ *               buffer of KeyCap bytes and typed values are copied with
+ *               their sizeof(), so no call allocates unless the table
+ *               compresses values. Errors are the HASH_* codes, nothing
+ *               throws. C++17, pinned values are std::span with C++20.
+ */
+
+#ifndef _TH_HASH_TABLE_HPP_
+#define _TH_HASH_TABLE_HPP_
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <string_view>
+#include <type_traits>
+#include <array>
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+#include "shared_hashtable.h"
+
+namespace shm {
+
+/* Longest name the table accepts, its NUL makes 120. */
+constexpr std::size_t max_key_size = 119;
+
+
+/*
+* Name:         key_buffer
+* Argument:     N, longest name
+* Return:       none
+* Purpose:      NUL terminated copy of a name, on the stack.
+* Note:         assign() refuses names longer than N.
+*/
+template <std::size_t N>
+class key_buffer {
+    static_assert(N >= 1 && N <= max_key_size,
+                  "names are 1 to 119 bytes long");
+public:
+    bool assign(std::string_view name){
+        if (name.empty() || name.size() > N)
+            return false;
+        std::memcpy(text_, name.data(), name.size());
+        text_[name.size()] = '\0';
+        return true;
+    }
+    char* c_str(){ return text_; }
+
+private:
+    char text_[N + 1];
+};
+
+
+/*
+* Name:         pinned
+* Argument:     none
+* Return:       none
+* Purpose:      Value of a name pinned in the table, read where it lies.
+* Note:         Non-owning view, valid while the pinned object lives: a
+*               SET or DELETE of the name meanwhile goes to another slot.
+*               Move only. A compressed value is viewed in a decompressed
+*               copy the view frees. Empty (false) when the lookup
+*               failed, error() then tells why.
+*/
+class pinned {
+public:
+    pinned() = default;
+    pinned(const pinned&) = delete;
+    pinned& operator=(const pinned&) = delete;
+    pinned(pinned &&other) noexcept { take(other); }
+    pinned& operator=(pinned &&other) noexcept {
+        if (this != &other){
+            reset();
+            take(other);
+        }
+        return *this;
+    }
+    ~pinned(){ reset(); }
+
+    explicit operator bool() const { return handle_ >= 0; }
+    int error() const { return handle_ >= 0 ? HASH_OK : handle_; }
+    const unsigned char* data() const { return data_; }
+    std::size_t size() const { return size_; }
+    const unsigned char* begin() const { return data_; }
+    const unsigned char* end() const { return data_ + size_; }
+    std::string_view str() const {
+        return std::string_view(reinterpret_cast<const char*>(data_), size_);
+    }
+#if __cplusplus >= 202002L
+    std::span<const unsigned char> bytes() const { return {data_, size_}; }
+#endif
+
+    /* Copy of the value as T, false unless it is sizeof(T) bytes. */
+    template <class T>
+    bool as(T &out) const {
+        static_assert(std::is_trivially_copyable_v<T>,
+                      "values are copied as bytes");
+        if (handle_ < 0 || size_ != sizeof(T))
+            return false;
+        std::memcpy(&out, data_, sizeof(T));
+        return true;
+    }
+
+    /* Unpin now instead of at destruction. */
+    void reset(){
+        if (handle_ >= 0)
+            hash_release(table_, handle_);
+        if (copy_)
+            std::free(data_);
+        table_ = nullptr;
+        handle_ = HASH_ERR_NOEXIT;
+        data_ = nullptr;
+        size_ = 0;
+        copy_ = false;
+    }
+
+private:
+    template <std::size_t, std::size_t> friend class table;
+
+    pinned(void *table, int handle) : table_(table), handle_(handle) {}
+
+    void take(pinned &other){
+        table_ = other.table_;
+        handle_ = other.handle_;
+        data_ = other.data_;
+        size_ = other.size_;
+        copy_ = other.copy_;
+        other.handle_ = HASH_ERR_NOEXIT;
+        other.copy_ = false;
+    }
+
+    void *table_ = nullptr;
+    int handle_ = HASH_ERR_NOEXIT;      /* From hash_acquire(), or error. */
+    unsigned char *data_ = nullptr;
+    std::size_t size_ = 0;
+    bool copy_ = false;                 /* data_ is malloc()ed. */
+};
+
+
+/*
+* Name:         table
+* Argument:     KeyCap, longest name; ValueCap, largest value
+* Return:       none
+* Purpose:      Typed handle of a shared table.
+* Note:         The constructor maps a new table whose slots hold exactly
+*               ValueCap bytes, owned (hash_detach() on destruction) and
+*               move only. adopt() wraps a table made elsewhere, e.g. by C
+*               code, checking its slots are large enough, and does not
+*               own it. attach() maps a table another process made with
+*               options name, hash_close() on destruction. Test the 
+*               handle with operator bool before use.
+*/
+template <std::size_t KeyCap, std::size_t ValueCap>
+class table {
+    static_assert(KeyCap >= 1 && KeyCap <= max_key_size,
+                  "names are 1 to 119 bytes long");
+    static_assert(ValueCap >= 1 && ValueCap <= INT_MAX,
+                  "values are 1 to INT_MAX bytes");
+public:
+    static constexpr std::size_t key_capacity = KeyCap;
+    static constexpr std::size_t value_capacity = ValueCap;
+    using value_buffer = std::array<unsigned char, ValueCap>;
+
+    table() = default;
+    table(int num_elements, const hash_options &options = hash_options{}){
+        hash_options copy = options;
+        table_ = make_hashtable_opt(num_elements, (int)ValueCap, &copy);
+        own_ = table_ != nullptr ? owner::made : owner::none;
+    }
+    table(const table&) = delete;
+    table& operator=(const table&) = delete;
+    table(table &&other) noexcept
+        : table_(other.table_), own_(other.own_) {
+        other.table_ = nullptr;
+        other.own_ = owner::none;
+    }
+    table& operator=(table &&other) noexcept {
+        if (this != &other){
+            close();
+            table_ = other.table_;
+            own_ = other.own_;
+            other.table_ = nullptr;
+            other.own_ = owner::none;
+        }
+        return *this;
+    }
+    ~table(){ close(); }
+
+    /* Wrap raw without owning it, empty if its values may not fit. */
+    static table adopt(void *raw){
+        table t;
+        if (raw != nullptr &&
+            (std::size_t)hash_get_max_value_size(raw) >= ValueCap)
+            t.table_ = raw;
+        return t;
+    }
+
+    /* Map the table made under name, empty if missing or too small. */
+    static table attach(const char *name){
+        table t;
+        void *raw = hash_attach(name);
+        if (raw != nullptr &&
+            (std::size_t)hash_get_max_value_size(raw) < ValueCap){
+            hash_close(raw);
+            raw = nullptr;
+        }
+        t.table_ = raw;
+        t.own_ = raw != nullptr ? owner::attached : owner::none;
+        return t;
+    }
+
+    explicit operator bool() const { return table_ != nullptr; }
+    void* raw() const { return table_; }
+
+    /* Store size bytes of data under name, HASH_OK or an error. */
+    int set(std::string_view name, const void *data, std::size_t size){
+        key_buffer<KeyCap> key;
+
+        if (!key.assign(name))
+            return HASH_ERR_NAME;
+        if (size > ValueCap)
+            return HASH_ERR_DATASIZE;
+        return hash_set(table_, key.c_str(), const_cast<void*>(data),
+                        (int)size);
+    }
+
+    int set(std::string_view name, std::string_view value){
+        return set(name, value.data(), value.size());
+    }
+
+    template <class T, class = std::enable_if_t<
+                  std::is_trivially_copyable_v<T> &&
+                  !std::is_convertible_v<const T&, std::string_view>>>
+    int set(std::string_view name, const T &value){
+        static_assert(sizeof(T) <= ValueCap, "value larger than a slot");
+        return set(name, &value, sizeof(T));
+    }
+
+    /* Pin the value of name, see pinned. */
+    pinned get(std::string_view name) const {
+        key_buffer<KeyCap> key;
+        void *data;
+        int size, status;
+
+        if (!key.assign(name))
+            return pinned(nullptr, HASH_ERR_NAME);
+        int handle = hash_acquire(table_, key.c_str(), &data, &size);
+        if (handle < 0)
+            return pinned(nullptr, handle);
+        pinned view(table_, handle);
+        status = hash_unpack(table_, handle, &data, &size);
+        if (status < 0){
+            view.reset();
+            return pinned(nullptr, status);
+        }
+        view.data_ = static_cast<unsigned char*>(data);
+        view.size_ = size;
+        view.copy_ = status == 1;
+        return view;
+    }
+
+    /* Copy the value of name into out, its size or an error. */
+    int get(std::string_view name, value_buffer &out) const {
+        pinned view = get(name);
+
+        if (!view)
+            return view.error();
+        if (view.size() > ValueCap)
+            return HASH_ERR_DATASIZE;
+        std::memcpy(out.data(), view.data(), view.size());
+        return (int)view.size();
+    }
+
+    /* Copy the value of name into out, HASH_OK or an error. */
+    template <class T, class = std::enable_if_t<
+                  std::is_trivially_copyable_v<T>>>
+    int get(std::string_view name, T &out) const {
+        static_assert(sizeof(T) <= ValueCap, "value larger than a slot");
+        pinned view = get(name);
+
+        if (!view)
+            return view.error();
+        return view.as(out) ? HASH_OK : HASH_ERR_DATASIZE;
+    }
+
+    int erase(std::string_view name){
+        key_buffer<KeyCap> key;
+
+        if (!key.assign(name))
+            return HASH_ERR_NAME;
+        return hash_delete(table_, key.c_str());
+    }
+
+    int stats(hash_stats &out) const { return hash_get_stats(table_, &out); }
+
+    /* Detach an owned table now, unmap an attached one, forget an 
+     * adopted one. */
+    void close(){
+        if (own_ == owner::made)
+            hash_detach(table_);
+        else if (own_ == owner::attached)
+            hash_close(table_);
+        table_ = nullptr;
+        own_ = owner::none;
+    }
+
+private:
+    enum class owner { none, made, attached };
+
+    void *table_ = nullptr;
+    owner own_ = owner::none;
+};
+
+/* Table of one trivially copyable value type. */
+template <class T, std::size_t KeyCap = max_key_size>
+using table_of = table<KeyCap, sizeof(T)>;
+
+}   /* namespace shm */
+
+#endif      /* _TH_HASH_TABLE_HPP_ */
@@ -15,7 +15,6 @@
  */
 int read_in_full(int fd, void *data, size_t size) {
     size_t total_read = 0; 
-    fprintf(stderr, "READING data.\n");
 
     /* Keep going until all requested bytes have been read... */
     while (total_read < size) {
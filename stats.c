@@ -0,0 +1,228 @@
+/* 
+ *  File:        stats.c
+ *  Purpose:     Server counters shared by every worker and the STATS 
+ *               command output.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "shared_hashtable.h"
+#include "stats.h"
+
+server_stats *stats = NULL;
+
+
+/*  
+* Name:         stats_create
+* Argument:     none
+* Return:       server_stats*
+* Purpose:      Map the shared counters and make them the global stats.
+* Note:         none
+*/
+server_stats* stats_create(void){
+    void *allocated = mmap(NULL, sizeof(server_stats), PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (allocated == MAP_FAILED)
+        return NULL;
+
+    stats = (server_stats*)allocated;
+    memset(stats, 0, sizeof(server_stats));
+    return stats;
+}
+
+
+/*  
+* Name:         stats_text
+* Argument:     char*, size_t, int*, const char*, const char*
+* Return:       none
+* Purpose:      Append one "STAT <name> <value>\r\n" line.
+* Note:         *used is left unchanged once the output is full.
+*/
+static void stats_text(char *out, size_t size, int *used, const char *name,
+                       const char *value){
+    int length;
+
+    if ((size_t)*used >= size)
+        return;
+    length = snprintf(out + *used, size - *used, "STAT %s %s\r\n", 
+                      name, value);
+    if (length > 0 && (size_t)(*used + length) < size)
+        *used += length;
+}
+
+/*  
+* Name:         stats_line
+* Argument:     char*, size_t, int*, const char*, unsigned long
+* Return:       none
+* Purpose:      Append one "STAT <name> <value>\r\n" line for a counter.
+* Note:         none
+*/
+static void stats_line(char *out, size_t size, int *used, const char *name,
+                       unsigned long value){
+    char text[32];
+
+    snprintf(text, sizeof(text), "%lu", value);
+    stats_text(out, size, used, name, text);
+}
+
+
+/*  
+* Name:         stats_format
+* Argument:     void*, char*, size_t
+* Return:       int
+* Purpose:      Write "STAT <name> <value>\r\n" lines for the server 
+*               counters and the hashtable into out.
+* Note:         none
+*/
+int stats_format(void *hashtable, char *out, size_t size){
+    hash_stats table;
+    int used = 0;
+
+    if (stats != NULL){
+        stats_line(out, size, &used, "connections", STAT_GET(connections));
+        stats_line(out, size, &used, "requests", STAT_GET(requests));
+        stats_line(out, size, &used, "syscalls", STAT_GET(syscalls));
+        stats_line(out, size, &used, "cmd_set", STAT_GET(cmd_set));
+        stats_line(out, size, &used, "cmd_get", STAT_GET(cmd_get));
+        stats_line(out, size, &used, "cmd_delete", STAT_GET(cmd_delete));
+        stats_line(out, size, &used, "get_hits", STAT_GET(get_hits));
+        stats_line(out, size, &used, "get_misses", STAT_GET(get_misses));
+        stats_line(out, size, &used, "near_hits", STAT_GET(near_hits));
+        stats_line(out, size, &used, "bad_requests", STAT_GET(bad_requests));
+        stats_line(out, size, &used, "repl_offset", STAT_GET(repl_offset));
+        stats_line(out, size, &used, "repl_links", STAT_GET(repl_links));
+    }
+
+    if (hash_get_stats(hashtable, &table) == HASH_OK){
+        stats_line(out, size, &used, "num_elements", table.num_elements);
+        stats_line(out, size, &used, "max_element_size", 
+                   table.max_element_size);
+        stats_line(out, size, &used, "n_items", table.n_items);
+        stats_line(out, size, &used, "memory_size", table.memory_size);
+        if (table.compress_threshold > 0){
+            char ratio[32];
+
+            snprintf(ratio, sizeof(ratio), "%.2f", table.stored_bytes ? 
+                     (double)table.raw_bytes/table.stored_bytes : 1.0);
+            stats_line(out, size, &used, "compress_threshold", 
+                       table.compress_threshold);
+            stats_line(out, size, &used, "bytes_raw", table.raw_bytes);
+            stats_line(out, size, &used, "bytes_stored", table.stored_bytes);
+            stats_text(out, size, &used, "compression_ratio", ratio);
+        }
+        stats_line(out, size, &used, "evictions", table.evictions);
+        if (table.tiered){
+            /* A GET the table misses goes on to the extent file. */
+            stats_line(out, size, &used, "tier_threshold", 
+                       table.tier_threshold);
+            stats_line(out, size, &used, "tier_items", table.tier_items);
+            stats_line(out, size, &used, "tier_bytes", table.tier_bytes);
+            stats_line(out, size, &used, "tier_file_bytes", 
+                       table.tier_file_bytes);
+            stats_line(out, size, &used, "tier_spills", table.tier_spills);
+            stats_line(out, size, &used, "tier_compacted_bytes", 
+                       table.tier_compacted);
+            stats_line(out, size, &used, "memory_hits", table.memory_hits);
+            stats_line(out, size, &used, "memory_misses", 
+                       table.tier_hits + table.get_misses);
+            stats_line(out, size, &used, "tier_hits", table.tier_hits);
+            stats_line(out, size, &used, "tier_misses", table.get_misses);
+        }
+        if (table.sketch_counters > 0)
+            stats_line(out, size, &used, "admission_rejected", 
+                       table.rejected);
+        stats_line(out, size, &used, "lock_acquired", table.lock_acquired);
+        stats_line(out, size, &used, "lock_contended", table.lock_contended);
+        stats_line(out, size, &used, "lock_wait_us", table.lock_wait_ns/1000);
+        stats_line(out, size, &used, "lock_hold_us", table.lock_hold_ns/1000);
+        stats_line(out, size, &used, "lock_wait_max_us", 
+                   table.lock_wait_max_ns/1000);
+        stats_line(out, size, &used, "lock_hold_max_us", 
+                   table.lock_hold_max_ns/1000);
+        stats_line(out, size, &used, "lock_spin", table.lock_spin);
+        stats_line(out, size, &used, "lock_owner_deaths", table.owner_deaths);
+        if (table.bloom_counters > 0){
+            unsigned long absent = table.bloom_negatives + 
+                                   table.bloom_false_positives;
+            char rate[32];
+
+            /* Share of the GETs for absent names the filter let through. */
+            snprintf(rate, sizeof(rate), "%.4f", absent ? 
+                     (double)table.bloom_false_positives/absent : 0.0);
+            stats_line(out, size, &used, "bloom_counters", 
+                       table.bloom_counters);
+            stats_line(out, size, &used, "bloom_negatives", 
+                       table.bloom_negatives);
+            stats_line(out, size, &used, "bloom_false_positives", 
+                       table.bloom_false_positives);
+            stats_text(out, size, &used, "bloom_fp_rate", rate);
+        }
+    }
+    return used;
+}
+
+
+/*  
+* Name:         memory_format
+* Argument:     void*, char*, size_t
+* Return:       int
+* Purpose:      Write "STAT <name> <value>\r\n" lines accounting for the 
+*               table's memory into out.
+* Note:         used_bytes is what memory_limit caps. slot_bytes are the 
+*               key and value slots held by items, fragmentation_bytes the
+*               part of them names and values leave unused.
+*/
+int memory_format(void *hashtable, char *out, size_t size){
+    hash_stats table;
+    size_t used_bytes, slot_bytes;
+    char ratio[32];
+    int used = 0;
+
+    if (hash_get_stats(hashtable, &table) != HASH_OK)
+        return 0;
+    used_bytes = table.metadata_bytes + table.key_bytes + table.stored_bytes;
+    slot_bytes = table.slot_bytes;
+    snprintf(ratio, sizeof(ratio), "%.2f", 
+             table.key_bytes + table.stored_bytes ? 
+             (double)slot_bytes/(table.key_bytes + table.stored_bytes) : 1.0);
+
+    stats_line(out, size, &used, "limit_bytes", table.memory_limit);
+    stats_line(out, size, &used, "mapped_bytes", table.memory_size);
+    stats_line(out, size, &used, "used_bytes", used_bytes);
+    stats_line(out, size, &used, "free_bytes", table.memory_limit > used_bytes
+               ? table.memory_limit - used_bytes : 0);
+    stats_line(out, size, &used, "metadata_bytes", table.metadata_bytes);
+    stats_line(out, size, &used, "key_bytes", table.key_bytes);
+    stats_line(out, size, &used, "value_bytes", table.stored_bytes);
+    stats_line(out, size, &used, "value_raw_bytes", table.raw_bytes);
+    stats_line(out, size, &used, "slot_bytes", slot_bytes);
+    stats_line(out, size, &used, "fragmentation_bytes", slot_bytes - 
+               table.key_bytes - table.stored_bytes);
+    stats_text(out, size, &used, "fragmentation_ratio", ratio);
+    stats_line(out, size, &used, "n_items", table.n_items);
+    stats_line(out, size, &used, "free_slots", 
+               table.num_elements - table.n_items);
+    stats_text(out, size, &used, "layout", table.layout == HASH_LAYOUT_BUCKETS
+               ? "buckets" : "arrays");
+    stats_text(out, size, &used, "engine", table.engine == HASH_ENGINE_CUCKOO
+               ? "cuckoo" : "probing");
+    if (table.engine == HASH_ENGINE_CUCKOO)
+        stats_line(out, size, &used, "displaced", table.displaced);
+    stats_text(out, size, &used, "policy", table.evict ? "evict" : "refuse");
+    stats_line(out, size, &used, "evictions", table.evictions);
+    stats_line(out, size, &used, "refused", table.refused);
+    if (table.tiered){
+        stats_line(out, size, &used, "tier_items", table.tier_items);
+        stats_line(out, size, &used, "tier_bytes", table.tier_bytes);
+        stats_line(out, size, &used, "tier_file_bytes", table.tier_file_bytes);
+        stats_line(out, size, &used, "tier_spills", table.tier_spills);
+    }
+    if (table.sketch_counters > 0){
+        stats_line(out, size, &used, "sketch_counters", table.sketch_counters);
+        stats_line(out, size, &used, "admission_rejected", table.rejected);
+    }
+    return used;
+}
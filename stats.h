@@ -0,0 +1,86 @@
+/* 
+ *  File:        stats.h
+ *  Purpose:     Server counters shared by every worker, forked children 
+ *               included, and the STATS and MEMORY commands that report 
+ *               them.
+ * 
+ *  Note:        Counters live in a shared anonymous mapping and are 
+ *               updated with relaxed atomics, a snapshot is not exact 
+ *               while requests are in flight.
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+
+/* Structure of the server counters. */
+typedef struct server_stats_struct {
+    unsigned long connections;      /* Clients accepted. */
+    unsigned long requests;         /* Requests answered. */
+    unsigned long syscalls;         /* Syscalls issued serving clients. */
+    unsigned long cmd_set;          /* SET requests. */
+    unsigned long cmd_get;          /* GET requests. */
+    unsigned long cmd_delete;       /* DELETE requests. */
+    unsigned long get_hits;         /* GET found the name. */
+    unsigned long get_misses;       /* GET did not find the name. */
+    unsigned long near_hits;        /* GET hits served by a near cache. */
+    unsigned long bad_requests;     /* Requests answered with a parse error. */
+    unsigned long repl_offset;      /* Replication log position, written 
+                                       by the primary, applied by a replica. */
+    unsigned long repl_links;       /* Replicas connected to this primary, 
+                                       or 1 while a replica is connected. */
+} server_stats;
+
+/* Counters of this server, NULL until stats_create() is called. */
+extern server_stats *stats;
+
+#define STAT_ADD(field, n) \
+        do { if (stats != NULL) \
+            __atomic_fetch_add(&stats->field, (n), __ATOMIC_RELAXED); \
+        } while (0)
+
+#define STAT_SET(field, n) \
+        do { if (stats != NULL) \
+            __atomic_store_n(&stats->field, (n), __ATOMIC_RELAXED); \
+        } while (0)
+
+#define STAT_GET(field)     __atomic_load_n(&stats->field, __ATOMIC_RELAXED)
+
+
+/*  
+* Name:         stats_create
+* Argument:     none
+* Return:       server_stats*
+* Purpose:      Map the shared counters and make them the global stats.
+* Note:         Call before fork() or creating threads. Returns NULL if the 
+*               mapping fail, counting is then disabled.
+*/
+server_stats* stats_create(void);
+
+
+/*  
+* Name:         stats_format
+* Argument:     void*, char*, size_t
+* Return:       int
+* Purpose:      Write "STAT <name> <value>\r\n" lines for the server 
+*               counters and the hashtable into out.
+* Note:         Returns the number of bytes written, output is truncated 
+*               to size.
+*/
+int stats_format(void *hashtable, char *out, size_t size);
+
+
+/*  
+* Name:         memory_format
+* Argument:     void*, char*, size_t
+* Return:       int
+* Purpose:      Write "STAT <name> <value>\r\n" lines accounting for the 
+*               table's memory (limit, metadata, names, values, 
+*               fragmentation, evictions) into out.
+* Note:         Returns the number of bytes written, output is truncated 
+*               to size.
+*/
+int memory_format(void *hashtable, char *out, size_t size);
+
+#endif      /* _STATS_H_ */
@@ -0,0 +1,165 @@
+/*
+ *  File:        test_replication.c
+ *  Purpose:     Check a replica whose full sync is cut short asks for a
+ *               full sync again, and only resumes from the log once a
+ *               full sync ended.
+ *
+ *               ./test_replication
+ *
+ *  Note:        The test plays the primary on a port of its own, the
+ *               replica thread reconnects a second after each cut. It
+ *               exits 0 when every check passed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "utility_macros.h"
+#include "socket_utils.h"
+#include "shared_hashtable.h"
+#include "replication.h"
+
+#define RUN_ID          "0123456789abcdef"
+#define SYNC_OFFSET     4096        /* Where the log resumes after the
+                                       snapshot. */
+
+static int failures = 0;
+
+
+/*
+* Name:         check
+* Argument:     int, const char*
+* Return:       none
+* Purpose:      Report a check, counting it if it failed.
+* Note:         none
+*/
+static void check(int passed, const char *what){
+    printf("%s: %s\n", passed ? "ok" : "FAILED", what);
+    failures += !passed;
+}
+
+/*
+* Name:         listen_any
+* Argument:     int*
+* Return:       int
+* Purpose:      Listen on a free port of the loopback, *port says which.
+* Note:         Returns the socket, exits on errors.
+*/
+static int listen_any(int *port){
+    struct sockaddr_in address = {0};
+    socklen_t length = sizeof(address);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    EXIT_ON_VALUE(fd == -1 ||
+                  bind(fd, (struct sockaddr*)&address, length) == -1 ||
+                  listen(fd, 1) == -1 ||
+                  getsockname(fd, (struct sockaddr*)&address, &length) == -1,
+                  1, "CANNOT LISTEN, EXIT.\n", EXIT_FAILURE);
+    *port = ntohs(address.sin_port);
+    return fd;
+}
+
+/*
+* Name:         put_frame
+* Argument:     int, int, const char*, const char*, unsigned long long
+* Return:       none
+* Purpose:      Send a frame of the primary, see replication.h.
+* Note:         name and value may be NULL for none.
+*/
+static void put_frame(int fd, int type, const char *name, const char *value,
+                      unsigned long long offset){
+    unsigned char header[REPL_FRAME_HEADER];
+    uint32_t name_len = name ? strlen(name) : 0;
+    uint32_t value_len = value ? strlen(value) : 0;
+
+    header[0] = type;
+    FORONE(i, 4){
+        header[1 + i] = (name_len >> (8*i)) & 0xff;
+        header[5 + i] = (value_len >> (8*i)) & 0xff;
+    }
+    FORONE(i, 8)
+        header[9 + i] = (offset >> (8*i)) & 0xff;
+    write_in_full(fd, header, REPL_FRAME_HEADER);
+    write_in_full(fd, (void*)name, name_len);
+    write_in_full(fd, (void*)value, value_len);
+}
+
+/*
+* Name:         accept_sync
+* Argument:     int, char*, size_t
+* Return:       int
+* Purpose:      Take the replica's next connection and its SYNC line,
+*               without the line end, into line.
+* Note:         Returns the connection.
+*/
+static int accept_sync(int listen_fd, char *line, size_t size){
+    int fd = accept(listen_fd, NULL, NULL);
+    size_t length = 0;
+
+    EXIT_ON_VALUE(fd, -1, "CANNOT ACCEPT, EXIT.\n", EXIT_FAILURE);
+    while (length < size - 1 && read(fd, line + length, 1) == 1 &&
+           line[length] != '\n')
+        length++;
+    line[length] = '\0';
+    if (length > 0 && line[length - 1] == '\r')
+        line[length - 1] = '\0';
+    return fd;
+}
+
+int main(void){
+    char line[64], *value = NULL;
+    int listen_fd, fd, port, size;
+    void *table = make_hashtable(64, 32);
+
+    EXIT_ON_VALUE(table, NULL, "CANNOT MAKE TABLE, EXIT.\n", EXIT_FAILURE);
+    /* A replica stuck waiting fails the test instead of hanging it. */
+    alarm(30);
+    listen_fd = listen_any(&port);
+    EXIT_NOT_ON_VALUE(repl_replica_start(table, "127.0.0.1", port), 0,
+                      "CANNOT START REPLICA, EXIT.\n", EXIT_FAILURE);
+
+    fd = accept_sync(listen_fd, line, sizeof(line));
+    check(strcmp(line, "SYNC none 0") == 0, "first SYNC asks for everything");
+
+    /* Cut the link in the middle of the snapshot. */
+    put_frame(fd, REPL_FRAME_FULL, RUN_ID, NULL, SYNC_OFFSET);
+    put_frame(fd, REPL_FRAME_SET, "partial", "1", SYNC_OFFSET);
+    close(fd);
+
+    fd = accept_sync(listen_fd, line, sizeof(line));
+    check(strncmp(line, "SYNC none ", 10) == 0,
+          "SYNC after a cut snapshot asks for a full sync");
+
+    /* A whole snapshot, then a change from the log. */
+    put_frame(fd, REPL_FRAME_FULL, RUN_ID, NULL, SYNC_OFFSET);
+    put_frame(fd, REPL_FRAME_SET, "whole", "2", SYNC_OFFSET);
+    put_frame(fd, REPL_FRAME_END, NULL, NULL, SYNC_OFFSET);
+    put_frame(fd, REPL_FRAME_SET, "logged", "3", SYNC_OFFSET + 40);
+    close(fd);
+
+    fd = accept_sync(listen_fd, line, sizeof(line));
+    check(strcmp(line, "SYNC " RUN_ID " 4136") == 0,
+          "SYNC after a whole snapshot resumes from the log");
+    check(hash_get(table, "partial", (void**)&value, &size) != HASH_OK,
+          "the cut snapshot is gone");
+    check(hash_get(table, "whole", (void**)&value, &size) == HASH_OK &&
+          size == 1 && value[0] == '2', "the whole snapshot is applied");
+    free(value);
+    value = NULL;
+    check(hash_get(table, "logged", (void**)&value, &size) == HASH_OK &&
+          size == 1 && value[0] == '3', "the log change is applied");
+    free(value);
+    close(fd);
+
+    repl_stop();
+    close(listen_fd);
+    hash_detach(table);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,121 @@
+/*
+ *  File:        test_stats.c
+ *  Purpose:     Check the slot_bytes hash_get_stats() reports, behind
+ *               MEMORY's fragmentation, for each layout and each place a
+ *               value can be: inline in a bucket, in a value slot, or
+ *               spilled to the extent file.
+ *
+ *               ./test_stats
+ *
+ *  Note:        A bucket holds a 120 byte name and 48 bytes of value
+ *               after its int fields. hash_detach() removes the extent
+ *               file. It exits 0 when every check passed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utility_macros.h"
+#include "shared_hashtable.h"
+
+#define NAME_SLOT       120         /* KEY_SIZE. */
+#define BUCKET_SLOT     (NAME_SLOT + 48)
+#define ELEMENT_SIZE    256
+#define TIER_THRESHOLD  200
+
+static int failures = 0;
+
+
+/*
+* Name:         check
+* Argument:     int, const char*
+* Return:       none
+* Purpose:      Report a check, counting it if it failed.
+* Note:         none
+*/
+static void check(int passed, const char *what){
+    printf("%s: %s\n", passed ? "ok" : "FAILED", what);
+    failures += !passed;
+}
+
+/*
+* Name:         slot_bytes
+* Argument:     void*
+* Return:       size_t
+* Purpose:      slot_bytes of a table now.
+* Note:         none
+*/
+static size_t slot_bytes(void *table){
+    hash_stats stats;
+
+    if (hash_get_stats(table, &stats) != HASH_OK)
+        return 0;
+    return stats.slot_bytes;
+}
+
+/*
+* Name:         set_sized
+* Argument:     void*, const char*, int
+* Return:       int
+* Purpose:      SET name to size bytes of 'x'.
+* Note:         Returns like hash_set().
+*/
+static int set_sized(void *table, const char *name, int size){
+    char value[TIER_THRESHOLD];
+
+    memset(value, 'x', size);
+    return hash_set(table, (char*)name, value, size);
+}
+
+int main(void){
+    char tier_path[] = "/tmp/test_stats.XXXXXX", name[16];
+    hash_options options = {0};
+    void *table;
+    size_t before;
+    int fd = mkstemp(tier_path);
+
+    EXIT_ON_VALUE(fd, -1, "CANNOT MAKE EXTENT FILE, EXIT.\n", EXIT_FAILURE);
+    close(fd);
+
+    options.lock_type = HASH_LOCK_THREAD;
+    options.layout = HASH_LAYOUT_BUCKETS;
+    options.tier_path = tier_path;
+    options.tier_threshold = TIER_THRESHOLD;
+    table = make_hashtable_opt(256, ELEMENT_SIZE, &options);
+    EXIT_ON_VALUE(table, NULL, "CANNOT MAKE TABLE, EXIT.\n", EXIT_FAILURE);
+
+    FORONE(i, 100){
+        snprintf(name, sizeof(name), "k%d", i);
+        set_sized(table, name, 10);
+    }
+    check(slot_bytes(table) == 100*BUCKET_SLOT,
+          "buckets: an inline value only holds its bucket");
+
+    before = slot_bytes(table);
+    set_sized(table, "large", 100);
+    check(slot_bytes(table) - before == BUCKET_SLOT + ELEMENT_SIZE,
+          "buckets: a value out of line holds a value slot too");
+
+    before = slot_bytes(table);
+    set_sized(table, "spilled", TIER_THRESHOLD);
+    check(slot_bytes(table) - before == BUCKET_SLOT,
+          "buckets: a spilled value's location is inline");
+
+    before = slot_bytes(table);
+    set_sized(table, "large", 10);
+    check(before - slot_bytes(table) == ELEMENT_SIZE,
+          "buckets: overwritten inline, the value slot is given back");
+    hash_detach(table);
+
+    options.layout = HASH_LAYOUT_ARRAYS;
+    options.tier_path = NULL;
+    table = make_hashtable_opt(256, ELEMENT_SIZE, &options);
+    EXIT_ON_VALUE(table, NULL, "CANNOT MAKE TABLE, EXIT.\n", EXIT_FAILURE);
+    set_sized(table, "small", 10);
+    check(slot_bytes(table) == NAME_SLOT + ELEMENT_SIZE,
+          "arrays: every value holds a name slot and a value slot");
+    hash_detach(table);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,45 @@
+/* 
+ *  File:        trace_probes.h
+ *  Purpose:     Static USDT tracepoints for memcache and the shared 
+ *               hashtable, attachable at runtime with bpftrace or perf.
+ * 
+ *  Note:        Probes are emitted through <sys/sdt.h> when it is available,
+ *               each one compiles down to a single nop until a tracer 
+ *               attaches. Arguments must already be computed values, they 
+ *               are never evaluated when sdt.h is missing. Build with 
+ *               -DNO_SDT to remove the probes entirely.
+ * 
+ *               Provider name is "memcache", list them with:
+ *                   bpftrace -l 'usdt:./memcache:*'
+ */
+
+#ifndef _TRACE_PROBES_H_
+#define _TRACE_PROBES_H_
+
+#if !defined(NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT 1
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#define TRACE0(name)                    DTRACE_PROBE(memcache, name)
+#define TRACE1(name, a)                 DTRACE_PROBE1(memcache, name, a)
+#define TRACE2(name, a, b)              DTRACE_PROBE2(memcache, name, a, b)
+#define TRACE3(name, a, b, c)           DTRACE_PROBE3(memcache, name, a, b, c)
+#define TRACE4(name, a, b, c, d)        DTRACE_PROBE4(memcache, name, a, b, c, d)
+#else
+#define TRACE0(name)                    do {} while (0)
+#define TRACE1(name, a)                 do {} while (0)
+#define TRACE2(name, a, b)              do {} while (0)
+#define TRACE3(name, a, b, c)           do {} while (0)
+#define TRACE4(name, a, b, c, d)        do {} while (0)
+#endif /* HAVE_SDT */
+
+/* Operation codes passed as the first argument of probe_loop. */
+#define TRACE_OP_SET        0
+#define TRACE_OP_GET        1
+#define TRACE_OP_DELETE     2
+
+#endif      /* _TRACE_PROBES_H_ */